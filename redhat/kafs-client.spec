@@ -1,6 +1,6 @@
 # % define buildid .local
-%global libapivermajor 0
-%global libapiversion %{libapivermajor}.1
+%global libapivermajor 1
+%global libapiversion %{libapivermajor}.0
 
 Name:		kafs-client
 Version:	0.1
@@ -75,6 +75,7 @@ make all \
 	BINDIR=%{_bindir} \
 	SBINDIR=%{_sbindir} \
 	DATADIR=%{datadir} \
+	CACHEDIR=%{_localstatedir}/cache/kafs \
 	INCLUDEDIR=%{_includedir} \
 	LIBDIR=%{_libdir} \
 	LIBEXECDIR=%{_libexecdir} \
@@ -93,6 +94,7 @@ make DESTDIR=%{buildroot} install \
 	BINDIR=%{_bindir} \
 	SBINDIR=%{_sbindir} \
 	DATADIR=%{datadir} \
+	CACHEDIR=%{_localstatedir}/cache/kafs \
 	INCLUDEDIR=%{_includedir} \
 	LIBDIR=%{_libdir} \
 	LIBEXECDIR=%{_libexecdir} \
@@ -105,13 +107,13 @@ ln -s aklog-kafs %{buildroot}/%{_bindir}/aklog
 %ldconfig_scriptlets libs
 
 %post
-%systemd_post afs.mount
+%systemd_post afs.mount kafs-dns.service
 
 %preun
-%systemd_preun afs.mount
+%systemd_preun afs.mount kafs-dns.service
 
 %postun
-%systemd_postun_with_restart afs.mount
+%systemd_postun_with_restart afs.mount kafs-dns.service
 
 %files
 %doc README
@@ -131,6 +133,7 @@ ln -s aklog-kafs %{buildroot}/%{_bindir}/aklog
 %{datadir}
 %config(noreplace) %{_sysconfdir}/kafs/client.conf
 %config(noreplace) %{_sysconfdir}/kafs/client.d
+%dir %{_localstatedir}/cache/kafs
 
 %files libs-devel
 %{_libdir}/libkafs_client.so
@@ -16,15 +16,18 @@
  * Kerberos-5 strong enctype support for rxkad:
  *	https://tools.ietf.org/html/draft-kaduk-afs3-rxkad-k5-kdf-00
  *
- * Invoke as: aklog-k5 <cell> [<realm>]
+ * Invoke as: aklog-k5 [<cell> [-k <realm>]]...
  */
 
 #define _GNU_SOURCE
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
 #include <keyutils.h>
 #include <krb5/krb5.h>
 #include <openssl/hmac.h>
@@ -32,6 +35,7 @@
 #include <openssl/des.h>
 #include <openssl/md5.h>
 #include <openssl/err.h>
+#include <kafs/cellserv.h>
 
 struct rxrpc_key_sec2_v1 {
         uint32_t        kver;                   /* key payload interface version */
@@ -43,30 +47,68 @@ struct rxrpc_key_sec2_v1 {
         uint8_t         ticket[0];              /* the encrypted ticket */
 };
 
+/*
+ * A cell to get a token for.
+ */
+struct aklog_cell {
+	char		*name;
+	char		*realm;
+	char		*princ;
+	char		*desc;
+	struct rxrpc_key_sec2_v1 *payload;
+	size_t		plen;
+	char		*error;		/* Why we couldn't get a ticket */
+};
+
+/*
+ * The cells whose tickets weren't in the ccache, to be fetched in parallel.
+ */
+struct aklog_batch {
+	struct aklog_cell *cells;
+	unsigned int	*todo;		/* Indices of the cells to fetch */
+	unsigned int	nr_todo;
+	unsigned int	next;		/* Next todo slot to take */
+	const char	*ccname;	/* Full name of the ccache */
+	krb5_principal	client;
+};
+
+#define AKLOG_MAX_THREADS	8
+
 #define RXKAD_TKT_TYPE_KERBEROS_V5              256
 #define OSERROR(X, Y) do { if ((long)(X) == -1) { perror(Y); exit(1); } } while(0)
 #define OSZERROR(X, Y) do { if ((long)(X) == 0) { perror(Y); exit(1); } } while(0)
 #define KRBERROR(X, Y) do { if ((X) != 0) { const char *msg = krb5_get_error_message(k5_ctx, (X)); fprintf(stderr, "%s: %s\n", (Y), msg); krb5_free_error_message(k5_ctx, msg); exit(1); } } while(0)
 
 /*
- * Report an error from the crypto lib.
+ * Note why we couldn't make a key for a cell.
  */
-static void crypto_error(const char *msg)
+static __attribute__((format(printf, 2, 3)))
+void note_error(struct aklog_cell *cell, const char *fmt, ...)
 {
-	const char *file;
-	char buf[120];
-	int e, line;
+	va_list va;
 
-	if (ERR_peek_error() == 0)
-		return;
-	fprintf(stderr, "aklog: %s:\n", msg);
+	va_start(va, fmt);
+	if (vasprintf(&cell->error, fmt, va) == -1)
+		cell->error = NULL;
+	va_end(va);
+}
 
-	while ((e = ERR_get_error_line(&file, &line))) {
-		ERR_error_string(e, buf);
-		fprintf(stderr, "- SSL %s: %s:%d\n", buf, file, line);
-	}
+/*
+ * Note an error from the crypto lib.  The crypto lib's error queue is per
+ * thread, so this is cleared for the next cell.
+ */
+static void crypto_error(struct aklog_cell *cell, const char *msg)
+{
+	unsigned long e = ERR_get_error();
+	char buf[120];
 
-	exit(1);
+	if (e) {
+		ERR_error_string_n(e, buf, sizeof(buf));
+		note_error(cell, "%s: %s", msg, buf);
+	} else {
+		note_error(cell, "%s failed", msg);
+	}
+	ERR_clear_error();
 }
 
 /*
@@ -135,7 +177,8 @@ static const struct kdf_data rxkad_kdf_data = {
  *
  * [afs3-rxkad-k5-kdf-00 §4.3]
  */
-static void key_derivation_function(krb5_creds *creds, uint8_t *session_key)
+static int key_derivation_function(struct aklog_cell *cell, krb5_creds *creds,
+				   uint8_t *session_key)
 {
 	unsigned int i, len;
 	union {
@@ -153,12 +196,14 @@ static void key_derivation_function(krb5_creds *creds, uint8_t *session_key)
 		if (!HMAC(algo,
 			  creds->keyblock.contents, creds->keyblock.length,
 			  (unsigned char *)&kdf_data, sizeof(kdf_data),
-			  buf.md5, &len))
-			    crypto_error("HMAC");
+			  buf.md5, &len)) {
+			crypto_error(cell, "HMAC");
+			return -1;
+		}
 
 		if (len < sizeof(buf.des)) {
-			fprintf(stderr, "aklog: HMAC returned short result\n");
-			exit(1);
+			note_error(cell, "HMAC returned short result");
+			return -1;
 		}
 
 		/* Overlay the DES parity. */
@@ -167,17 +212,20 @@ static void key_derivation_function(krb5_creds *creds, uint8_t *session_key)
 			goto success;
 	}
 
-	fprintf(stderr, "aklog: Unable to derive strong DES key\n");
-	exit(1);
+	note_error(cell, "Unable to derive strong DES key");
+	return -1;
 
 success:
 	memcpy(session_key, buf.des, sizeof(buf.des));
+	return 0;
 }
 
 /*
- * Extract or derive the session key.
+ * Extract or derive the session key.  If that can't be done, the reason is
+ * noted against the cell and -1 is returned.
  */
-static void derive_key(krb5_creds *creds, uint8_t *session_key)
+static int derive_key(struct aklog_cell *cell, krb5_creds *creds,
+		      uint8_t *session_key)
 {
 	unsigned int length = creds->keyblock.length;
 
@@ -210,8 +258,8 @@ static void derive_key(krb5_creds *creds, uint8_t *session_key)
 	/* Strip the parity bits for 3DES then do KDF [afs3-rxkad-k5-kdf-00 §4.2]. */
 des3_discard_parity:
 	if (length & 7) {
-		fprintf(stderr, "aklog: 3DES session key not multiple of 8 octets.\n");
-		exit(1);
+		note_error(cell, "3DES session key not multiple of 8 octets");
+		return -1;
 	}
 	creds->keyblock.length = des3_key_to_random(creds->keyblock.contents,
 						    creds->keyblock.contents,
@@ -220,70 +268,266 @@ des3_discard_parity:
 
 	/* Do KDF [afs3-rxkad-k5-kdf-00 §4.3]. */
 derive_key:
-	key_derivation_function(creds, session_key);
-	return;
+	return key_derivation_function(cell, creds, session_key);
 
 	/* Use as-is for single-DES [afs3-rxkad-k5-kdf-00 §4.1]. */
 just_copy:
 	if (length != 8) {
-		fprintf(stderr, "aklog: DES session key not 8 octets.\n");
-		exit(1);
+		note_error(cell, "DES session key not 8 octets");
+		return -1;
 	}
 
 	memcpy(session_key, creds->keyblock.contents, length);
-	return;
+	return 0;
 
 deprecated:
-	fprintf(stderr, "aklog: Ticket contains deprecated enc type (%d)\n",
-		creds->keyblock.enctype);
-	exit(1);
+	note_error(cell, "Ticket contains deprecated enc type (%d)",
+		   creds->keyblock.enctype);
+	return -1;
 
 not_supported:
-	fprintf(stderr, "aklog: Ticket contains unsupported enc type (%d)\n",
-		creds->keyblock.enctype);
-	exit(1);
+	note_error(cell, "Ticket contains unsupported enc type (%d)",
+		   creds->keyblock.enctype);
+	return -1;
 key_too_short:
-	fprintf(stderr, "aklog: Ticket contains short key block (%u)\n", length);
-	exit(1);
+	note_error(cell, "Ticket contains short key block (%u)", length);
+	return -1;
 }
 
-int main(int argc, char **argv)
+/*
+ * Build the rxrpc key payload from a ticket.  If that can't be done, the
+ * reason is noted against the cell and -1 is returned.
+ */
+static int make_payload(struct aklog_cell *cell, krb5_creds *creds)
 {
-	char *cell, *realm, *princ, *desc, *p;
-	int ret;
-	size_t plen;
 	struct rxrpc_key_sec2_v1 *payload;
+	size_t plen;
+
+	plen = sizeof(*payload) + creds->ticket.length;
+	payload = calloc(1, plen + 4);
+	if (!payload) {
+		note_error(cell, "calloc: %m");
+		return -1;
+	}
+
+	/* use version 1 of the key data interface */
+	payload->kver           = 1;
+	payload->security_index = 2;
+	payload->ticket_length  = creds->ticket.length;
+	payload->expiry         = creds->times.endtime;
+	payload->kvno           = RXKAD_TKT_TYPE_KERBEROS_V5;
+
+	if (derive_key(cell, creds, payload->session_key) < 0) {
+		free(payload);
+		return -1;
+	}
+	memcpy(payload->ticket, creds->ticket.data, creds->ticket.length);
+
+	cell->payload = payload;
+	cell->plen = plen;
+	return 0;
+}
+
+/*
+ * Note why we couldn't get a ticket for a cell.
+ */
+static void note_krb_error(krb5_context k5_ctx, struct aklog_cell *cell,
+			   krb5_error_code kresult, const char *what)
+{
+	const char *msg = krb5_get_error_message(k5_ctx, kresult);
+
+	if (asprintf(&cell->error, "%s: %s", what, msg) == -1)
+		cell->error = NULL;
+	krb5_free_error_message(k5_ctx, msg);
+}
+
+/*
+ * Get a ticket for a cell and turn it into a key payload.  KRB5_GC_CACHED can
+ * be passed to only look in the ccache.  Only a failure to get the ticket is
+ * returned; if the ticket can't be turned into a payload, the reason is noted
+ * against the cell and 0 is returned as asking again won't help.
+ */
+static krb5_error_code get_token(krb5_context k5_ctx, krb5_ccache cc,
+				 krb5_principal client, struct aklog_cell *cell,
+				 krb5_flags options)
+{
+	krb5_creds search_cred, *creds;
+	krb5_error_code kresult;
+
+	memset(&search_cred, 0, sizeof(krb5_creds));
+	search_cred.client = client;
+
+	kresult = krb5_parse_name(k5_ctx, cell->princ, &search_cred.server);
+	if (kresult) {
+		note_krb_error(k5_ctx, cell, kresult, "Parsing server principal name");
+		return kresult;
+	}
+
+	kresult = krb5_get_credentials(k5_ctx, options, cc, &search_cred, &creds);
+	krb5_free_principal(k5_ctx, search_cred.server);
+	if (kresult) {
+		if (!(options & KRB5_GC_CACHED))
+			note_krb_error(k5_ctx, cell, kresult, "Getting tickets");
+		return kresult;
+	}
+
+	make_payload(cell, creds);
+	krb5_free_creds(k5_ctx, creds);
+	return 0;
+}
+
+/*
+ * Fetch tickets for the cells in a batch until there are none left.  A krb5
+ * context can't be used by more than one thread at once, so each thread has
+ * its own context and its own handle on the ccache.
+ */
+static void *get_tokens(void *data)
+{
+	struct aklog_batch *batch = data;
+	struct aklog_cell *cell;
 	krb5_error_code kresult;
 	krb5_context k5_ctx;
-	krb5_ccache cc;
-	krb5_creds search_cred, *creds;
+	krb5_ccache cc = NULL;
+	unsigned int i;
 
-	if (argc < 2 || argc > 3) {
-		fprintf(stderr, "Usage: aklog <cell> [<realm>]\n");
-		exit(1);
+	kresult = krb5_init_context(&k5_ctx);
+	if (kresult)
+		k5_ctx = NULL;
+	else
+		kresult = krb5_cc_resolve(k5_ctx, batch->ccname, &cc);
+
+	while (i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED),
+	       i < batch->nr_todo) {
+		cell = &batch->cells[batch->todo[i]];
+		if (!k5_ctx)
+			cell->error = strdup("krb5_init_context failed");
+		else if (kresult)
+			note_krb_error(k5_ctx, cell, kresult, "Getting credential cache");
+		else
+			get_token(k5_ctx, cc, batch->client, cell, 0);
 	}
 
-	cell = argv[1];
-	if (argc == 3) {
-		realm = strdup(argv[3]);
-		OSZERROR(realm, "strdup");
-	} else {
-		realm = strdup(cell);
-		OSZERROR(realm, "strdup");
+	if (cc)
+		krb5_cc_close(k5_ctx, cc);
+	if (k5_ctx)
+		krb5_free_context(k5_ctx);
+	return NULL;
+}
+
+static void config_error(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	fputs("aklog: ", stderr);
+	vfprintf(stderr, fmt, va);
+	fputc('\n', stderr);
+	va_end(va);
+}
+
+/*
+ * Read the kafs client configuration.
+ */
+static struct kafs_config *read_config(void)
+{
+	struct kafs_report report = { .error = config_error };
+
+	return kafs_new_config(NULL, KAFS_READ_CONFIG_LAZY, &report);
+}
+
+/*
+ * Work out the realm for a cell.  The cell's kerberos_realm setting is used if
+ * it has one; otherwise the realm is assumed to be the cell name in upper case.
+ */
+static char *cell_realm(struct kafs_config *config, const char *name)
+{
+	struct kafs_report report = { .error = config_error };
+	struct kafs_cell *cell = NULL;
+	char *realm, *p;
+	int err;
+
+	if (config && config->db)
+		cell = kafs_cellserv_find_cell2(config->db, name, &report, &err);
+	if (cell && cell->realm)
+		return strdup(cell->realm);
+
+	realm = strdup(name);
+	if (realm)
 		for (p = realm; *p; p++)
 			*p = toupper(*p);
+	return realm;
+}
+
+static __attribute__((noreturn))
+void usage(void)
+{
+	fprintf(stderr, "Usage: aklog [<cell> [-k <realm>]]...\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct kafs_config *config = NULL;
+	struct aklog_batch batch = {};
+	struct aklog_cell *cells, *cell;
+	pthread_t threads[AKLOG_MAX_THREADS];
+	unsigned int nr_cells = 0, nr_threads, i;
+	char *ccname, *p;
+	int a, ret, status = 0;
+	krb5_error_code kresult;
+	krb5_context k5_ctx;
+	krb5_ccache cc;
+	krb5_principal client;
+
+	cells = calloc(argc, sizeof(*cells));
+	OSZERROR(cells, "calloc");
+
+	/* Each cell may be followed by "-k <realm>" to give the realm to use
+	 * for it.  If no cells are given, the local cell is used.
+	 */
+	for (a = 1; a < argc; a++) {
+		if (strcmp(argv[a], "-k") == 0) {
+			if (nr_cells == 0 || cells[nr_cells - 1].realm ||
+			    a + 1 >= argc)
+				usage();
+			cells[nr_cells - 1].realm = strdup(argv[++a]);
+			OSZERROR(cells[nr_cells - 1].realm, "strdup");
+			continue;
+		}
+
+		if (argv[a][0] == '-')
+			usage();
+		cells[nr_cells++].name = argv[a];
+	}
+
+	if (nr_cells == 0) {
+		config = read_config();
+		if (!config || !config->this_cell) {
+			fprintf(stderr, "aklog: No cell given and no local cell configured\n");
+			exit(1);
+		}
+		cells[nr_cells].name = strdup(config->this_cell);
+		OSZERROR(cells[nr_cells].name, "strdup");
+		nr_cells++;
 	}
 
-	for (p = cell; *p; p++)
-		*p = tolower(*p);
+	for (i = 0; i < nr_cells; i++) {
+		cell = &cells[i];
+		for (p = cell->name; *p; p++)
+			*p = tolower(*p);
 
-	ret = asprintf(&princ, "afs/%s@%s", cell, realm);
-	OSERROR(ret, "asprintf");
-	ret = asprintf(&desc, "afs@%s", cell);
-	OSERROR(ret, "asprintf");
+		if (!cell->realm) {
+			if (!config)
+				config = read_config();
+			cell->realm = cell_realm(config, cell->name);
+			OSZERROR(cell->realm, "strdup");
+		}
 
-	printf("CELL %s\n", cell);
-	printf("PRINC %s\n", princ);
+		ret = asprintf(&cell->princ, "afs/%s@%s", cell->name, cell->realm);
+		OSERROR(ret, "asprintf");
+		ret = asprintf(&cell->desc, "afs@%s", cell->name);
+		OSERROR(ret, "asprintf");
+	}
 
 	kresult = krb5_init_context(&k5_ctx);
 	if (kresult) { fprintf(stderr, "krb5_init_context failed\n"); exit(1); }
@@ -291,45 +535,68 @@ int main(int argc, char **argv)
 	kresult = krb5_cc_default(k5_ctx, &cc);
 	KRBERROR(kresult, "Getting credential cache");
 
-	memset(&search_cred, 0, sizeof(krb5_creds));
-
-	kresult = krb5_cc_get_principal(k5_ctx, cc, &search_cred.client);
+	kresult = krb5_cc_get_principal(k5_ctx, cc, &client);
 	KRBERROR(kresult, "Getting client principal");
 
-	kresult = krb5_parse_name(k5_ctx, princ, &search_cred.server);
-	KRBERROR(kresult, "Parsing server principal name");
-
-	//search_cred.keyblock.enctype = ENCTYPE_DES_CBC_CRC;
-
-	kresult = krb5_get_credentials(k5_ctx, 0, cc, &search_cred, &creds);
-	KRBERROR(kresult, "Getting tickets");
-
-	plen = sizeof(*payload) + creds->ticket.length;
-	payload = calloc(1, plen + 4);
-	if (!payload) {
-		perror("calloc");
-		exit(1);
+	/* Use the tickets we already have and then ask the KDC for the rest,
+	 * several at a time if there's more than one.
+	 */
+	batch.todo = calloc(nr_cells, sizeof(batch.todo[0]));
+	OSZERROR(batch.todo, "calloc");
+	for (i = 0; i < nr_cells; i++)
+		if (get_token(k5_ctx, cc, client, &cells[i], KRB5_GC_CACHED) != 0)
+			batch.todo[batch.nr_todo++] = i;
+
+	if (batch.nr_todo == 1) {
+		get_token(k5_ctx, cc, client, &cells[batch.todo[0]], 0);
+	} else if (batch.nr_todo > 1) {
+		kresult = krb5_cc_get_full_name(k5_ctx, cc, &ccname);
+		KRBERROR(kresult, "Getting credential cache name");
+
+		batch.cells = cells;
+		batch.ccname = ccname;
+		batch.client = client;
+		nr_threads = batch.nr_todo;
+		if (nr_threads > AKLOG_MAX_THREADS)
+			nr_threads = AKLOG_MAX_THREADS;
+		for (i = 0; i < nr_threads; i++) {
+			ret = pthread_create(&threads[i], NULL, get_tokens, &batch);
+			if (ret != 0) {
+				errno = ret;
+				perror("pthread_create");
+				exit(1);
+			}
+		}
+		for (i = 0; i < nr_threads; i++)
+			pthread_join(threads[i], NULL);
+		krb5_free_string(k5_ctx, ccname);
 	}
 
-	printf("plen=%zu tklen=%u rk=%zu\n",
-	       plen, creds->ticket.length, sizeof(*payload));
-
-	/* use version 1 of the key data interface */
-	payload->kver           = 1;
-	payload->security_index = 2;
-	payload->ticket_length  = creds->ticket.length;
-	payload->expiry         = creds->times.endtime;
-	payload->kvno           = RXKAD_TKT_TYPE_KERBEROS_V5;
+	/* Install all the keys we got. */
+	for (i = 0; i < nr_cells; i++) {
+		cell = &cells[i];
+		printf("CELL %s\n", cell->name);
+		printf("PRINC %s\n", cell->princ);
+
+		if (!cell->payload) {
+			fprintf(stderr, "%s: %s\n", cell->name,
+				cell->error ?: "Unable to get ticket");
+			status = 1;
+			continue;
+		}
 
-	derive_key(creds, payload->session_key);
-	memcpy(payload->ticket, creds->ticket.data, creds->ticket.length);
+		printf("plen=%zu tklen=%u rk=%zu\n",
+		       cell->plen, cell->payload->ticket_length,
+		       sizeof(*cell->payload));
 
-	ret = add_key("rxrpc", desc, payload, plen, KEY_SPEC_SESSION_KEYRING);
-	OSERROR(ret, "add_key");
+		ret = add_key("rxrpc", cell->desc, cell->payload, cell->plen,
+			      KEY_SPEC_SESSION_KEYRING);
+		OSERROR(ret, "add_key");
+	}
 
-	krb5_free_creds(k5_ctx, creds);
-	krb5_free_cred_contents(k5_ctx, &search_cred);
+	krb5_free_principal(k5_ctx, client);
 	krb5_cc_close(k5_ctx, cc);
 	krb5_free_context(k5_ctx);
-	exit(0);
+	kafs_put_config(config);
+	exit(status);
 }
@@ -1,11 +1,29 @@
 struct kafs_lookup_context;
 
-extern void *kafs_generate_text_payload(void *result,
-					const char *cell_name,
+/*
+ * Payload writer.  With no buffer, nothing is stored but len still advances,
+ * so a first pass over the data gives the exact size of the payload.
+ */
+struct kafs_payload {
+	unsigned char	*buf;
+	size_t		size;		/* Size of buf */
+	size_t		len;		/* Amount of payload generated */
+};
+
+static inline void kafs_payload_store(struct kafs_payload *pl,
+				      const void *p, size_t n)
+{
+	if (pl->buf && pl->len <= pl->size && n <= pl->size - pl->len)
+		memcpy(pl->buf + pl->len, p, n);
+	pl->len += n;
+}
+
+extern void *kafs_generate_text_payload(const char *cell_name,
+					size_t *_len,
 					unsigned int *_ttl,
 					struct kafs_lookup_context *ctx);
 
-extern void *kafs_generate_v1_payload(void *result,
-				      const char *cell_name,
+extern void *kafs_generate_v1_payload(const char *cell_name,
+				      size_t *_len,
 				      unsigned int *_ttl,
 				      struct kafs_lookup_context *ctx);
@@ -15,23 +15,20 @@
 #include <arpa/inet.h>
 #include "dns_afsdb.h"
 
-static void store_char(char **_b, char n)
+static void store_char(struct kafs_payload *pl, char n)
 {
-	*(*_b)++ = n;
+	kafs_payload_store(pl, &n, 1);
 }
 
-static void store_string(char **_b, const char *p)
+static void store_string(struct kafs_payload *pl, const char *p)
 {
-	unsigned int len = strlen(p);
-
-	memcpy(*_b, p, len);
-	*_b += len;
+	kafs_payload_store(pl, p, strlen(p));
 }
 
 /*
  * Generate the payload to pass to the kernel as v1 server bundle.
  */
-static void emit_text_str(char **_b,
+static void emit_text_str(struct kafs_payload *pl,
 			  struct kafs_server_list *vls,
 			  unsigned short default_port)
 {
@@ -49,7 +46,7 @@ static void emit_text_str(char **_b,
 			addr = &server->addrs[j];
 
 			if (need_sep)
-				store_char(_b, ',');
+				store_char(pl, ',');
 			need_sep = true;
 
 			switch (addr->sin.sin_family) {
@@ -57,18 +54,18 @@ static void emit_text_str(char **_b,
 				p = inet_ntop(AF_INET, &addr->sin.sin_addr,
 					      buf, sizeof(buf));
 				if (p) {
-					store_char(_b, '[');
-					store_string(_b, buf);
-					store_char(_b, ']');
+					store_char(pl, '[');
+					store_string(pl, buf);
+					store_char(pl, ']');
 				}
 				break;
 			case AF_INET6:
 				p = inet_ntop(AF_INET6, &addr->sin6.sin6_addr,
 					      buf, sizeof(buf));
 				if (p) {
-					store_char(_b, '[');
-					store_string(_b, buf);
-					store_char(_b, ']');
+					store_char(pl, '[');
+					store_string(pl, buf);
+					store_char(pl, ']');
 				}
 				break;
 			default:
@@ -77,29 +74,52 @@ static void emit_text_str(char **_b,
 
 			if (server->port && server->port != default_port) {
 				sprintf(buf, "%u", server->port);
-				store_char(_b, '+');
-				store_string(_b, buf);
+				store_char(pl, '+');
+				store_string(pl, buf);
 			}
 		}
 	}
 
-	store_char(_b, 0);
+	store_char(pl, 0);
 }
 
-void *kafs_generate_text_payload(void *result,
-				 const char *cell_name,
+/*
+ * Look up a cell and generate a text payload for it in a buffer of exactly the
+ * right size, which the caller must free.  The NUL terminator is included.
+ */
+void *kafs_generate_text_payload(const char *cell_name,
+				 size_t *_len,
 				 unsigned int *_ttl,
 				 struct kafs_lookup_context *ctx)
 {
+	struct kafs_payload pl = {};
 	struct kafs_cell *cell;
-	char *b = result;
+	unsigned long long start;
 
 	ctx->report.what = cell_name;
 	cell = kafs_lookup_cell(cell_name, ctx);
 	if (!cell)
 		return NULL;
 
+	/* Size the payload and then generate it. */
+	start = kafs_stats_start(&ctx->report);
+	if (cell->vlservers)
+		emit_text_str(&pl, cell->vlservers, 7003);
+
+	pl.size = pl.len;
+	pl.len = 0;
+	pl.buf = malloc(pl.size ?: 1);
+	if (!pl.buf) {
+		ctx->report.bad_error = true;
+		ctx->report.error("%m");
+		goto out;
+	}
+
 	if (cell->vlservers)
-		emit_text_str(&b, cell->vlservers, 7003);
-	return b;
+		emit_text_str(&pl, cell->vlservers, 7003);
+	*_len = pl.len;
+	kafs_stats_end(&ctx->report, kafs_stats_payload, start);
+out:
+	kafs_free_cell(cell);
+	return pl.buf;
 }
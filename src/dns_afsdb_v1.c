@@ -15,89 +15,123 @@
 #include "dns_afsdb.h"
 #include "dns_resolver.h"
 
-static void store_u8(unsigned char **_b, unsigned char n)
+#define V1_MAX_COUNT	255	/* Server and address counts are u8 */
+
+static void store_u8(struct kafs_payload *pl, unsigned char n)
 {
-	*(*_b)++ = n;
+	kafs_payload_store(pl, &n, 1);
 }
 
-static void store_u16(unsigned char **_b, unsigned short n)
+static void store_u16(struct kafs_payload *pl, unsigned short n)
 {
-	*(*_b)++ = (n >>  0) & 0xff;
-	*(*_b)++ = (n >>  8) & 0xff;
+	unsigned char b[2] = { (n >> 0) & 0xff, (n >> 8) & 0xff };
+
+	kafs_payload_store(pl, b, 2);
 }
 
-static void store_octets(unsigned char **_b, const void *p, size_t n)
+static void store_octets(struct kafs_payload *pl, const void *p, size_t n)
 {
-	memcpy(*_b, p, n);
-	*_b += n;
+	kafs_payload_store(pl, p, n);
 }
 
 /*
- * Generate the payload to pass to the kernel as v1 server bundle.
+ * Generate the payload to pass to the kernel as v1 server bundle.  Anything
+ * beyond what the u8 counts can describe is left out.
  */
-static void emit_v1(unsigned char **_b, struct kafs_server_list *vls)
+static void emit_v1(struct kafs_payload *pl, struct kafs_server_list *vls)
 {
 	struct kafs_server_addr *addr;
 	struct kafs_server *server;
-	unsigned int i, j, n;
+	unsigned int i, j, n, nr_servers, nr_addrs;
+
+	nr_servers = vls->nr_servers;
+	if (nr_servers > V1_MAX_COUNT)
+		nr_servers = V1_MAX_COUNT;
 
-	store_u8 (_b, 0); /* It's not a string */
-	store_u8 (_b, DNS_PAYLOAD_IS_SERVER_LIST);
-	store_u8 (_b, 1); /* Encoding version */
-	store_u8 (_b, vls->source);
-	store_u8 (_b, vls->status);
-	store_u8 (_b, vls->nr_servers);
+	store_u8 (pl, 0); /* It's not a string */
+	store_u8 (pl, DNS_PAYLOAD_IS_SERVER_LIST);
+	store_u8 (pl, 1); /* Encoding version */
+	store_u8 (pl, vls->source);
+	store_u8 (pl, vls->status);
+	store_u8 (pl, nr_servers);
 
-	for (i = 0; i < vls->nr_servers; i++) {
+	for (i = 0; i < nr_servers; i++) {
 		server = &vls->servers[i];
+		nr_addrs = server->nr_addrs;
+		if (nr_addrs > V1_MAX_COUNT)
+			nr_addrs = V1_MAX_COUNT;
 
 		n = strlen(server->name);
-		store_u16(_b, n);
-		store_u16(_b, server->pref);
-		store_u16(_b, server->weight);
-		store_u16(_b, server->port);
-		store_u8 (_b, server->source);
-		store_u8 (_b, server->status);
-		store_u8 (_b, server->protocol);
-		store_u8 (_b, server->nr_addrs);
-		store_octets(_b, server->name, n);
-
-		for (j = 0; j < server->nr_addrs; j++) {
+		store_u16(pl, n);
+		store_u16(pl, server->pref);
+		store_u16(pl, server->weight);
+		store_u16(pl, server->port);
+		store_u8 (pl, server->source);
+		store_u8 (pl, server->status);
+		store_u8 (pl, server->protocol);
+		store_u8 (pl, nr_addrs);
+		store_octets(pl, server->name, n);
+
+		for (j = 0; j < nr_addrs; j++) {
 			addr = &server->addrs[j];
 
 			switch (addr->sin.sin_family) {
 			case AF_INET:
-				store_u8(_b, DNS_ADDRESS_IS_IPV4);
-				store_octets(_b, &addr->sin.sin_addr, 4);
+				store_u8(pl, DNS_ADDRESS_IS_IPV4);
+				store_octets(pl, &addr->sin.sin_addr, 4);
 				break;
 			case AF_INET6:
-				store_u8(_b, DNS_ADDRESS_IS_IPV6);
-				store_octets(_b, &addr->sin6.sin6_addr, 16);
+				store_u8(pl, DNS_ADDRESS_IS_IPV6);
+				store_octets(pl, &addr->sin6.sin6_addr, 16);
 				break;
 			default:
-				store_u8(_b, 0);
+				store_u8(pl, 0);
 				continue;
 			}
 		}
 	}
 }
 
-void *kafs_generate_v1_payload(void *result,
-			       const char *cell_name,
+/*
+ * Look up a cell and generate a v1 payload for it in a buffer of exactly the
+ * right size, which the caller must free.
+ */
+void *kafs_generate_v1_payload(const char *cell_name,
+			       size_t *_len,
 			       unsigned int *_ttl,
 			       struct kafs_lookup_context *ctx)
 {
+	struct kafs_payload pl = {};
 	struct kafs_cell *cell;
-	unsigned char *b = result;
+	unsigned long long start;
 
 	ctx->report.what = cell_name;
 	cell = kafs_lookup_cell(cell_name, ctx);
 	if (!cell)
 		return NULL;
 
-	if (_ttl)
-		*_ttl = cell->vlservers->ttl;
+	/* Size the payload and then generate it. */
+	start = kafs_stats_start(&ctx->report);
+	if (cell->vlservers) {
+		if (_ttl)
+			*_ttl = cell->vlservers->ttl;
+		emit_v1(&pl, cell->vlservers);
+	}
+
+	pl.size = pl.len;
+	pl.len = 0;
+	pl.buf = malloc(pl.size ?: 1);
+	if (!pl.buf) {
+		ctx->report.bad_error = true;
+		ctx->report.error("%m");
+		goto out;
+	}
+
 	if (cell->vlservers)
-		emit_v1(&b, cell->vlservers);
-	return b;
+		emit_v1(&pl, cell->vlservers);
+	*_len = pl.len;
+	kafs_stats_end(&ctx->report, kafs_stats_payload, start);
+out:
+	kafs_free_cell(cell);
+	return pl.buf;
 }
@@ -0,0 +1,15 @@
+/*
+ * Protocol spoken to the kafs-dns resolver daemon.
+ *
+ * The client sends the cell name and the callout info as a pair of
+ * NUL-terminated strings and then shuts down its side of the socket.  The
+ * daemon sends back a reply header followed by the payload, if any.
+ */
+#define KAFS_DNS_SOCKET	"/run/kafs-dns.sock"
+#define REQUEST_MAX	4096
+
+struct kafs_dns_reply {
+	int32_t		status;		/* 0 or -1 if the lookup failed */
+	uint32_t	ttl;
+	uint32_t	len;		/* Length of payload */
+};
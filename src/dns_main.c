@@ -45,19 +45,36 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <keyutils.h>
-#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <kafs/cellserv.h>
 #include "dns_afsdb.h"
+#include "dns_daemon.h"
+#include "dns_trace.h"
 
 static const char *DNS_PARSE_VERSION = "2.0";
 static const char prog[] = "dns_afsdb";
 static const char key_type[] = "dns_resolver";
 static const char afsdb_query_type[] = "afsdb:";
+static const char *socket_path = KAFS_DNS_SOCKET;
 static key_serial_t key;
 static int debug_mode;
-static bool one_addr_only = true;
-static unsigned int output_version = 0;
+static struct kafs_stats stats;
+static int trace_fd = -1;
+
+/*
+ * The kernel won't accept a payload larger than 1MiB, so nor will we.
+ */
+#define PAYLOAD_MAX	(1024 * 1024)
 
 /*
  * Print an error to stderr or the syslog, negate the key being created and
@@ -137,18 +154,26 @@ void usage(void)
 			prog);
 		fprintf(stderr,	"       %s -D [OPTION]... <desc> <calloutinfo>\n",
 			prog);
+		fprintf(stderr,	"       %s -d [OPTION]...\n",
+			prog);
 		fprintf(stderr,	"       %s -V\n",
 			prog);
 
 		fprintf(stderr,	"\n");
 		fprintf(stderr,	"Where [OPTION].. is a combination of one or more of:\n");
 		fprintf(stderr,	"\t-c <conffile>\n");
+		fprintf(stderr,	"\t-M <dns_fixture>\n");
 		fprintf(stderr,	"\t-N dns\n");
 		fprintf(stderr,	"\t-N vls-afsdb\n");
 		fprintf(stderr,	"\t-N vls-srv\n");
 		fprintf(stderr,	"\t-N vls-all\n");
 		fprintf(stderr,	"\t-N vl-host\n");
 		fprintf(stderr,	"\t-o <dumpfile>\n");
+		fprintf(stderr,	"\t-R <rtt_probe_timeout_ms>\n");
+		fprintf(stderr,	"\t-S <socket>\n");
+		fprintf(stderr,	"\t-s\n");
+		fprintf(stderr,	"\t-T <addr_lookup_timeout_ms>\n");
+		fprintf(stderr,	"\t-t <tracefile>\n");
 		fprintf(stderr,	"\t-v\n");
 	} else {
 		verbose("Usage: %s [-vv] <key_serial>", prog);
@@ -157,19 +182,23 @@ void usage(void)
 }
 
 /*
- * Parse the callout info string.
+ * Parse the callout info string.  The payload format wanted is returned in
+ * *_version.
  */
-static void parse_callout(char *options, struct kafs_lookup_context *ctx)
+static int parse_callout(char *options, struct kafs_lookup_context *ctx,
+			 unsigned int *_version)
 {
 	char *k, *val;
 
 	ctx->want_ipv4_addrs = true;
 	ctx->want_ipv6_addrs = true;
+	ctx->addr_family = kafs_addr_family_default;
+	*_version = 0;
 
 	if (!*options) {
 		/* legacy mode */
 		ctx->want_ipv6_addrs = false;
-		return;
+		return 0;
 	}
 
 	do {
@@ -181,8 +210,10 @@ static void parse_callout(char *options, struct kafs_lookup_context *ctx)
 			*options++ = '\0';
 		if (!*k)
 			continue;
-		if (strchr(k, ','))
-			error("Option name '%s' contains a comma", k);
+		if (strchr(k, ',')) {
+			print_error("Option name '%s' contains a comma", k);
+			return -1;
+		}
 
 		val = strchr(k, '=');
 		if (val)
@@ -198,18 +229,666 @@ static void parse_callout(char *options, struct kafs_lookup_context *ctx)
 			ctx->want_ipv4_addrs = false;
 			ctx->want_ipv6_addrs = true;
 		} else if (strcmp(k, "list") == 0) {
-			one_addr_only = false;
+			/* All the addresses are always listed. */
 		} else if (strcmp(k, "srv") == 0) {
-			output_version = atoi(val);
+			if (!val) {
+				print_error("Option 'srv' needs a value");
+				return -1;
+			}
+			*_version = atoi(val);
+		} else if (strcmp(k, "family") == 0) {
+			if (!val || kafs_parse_addr_family(val, &ctx->addr_family) < 0)
+				print_error("Ignoring address family policy '%s'",
+					    val ?: "");
 		}
 	} while (*options);
+
+	return 0;
+}
+
+/*
+ * Log a summary of the time spent in each phase of a lookup if asked to.
+ */
+static void report_stats(const char *name, struct kafs_lookup_context *ctx)
+{
+	char buf[512];
+
+	if (!ctx->report.stats)
+		return;
+	kafs_format_stats(ctx->report.stats, buf, sizeof(buf));
+	verbose("Stats %s: %s", name, buf);
+}
+
+/*
+ * Upcall tracing.  If asked to, a record of each request is appended to a
+ * trace file, noting what was asked for, when, how long it took to answer and
+ * a hash of the payload, so that kafs-dns-replay can play the load back later.
+ */
+struct trace_start {
+	uint64_t	wall_ns;
+	uint64_t	mono_ns;
+};
+
+static struct trace_start upcall_start;
+static const char *upcall_name;
+static char *upcall_info;
+static enum kafs_dns_trace_source upcall_source = KAFS_DNS_TRACE_UPCALL;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace_start(struct trace_start *ts)
+{
+	ts->wall_ns = clock_ns(CLOCK_REALTIME);
+	ts->mono_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+static void trace_request(const struct trace_start *ts,
+			  enum kafs_dns_trace_source source,
+			  const char *name, const char *callout_info,
+			  int status, const void *result, size_t len,
+			  unsigned int ttl)
+{
+	struct kafs_dns_trace_rec *rec;
+	size_t qlen = sizeof(afsdb_query_type) - 1;
+	size_t dlen = qlen + strlen(name) + 1;
+	size_t ilen = strlen(callout_info) + 1;
+	size_t size = KAFS_DNS_TRACE_REC_SIZE(dlen, ilen);
+	char *p;
+
+	if (trace_fd == -1 || dlen > UINT16_MAX || ilen > UINT16_MAX)
+		return;
+
+	rec = calloc(1, size);
+	if (!rec)
+		return;
+	rec->magic	 = KAFS_DNS_TRACE_MAGIC;
+	rec->desc_len	 = dlen;
+	rec->info_len	 = ilen;
+	rec->start_ns	 = ts->wall_ns;
+	rec->duration_ns = clock_ns(CLOCK_MONOTONIC) - ts->mono_ns;
+	rec->hash	 = result ? kafs_dns_trace_hash(result, len) : 0;
+	rec->status	 = status;
+	rec->ttl	 = ttl;
+	rec->len	 = result ? len : 0;
+	rec->source	 = source;
+
+	p = (char *)(rec + 1);
+	memcpy(p, afsdb_query_type, qlen);
+	memcpy(p + qlen, name, dlen - qlen);
+	memcpy(p + dlen, callout_info, ilen);
+
+	if (write(trace_fd, rec, size) != (ssize_t)size)
+		print_error("Trace: %m");
+	free(rec);
+}
+
+/*
+ * Record the outcome of this upcall, once we know what it's for.
+ */
+static void trace_upcall(int status, const void *result, size_t len,
+			 unsigned int ttl)
+{
+	if (!upcall_name)
+		return;
+	trace_request(&upcall_start, upcall_source, upcall_name, upcall_info,
+		      status, result, len, ttl);
+	upcall_name = NULL;
+}
+
+/*
+ * Record an upcall that exits before producing a payload.
+ */
+static void trace_upcall_failed(void)
+{
+	trace_upcall(-1, NULL, 0, UINT_MAX);
+}
+
+/*
+ * Generate the payload for a cell, returning a buffer of exactly the right size
+ * that the caller must free or NULL on failure.
+ */
+static char *generate_payload(const char *name, char *callout_info, size_t *_len,
+			      unsigned int *_ttl, struct kafs_lookup_context *ctx)
+{
+	unsigned int version;
+	char *result;
+
+	if (parse_callout(callout_info, ctx, &version) < 0)
+		return NULL;
+
+	switch (version) {
+	case 0:
+		result = kafs_generate_text_payload(name, _len, _ttl, ctx);
+		break;
+	case 1:
+	default:
+		result = kafs_generate_v1_payload(name, _len, _ttl, ctx);
+		break;
+	}
+
+	if (result && *_len > PAYLOAD_MAX) {
+		print_error("%s: Payload too big (%zu bytes)", name, *_len);
+		free(result);
+		return NULL;
+	}
+	return result;
+}
+
+/*
+ * Write a buffer to a socket in its entirety.
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read from a socket until EOF or the buffer is full.
+ */
+static ssize_t read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		p += n;
+		len -= n;
+	}
+	return p - (char *)buf;
+}
+
+/*
+ * Fill in the address of the daemon's socket.
+ */
+static int daemon_address(struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(sun->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun->sun_path, socket_path);
+	return 0;
+}
+
+/*
+ * How long an upcall waits for the daemon to answer (s).  This is kept well
+ * short of the time the resolver may spend on a cell with dead nameservers so
+ * that a wedged daemon doesn't hold up every upcall for long.
+ */
+#define DAEMON_REPLY_TIMEOUT	10
+
+/*
+ * Hand a lookup off to the resolver daemon.  Returns 1 if the daemon produced
+ * a payload and 0 if there's no daemon to talk to or it didn't answer in time,
+ * in which case we do the lookup ourselves.  If the daemon tells us the lookup
+ * failed, the key is negated.
+ */
+static int call_daemon(const char *name, const char *callout_info,
+		       char **_result, size_t *_len, unsigned int *_ttl)
+{
+	struct kafs_dns_reply reply;
+	struct sockaddr_un sun;
+	struct timeval tv = { .tv_sec = DAEMON_REPLY_TIMEOUT };
+	size_t nlen = strlen(name) + 1, clen = strlen(callout_info) + 1;
+	char *result;
+	int fd;
+
+	if (nlen + clen > REQUEST_MAX || daemon_address(&sun) < 0)
+		return 0;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return 0;
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		if (errno != ENOENT && errno != ECONNREFUSED)
+			print_error("%s: connect: %m", socket_path);
+		goto no_daemon;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (write_all(fd, name, nlen) < 0 ||
+	    write_all(fd, callout_info, clen) < 0 ||
+	    shutdown(fd, SHUT_WR) < 0 ||
+	    read_all(fd, &reply, sizeof(reply)) != sizeof(reply))
+		goto bad_reply;
+
+	if (reply.status != 0)
+		error("daemon: Lookup failed");
+	if (reply.len > PAYLOAD_MAX)
+		goto bad_reply;
+
+	result = malloc(reply.len + 1);
+	if (!result)
+		error("%m");
+	if (read_all(fd, result, reply.len) != reply.len) {
+		free(result);
+		goto bad_reply;
+	}
+
+	close(fd);
+	verbose("Got %u bytes from daemon", reply.len);
+	*_result = result;
+	*_len = reply.len;
+	*_ttl = reply.ttl;
+	return 1;
+
+bad_reply:
+	print_error("%s: Bad reply from daemon", socket_path);
+no_daemon:
+	close(fd);
+	return 0;
+}
+
+/*
+ * Service a single request from a client.
+ */
+static void serve_request(int fd, struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_reply reply = { .status = -1, .ttl = UINT_MAX };
+	struct trace_start ts;
+	struct ucred cred;
+	socklen_t clen = sizeof(cred);
+	struct timeval tv = { .tv_sec = 5 };
+	char req[REQUEST_MAX + 1], *name, *callout_info, *result = NULL;
+	char *info = NULL;
+	size_t plen;
+	ssize_t len;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) == -1 ||
+	    (cred.uid != 0 && cred.uid != geteuid())) {
+		print_error("Rejecting request from uid %u", cred.uid);
+		return;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	len = read_all(fd, req, REQUEST_MAX);
+	if (len <= 0)
+		return;
+	req[len] = 0;
+	trace_start(&ts);
+
+	name = req;
+	callout_info = name + strlen(name) + 1;
+	if (callout_info >= req + len ||
+	    callout_info + strlen(callout_info) + 1 != req + len) {
+		print_error("Malformed request");
+		goto out;
+	}
+
+	verbose("Do AFS VL server query for:'%s' mask:'%s'", name, callout_info);
+
+	/* Parsing the callout info chops it up. */
+	if (trace_fd != -1)
+		info = strdup(callout_info);
+
+	ctx->report.bad_error = false;
+	ctx->report.bad_config = false;
+	if (ctx->report.stats)
+		kafs_reset_stats(ctx->report.stats);
+	result = generate_payload(name, callout_info, &plen, &reply.ttl, ctx);
+	if (result) {
+		reply.status = 0;
+		reply.len = plen;
+	}
+	report_stats(name, ctx);
+	if (info)
+		trace_request(&ts, KAFS_DNS_TRACE_DAEMON, name, info,
+			      reply.status, result, reply.len, reply.ttl);
+	free(info);
+
+out:
+	if (write_all(fd, &reply, sizeof(reply)) < 0 ||
+	    (result && write_all(fd, result, reply.len) < 0))
+		print_error("Reply: %m");
+	free(result);
+}
+
+static volatile sig_atomic_t flush_cache;
+
+static void sighup(int sig)
+{
+	flush_cache = 1;
+}
+
+#define REFRESH_MAX_WAIT 60	/* Longest time between refresh passes (s) */
+
+/*
+ * Keep the lookup cache warm by re-resolving cells that are in use before
+ * their cached results expire, so that the next upcall for a cell doesn't have
+ * to wait for the DNS.  This runs in its own thread with its own copy of the
+ * lookup context.
+ */
+static void *refresh_cache(void *data)
+{
+	struct kafs_lookup_context *ctx = data;
+	unsigned int wait;
+
+	for (;;) {
+		wait = kafs_lookup_cache_refresh(ctx->cache, ctx);
+		if (wait > REFRESH_MAX_WAIT)
+			wait = REFRESH_MAX_WAIT;
+		sleep(wait ?: 1);
+	}
+
+	return NULL;
+}
+
+#define RELOAD_SETTLE_MS 250	/* Quiet time to wait for after a config change */
+#define RELOAD_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |	\
+		       IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB)
+
+struct reload_state {
+	struct kafs_config	*config;
+	struct kafs_lookup_cache *cache;
+	struct kafs_report	report;
+};
+
+/*
+ * Watch the directories holding the files that a config was read from, and
+ * the include directories.  Watching a directory twice just gets the same
+ * watch back.
+ */
+static int watch_config(const struct kafs_config *config, int ifd)
+{
+	const struct kafs_config_unit *u;
+	unsigned int i;
+	char *dir, *p;
+
+	if (ifd == -1)
+		ifd = inotify_init1(IN_CLOEXEC);
+	if (ifd == -1) {
+		print_error("inotify_init: %m");
+		return -1;
+	}
+
+	for (i = 0; i < config->nr_units; i++) {
+		u = &config->units[i];
+		dir = strdup(u->path);
+		if (!dir)
+			continue;
+		if (!u->is_dir) {
+			p = strrchr(dir, '/');
+			if (!p)
+				strcpy(dir, ".");
+			else if (p == dir)
+				p[1] = 0;
+			else
+				*p = 0;
+		}
+		if (inotify_add_watch(ifd, dir, RELOAD_EVENTS) == -1)
+			print_error("%s: inotify_add_watch: %m", dir);
+		free(dir);
+	}
+	return ifd;
+}
+
+/*
+ * Reload the configuration when any of the files it was read from change.
+ * Where possible, only the changed files are reparsed and only the cached
+ * results for the cells that they redefine are discarded.  Lookups in progress
+ * carry on with the config they started with.
+ */
+static void *reload_config(void *data)
+{
+	struct reload_state *rs = data;
+	struct kafs_config *config = rs->config, *new;
+	struct pollfd pfd;
+	unsigned int i;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int ifd;
+
+	ifd = watch_config(config, -1);
+	if (ifd == -1)
+		return NULL;
+
+	for (;;) {
+		/* Wait for a change and then for things to settle down. */
+		pfd.fd = ifd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno != EINTR) {
+				print_error("poll: %m");
+				return NULL;
+			}
+			continue;
+		}
+		do {
+			if (read(ifd, buf, sizeof(buf)) == -1 && errno != EINTR) {
+				print_error("inotify: %m");
+				return NULL;
+			}
+		} while (poll(&pfd, 1, RELOAD_SETTLE_MS) > 0);
+
+		/* Start watching afresh before reading so that changes made
+		 * whilst we're reading aren't missed.
+		 */
+		close(ifd);
+		ifd = watch_config(config, -1);
+		if (ifd == -1)
+			return NULL;
+
+		rs->report.bad_error = false;
+		rs->report.bad_config = false;
+		new = kafs_reload_config(config, &rs->report);
+		if (!new) {
+			print_error("Config reload failed; keeping the old config");
+			continue;
+		}
+		if (new == config) {
+			kafs_put_config(new);
+			continue;
+		}
+
+		kafs_set_default_config(new);
+		if (new->base == config) {
+			verbose("Reloaded config, %u cells changed", new->nr_changed);
+			for (i = 0; i < new->nr_changed; i++)
+				kafs_lookup_cache_forget(rs->cache, new->changed[i]);
+		} else {
+			verbose("Reread config, flushing lookup cache");
+			kafs_flush_lookup_cache(rs->cache);
+		}
+		kafs_put_config(config);
+		config = new;
+		watch_config(config, ifd);
+	}
+
+	return NULL;
+}
+
+#define DAEMON_WORKERS	8	/* Number of requests serviced at once */
+
+struct daemon_worker {
+	struct kafs_lookup_context ctx;
+	struct kafs_stats	stats;
+	pthread_t		thread;
+	int			lfd;
+};
+
+/*
+ * Accept and service requests until the daemon exits.  Each worker has its own
+ * lookup context and resolver state, so a cell whose nameservers don't answer
+ * only holds up the upcalls that are waiting for it.
+ */
+static void *daemon_worker(void *data)
+{
+	struct daemon_worker *w = data;
+	int fd;
+
+	for (;;) {
+		fd = accept4(w->lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				print_error("accept: %m");
+			continue;
+		}
+		serve_request(fd, &w->ctx);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * Run as a daemon, keeping the configuration and resolver state loaded and
+ * servicing lookups passed to us by upcall instances of this program.  Up to
+ * DAEMON_WORKERS requests are serviced at once; further upcalls queue on the
+ * socket's backlog.  Lookup results are cached until their TTL runs out;
+ * SIGHUP discards the cache.  Cached results that are in use are refreshed in
+ * the background before they expire and the last good result is served if a
+ * lookup fails transiently.  The configuration is reloaded when the files it
+ * came from change.  If stats are being collected, a summary is logged for
+ * each request.
+ */
+static __attribute__((noreturn))
+void run_daemon(const char **filep, struct kafs_lookup_context *ctx)
+{
+	static struct kafs_lookup_context refresh_ctx;
+	static struct daemon_worker workers[DAEMON_WORKERS];
+	static struct reload_state reload;
+	struct daemon_worker *w;
+	struct sigaction sa = { .sa_handler = sighup };
+	struct sockaddr_un sun;
+	sigset_t hup, unblocked;
+	pthread_t refresher, reloader;
+	unsigned int i;
+	int lfd;
+
+	/* Only the main thread takes SIGHUP; the others inherit the mask. */
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &hup, &unblocked);
+	sigdelset(&unblocked, SIGHUP);
+
+	if (kafs_init_lookup_context(ctx) < 0)
+		exit(1);
+	ctx->reuse_dns_tcp = true;
+
+	/* Lookups use the default config so that it can be swapped under them. */
+	reload.config = kafs_new_config(filep,
+					KAFS_READ_CONFIG_PARALLEL |
+					KAFS_READ_CONFIG_LAZY |
+					KAFS_READ_CONFIG_RELOADABLE,
+					&ctx->report);
+	if (!reload.config)
+		exit(ctx->report.bad_config ? 3 : 1);
+	kafs_set_default_config(reload.config);
+	report_stats("<config>", ctx);
+
+	ctx->cache = kafs_alloc_lookup_cache(&ctx->report);
+	if (!ctx->cache)
+		exit(1);
+
+	reload.cache = ctx->cache;
+	reload.report = ctx->report;
+	reload.report.stats = NULL;
+	if (pthread_create(&reloader, NULL, reload_config, &reload) != 0) {
+		print_error("pthread_create: %m");
+		exit(1);
+	}
+	pthread_detach(reloader);
+
+	refresh_ctx = *ctx;
+	refresh_ctx.report.stats = NULL;
+	if (kafs_init_lookup_context(&refresh_ctx) < 0)
+		exit(1);
+	if (pthread_create(&refresher, NULL, refresh_cache, &refresh_ctx) != 0) {
+		print_error("pthread_create: %m");
+		exit(1);
+	}
+	pthread_detach(refresher);
+
+	if (daemon_address(&sun) < 0) {
+		print_error("%s: %m", socket_path);
+		exit(1);
+	}
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd == -1) {
+		print_error("socket: %m");
+		exit(1);
+	}
+
+	unlink(socket_path);
+	if (bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	    chmod(socket_path, 0600) == -1 ||
+	    listen(lfd, 64) == -1) {
+		print_error("%s: %m", socket_path);
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGHUP, &sa, NULL);
+
+	for (i = 0; i < DAEMON_WORKERS; i++) {
+		w = &workers[i];
+		w->ctx = *ctx;
+		if (ctx->report.stats)
+			w->ctx.report.stats = &w->stats;
+		w->lfd = lfd;
+		if (kafs_init_lookup_context(&w->ctx) < 0)
+			exit(1);
+		if (pthread_create(&w->thread, NULL, daemon_worker, w) != 0) {
+			print_error("pthread_create: %m");
+			exit(1);
+		}
+		pthread_detach(w->thread);
+	}
+
+	verbose("Listening on %s", socket_path);
+
+	for (;;) {
+		sigsuspend(&unblocked);
+		if (flush_cache) {
+			flush_cache = 0;
+			verbose("Flushing lookup cache");
+			kafs_flush_lookup_cache(ctx->cache);
+		}
+	}
 }
 
 const struct option long_options[] = {
 	{ "conf",	0, NULL, 'c' },
+	{ "daemon",	0, NULL, 'd' },
 	{ "debug",	0, NULL, 'D' },
+	{ "mock",	required_argument, NULL, 'M' },
 	{ "no",		0, NULL, 'N' },
 	{ "output",	0, NULL, 'o' },
+	{ "probe",	required_argument, NULL, 'R' },
+	{ "socket",	required_argument, NULL, 'S' },
+	{ "stats",	0, NULL, 's' },
+	{ "timeout",	required_argument, NULL, 'T' },
+	{ "trace",	required_argument, NULL, 't' },
 	{ "verbose",	0, NULL, 'v' },
 	{ "version",	0, NULL, 'V' },
 	{ NULL,		0, NULL, 0 }
@@ -220,14 +899,19 @@ const struct option long_options[] = {
  */
 int main(int argc, char *argv[])
 {
-	struct kafs_lookup_context ctx = { .report.error = print_error, };
-	const char *dump_file = NULL;
+	struct kafs_lookup_context ctx = {
+		.report.error		= print_error,
+		.parallel_addr_lookup	= true,
+		.race_vls_lookup	= true,
+	};
+	const char *dump_file = NULL, *fixture = NULL, *trace_file = NULL;
 	const char *filev[10], **filep = NULL;
 	char *keyend, *p;
 	char *callout_info = NULL;
-	char *buf = NULL, *name, *result, *r_end;
-	unsigned int ttl;
-	size_t ktlen;
+	char *buf = NULL, *name, *result;
+	unsigned int ttl = UINT_MAX;
+	size_t ktlen, len;
+	bool daemon_mode = false;
 	int ret, filec = 0;
 
 	if (argc > 1 && strcmp(argv[1], "--help") == 0)
@@ -235,7 +919,7 @@ int main(int argc, char *argv[])
 
 	openlog(prog, 0, LOG_DAEMON);
 
-	while ((ret = getopt_long(argc, argv, "Dvc:N:o:V:", long_options, NULL)) != -1) {
+	while ((ret = getopt_long(argc, argv, "dDsvc:M:N:o:R:S:t:T:V:", long_options, NULL)) != -1) {
 		switch (ret) {
 		case 'c':
 			if (filec >= 9) {
@@ -244,9 +928,15 @@ int main(int argc, char *argv[])
 			}
 			filev[filec++] = optarg;
 			break;
+		case 'd':
+			daemon_mode = true;
+			break;
 		case 'D':
 			debug_mode = 1;
 			break;
+		case 'M':
+			fixture = optarg;
+			break;
 		case 'V':
 			printf("version: %s from %s (%s)\n",
 			       DNS_PARSE_VERSION,
@@ -281,6 +971,29 @@ int main(int argc, char *argv[])
 		case 'o':
 			dump_file = optarg;
 			break;
+		case 'R':
+			ctx.rtt_probe_timeout = strtoul(optarg, &p, 0);
+			if (*p) {
+				fprintf(stderr, "Invalid probe timeout '%s'\n", optarg);
+				usage();
+			}
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 's':
+			ctx.report.stats = &stats;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'T':
+			ctx.addr_lookup_timeout = strtoul(optarg, &p, 0);
+			if (*p) {
+				fprintf(stderr, "Invalid timeout '%s'\n", optarg);
+				usage();
+			}
+			break;
 		default:
 			if (!isatty(2))
 				syslog(LOG_ERR, "unknown option: %c", ret);
@@ -291,6 +1004,35 @@ int main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (filec > 0) {
+		filev[filec] = NULL;
+		filep = filev;
+	}
+
+	if (trace_file) {
+		trace_start(&upcall_start);
+		trace_fd = open(trace_file,
+				O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+		if (trace_fd == -1) {
+			print_error("%s: %m", trace_file);
+			exit(1);
+		}
+		atexit(trace_upcall_failed);
+	}
+
+	/* Take DNS data from a fixture rather than the nameservers if asked. */
+	if (fixture) {
+		ctx.resolver = kafs_new_mock_resolver(fixture, &ctx.report);
+		if (!ctx.resolver)
+			exit(ctx.report.bad_config ? 3 : 1);
+	}
+
+	if (daemon_mode) {
+		if (argc != 0 || debug_mode)
+			usage();
+		run_daemon(filep, &ctx);
+	}
+
 	if (!debug_mode) {
 		if (argc != 1)
 			usage();
@@ -349,42 +1091,38 @@ int main(int argc, char *argv[])
 
 	verbose("Do AFS VL server query for:'%s' mask:'%s'", name, callout_info);
 
-	parse_callout(callout_info, &ctx);
-
-	/* Anything we create must fit into 1MiB buffer */
-	result = mmap(NULL, 1024 * 1024, PROT_READ | PROT_WRITE,
-		      MAP_PRIVATE | MAP_ANON, -1, 0);
-	if (result == MAP_FAILED)
-		error("mmap: %m");
-
-	if (filec > 0) {
-		filev[filec] = NULL;
-		filep = filev;
+	/* Parsing the callout info chops it up, so keep a copy for the trace. */
+	if (trace_fd != -1) {
+		upcall_info = strdup(callout_info);
+		if (upcall_info)
+			upcall_name = name;
 	}
 
+	/* Let the daemon do the lookup if there is one */
+	upcall_source = KAFS_DNS_TRACE_VIA_DAEMON;
+	if (!debug_mode &&
+	    call_daemon(name, callout_info, &result, &len, &ttl))
+		goto got_payload;
+	upcall_source = KAFS_DNS_TRACE_UPCALL;
+
 	if (kafs_init_lookup_context(&ctx) < 0)
 		exit(1);
 
-	if (kafs_read_config(filep, &ctx.report) < 0)
+	ctx.config = kafs_new_config(filep,
+				     KAFS_READ_CONFIG_IMAGE | KAFS_READ_CONFIG_STREAM,
+				     &ctx.report);
+	if (!ctx.config)
 		exit(ctx.report.bad_config ? 3 : 1);
 
 	/* Generate the payload */
-	switch (output_version) {
-	case 0:
-		r_end = kafs_generate_text_payload(result, name, &ttl, &ctx);
-		break;
-
-	case 1:
-	default:
-		r_end = kafs_generate_v1_payload(result, name, &ttl, &ctx);
-		break;
-	}
-
-	if (!r_end)
+	result = generate_payload(name, callout_info, &len, &ttl, &ctx);
+	report_stats(name, &ctx);
+	if (!result)
 		error("failed");
 
-	verbose("version %u %zu", output_version, r_end - result);
+	verbose("payload %zu", len);
 
+got_payload:
 	if (dump_file) {
 		int fd = open(dump_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 		if (fd == -1) {
@@ -392,7 +1130,7 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 
-		if (write(fd, result, r_end - result) != r_end - result)  {
+		if (write(fd, result, len) != (ssize_t)len)  {
 			perror(dump_file);
 			exit(1);
 		}
@@ -409,11 +1147,12 @@ int main(int argc, char *argv[])
 				error("keyctl_set_timeout: %m");
 		}
 
-		ret = keyctl_instantiate(key, result, r_end - result, 0);
+		ret = keyctl_instantiate(key, result, len, 0);
 		if (ret == -1)
 			error("keyctl_instantiate: %m");
 	}
 
-	verbose("Success (%zu bytes)", r_end - result);
+	trace_upcall(0, result, len, ttl);
+	verbose("Success (%zu bytes)", len);
 	return 0;
 }
@@ -0,0 +1,49 @@
+/*
+ * Upcall trace records written by kafs-dns -t and read by kafs-dns-replay.
+ *
+ * A trace file is a sequence of records, each a header followed by the query
+ * description ("afsdb:<cell>") and the callout info as NUL-terminated strings,
+ * padded to a multiple of 8 bytes.  Each record is appended with a single
+ * write so that upcall processes sharing a trace file don't interleave.  The
+ * payload itself isn't kept, only its length and a hash of it.  All fields are
+ * in host byte order.
+ */
+#define KAFS_DNS_TRACE_MAGIC	0x4b445431	/* "KDT1" */
+
+enum kafs_dns_trace_source {
+	KAFS_DNS_TRACE_UPCALL,		/* Upcall that did its own lookup */
+	KAFS_DNS_TRACE_VIA_DAEMON,	/* Upcall that the daemon answered */
+	KAFS_DNS_TRACE_DAEMON,		/* Request serviced by the daemon */
+};
+
+struct kafs_dns_trace_rec {
+	uint32_t	magic;
+	uint16_t	desc_len;	/* Including the NUL */
+	uint16_t	info_len;	/* Including the NUL */
+	uint64_t	start_ns;	/* Wall clock time the request arrived */
+	uint64_t	duration_ns;	/* Time taken to produce the result */
+	uint64_t	hash;		/* kafs_dns_trace_hash() of the payload */
+	int32_t		status;		/* 0 or -1 if the lookup failed */
+	uint32_t	ttl;
+	uint32_t	len;		/* Length of payload */
+	uint8_t		source;		/* enum kafs_dns_trace_source */
+	uint8_t		__pad[3];
+};
+
+#define KAFS_DNS_TRACE_REC_SIZE(desc_len, info_len) \
+	((sizeof(struct kafs_dns_trace_rec) + (desc_len) + (info_len) + 7) & ~7UL)
+
+/*
+ * The payload hash is 64-bit FNV-1a.
+ */
+static inline uint64_t kafs_dns_trace_hash(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
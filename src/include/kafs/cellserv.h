@@ -16,9 +16,12 @@
 #include <resolv.h>
 #include <netinet/in.h>
 #include "reporting.h"
+#include "profile.h"
 
-struct kafs_profile;
 struct kafs_profile_parse;
+struct kafs_lookup_cache;
+struct kafs_dns_engine;
+struct addrinfo;
 
 enum kafs_server_type {
 	kafs_server_is_untyped,
@@ -48,6 +51,49 @@ enum kafs_lookup_status {
 	nr__kafs_lookup_status
 };
 
+/*
+ * How the addresses in a server list are to be ordered by family.  This is
+ * done before the servers are ordered by RTT, if they are, so that probe
+ * results override the policy and the policy only decides between servers
+ * and addresses that are equally quick or that didn't answer.
+ */
+enum kafs_addr_family_policy {
+	kafs_addr_family_default,	/* As set by the config */
+	kafs_addr_family_as_listed,	/* In the order they were looked up in */
+	kafs_addr_family_prefer_ipv6,	/* IPv6 addresses and servers first */
+	kafs_addr_family_prefer_ipv4,	/* IPv4 addresses and servers first */
+	kafs_addr_family_interleave,	/* Alternate families, IPv6 first */
+	nr__kafs_addr_family_policy
+};
+
+/*
+ * Timings and counters for the phases of reading the config and looking up
+ * cells, collected if the caller points report->stats at one of these.  Each
+ * SRV and AFSDB query and each call to look up a server list's addresses
+ * counts as one run of its phase; query outcomes are counted for the DNS
+ * queries and for each server whose addresses are looked up.  The lookup
+ * phase includes the DNS phases.
+ */
+enum kafs_stats_phase {
+	kafs_stats_config,		/* Reading the configuration */
+	kafs_stats_lookup,		/* Looking up a cell */
+	kafs_stats_srv,			/* DNS SRV queries */
+	kafs_stats_afsdb,		/* DNS AFSDB queries */
+	kafs_stats_addrs,		/* Server address lookups */
+	kafs_stats_payload,		/* Upcall payload generation */
+	nr__kafs_stats_phase
+};
+
+struct kafs_phase_stats {
+	unsigned int		count;		/* Number of runs */
+	unsigned long long	ns;		/* Total monotonic time spent */
+	unsigned int		results[nr__kafs_lookup_status]; /* Query outcomes */
+};
+
+struct kafs_stats {
+	struct kafs_phase_stats	phases[nr__kafs_stats_phase];
+};
+
 struct kafs_server_addr {
 	union {
 		struct sockaddr_in	sin;
@@ -78,25 +124,129 @@ struct kafs_server_list {
 	enum kafs_record_source	source : 8;
 	enum kafs_lookup_status	status : 8;
 	struct kafs_server	*servers;
+	size_t			packed_size;	/* Size of block if packed, else 0 */
+};
+
+/*
+ * Where a definition of a cell lies in the config files.  These are noted in
+ * place of profile nodes when the config is indexed rather than parsed
+ * (KAFS_READ_CONFIG_STREAM), one for each definition to be merged.
+ */
+struct kafs_cell_pos {
+	struct kafs_cell_pos	*next;
+	const char		*file;
+	off_t			offset;		/* File offset of the "name = {" line */
+	unsigned int		line;
+	bool			final;		/* T if closed with "}*" */
 };
 
 struct kafs_cell {
+	unsigned int		usage;		/* Reference count */
 	char			*name;
 	char			*desc;
 	char			*realm;
 	bool			use_dns;
 	bool			show_cell;
+	bool			hot;		/* Resolve in advance at boot */
 	bool			borrowed_name;
 	bool			borrowed_desc;
 	bool			borrowed_realm;
 	struct kafs_server_list	*vlservers;
+	struct kafs_config	*config;	/* Config the cell borrows from or NULL */
+	const struct kafs_profile *node;	/* Profile node not yet parsed or NULL */
+	const struct kafs_profile *def;		/* Profile node it was made from or NULL */
+	const struct kafs_cell_pos *pos;	/* Definitions not yet read or NULL */
 };
 
+/*
+ * A cell database.  If it was loaded from a compiled image, the cells are
+ * looked up in the image rather than the hash index and each slot is empty
+ * until the cell is first looked up or kafs_cellserv_materialise() is called.
+ */
 struct kafs_cell_db {
 	unsigned int		nr_cells;
+	unsigned int		index_mask;	/* Size of index - 1 */
+	unsigned int		*index;		/* Hash of cell name -> cell nr + 1 */
+	struct kafs_config	*image_config;	/* Config holding the image or NULL */
 	struct kafs_cell	*cells[];
 };
 
+/*
+ * A file or directory that went into a config, noted so that the config can
+ * be reloaded incrementally.  The cells it contributed to are listed in
+ * strcmp() order.
+ */
+struct kafs_config_unit {
+	const char		*path;
+	struct timespec		mtime;
+	off_t			size;
+	unsigned int		depth;		/* Inclusion depth */
+	bool			is_dir;
+	bool			incremental;	/* T if it can be reparsed on its own */
+	bool			has_final;	/* T if it marks anything in a cell final */
+	bool			own_path;	/* T if path belongs to this unit */
+	bool			own_cells;	/* T if cells belongs to this unit */
+	unsigned int		nr_cells;
+	const char		**cells;
+};
+
+/*
+ * A loaded configuration.  This is read-only once built and may be shared
+ * between threads; the cells looked up from it hold references on it.
+ *
+ * A config that was reloaded incrementally shares the cells that didn't change
+ * with the config it was reloaded from, which it keeps a reference on.  Its
+ * profile holds only the definitions of the cells that it rebuilt.
+ */
+struct kafs_config {
+	unsigned int		usage;
+	unsigned long long	serial;		/* Identifies it to the lookup cache */
+	struct kafs_profile	profile;	/* The text config, if parsed */
+	struct kafs_cell_db	*db;
+	const char		*this_cell;
+	const char		*sysname;
+	enum kafs_addr_family_policy addr_family; /* Default family ordering */
+	void			*image;		/* Compiled image, if loaded from one */
+	size_t			image_size;
+	unsigned int		flags;		/* KAFS_READ_CONFIG_* it was read with */
+	char			**files;	/* Files it was read from */
+	struct kafs_config	*base;		/* Config reloaded from or NULL */
+	unsigned int		layers;		/* Number of bases below this one */
+	unsigned int		nr_units;
+	struct kafs_config_unit	*units;		/* Provenance if reloadable or NULL */
+	const char		**unit_cells;	/* Storage for the base's unit cell lists */
+	unsigned int		nr_changed;
+	const char		**changed;	/* Cells that differ from the base's */
+};
+
+/*
+ * A source of DNS data to use in place of the system resolver.  query() works
+ * like res_nquery(), putting the answer into the buffer and returning its
+ * length or returning -1 with the reason in *_herr.  getaddrinfo() and
+ * freeaddrinfo() work like the libc functions.  A resolver may be used by
+ * several lookups at once.
+ *
+ * An address lookup that a caller gives up waiting for carries on in the
+ * background, so a resolver with a release() method is reference counted:
+ * each such lookup holds a reference and release() is called when the last
+ * one is put.  The creator holds the first reference and drops it with
+ * kafs_put_resolver() rather than freeing the resolver.  A resolver without a
+ * release() method must outlive every lookup that might use it.
+ */
+struct kafs_resolver {
+	const char	*name;
+	int (*query)(const struct kafs_resolver *resolver,
+		     const char *name, int type,
+		     unsigned char *answer, int anslen, int *_herr);
+	int (*getaddrinfo)(const struct kafs_resolver *resolver,
+			   const char *node, const struct addrinfo *hints,
+			   struct addrinfo **_result);
+	void (*freeaddrinfo)(const struct kafs_resolver *resolver,
+			     struct addrinfo *res);
+	void (*release)(struct kafs_resolver *resolver);
+	unsigned int	usage;		/* References if release() is set */
+};
+
 struct kafs_lookup_context {
 	struct kafs_report	report;
 	struct __res_state	res;
@@ -105,6 +255,18 @@ struct kafs_lookup_context {
 	bool			no_vls_afsdb;
 	bool			no_vls_srv;
 	bool			no_vl_host;
+	bool			race_vls_lookup; /* Issue SRV and AFSDB queries together */
+	bool			parallel_addr_lookup; /* Look up server addresses in parallel */
+	unsigned int		addr_lookup_timeout; /* Limit on parallel lookups (ms) or 0 */
+	struct kafs_lookup_cache *cache;	/* Cache of lookup results or NULL */
+	bool			cache_refresh;	/* Update the cache without reading it */
+	unsigned int		max_cells_in_flight; /* Limit on batch lookups or 0 */
+	unsigned int		rtt_probe_timeout; /* Order servers by RTT (ms) or 0 */
+	enum kafs_addr_family_policy addr_family; /* Family ordering or default */
+	struct kafs_config	*config;	/* Config to use or NULL for the default */
+	bool			reuse_dns_tcp;	/* Keep TCP connections to nameservers open */
+	struct kafs_dns_engine	*dns;		/* DNS query engine state */
+	const struct kafs_resolver *resolver;	/* DNS source or NULL for the system's */
 };
 
 /*
@@ -114,19 +276,52 @@ extern int kafs_init_lookup_context(struct kafs_lookup_context *ctx);
 extern void kafs_clear_lookup_context(struct kafs_lookup_context *ctx);
 extern struct kafs_server_list *kafs_alloc_server_list(struct kafs_report *report);
 extern void kafs_free_server_list(struct kafs_server_list *sl);
+extern struct kafs_cell *kafs_get_cell(struct kafs_cell *cell);
 extern void kafs_free_cell(struct kafs_cell *cell);
 extern void kafs_transfer_addresses(struct kafs_server *to,
 				    const struct kafs_server *from);
 extern int kafs_transfer_server_list(struct kafs_server_list *to,
 				     const struct kafs_server_list *from);
+extern struct kafs_server_list *kafs_alloc_packed_server_list(unsigned int nr_servers,
+							      unsigned int nr_addrs,
+							      size_t strings,
+							      struct kafs_server_addr **_addrs,
+							      char **_strings,
+							      struct kafs_report *report);
+extern struct kafs_server_list *kafs_pack_server_list(const struct kafs_server_list *from,
+						      struct kafs_report *report);
+extern struct kafs_server_list *kafs_dup_server_list(const struct kafs_server_list *from,
+						     struct kafs_report *report);
 extern void kafs_transfer_cell(struct kafs_cell *to,
 			       const struct kafs_cell *from);
+extern void kafs_free_cell_db(struct kafs_cell_db *db);
 
 /*
  * cellserv.c
  */
 extern struct kafs_cell_db *kafs_cellserv_parse_conf(const struct kafs_profile *prof,
 						     struct kafs_report *report);
+extern struct kafs_cell_db *kafs_cellserv_parse_conf2(const struct kafs_profile *prof,
+						      unsigned int flags,
+						      struct kafs_report *report);
+extern int kafs_cellserv_materialise(const struct kafs_cell_db *db,
+				     struct kafs_report *report);
+extern struct kafs_cell_db *kafs_cellserv_stream_conf(struct kafs_profile *prof,
+						      const char *const *files,
+						      struct kafs_report *report);
+extern struct kafs_cell *kafs_cellserv_stream_cell(const char *const *files,
+						   const char *cell_name,
+						   bool first_only,
+						   struct kafs_report *report,
+						   int *_err);
+extern int kafs_cellserv_index(struct kafs_cell_db *db,
+			       struct kafs_report *report);
+extern struct kafs_cell *kafs_cellserv_find_cell(const struct kafs_cell_db *db,
+						 const char *cell_name);
+extern struct kafs_cell *kafs_cellserv_find_cell2(const struct kafs_cell_db *db,
+						  const char *cell_name,
+						  struct kafs_report *report,
+						  int *_err);
 extern void kafs_cellserv_dump(const struct kafs_cell_db *db);
 extern const char *kafs_record_source(enum kafs_record_source source);
 extern const char *kafs_lookup_status(enum kafs_lookup_status status);
@@ -140,17 +335,123 @@ extern int kafs_dns_lookup_addresses(struct kafs_server_list *sl,
 extern int kafs_dns_lookup_vlservers(struct kafs_server_list *vsl,
 				     const char *cell_name,
 				     struct kafs_lookup_context *ctx);
+extern void kafs_put_resolver(const struct kafs_resolver *resolver);
+
+/*
+ * mock_resolver.c
+ */
+extern struct kafs_resolver *kafs_new_mock_resolver(const char *fixture,
+						    struct kafs_report *report);
+extern void kafs_free_mock_resolver(struct kafs_resolver *resolver);
+
+/*
+ * stats.c
+ */
+extern unsigned long long kafs_stats_start(const struct kafs_report *report);
+extern void kafs_stats_end(struct kafs_report *report, enum kafs_stats_phase phase,
+			   unsigned long long start);
+extern void kafs_stats_add(struct kafs_report *report, enum kafs_stats_phase phase,
+			   unsigned long long ns);
+extern void kafs_stats_result(struct kafs_report *report, enum kafs_stats_phase phase,
+			      enum kafs_lookup_status status);
+extern void kafs_reset_stats(struct kafs_stats *stats);
+extern int kafs_format_stats(const struct kafs_stats *stats, char *buf, size_t size);
+
+/*
+ * server_order.c
+ */
+extern void kafs_dedup_addresses(struct kafs_server_list *vsl,
+				 struct kafs_lookup_context *ctx);
+extern void kafs_order_servers(struct kafs_server_list *vsl,
+			       struct kafs_lookup_context *ctx);
+extern int kafs_parse_addr_family(const char *name,
+				  enum kafs_addr_family_policy *_policy);
+extern const char *kafs_addr_family_name(enum kafs_addr_family_policy policy);
+extern void kafs_order_families(struct kafs_server_list *vsl,
+				enum kafs_addr_family_policy policy,
+				struct kafs_lookup_context *ctx);
+
+/*
+ * lookup_cache.c
+ */
+extern struct kafs_lookup_cache *kafs_alloc_lookup_cache(struct kafs_report *report);
+extern void kafs_flush_lookup_cache(struct kafs_lookup_cache *cache);
+extern void kafs_lookup_cache_forget(struct kafs_lookup_cache *cache,
+				     const char *cell_name);
+extern void kafs_free_lookup_cache(struct kafs_lookup_cache *cache);
+extern struct kafs_server_list *kafs_lookup_cache_get(struct kafs_lookup_cache *cache,
+						      const char *cell_name,
+						      const struct kafs_config *config,
+						      struct kafs_lookup_context *ctx,
+						      int *_err);
+extern void kafs_lookup_cache_put(struct kafs_lookup_cache *cache,
+				  const char *cell_name,
+				  const struct kafs_config *config,
+				  const struct kafs_server_list *vsl,
+				  struct kafs_lookup_context *ctx);
+extern struct kafs_server_list *kafs_lookup_cache_get_stale(struct kafs_lookup_cache *cache,
+							    const char *cell_name,
+							    const struct kafs_config *config,
+							    const struct kafs_server_list *vsl,
+							    struct kafs_lookup_context *ctx);
+extern unsigned int kafs_lookup_cache_refresh(struct kafs_lookup_cache *cache,
+					      struct kafs_lookup_context *ctx);
+
+/*
+ * celldb.c
+ */
+extern int kafs_celldb_write(const char *image, struct kafs_report *report);
+extern int kafs_celldb_write2(const char *image, const struct kafs_config *config,
+			      struct kafs_report *report);
+extern int kafs_celldb_load(const char *image, const char *const *files,
+			    struct kafs_config *config,
+			    struct kafs_report *report);
+
+/*
+ * config_reload.c
+ */
+extern struct kafs_config *kafs_reload_config(struct kafs_config *config,
+					      struct kafs_report *report);
 
 /*
  * cell_lookup.c
  */
+#define KAFS_READ_CONFIG_IMAGE		0x01	/* Use the compiled cell database if current */
+#define KAFS_READ_CONFIG_PARALLEL	0x02	/* Parse include dirs on multiple threads */
+#define KAFS_READ_CONFIG_LAZY		0x04	/* Build cell records on first lookup */
+#define KAFS_READ_CONFIG_RELOADABLE	0x08	/* Note provenance for kafs_reload_config() */
+#define KAFS_READ_CONFIG_STREAM		0x10	/* Just index the cells in the text */
+#define KAFS_READ_CONFIG_MAX_THREADS	KAFS_PROFILE_MAX_THREADS
+
 extern struct kafs_profile kafs_config_profile;
 extern struct kafs_cell_db *kafs_cellserv_db;
 extern const char *kafs_this_cell;
 extern const char *kafs_sysname;
+extern const char *kafs_celldb_image;
 extern int kafs_read_config(const char *const *files,
 			    struct kafs_report *report);
+extern int kafs_read_config2(const char *const *files,
+			     unsigned int flags,
+			     struct kafs_report *report);
+extern struct kafs_config *kafs_new_config(const char *const *files,
+					   unsigned int flags,
+					   struct kafs_report *report);
+extern struct kafs_config *kafs_get_config(struct kafs_config *config);
+extern void kafs_put_config(struct kafs_config *config);
+extern struct kafs_config *kafs_get_default_config(struct kafs_report *report);
+extern void kafs_set_default_config(struct kafs_config *config);
 extern struct kafs_cell *kafs_lookup_cell(const char *cell_name,
 					  struct kafs_lookup_context *ctx);
 
+#define KAFS_LOOKUP_CELLS_DEFAULT_IN_FLIGHT	16
+#define KAFS_LOOKUP_CELLS_MAX_IN_FLIGHT		64
+
+typedef void (*kafs_lookup_cells_func_t)(struct kafs_cell *cell,
+					 const char *cell_name,
+					 unsigned int index,
+					 void *data);
+extern int kafs_lookup_cells(const char *const *names, unsigned int nr_names,
+			     struct kafs_lookup_context *ctx,
+			     kafs_lookup_cells_func_t func, void *data);
+
 #endif /* _KAFS_CELLSERV_H */
@@ -13,6 +13,8 @@
 #define _KAFS_PROFILE_H
 
 #include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
 #include "reporting.h"
 
 enum kafs_profile_value_type {
@@ -20,27 +22,113 @@ enum kafs_profile_value_type {
 	kafs_profile_value_is_string,
 };
 
+/*
+ * Record of a file or directory that got read into a profile tree.
+ */
+struct kafs_profile_source {
+	struct kafs_profile_source *next;
+	bool			is_dir;
+	bool			is_root;	/* T if not reached by inclusion */
+	unsigned int		depth;		/* Inclusion depth */
+	struct timespec		mtime;
+	off_t			size;
+	char			path[];
+};
+
+/*
+ * State attached to the root of a profile tree.  All the nodes, relation
+ * vectors and file contents for the tree are allocated from an arena attached
+ * to it so that the whole lot can be discarded in one go.
+ */
+struct kafs_profile_chunk;
+struct kafs_profile_index;
+
+struct kafs_profile_tree {
+	struct kafs_profile_chunk *chunks;	/* Arena; current chunk first */
+	struct kafs_profile_source *sources;	/* In the order read */
+	struct kafs_profile_source **sources_tail;
+	unsigned int		depth;		/* Inclusion depth */
+	unsigned int		nr_threads;	/* Threads for parsing include dirs */
+};
+
 struct kafs_profile {
 	enum kafs_profile_value_type type : 8;
 	bool			final;
 	bool			dummy;
 	unsigned int		nr_relations;
+	unsigned int		max_relations;
 	unsigned int		line;
 	const char		*file;
 	char			*name;
 	char			*value;
 	struct kafs_profile	*parent;
 	struct kafs_profile	**relations;
+	struct kafs_profile_index *index;	/* Name index for big lists */
+	struct kafs_profile_tree *tree;		/* Root only */
+};
+
+/*
+ * Events generated by scanning a kafs_profile file, in the order the lines
+ * appear.  The depth is the nesting depth of the list being opened or closed
+ * or of the relation, counting the lists opened in the section: a list opened
+ * directly in a section is at depth 1 and its relations at depth 2.  Inclusion
+ * directives are followed by kafs_profile_stream() and aren't passed on.
+ */
+enum kafs_profile_event_type {
+	kafs_profile_event_section,	/* [name] */
+	kafs_profile_event_open,	/* name = { */
+	kafs_profile_event_relation,	/* name = value */
+	kafs_profile_event_close,	/* } or }* */
+	kafs_profile_event_include,	/* include value */
+	kafs_profile_event_include_dir,	/* includedir value */
+};
+
+struct kafs_profile_event {
+	enum kafs_profile_event_type type : 8;
+	bool			final;		/* Close: list marked final */
+	unsigned int		depth;
+	unsigned int		line;
+	off_t			offset;		/* File offset of the line */
+	const char		*file;
+	char			*name;
+	char			*value;
+};
+
+typedef int (*kafs_profile_event_func_t)(const struct kafs_profile_event *event,
+					 void *data,
+					 struct kafs_report *report);
+
+/*
+ * State for building a tree from events.  Zero it, apart from the root, before
+ * the first event.  Unless copy is set, the event strings are taken over by
+ * the tree and must last as long as it.
+ */
+struct kafs_profile_builder {
+	struct kafs_profile	*root;
+	struct kafs_profile	*list;		/* List being added to */
+	const char		*file;		/* Filename to attach to nodes */
+	bool			copy;		/* T to copy the strings into the tree */
 };
 
 extern void kafs_profile_dump(const struct kafs_profile *p,
 			      unsigned int depth);
+extern void kafs_profile_free(struct kafs_profile *prof);
 extern int kafs_profile_parse_file(struct kafs_profile *prof,
 				   const char *filename,
 				   struct kafs_report *report);
 extern int kafs_profile_parse_dir(struct kafs_profile *prof,
 				  const char *dirname,
 				  struct kafs_report *report);
+extern int kafs_profile_stream(const char *file, off_t offset, unsigned int line,
+			       kafs_profile_event_func_t func, void *data,
+			       struct kafs_report *report);
+extern int kafs_profile_build(struct kafs_profile_builder *b,
+			      const struct kafs_profile_event *ev,
+			      struct kafs_report *report);
+extern bool kafs_profile_set_simd(bool enable);
+#define KAFS_PROFILE_MAX_THREADS	8	/* Limit for kafs_profile_set_threads() */
+extern int kafs_profile_set_threads(struct kafs_profile *prof,
+				    unsigned int nr_threads);
 extern const struct kafs_profile *
 kafs_profile_find_first_child(const struct kafs_profile *prof,
 			      enum kafs_profile_value_type type,
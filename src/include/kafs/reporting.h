@@ -12,6 +12,8 @@
 #ifndef _KAFS_REPORTING_H
 #define _KAFS_REPORTING_H
 
+struct kafs_stats;
+
 struct kafs_report {
 	void (*error)(const char *fmt, ...)
 		__attribute__((format(printf, 1, 2)));
@@ -24,6 +26,7 @@ struct kafs_report {
 	bool		bad_config;	/* T if bad config encountered */
 	bool		bad_error;	/* T if fatal system error encountered */
 	bool		abandon_alloc;	/* T to not clean up on error */
+	struct kafs_stats *stats;	/* Phase timings and counters or NULL */
 };
 
 #endif /* _KAFS_REPORTING_H */
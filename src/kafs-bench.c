@@ -0,0 +1,726 @@
+/*
+ * Microbenchmarks for the config parsing, cell lookup and payload generation
+ * paths.
+ *
+ * Each benchmark is run repeatedly for at least the minimum time and reports
+ * the mean time per operation, the number of heap allocations per operation
+ * and the peak RSS reached whilst it was running.  DNS data comes from a mock
+ * resolver so that the nameservers don't figure in the results.  The data and
+ * synthetic configs are generated into a temporary directory.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <malloc.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <kafs/cellserv.h>
+#include <kafs/profile.h>
+#include "dns_afsdb.h"
+
+#define NR_DNS_CELLS	1000	/* Number of cells in the DNS fixture */
+
+extern char **environ;
+
+static const char *conf_dir = "../conf";
+static const char *kafs_dns = "./kafs-dns";
+static char tmp_dir[] = "/tmp/kafs-bench.XXXXXX";
+static unsigned long min_time_ms = 500;
+static bool json;
+static char **filters;
+static int nr_filters;
+
+/*
+ * Count heap allocations by interposing on the allocator.  This catches the
+ * library's allocations as well as our own.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long long nr_allocs;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+static void error_report(const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	vfprintf(stderr, fmt, va);
+	fputc('\n', stderr);
+	va_end(va);
+}
+
+static void quiet_report(const char *fmt, ...)
+{
+}
+
+static __attribute__((noreturn))
+void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-j] [-t <ms>] [-C <confdir>] [-k <kafs-dns>] [<benchmark>]*\n",
+		prog);
+	exit(2);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Reset the peak RSS of the process (Linux 4.0+) and read it back.
+ */
+static void reset_peak_rss(void)
+{
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+
+	if (fd != -1) {
+		/* The peak figure then covers everything run so far. */
+		if (write(fd, "5", 1) != 1)
+			perror("/proc/self/clear_refs");
+		close(fd);
+	}
+}
+
+static long read_peak_rss(void)
+{
+	struct rusage ru;
+	char line[128];
+	long kb = -1;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+				break;
+		fclose(f);
+	}
+
+	if (kb == -1 && getrusage(RUSAGE_SELF, &ru) == 0)
+		kb = ru.ru_maxrss;
+	return kb;
+}
+
+static bool selected(const char *name)
+{
+	int i;
+
+	if (!nr_filters)
+		return true;
+	for (i = 0; i < nr_filters; i++)
+		if (strstr(name, filters[i]))
+			return true;
+	return false;
+}
+
+static void report_result(const char *name, unsigned long long iterations,
+			  unsigned long long ns, long long allocs, long peak_rss)
+{
+	double ns_per_op = (double)ns / iterations;
+
+	if (json) {
+		printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.1f,",
+		       name, iterations, ns_per_op);
+		if (allocs >= 0)
+			printf("\"allocs_per_op\":%.2f,", (double)allocs / iterations);
+		else
+			printf("\"allocs_per_op\":null,");
+		printf("\"peak_rss_kb\":%ld}\n", peak_rss);
+	} else {
+		printf("%-36s %10llu %14.1f ns/op", name, iterations, ns_per_op);
+		if (allocs >= 0)
+			printf(" %10.2f allocs/op", (double)allocs / iterations);
+		else
+			printf(" %10s allocs/op", "-");
+		printf(" %8ld KB peak\n", peak_rss);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Run an operation enough times to take at least the minimum time and report
+ * the results.  The timed run is preceded by calibration runs, which also
+ * serve to warm things up.
+ */
+static int run_bench(const char *name, int (*op)(void *data, unsigned long long i),
+		     void *data)
+{
+	unsigned long long n = 1, i, t0, t1, a0, a1, min_ns = min_time_ms * 1000000ULL;
+	long peak;
+
+	if (!selected(name))
+		return 0;
+
+	for (;;) {
+		t0 = now_ns();
+		for (i = 0; i < n; i++)
+			if (op(data, i) < 0)
+				goto failed;
+		t1 = now_ns();
+		if (t1 - t0 >= min_ns / 10 || n >= 1ULL << 40)
+			break;
+		n *= 10;
+	}
+
+	/* Aim for the minimum time on the timed run. */
+	if (t1 - t0 < min_ns)
+		n = n * min_ns / (t1 - t0 ?: 1) + 1;
+
+	malloc_trim(0);
+	reset_peak_rss();
+	a0 = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED);
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		if (op(data, i) < 0)
+			goto failed;
+	t1 = now_ns();
+	a1 = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED);
+	peak = read_peak_rss();
+
+	report_result(name, n, t1 - t0, a1 - a0, peak);
+	return 0;
+
+failed:
+	fprintf(stderr, "%s: Benchmark failed\n", name);
+	return -1;
+}
+
+/*
+ * Generate the test data.
+ */
+static char *tmp_path(const char *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s", tmp_dir, name) == -1) {
+		perror(NULL);
+		exit(1);
+	}
+	return path;
+}
+
+static char *make_config(unsigned int nr_cells)
+{
+	unsigned int i, j;
+	char name[32], *path;
+	FILE *f;
+
+	snprintf(name, sizeof(name), "synthetic-%u.conf", nr_cells);
+	path = tmp_path(name);
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	fprintf(f, "[cells]\n");
+	for (i = 0; i < nr_cells; i++) {
+		fprintf(f,
+			"\tcell%u.bench.test = {\n"
+			"\t\tdescription = \"Synthetic cell %u\"\n"
+			"\t\tuse_dns = yes\n"
+			"\t\tkerberos_realm = CELL%u.BENCH.TEST\n"
+			"\t\tservers = {\n",
+			i, i, i);
+		for (j = 0; j < 3; j++)
+			fprintf(f,
+				"\t\t\tvl%u.cell%u.bench.test = {\n"
+				"\t\t\t\taddress = 10.%u.%u.%u\n"
+				"\t\t\t}\n",
+				j, i, i >> 16 & 255, i >> 8 & 255, i & 255);
+		fprintf(f, "\t\t}\n\t}\n");
+	}
+
+	if (fclose(f) == EOF) {
+		perror(path);
+		exit(1);
+	}
+	return path;
+}
+
+static char *make_fixture(void)
+{
+	unsigned int i, j;
+	char *path;
+	FILE *f;
+
+	path = tmp_path("fixture.zone");
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	fprintf(f, "$TTL 300\n");
+	for (i = 0; i < NR_DNS_CELLS; i++) {
+		for (j = 0; j < 3; j++)
+			fprintf(f, "_afs3-vlserver._udp.dyn%u.bench.test SRV %u 10 7003 vl%u.dyn%u.bench.test\n",
+				i, j, j, i);
+		for (j = 0; j < 3; j++) {
+			fprintf(f, "vl%u.dyn%u.bench.test 600 A 10.%u.%u.%u\n",
+				j, i, 128 + j, i >> 8 & 255, i & 255);
+			fprintf(f, "vl%u.dyn%u.bench.test 600 AAAA fd00::%u:%u\n",
+				j, i, j, i);
+		}
+	}
+
+	if (fclose(f) == EOF) {
+		perror(path);
+		exit(1);
+	}
+	return path;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+			struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/*
+ * Config parsing benchmarks.
+ */
+static int op_profile_parse(void *data, unsigned long long i)
+{
+	struct kafs_report report = { .error = error_report };
+	struct kafs_profile prof = {};
+	int ret;
+
+	ret = kafs_profile_parse_file(&prof, data, &report);
+	kafs_profile_free(&prof);
+	return ret;
+}
+
+/*
+ * Check that two profile trees are the same, node for node.
+ */
+static bool same_profile(const struct kafs_profile *a, const struct kafs_profile *b)
+{
+	unsigned int i;
+
+	if (a->type != b->type ||
+	    a->final != b->final ||
+	    a->line != b->line ||
+	    a->nr_relations != b->nr_relations ||
+	    strcmp(a->name ?: "", b->name ?: "") != 0 ||
+	    strcmp(a->value ?: "", b->value ?: "") != 0 ||
+	    strcmp(a->file ?: "", b->file ?: "") != 0)
+		return false;
+	for (i = 0; i < a->nr_relations; i++)
+		if (!same_profile(a->relations[i], b->relations[i]))
+			return false;
+	return true;
+}
+
+/*
+ * Check that the vector tokeniser, if there is one, parses a file the same as
+ * the scalar one does.
+ */
+static int check_profile_scan(const char *path)
+{
+	struct kafs_report report = { .error = error_report };
+	struct kafs_profile vec = {}, scalar = {};
+	bool simd, same;
+
+	simd = kafs_profile_set_simd(false);
+	if (kafs_profile_parse_file(&scalar, path, &report) < 0)
+		return -1;
+	kafs_profile_set_simd(true);
+	if (!simd)
+		goto out;
+	if (kafs_profile_parse_file(&vec, path, &report) < 0)
+		return -1;
+
+	same = same_profile(&vec, &scalar);
+	kafs_profile_free(&vec);
+	if (!same) {
+		fprintf(stderr, "%s: Vector and scalar tokenisers differ\n", path);
+		kafs_profile_free(&scalar);
+		return -1;
+	}
+out:
+	kafs_profile_free(&scalar);
+	return 0;
+}
+
+static int op_profile_event(const struct kafs_profile_event *ev, void *data,
+			    struct kafs_report *report)
+{
+	return 0;
+}
+
+static int op_profile_stream(void *data, unsigned long long i)
+{
+	struct kafs_report report = { .error = error_report };
+
+	return kafs_profile_stream(data, 0, 0, op_profile_event, NULL, &report);
+}
+
+struct stream_bench {
+	const char		*files[2];
+	const char		*cell;
+};
+
+static int op_cellserv_stream_conf(void *data, unsigned long long i)
+{
+	struct kafs_report report = { .error = quiet_report };
+	struct stream_bench *b = data;
+	struct kafs_profile prof = {};
+	struct kafs_cell_db *db;
+
+	db = kafs_cellserv_stream_conf(&prof, b->files, &report);
+	if (db)
+		kafs_free_cell_db(db);
+	kafs_profile_free(&prof);
+	return db ? 0 : -1;
+}
+
+static int op_cellserv_stream_cell(void *data, unsigned long long i)
+{
+	struct kafs_report report = { .error = quiet_report };
+	struct stream_bench *b = data;
+	struct kafs_cell *cell;
+	int err;
+
+	cell = kafs_cellserv_stream_cell(b->files, b->cell, true, &report, &err);
+	if (!cell)
+		return -1;
+	kafs_free_cell(cell);
+	return 0;
+}
+
+struct parse_conf_bench {
+	struct kafs_profile	prof;
+	unsigned int		flags;
+};
+
+static int op_cellserv_parse_conf(void *data, unsigned long long i)
+{
+	struct kafs_report report = { .error = quiet_report };
+	struct parse_conf_bench *b = data;
+	struct kafs_cell_db *db;
+
+	db = kafs_cellserv_parse_conf2(&b->prof, b->flags, &report);
+	if (!db)
+		return -1;
+	kafs_free_cell_db(db);
+	return 0;
+}
+
+static int bench_config(const char *label, const char *path, const char *cell)
+{
+	struct kafs_report report = { .error = error_report };
+	struct parse_conf_bench b = {};
+	struct stream_bench sb = { .files = { path }, .cell = cell };
+	char name[64], lazy_name[64], scalar_name[64];
+	int ret;
+
+	/* Check the tokenisers agree before timing them. */
+	snprintf(name, sizeof(name), "profile_parse.%s", label);
+	snprintf(scalar_name, sizeof(scalar_name), "profile_parse_scalar.%s", label);
+	if ((selected(name) || selected(scalar_name)) &&
+	    check_profile_scan(path) < 0)
+		return -1;
+	if (run_bench(name, op_profile_parse, (void *)path) < 0)
+		return -1;
+	kafs_profile_set_simd(false);
+	ret = run_bench(scalar_name, op_profile_parse, (void *)path);
+	kafs_profile_set_simd(true);
+	if (ret < 0)
+		return -1;
+	snprintf(name, sizeof(name), "profile_stream.%s", label);
+	if (run_bench(name, op_profile_stream, (void *)path) < 0)
+		return -1;
+	snprintf(name, sizeof(name), "cellserv_stream_conf.%s", label);
+	if (run_bench(name, op_cellserv_stream_conf, &sb) < 0)
+		return -1;
+	snprintf(name, sizeof(name), "cellserv_stream_cell.%s", label);
+	if (run_bench(name, op_cellserv_stream_cell, &sb) < 0)
+		return -1;
+
+	/* Only parse the profile for the cell database benchmarks if needed. */
+	snprintf(name, sizeof(name), "cellserv_parse_conf.%s", label);
+	snprintf(lazy_name, sizeof(lazy_name), "cellserv_parse_conf_lazy.%s", label);
+	if (!selected(name) && !selected(lazy_name))
+		return 0;
+
+	if (kafs_profile_parse_file(&b.prof, path, &report) < 0)
+		return -1;
+
+	ret = run_bench(name, op_cellserv_parse_conf, &b);
+	if (ret == 0) {
+		b.flags = KAFS_READ_CONFIG_LAZY;
+		ret = run_bench(lazy_name, op_cellserv_parse_conf, &b);
+	}
+
+	kafs_profile_free(&b.prof);
+	return ret;
+}
+
+/*
+ * Lookup and payload benchmarks.
+ */
+static int op_lookup_hit(void *data, unsigned long long i)
+{
+	struct kafs_cell *cell;
+
+	cell = kafs_lookup_cell("dyn0.bench.test", data);
+	if (!cell || !cell->vlservers || cell->vlservers->nr_servers != 3)
+		return -1;
+	kafs_free_cell(cell);
+	return 0;
+}
+
+static int op_lookup_miss(void *data, unsigned long long i)
+{
+	struct kafs_cell *cell;
+	char name[32];
+
+	snprintf(name, sizeof(name), "dyn%llu.bench.test", i % NR_DNS_CELLS);
+	cell = kafs_lookup_cell(name, data);
+	if (!cell || !cell->vlservers || cell->vlservers->nr_servers != 3)
+		return -1;
+	kafs_free_cell(cell);
+	return 0;
+}
+
+static int op_payload_v1(void *data, unsigned long long i)
+{
+	unsigned int ttl = UINT_MAX;
+	size_t len;
+	void *p;
+
+	p = kafs_generate_v1_payload("dyn0.bench.test", &len, &ttl, data);
+	if (!p)
+		return -1;
+	free(p);
+	return 0;
+}
+
+static int op_payload_text(void *data, unsigned long long i)
+{
+	unsigned int ttl = UINT_MAX;
+	size_t len;
+	void *p;
+
+	p = kafs_generate_text_payload("dyn0.bench.test", &len, &ttl, data);
+	if (!p)
+		return -1;
+	free(p);
+	return 0;
+}
+
+static int bench_lookups(const char *fixture, const char *conf)
+{
+	struct kafs_lookup_context ctx = {
+		.report.error		= error_report,
+		.report.verbose		= NULL,
+		.want_ipv4_addrs	= true,
+		.want_ipv6_addrs	= true,
+	};
+	const char *files[] = { conf, NULL };
+	int ret = -1;
+
+	if (kafs_init_lookup_context(&ctx) < 0)
+		return -1;
+
+	ctx.config = kafs_new_config(files, 0, &ctx.report);
+	ctx.resolver = kafs_new_mock_resolver(fixture, &ctx.report);
+	if (!ctx.config || !ctx.resolver)
+		goto out;
+
+	if (run_bench("lookup_cell.miss", op_lookup_miss, &ctx) < 0)
+		goto out;
+
+	ctx.cache = kafs_alloc_lookup_cache(&ctx.report);
+	if (!ctx.cache)
+		goto out;
+
+	if (run_bench("lookup_cell.hit", op_lookup_hit, &ctx) < 0 ||
+	    run_bench("payload.v1", op_payload_v1, &ctx) < 0 ||
+	    run_bench("payload.text", op_payload_text, &ctx) < 0)
+		goto out;
+	ret = 0;
+
+out:
+	if (ctx.cache)
+		kafs_free_lookup_cache(ctx.cache);
+	kafs_clear_lookup_context(&ctx);
+	kafs_free_mock_resolver((struct kafs_resolver *)ctx.resolver);
+	if (ctx.config)
+		kafs_put_config(ctx.config);
+	return ret;
+}
+
+/*
+ * End-to-end upcall benchmark.  Each operation runs kafs-dns in debug mode
+ * against the mock resolver, so it includes process startup and config
+ * loading.  Allocations in the child aren't counted; the peak RSS is the
+ * largest reached by any child.  As posix_spawn() may use vfork(), the child's
+ * peak includes our own RSS at the time, so this is run before the other
+ * benchmarks inflate it.
+ */
+struct upcall_bench {
+	char	*argv[12];
+	long	peak_rss;
+};
+
+static int op_upcall(void *data, unsigned long long i)
+{
+	struct upcall_bench *b = data;
+	struct rusage ru;
+	char desc[48];
+	pid_t pid;
+	int status;
+
+	snprintf(desc, sizeof(desc), "afsdb:dyn%llu.bench.test", i % NR_DNS_CELLS);
+	b->argv[9] = desc;
+
+	if (posix_spawn(&pid, kafs_dns, NULL, NULL, b->argv, environ) != 0) {
+		perror(kafs_dns);
+		return -1;
+	}
+	if (wait4(pid, &status, 0, &ru) == -1 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+	if (ru.ru_maxrss > b->peak_rss)
+		b->peak_rss = ru.ru_maxrss;
+	return 0;
+}
+
+static int bench_upcall(const char *fixture, const char *conf)
+{
+	const char *name = "upcall.kafs_dns_D";
+	struct upcall_bench b = {
+		.argv = {
+			(char *)kafs_dns, "-D",
+			"-M", (char *)fixture,
+			"-c", (char *)conf,
+			"-o", "/dev/null",
+			"--",
+			NULL,			/* Key description */
+			"srv=1",
+			NULL
+		},
+	};
+	unsigned long long n, i, t0, t1, min_ns = min_time_ms * 1000000ULL;
+
+	if (!selected(name))
+		return 0;
+	if (access(kafs_dns, X_OK) == -1) {
+		fprintf(stderr, "%s: %m; skipping %s\n", kafs_dns, name);
+		return 0;
+	}
+
+	t0 = now_ns();
+	if (op_upcall(&b, 0) < 0)
+		goto failed;
+	t1 = now_ns();
+	n = min_ns / (t1 - t0 ?: 1) + 1;
+
+	b.peak_rss = 0;
+	t0 = now_ns();
+	for (i = 0; i < n; i++)
+		if (op_upcall(&b, i) < 0)
+			goto failed;
+	t1 = now_ns();
+
+	report_result(name, n, t1 - t0, -1, b.peak_rss);
+	return 0;
+
+failed:
+	fprintf(stderr, "%s: Benchmark failed\n", name);
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	char *cellservdb, *synth10k, *synth100k, *fixture;
+	char *p;
+	int opt, ret = 0;
+
+	while (opt = getopt(argc, argv, "jt:C:k:"),
+	       opt != -1) {
+		switch (opt) {
+		case 'j':
+			json = true;
+			break;
+		case 't':
+			min_time_ms = strtoul(optarg, &p, 0);
+			if (*p || !min_time_ms)
+				usage(argv[0]);
+			break;
+		case 'C':
+			conf_dir = optarg;
+			break;
+		case 'k':
+			kafs_dns = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	filters = argv + optind;
+	nr_filters = argc - optind;
+
+	if (!mkdtemp(tmp_dir)) {
+		perror(tmp_dir);
+		exit(1);
+	}
+
+	if (asprintf(&cellservdb, "%s/cellservdb.conf", conf_dir) == -1) {
+		perror(NULL);
+		exit(1);
+	}
+	synth10k = make_config(10000);
+	synth100k = make_config(100000);
+	fixture = make_fixture();
+
+	if (bench_upcall(fixture, cellservdb) < 0 ||
+	    bench_config("cellservdb", cellservdb, "grand.central.org") < 0 ||
+	    bench_config("synthetic-10k", synth10k, "cell5000.bench.test") < 0 ||
+	    bench_config("synthetic-100k", synth100k, "cell50000.bench.test") < 0 ||
+	    bench_lookups(fixture, cellservdb) < 0)
+		ret = 1;
+
+	nftw(tmp_dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
@@ -41,7 +41,7 @@ static __attribute__((noreturn))
 void usage(const char *prog)
 {
 	fprintf(stderr,
-		"Usage: %s [-46PDvv] [-c <conffile>]* [-N <restriction>] [<cellname>]*\n",
+		"Usage: %s [-46APDSvv] [-c <conffile>]* [-C <imagefile>] [-M <fixture>] [-N <restriction>] [-T <ms>] [-R <ms>] [-j <n>] [<cellname>]*\n",
 		prog);
 	fprintf(stderr,	"\n");
 	fprintf(stderr,	"Where restrictions are one or more of:\n");
@@ -53,21 +53,64 @@ void usage(const char *prog)
 	exit(2);
 }
 
+/*
+ * Lookup results held until the ones before them in the list have been shown.
+ */
+struct show_state {
+	unsigned int		next;		/* Index of the next cell to show */
+	struct kafs_cell	**cells;
+	bool			*done;
+};
+
+/*
+ * Note a cell's lookup completing and display it, along with any that follow
+ * it that have already completed, if it's the next one in the list.  Lookups
+ * done in parallel complete in any order, but the cells are always shown in
+ * the order in which they were listed.
+ */
+static void show_cell(struct kafs_cell *cell, const char *cell_name,
+		      unsigned int index, void *data)
+{
+	struct show_state *state = data;
+
+	state->cells[index] = cell;
+	state->done[index] = true;
+
+	for (; state->done[state->next]; state->next++) {
+		cell = state->cells[state->next];
+		if (cell) {
+			printf("\n");
+			printf("=== Found cell %s ===\n", cell->name);
+			kafs_dump_cell(cell);
+			kafs_free_cell(cell);
+		}
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	struct kafs_lookup_context ctx = {
 		.report.error		= error_report,
 		.want_ipv4_addrs	= true,
 		.want_ipv6_addrs	= true,
+		.parallel_addr_lookup	= true,
+		.race_vls_lookup	= true,
 	};
+	struct show_state state = {};
+	struct kafs_config *config;
 	const char *filev[10], **filep = NULL;
-	bool dump_profile = false, dump_db = false;
+	const char *image = NULL, *fixture = NULL;
+	const char **names;
+	unsigned int nr_names, i;
+	bool dump_profile = false, dump_db = false, all_cells = false;
+	unsigned int flags = KAFS_READ_CONFIG_PARALLEL;
+	char *p;
 	int opt, filec = 0;
 
 	if (argc > 1 && strcmp(argv[1], "--help") == 0)
 		usage(argv[0]);
 
-	while (opt = getopt(argc, argv, "46PDc:vN:"),
+	while (opt = getopt(argc, argv, "46APDSc:C:M:vN:R:T:j:"),
 	       opt != -1) {
 		switch (opt) {
 		case 'c':
@@ -77,18 +120,45 @@ int main(int argc, char *argv[])
 			}
 			filev[filec++] = optarg;
 			break;
+		case 'C':
+			image = optarg;
+			break;
+		case 'M':
+			fixture = optarg;
+			break;
+		case 'T':
+			ctx.addr_lookup_timeout = strtoul(optarg, &p, 0);
+			if (*p)
+				usage(argv[0]);
+			break;
 		case 'v':
 			if (!ctx.report.verbose)
 				ctx.report.verbose = verbose;
 			else
 				ctx.report.verbose2 = verbose;
 			break;
+		case 'A':
+			all_cells = true;
+			break;
+		case 'R':
+			ctx.rtt_probe_timeout = strtoul(optarg, &p, 0);
+			if (*p)
+				usage(argv[0]);
+			break;
+		case 'j':
+			ctx.max_cells_in_flight = strtoul(optarg, &p, 0);
+			if (*p)
+				usage(argv[0]);
+			break;
 		case 'P':
 			dump_profile = true;
 			break;
 		case 'D':
 			dump_db = true;
 			break;
+		case 'S':
+			flags = KAFS_READ_CONFIG_STREAM;
+			break;
 		case '4':
 			ctx.want_ipv4_addrs = true;
 			ctx.want_ipv6_addrs = false;
@@ -132,25 +202,57 @@ int main(int argc, char *argv[])
 	if (kafs_init_lookup_context(&ctx) < 0)
 		exit(1);
 
-	if (kafs_read_config(filep, &ctx.report) < 0)
+	/* Take DNS data from a fixture rather than the nameservers if asked. */
+	if (fixture) {
+		ctx.resolver = kafs_new_mock_resolver(fixture, &ctx.report);
+		if (!ctx.resolver)
+			exit(ctx.report.bad_config ? 3 : 1);
+	}
+
+	/* Always check the text form of the config. */
+	config = kafs_new_config(filep, flags, &ctx.report);
+	if (!config)
 		exit(ctx.report.bad_config ? 3 : 1);
+	ctx.config = config;
 
-	if (dump_profile)
-		kafs_profile_dump(&kafs_config_profile, 0);
-	if (dump_db)
-		kafs_cellserv_dump(kafs_cellserv_db);
+	if (image && kafs_celldb_write2(image, config, &ctx.report) < 0)
+		exit(1);
 
-	for (; *argv; argv++) {
-		struct kafs_cell *cell;
+	if (dump_profile)
+		kafs_profile_dump(&config->profile, 0);
+	if (dump_db) {
+		if (kafs_cellserv_materialise(config->db, &ctx.report) < 0)
+			exit(3);
+		kafs_cellserv_dump(config->db);
+	}
 
-		cell = kafs_lookup_cell(*argv, &ctx);
-		if (cell) {
-			printf("\n");
-			printf("=== Found cell %s ===\n", cell->name);
-			kafs_dump_cell(cell);
+	/* Look up the cells named on the command line, or all of them. */
+	nr_names = argc;
+	names = (const char **)argv;
+	if (all_cells) {
+		nr_names = config->db->nr_cells;
+		names = calloc(nr_names + 1, sizeof(names[0]));
+		if (!names) {
+			perror(NULL);
+			exit(1);
 		}
+		for (i = 0; i < nr_names; i++)
+			names[i] = config->db->cells[i]->name;
 	}
 
+	/* The extra slot in done[] stops show_cell() at the end of the list. */
+	state.cells = calloc(nr_names + 1, sizeof(state.cells[0]));
+	state.done = calloc(nr_names + 1, sizeof(state.done[0]));
+	if (!state.cells || !state.done) {
+		perror(NULL);
+		exit(1);
+	}
+
+	if (kafs_lookup_cells(names, nr_names, &ctx, show_cell, &state) < 0)
+		exit(1);
+
 	kafs_clear_lookup_context(&ctx);
+	kafs_free_mock_resolver((struct kafs_resolver *)ctx.resolver);
+	kafs_put_config(config);
 	return 0;
 }
@@ -0,0 +1,540 @@
+/*
+ * Replay a trace of upcalls recorded by kafs-dns -t.
+ *
+ * The requests in the trace are fired at kafs-dns, either by running it in
+ * debug mode as an upcall would be run or by passing them to the resolver
+ * daemon, at the rate they were recorded at or at a scaled rate, from a number
+ * of workers at once.  The throughput, latency distribution and any payloads
+ * that differ from the ones recorded are reported.
+ *
+ * When the replay is paced, latency is measured from the time at which a
+ * request was due to be sent rather than the time it was actually sent so that
+ * requests held up waiting for a free worker are counted fairly.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "dns_daemon.h"
+#include "dns_trace.h"
+
+#define PAYLOAD_MAX	(1024 * 1024)
+#define MAX_ARGS	32
+#define MAX_REPORTED	10	/* Mismatches to list unless -v */
+#define LATE_NS		1000000ULL
+
+extern char **environ;
+
+struct replay_req {
+	const struct kafs_dns_trace_rec *rec;
+	const char	*desc;		/* "afsdb:<cell>" */
+	const char	*info;		/* Callout info */
+	uint64_t	due_ns;		/* Offset from the start of the trace */
+	/* Result of replaying it */
+	uint64_t	latency_ns;
+	uint64_t	hash;
+	uint32_t	len;
+	int32_t		status;
+	bool		late;
+};
+
+static const char *kafs_dns = "./kafs-dns";
+static const char *socket_path = KAFS_DNS_SOCKET;
+static bool to_daemon;
+static bool all_mismatches;
+static double rate = 1.0;
+static unsigned int nr_workers = 1;
+static char *exec_args[MAX_ARGS];
+static int nr_exec_args;
+
+static struct replay_req *reqs;
+static unsigned int nr_reqs;
+static unsigned int next_req;
+static uint64_t replay_start_ns;
+
+static __attribute__((noreturn))
+void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-dv] [-j <workers>] [-r <rate>] [-s upcall|daemon] [-S <socket>]\n"
+		"       %*s [-k <kafs-dns>] <tracefile> [-- <kafs-dns option>...]\n",
+		prog, (int)strlen(prog), "");
+	exit(2);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_due(const void *a, const void *b)
+{
+	const struct replay_req *x = a, *y = b;
+
+	if (x->rec->start_ns != y->rec->start_ns)
+		return x->rec->start_ns < y->rec->start_ns ? -1 : 1;
+	return x->rec < y->rec ? -1 : x->rec > y->rec;
+}
+
+/*
+ * Read a trace file and index the requests in it, selecting those recorded by
+ * upcalls or those recorded by the daemon.  A request that the daemon answered
+ * is recorded by both, so only one side's records are replayed; unless asked
+ * for the daemon's, the upcalls' are used if there are any.  The requests are
+ * sorted by the time they arrived.
+ */
+static int load_trace(const char *path, int source)
+{
+	const struct kafs_dns_trace_rec *rec;
+	struct replay_req *r;
+	struct stat st;
+	size_t size, off, n;
+	unsigned int i, j;
+	char *buf, *p;
+	ssize_t got;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		return -1;
+	}
+
+	size = st.st_size;
+	buf = malloc(size ?: 1);
+	reqs = calloc(size / sizeof(*rec) + 1, sizeof(*reqs));
+	if (!buf || !reqs) {
+		perror(NULL);
+		return -1;
+	}
+
+	for (off = 0; off < size; off += got) {
+		got = read(fd, buf + off, size - off);
+		if (got <= 0) {
+			fprintf(stderr, "%s: Short read\n", path);
+			return -1;
+		}
+	}
+	close(fd);
+
+	for (off = 0; off < size; off += n) {
+		rec = (const struct kafs_dns_trace_rec *)(buf + off);
+		if (size - off < sizeof(*rec) || rec->magic != KAFS_DNS_TRACE_MAGIC)
+			goto corrupt;
+		n = KAFS_DNS_TRACE_REC_SIZE(rec->desc_len, rec->info_len);
+		if (n > size - off)
+			goto corrupt;
+
+		p = (char *)(rec + 1);
+		if (!rec->desc_len || p[rec->desc_len - 1] ||
+		    !rec->info_len || p[rec->desc_len + rec->info_len - 1])
+			goto corrupt;
+
+		r = &reqs[nr_reqs++];
+		r->rec = rec;
+		r->desc = p;
+		r->info = p + rec->desc_len;
+	}
+
+	if (source == -1) {
+		source = KAFS_DNS_TRACE_DAEMON;
+		for (i = 0; i < nr_reqs; i++)
+			if (reqs[i].rec->source != KAFS_DNS_TRACE_DAEMON)
+				source = KAFS_DNS_TRACE_UPCALL;
+	}
+
+	for (i = j = 0; i < nr_reqs; i++)
+		if ((reqs[i].rec->source == KAFS_DNS_TRACE_DAEMON) ==
+		    (source == KAFS_DNS_TRACE_DAEMON))
+			reqs[j++] = reqs[i];
+	nr_reqs = j;
+
+	if (!nr_reqs) {
+		fprintf(stderr, "%s: No requests to replay\n", path);
+		return -1;
+	}
+
+	qsort(reqs, nr_reqs, sizeof(*reqs), cmp_due);
+	for (r = reqs; r < reqs + nr_reqs; r++)
+		r->due_ns = r->rec->start_ns - reqs[0].rec->start_ns;
+	return 0;
+
+corrupt:
+	fprintf(stderr, "%s: Corrupt trace record at offset %zu\n", path, off);
+	return -1;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static ssize_t read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		p += n;
+		len -= n;
+	}
+	return p - (char *)buf;
+}
+
+/*
+ * Run kafs-dns in debug mode on a request and collect the payload it writes.
+ */
+static int replay_exec(struct replay_req *r, char *buf)
+{
+	posix_spawn_file_actions_t fa;
+	char *argv[MAX_ARGS + 8];
+	ssize_t len;
+	pid_t pid;
+	int pfd[2], status, argc = 0, i;
+
+	argv[argc++] = (char *)kafs_dns;
+	argv[argc++] = "-D";
+	for (i = 0; i < nr_exec_args; i++)
+		argv[argc++] = exec_args[i];
+	argv[argc++] = "-o";
+	argv[argc++] = "/dev/stdout";
+	argv[argc++] = "--";
+	argv[argc++] = (char *)r->desc;
+	argv[argc++] = (char *)r->info;
+	argv[argc] = NULL;
+
+	if (pipe2(pfd, O_CLOEXEC) == -1)
+		return -1;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, pfd[1], 1);
+	if (posix_spawn(&pid, kafs_dns, &fa, NULL, argv, environ) != 0) {
+		perror(kafs_dns);
+		exit(1);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+	close(pfd[1]);
+
+	len = read_all(pfd[0], buf, PAYLOAD_MAX + 1);
+	close(pfd[0]);
+	if (waitpid(pid, &status, 0) == -1 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	    len < 0 || len > PAYLOAD_MAX)
+		return -1;
+
+	r->hash = kafs_dns_trace_hash(buf, len);
+	r->len = len;
+	return 0;
+}
+
+/*
+ * Pass a request to the resolver daemon.
+ */
+static int replay_daemon(struct replay_req *r, char *buf)
+{
+	struct kafs_dns_reply reply;
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	const char *name = strchr(r->desc, ':');
+	int fd, ret = -1;
+
+	name = name ? name + 1 : r->desc;
+	strncpy(sun.sun_path, socket_path, sizeof(sun.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		perror(socket_path);
+		exit(1);
+	}
+
+	if (write_all(fd, name, strlen(name) + 1) < 0 ||
+	    write_all(fd, r->info, strlen(r->info) + 1) < 0 ||
+	    shutdown(fd, SHUT_WR) < 0 ||
+	    read_all(fd, &reply, sizeof(reply)) != sizeof(reply) ||
+	    reply.status != 0 ||
+	    reply.len > PAYLOAD_MAX ||
+	    read_all(fd, buf, reply.len) != reply.len)
+		goto out;
+
+	r->hash = kafs_dns_trace_hash(buf, reply.len);
+	r->len = reply.len;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Take requests off the trace in turn, waiting till each is due if the replay
+ * is paced.
+ */
+static void *worker(void *data)
+{
+	struct replay_req *r;
+	struct timespec ts;
+	uint64_t due, start;
+	unsigned int i;
+	char *buf;
+
+	buf = malloc(PAYLOAD_MAX + 1);
+	if (!buf) {
+		perror(NULL);
+		exit(1);
+	}
+
+	while (i = __atomic_fetch_add(&next_req, 1, __ATOMIC_RELAXED),
+	       i < nr_reqs) {
+		r = &reqs[i];
+		start = now_ns();
+		if (rate > 0) {
+			due = replay_start_ns + (uint64_t)(r->due_ns / rate);
+			if (due > start) {
+				ts.tv_sec = due / 1000000000ULL;
+				ts.tv_nsec = due % 1000000000ULL;
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						       &ts, NULL) == EINTR)
+					;
+			} else if (start - due > LATE_NS) {
+				r->late = true;
+			}
+		} else {
+			due = start;
+		}
+
+		r->status = to_daemon ? replay_daemon(r, buf) : replay_exec(r, buf);
+		r->latency_ns = now_ns() - due;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t *sorted, unsigned int n, double pc)
+{
+	unsigned int i = (unsigned int)(pc / 100 * n);
+
+	if (i >= n)
+		i = n - 1;
+	return sorted[i] / 1e6;
+}
+
+static void print_latencies(const char *label, uint64_t *lat, unsigned int n)
+{
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	printf("%-12s p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f ms\n",
+	       label,
+	       percentile_ms(lat, n, 50), percentile_ms(lat, n, 90),
+	       percentile_ms(lat, n, 99), percentile_ms(lat, n, 99.9),
+	       lat[n - 1] / 1e6);
+}
+
+/*
+ * Summarise the replay.  Returns the number of requests whose outcome differed
+ * from that recorded.
+ */
+static unsigned int report(const char *trace, uint64_t elapsed_ns)
+{
+	const struct kafs_dns_trace_rec *rec;
+	struct replay_req *r;
+	unsigned int i, failed = 0, rec_failed = 0, late = 0, differ = 0;
+	uint64_t *lat, span;
+
+	lat = malloc(nr_reqs * sizeof(*lat));
+	if (!lat) {
+		perror(NULL);
+		exit(1);
+	}
+
+	for (i = 0; i < nr_reqs; i++) {
+		r = &reqs[i];
+		rec = r->rec;
+		failed += r->status != 0;
+		rec_failed += rec->status != 0;
+		late += r->late;
+
+		if (r->status == rec->status &&
+		    (r->status != 0 || (r->len == rec->len && r->hash == rec->hash)))
+			continue;
+
+		if (differ++ < MAX_REPORTED || all_mismatches) {
+			printf("DIFF %s '%s': ", r->desc, r->info);
+			if (r->status != rec->status)
+				printf("%s\n", r->status ? "now fails" : "now succeeds");
+			else
+				printf("%u bytes %016llx, was %u bytes %016llx\n",
+				       r->len, (unsigned long long)r->hash,
+				       rec->len, (unsigned long long)rec->hash);
+		}
+	}
+	if (differ > MAX_REPORTED && !all_mismatches)
+		printf("DIFF ... and %u more\n", differ - MAX_REPORTED);
+
+	span = reqs[nr_reqs - 1].due_ns;
+	printf("%s: %u requests recorded over %.3f s\n", trace, nr_reqs, span / 1e9);
+	printf("Replayed to %s with %u workers at ",
+	       to_daemon ? socket_path : kafs_dns, nr_workers);
+	if (rate > 0)
+		printf("%gx the recorded rate\n", rate);
+	else
+		printf("full speed\n");
+
+	printf("%-12s %.3f s\n", "elapsed", elapsed_ns / 1e9);
+	printf("%-12s %.1f req/s\n", "throughput", nr_reqs / (elapsed_ns / 1e9));
+	for (i = 0; i < nr_reqs; i++)
+		lat[i] = reqs[i].latency_ns;
+	print_latencies("latency", lat, nr_reqs);
+	for (i = 0; i < nr_reqs; i++)
+		lat[i] = reqs[i].rec->duration_ns;
+	print_latencies("recorded", lat, nr_reqs);
+	printf("%-12s %u (%u when recorded)\n", "failed", failed, rec_failed);
+	printf("%-12s %u\n", "differ", differ);
+	if (rate > 0)
+		printf("%-12s %u started more than %llu ms late\n", "late",
+		       late, LATE_NS / 1000000);
+
+	free(lat);
+	return differ;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	const char *trace;
+	unsigned int i;
+	uint64_t t1;
+	char *p;
+	int opt, source = -1;
+
+	while (opt = getopt(argc, argv, "+dvj:k:r:s:S:"),
+	       opt != -1) {
+		switch (opt) {
+		case 'd':
+			to_daemon = true;
+			break;
+		case 'v':
+			all_mismatches = true;
+			break;
+		case 'j':
+			nr_workers = strtoul(optarg, &p, 0);
+			if (*p || !nr_workers)
+				usage(argv[0]);
+			break;
+		case 'k':
+			kafs_dns = optarg;
+			break;
+		case 'r':
+			rate = strtod(optarg, &p);
+			if (*p || rate < 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			if (strcmp(optarg, "upcall") == 0)
+				source = KAFS_DNS_TRACE_UPCALL;
+			else if (strcmp(optarg, "daemon") == 0)
+				source = KAFS_DNS_TRACE_DAEMON;
+			else
+				usage(argv[0]);
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+	trace = argv[optind++];
+	if (optind < argc && strcmp(argv[optind], "--") == 0)
+		optind++;
+	for (; optind < argc; optind++) {
+		if (nr_exec_args >= MAX_ARGS || to_daemon)
+			usage(argv[0]);
+		exec_args[nr_exec_args++] = argv[optind];
+	}
+
+	if (strlen(socket_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		fprintf(stderr, "%s: %s\n", socket_path, strerror(ENAMETOOLONG));
+		exit(2);
+	}
+	if (!to_daemon && access(kafs_dns, X_OK) == -1) {
+		perror(kafs_dns);
+		exit(1);
+	}
+
+	if (load_trace(trace, source) < 0)
+		exit(1);
+
+	threads = calloc(nr_workers, sizeof(*threads));
+	if (!threads) {
+		perror(NULL);
+		exit(1);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	replay_start_ns = now_ns();
+	for (i = 0; i < nr_workers; i++) {
+		if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	t1 = now_ns();
+
+	return report(trace, t1 - replay_start_ns) ? 1 : 0;
+}
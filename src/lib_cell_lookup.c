@@ -10,21 +10,35 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <resolv.h>
 #include <netdb.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <kafs/cellserv.h>
 #include <kafs/profile.h>
+#include "lib_internal.h"
 
 static const char *const kafs_std_config[] = {
 	ETCDIR "/kafs/client.conf",
 	NULL
 };
 
+static unsigned long long kafs_config_serials;
+
+/*
+ * The default config, used by lookups that don't supply their own.  The
+ * globals mirror it for the benefit of older users of the library.
+ */
+static pthread_mutex_t kafs_default_config_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct kafs_config *kafs_default_config;
+
 struct kafs_profile kafs_config_profile = { .name = "<kafsconfig>" };
 struct kafs_cell_db *kafs_cellserv_db;
 const char *kafs_this_cell;
 const char *kafs_sysname;
+const char *kafs_celldb_image = CACHEDIR "/celldb";
 
 #define verbose(r, fmt, ...)						\
 	do {								\
@@ -44,6 +58,7 @@ struct kafs_cell *kafs_alloc_cell(const char *cell_name,
 	if (!cell)
 		goto error;
 
+	cell->usage = 1;
 	cell->name = strdup(cell_name);
 	if (!cell->name)
 		goto error;
@@ -58,12 +73,13 @@ error:
 /*
  * Read the [defaults] section.
  */
-static void kafs_read_defaults(struct kafs_profile *prof, struct kafs_report *report)
+static void kafs_read_defaults(struct kafs_config *config, struct kafs_report *report)
 {
 	const struct kafs_profile *def;
 	const char *p;
 
-	def = kafs_profile_find_first_child(prof, kafs_profile_value_is_list, "defaults", report);
+	def = kafs_profile_find_first_child(&config->profile, kafs_profile_value_is_list,
+					    "defaults", report);
 	if (!def) {
 		verbose(report, "Cannot find [defaults] section");
 		return;
@@ -72,35 +88,307 @@ static void kafs_read_defaults(struct kafs_profile *prof, struct kafs_report *re
 	/* Find the current cell name (thiscell = <cellname>) */
 	p = kafs_profile_get_string(def, "thiscell", report);
 	if (p)
-		kafs_this_cell = p;
+		config->this_cell = p;
 
 	/* Find the @sys substitutions (sysname = <sub> <sub> ...) */
 	p = kafs_profile_get_string(def, "sysname", report);
 	if (p)
-		kafs_sysname = p;
+		config->sysname = p;
+
+	/* Find the address family ordering (address_family = <policy>) */
+	p = kafs_profile_get_string(def, "address_family", report);
+	if (p && kafs_parse_addr_family(p, &config->addr_family) < 0)
+		verbose(report, "Unknown address_family '%s'", p);
 }
 
 /*
- * Read the configuration and initialise the cell database.
+ * Free a config once the last reference has gone.
  */
-int kafs_read_config(const char *const *files, struct kafs_report *report)
+static void kafs_free_config(struct kafs_config *config)
+{
+	if (config->db)
+		kafs_free_cell_db(config->db);
+	kafs_profile_free(&config->profile);
+	if (config->image)
+		munmap(config->image, config->image_size);
+	kafs_config_free_units(config);
+	if (config->base) {
+		kafs_put_config(config->base);
+	} else if (config->files) {
+		char **p;
+
+		for (p = config->files; *p; p++)
+			free(*p);
+		free(config->files);
+	}
+	free(config);
+}
+
+/*
+ * Get a reference on a config.
+ */
+struct kafs_config *kafs_get_config(struct kafs_config *config)
 {
+	__atomic_add_fetch(&config->usage, 1, __ATOMIC_RELAXED);
+	return config;
+}
+
+/*
+ * Drop a reference on a config, freeing it when the last one goes.
+ */
+void kafs_put_config(struct kafs_config *config)
+{
+	if (config &&
+	    __atomic_sub_fetch(&config->usage, 1, __ATOMIC_ACQ_REL) == 0)
+		kafs_free_config(config);
+}
+
+/*
+ * Allocate the number that identifies a new config to the lookup cache.
+ */
+unsigned long long kafs_config_new_serial(void)
+{
+	return __atomic_add_fetch(&kafs_config_serials, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read a configuration into a new config handle.  KAFS_READ_CONFIG_IMAGE asks
+ * for an up to date compiled image of the cell database to be used, if there
+ * is one, in preference to parsing the text files; the image holds only the
+ * cells and the defaults that lookups need, so the config's profile is left
+ * empty.
+ * KAFS_READ_CONFIG_PARALLEL allows the files in include directories to be
+ * parsed on multiple threads.  KAFS_READ_CONFIG_LAZY defers building each
+ * cell's record from the text until the cell is first looked up.
+ * KAFS_READ_CONFIG_RELOADABLE notes where everything came from so that
+ * kafs_reload_config() can later reparse just the files that have changed;
+ * the compiled image doesn't record that, so it isn't used.
+ * KAFS_READ_CONFIG_STREAM reads the files without parsing the cells into a
+ * tree, just noting where each is defined, and reads each cell in from the
+ * files when it's first looked up; it takes much less memory with a big cell
+ * database, but the files mustn't be altered whilst the config is in use and
+ * a reload always rereads the whole config.  The caller gets the only
+ * reference.
+ */
+struct kafs_config *kafs_new_config(const char *const *files, unsigned int flags,
+				    struct kafs_report *report)
+{
+	struct kafs_config *config;
+	unsigned long long start = kafs_stats_start(report);
+	unsigned int i;
+	int ret;
 
 	if (!files)
 		files = kafs_std_config;
 
+	config = calloc(1, sizeof(*config));
+	if (!config) {
+		report->bad_error = true;
+		report->error("%m");
+		return NULL;
+	}
+	config->usage = 1;
+	config->serial = kafs_config_new_serial();
+	config->profile.name = "<kafsconfig>";
+	config->flags = flags;
+
+	for (i = 0; files[i]; i++)
+		;
+	config->files = calloc(i + 1, sizeof(config->files[0]));
+	if (!config->files)
+		goto nomem;
+	for (i = 0; files[i]; i++) {
+		config->files[i] = strdup(files[i]);
+		if (!config->files[i])
+			goto nomem;
+	}
+
+	if ((flags & KAFS_READ_CONFIG_IMAGE) &&
+	    !(flags & KAFS_READ_CONFIG_RELOADABLE) &&
+	    kafs_celldb_image) {
+		ret = kafs_celldb_load(kafs_celldb_image, files, config, report);
+		if (ret < 0)
+			goto error;
+		if (ret > 0)
+			goto loaded;
+	}
+
+	if (flags & KAFS_READ_CONFIG_STREAM) {
+		config->db = kafs_cellserv_stream_conf(&config->profile, files, report);
+		if (!config->db)
+			goto error;
+		kafs_read_defaults(config, report);
+		goto loaded;
+	}
+
+	if (flags & KAFS_READ_CONFIG_PARALLEL) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (nr_cpus > KAFS_READ_CONFIG_MAX_THREADS)
+			nr_cpus = KAFS_READ_CONFIG_MAX_THREADS;
+		if (nr_cpus > 1 &&
+		    kafs_profile_set_threads(&config->profile, nr_cpus) < 0) {
+			report->bad_error = true;
+			report->error("%m");
+			goto error;
+		}
+	}
+
 	for (; *files; files++)
-		if (kafs_profile_parse_file(&kafs_config_profile, *files, report) == -1)
-			return -1;
+		if (kafs_profile_parse_file(&config->profile, *files, report) == -1)
+			goto error;
 
-	kafs_cellserv_db = kafs_cellserv_parse_conf(&kafs_config_profile, report);
-	if (!kafs_cellserv_db)
-		return -1;
+	config->db = kafs_cellserv_parse_conf2(&config->profile, flags, report);
+	if (!config->db)
+		goto error;
 
-	kafs_read_defaults(&kafs_config_profile, report);
+	kafs_read_defaults(config, report);
+
+	if ((flags & KAFS_READ_CONFIG_RELOADABLE) &&
+	    kafs_config_note_units(config, report) < 0)
+		goto error;
+
+loaded:
+	for (i = 0; i < config->db->nr_cells; i++)
+		if (config->db->cells[i])
+			config->db->cells[i]->config = config;
+	kafs_stats_end(report, kafs_stats_config, start);
+	return config;
+
+nomem:
+	report->bad_error = true;
+	report->error("%m");
+error:
+	if (!report->abandon_alloc)
+		kafs_free_config(config);
+	kafs_stats_end(report, kafs_stats_config, start);
+	return NULL;
+}
+
+/*
+ * Install a new default config, returning the old one for the caller to put.
+ * The caller must hold the lock.
+ */
+static struct kafs_config *kafs_install_default_config(struct kafs_config *config)
+{
+	struct kafs_config *old = kafs_default_config;
+
+	kafs_default_config = config;
+	if (config) {
+		kafs_config_profile	= config->profile;
+		kafs_cellserv_db	= config->db;
+		kafs_this_cell		= config->this_cell;
+		kafs_sysname		= config->sysname;
+	} else {
+		kafs_config_profile	= (struct kafs_profile){ .name = "<kafsconfig>" };
+		kafs_cellserv_db	= NULL;
+		kafs_this_cell		= NULL;
+		kafs_sysname		= NULL;
+	}
+	return old;
+}
+
+/*
+ * Replace the default config.  Lookups already in progress continue with the
+ * config they started with; the old config is freed when the last of them lets
+ * go of it.
+ */
+void kafs_set_default_config(struct kafs_config *config)
+{
+	struct kafs_config *old;
+
+	if (config)
+		kafs_get_config(config);
+	pthread_mutex_lock(&kafs_default_config_lock);
+	old = kafs_install_default_config(config);
+	pthread_mutex_unlock(&kafs_default_config_lock);
+	kafs_put_config(old);
+}
+
+/*
+ * Get a reference on the default config, reading the standard configuration
+ * files if it hasn't been set yet.
+ */
+struct kafs_config *kafs_get_default_config(struct kafs_report *report)
+{
+	struct kafs_config *config;
+
+	pthread_mutex_lock(&kafs_default_config_lock);
+	if (!kafs_default_config) {
+		config = kafs_new_config(NULL, 0, report);
+		if (config)
+			kafs_install_default_config(config);
+	}
+	config = kafs_default_config;
+	if (config)
+		kafs_get_config(config);
+	pthread_mutex_unlock(&kafs_default_config_lock);
+	return config;
+}
+
+/*
+ * Read the configuration and make it the default.  See kafs_new_config().
+ */
+int kafs_read_config2(const char *const *files, unsigned int flags,
+		      struct kafs_report *report)
+{
+	struct kafs_config *config;
+
+	config = kafs_new_config(files, flags, report);
+	if (!config)
+		return -1;
+	kafs_set_default_config(config);
+	kafs_put_config(config);
 	return 0;
 }
 
+int kafs_read_config(const char *const *files, struct kafs_report *report)
+{
+	return kafs_read_config2(files, 0, report);
+}
+
+/*
+ * See if we've looked this cell up recently.  Returns 1 if the server list
+ * was filled in from the cache, 0 if not and -1 on error.
+ */
+static int kafs_lookup_cached(struct kafs_cell *cell,
+			      const struct kafs_config *config,
+			      struct kafs_lookup_context *ctx)
+{
+	int err;
+
+	if (!ctx->cache || ctx->cache_refresh)
+		return 0;
+	cell->vlservers = kafs_lookup_cache_get(ctx->cache, cell->name, config, ctx, &err);
+	if (cell->vlservers)
+		return 1;
+	return err;
+}
+
+/*
+ * Record the result of a lookup in the cache.  If the lookup failed
+ * transiently, the last good result is substituted if we have one.
+ */
+static void kafs_lookup_cache_result(struct kafs_cell *cell,
+				     const struct kafs_config *config,
+				     struct kafs_lookup_context *ctx)
+{
+	struct kafs_server_list *stale;
+
+	if (!ctx->cache)
+		return;
+
+	stale = kafs_lookup_cache_get_stale(ctx->cache, cell->name, config,
+					    cell->vlservers, ctx);
+	if (stale) {
+		kafs_free_server_list(cell->vlservers);
+		cell->vlservers = stale;
+		return;
+	}
+
+	kafs_lookup_cache_put(ctx->cache, cell->name, config, cell->vlservers, ctx);
+}
+
 /*
  * Deal with an unconfigured cell.
  */
@@ -125,6 +413,81 @@ static int kafs_unconfigured_cell(struct kafs_cell *cell,
 	return 0;
 }
 
+/*
+ * Determine if the lookup of a configured cell would merely reproduce the
+ * configuration, in which case the config record can be handed out instead.
+ */
+static bool kafs_config_is_final(const struct kafs_cell *conf_cell,
+				 enum kafs_addr_family_policy family,
+				 const struct kafs_lookup_context *ctx)
+{
+	return (conf_cell->vlservers &&
+		(!conf_cell->use_dns || (ctx->no_vls_srv && ctx->no_vls_afsdb)) &&
+		ctx->no_vl_host &&
+		!ctx->rtt_probe_timeout &&
+		family <= kafs_addr_family_as_listed);
+}
+
+/*
+ * Borrow addresses from the config for any server that didn't find any in the
+ * DNS.  The configured servers are indexed by name on first need so that this
+ * doesn't go quadratic on a long list.
+ */
+static int kafs_borrow_config_addresses(struct kafs_server_list *vsl,
+					const struct kafs_server_list *cvsl,
+					struct kafs_lookup_context *ctx)
+{
+	unsigned int stack_map[64], *map = NULL;
+	unsigned int mask = 0, i, j, h;
+
+	for (i = 0; i < vsl->nr_servers; i++) {
+		struct kafs_server *srv = &vsl->servers[i];
+
+		if (srv->nr_addrs)
+			continue;
+
+		/* The map holds config server index + 1, 0 marking a free slot. */
+		if (!map) {
+			for (mask = 15; mask < cvsl->nr_servers * 2; mask = mask * 2 + 1)
+				;
+			map = stack_map;
+			if (mask >= 64) {
+				map = malloc((mask + 1) * sizeof(*map));
+				if (!map) {
+					ctx->report.bad_error = true;
+					ctx->report.error("%m");
+					return -1;
+				}
+			}
+			memset(map, 0, (mask + 1) * sizeof(*map));
+
+			for (j = 0; j < cvsl->nr_servers; j++) {
+				for (h = kafs_name_hash(cvsl->servers[j].name) & mask;
+				     map[h];
+				     h = (h + 1) & mask)
+					;
+				map[h] = j + 1;
+			}
+		}
+
+		verbose(&ctx->report, "Borrow addresses for '%s'", srv->name);
+		for (h = kafs_name_hash(srv->name) & mask; map[h]; h = (h + 1) & mask) {
+			const struct kafs_server *csrv = &cvsl->servers[map[h] - 1];
+
+			if (strcasecmp(srv->name, csrv->name) == 0) {
+				verbose(&ctx->report, "From '%s' %u",
+					csrv->name, csrv->nr_addrs);
+				kafs_transfer_addresses(srv, csrv);
+				break;
+			}
+		}
+	}
+
+	if (map != stack_map)
+		free(map);
+	return 0;
+}
+
 /*
  * Look up a cell in configuration and DNS.
  *
@@ -148,32 +511,55 @@ static int kafs_unconfigured_cell(struct kafs_cell *cell,
  *	    (*) we try to look up a list of addresses in NSS/DNS.
  *
  *	    (*) If that fails, we use the list of addresses from the config.
+ *
+ *  (*) The addresses are put in order by family if the context or, failing
+ *      that, the config asks for it.
+ *
+ *  (*) If the context asks for it, the servers are then ordered by probed
+ *      RTT before the result is cached.
+ *
+ * If nothing would be taken from the DNS or reordered, the configured cell is
+ * returned with a reference held on it instead of being copied.
  */
-struct kafs_cell *kafs_lookup_cell(const char *cell_name,
-				   struct kafs_lookup_context *ctx)
+static struct kafs_cell *kafs_lookup_cell_in(const struct kafs_config *config,
+					     const char *cell_name,
+					     struct kafs_lookup_context *ctx)
 {
-	const struct kafs_server_list *cvsl;
+	enum kafs_addr_family_policy family = ctx->addr_family ?: config->addr_family;
 	struct kafs_server_list *vsl;
-	const struct kafs_cell *conf_cell;
-	struct kafs_cell *cell;
-	unsigned int i, j;
+	struct kafs_cell *conf_cell, *cell;
+	int err;
 
-	if (!kafs_cellserv_db && kafs_read_config(NULL, &ctx->report) < 0)
+	conf_cell = kafs_cellserv_find_cell2(config->db, cell_name, &ctx->report, &err);
+	if (err < 0)
 		return NULL;
+	if (conf_cell && kafs_config_is_final(conf_cell, family, ctx)) {
+		verbose(&ctx->report, "%s: Using configured cell as is", cell_name);
+		return kafs_get_cell(conf_cell);
+	}
 
 	cell = kafs_alloc_cell(cell_name, ctx);
 	if (!cell)
 		return NULL;
 
-	for (i = 0; i < kafs_cellserv_db->nr_cells; i++) {
-		conf_cell = kafs_cellserv_db->cells[i];
+	if (conf_cell)
+		goto cell_is_configured;
 
-		if (strcmp(cell_name, conf_cell->name) == 0)
-			goto cell_is_configured;
+	switch (kafs_lookup_cached(cell, config, ctx)) {
+	case 1:
+		return cell;
+	case 0:
+		break;
+	default:
+		goto error;
 	}
 
 	if (kafs_unconfigured_cell(cell, ctx) < 0)
 		goto error;
+	kafs_dedup_addresses(cell->vlservers, ctx);
+	kafs_order_families(cell->vlservers, family, ctx);
+	kafs_order_servers(cell->vlservers, ctx);
+	kafs_lookup_cache_result(cell, config, ctx);
 	return cell;
 
 	/* Deal with the case where we have a configuration. */
@@ -182,6 +568,15 @@ cell_is_configured:
 
 	kafs_transfer_cell(cell, conf_cell);
 
+	switch (kafs_lookup_cached(cell, config, ctx)) {
+	case 1:
+		return cell;
+	case 0:
+		break;
+	default:
+		goto error;
+	}
+
 	vsl = kafs_alloc_server_list(&ctx->report);
 	if (!vsl)
 		goto error;
@@ -202,7 +597,7 @@ cell_is_configured:
 	/* If we didn't get any servers, copy the server list from the
 	 * configuration.
 	 */
-	if (vsl->nr_servers == 0) {
+	if (vsl->nr_servers == 0 && conf_cell->vlservers) {
 		verbose(&ctx->report, "Use configured server list");
 		if (kafs_transfer_server_list(vsl, conf_cell->vlservers) < 0)
 			goto error;
@@ -215,28 +610,14 @@ cell_is_configured:
 	/* Borrow addresses from the config for any server that didn't find any
 	 * in the DNS.
 	 */
-	cvsl = conf_cell->vlservers;
-	if (cvsl) {
-		for (i = 0; i < vsl->nr_servers; i++) {
-			struct kafs_server *srv = &vsl->servers[i];
-
-			if (srv->nr_addrs)
-				continue;
-
-			verbose(&ctx->report, "Borrow addresses for '%s'", srv->name);
-			for (j = 0; j < cvsl->nr_servers; j++) {
-				const struct kafs_server *csrv = &cvsl->servers[j];
-
-				if (strcmp(srv->name, csrv->name) == 0) {
-					verbose(&ctx->report, "From '%s' %u",
-						csrv->name, csrv->nr_addrs);
-					kafs_transfer_addresses(srv, csrv);
-					break;
-				}
-			}
-		}
-	}
+	if (conf_cell->vlservers &&
+	    kafs_borrow_config_addresses(vsl, conf_cell->vlservers, ctx) < 0)
+		goto error;
 
+	kafs_dedup_addresses(vsl, ctx);
+	kafs_order_families(vsl, family, ctx);
+	kafs_order_servers(vsl, ctx);
+	kafs_lookup_cache_result(cell, config, ctx);
 	return cell;
 
 error:
@@ -244,3 +625,137 @@ error:
 		kafs_free_cell(cell);
 	return NULL;
 }
+
+/*
+ * Look up a cell in the context's config, or in the default config if the
+ * context doesn't specify one.  The cell keeps the config it came from alive.
+ */
+struct kafs_cell *kafs_lookup_cell(const char *cell_name,
+				   struct kafs_lookup_context *ctx)
+{
+	struct kafs_config *config;
+	struct kafs_cell *cell;
+	unsigned long long start;
+
+	if (ctx->config)
+		config = kafs_get_config(ctx->config);
+	else
+		config = kafs_get_default_config(&ctx->report);
+	if (!config)
+		return NULL;
+
+	start = kafs_stats_start(&ctx->report);
+	cell = kafs_lookup_cell_in(config, cell_name, ctx);
+	kafs_stats_end(&ctx->report, kafs_stats_lookup, start);
+	kafs_put_config(config);
+	return cell;
+}
+
+struct kafs_lookup_batch {
+	const struct kafs_lookup_context *ctx;
+	struct kafs_config	*config;
+	const char *const	*names;
+	unsigned int		nr_names;
+	unsigned int		next;
+	kafs_lookup_cells_func_t func;
+	void			*data;
+	pthread_mutex_t		lock;		/* Serialises func and flag updates */
+	bool			bad_config;
+	bool			bad_error;
+};
+
+/*
+ * Look up cells from a batch until there are none left.  Each worker has its
+ * own resolver state.
+ */
+static void *kafs_lookup_cells_worker(void *data)
+{
+	struct kafs_lookup_batch *batch = data;
+	struct kafs_lookup_context ctx = *batch->ctx;
+	struct kafs_cell *cell;
+	unsigned int i;
+
+	ctx.config = batch->config;
+	ctx.report.bad_config = false;
+	ctx.report.bad_error = false;
+	if (kafs_init_lookup_context(&ctx) < 0)
+		goto out;
+
+	while (i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED),
+	       i < batch->nr_names) {
+		cell = kafs_lookup_cell(batch->names[i], &ctx);
+
+		pthread_mutex_lock(&batch->lock);
+		batch->func(cell, batch->names[i], i, batch->data);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	kafs_clear_lookup_context(&ctx);
+out:
+	pthread_mutex_lock(&batch->lock);
+	batch->bad_config |= ctx.report.bad_config;
+	batch->bad_error |= ctx.report.bad_error;
+	pthread_mutex_unlock(&batch->lock);
+	return NULL;
+}
+
+/*
+ * Look up a batch of cells, keeping up to ctx->max_cells_in_flight of them in
+ * progress at once.  Each cell is passed to func as its lookup completes, so
+ * the results may come back in any order; the index of the name is supplied
+ * to help the caller sort them out.  The cell is NULL if the lookup failed,
+ * otherwise func takes ownership of it.  Calls to func are serialised.
+ *
+ * The lookup context is used as a template: its options, report, cache and
+ * config are shared, but each worker gets its own resolver state.  Returns -1 if
+ * the lookups couldn't be started, 0 otherwise.
+ */
+int kafs_lookup_cells(const char *const *names, unsigned int nr_names,
+		      struct kafs_lookup_context *ctx,
+		      kafs_lookup_cells_func_t func, void *data)
+{
+	struct kafs_lookup_batch batch = {
+		.ctx		= ctx,
+		.names		= names,
+		.nr_names	= nr_names,
+		.func		= func,
+		.data		= data,
+	};
+	pthread_t threads[KAFS_LOOKUP_CELLS_MAX_IN_FLIGHT];
+	unsigned int i, nr_threads, nr_started = 0;
+
+	if (nr_names == 0)
+		return 0;
+
+	/* Pin the config now so that the whole batch sees the same one. */
+	if (ctx->config)
+		batch.config = kafs_get_config(ctx->config);
+	else
+		batch.config = kafs_get_default_config(&ctx->report);
+	if (!batch.config)
+		return -1;
+
+	nr_threads = ctx->max_cells_in_flight ?: KAFS_LOOKUP_CELLS_DEFAULT_IN_FLIGHT;
+	if (nr_threads > KAFS_LOOKUP_CELLS_MAX_IN_FLIGHT)
+		nr_threads = KAFS_LOOKUP_CELLS_MAX_IN_FLIGHT;
+	if (nr_threads > nr_names)
+		nr_threads = nr_names;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[nr_started], NULL,
+				   kafs_lookup_cells_worker, &batch) != 0)
+			break;
+		nr_started++;
+	}
+
+	kafs_lookup_cells_worker(&batch);
+	for (i = 0; i < nr_started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&batch.lock);
+	kafs_put_config(batch.config);
+
+	ctx->report.bad_config |= batch.bad_config;
+	ctx->report.bad_error |= batch.bad_error;
+	return 0;
+}
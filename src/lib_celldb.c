@@ -0,0 +1,782 @@
+/*
+ * Compiled cell database image.
+ *
+ * The image is a snapshot of the cell database as parsed from the text
+ * configuration, laid out so that it can be mapped read-only and used without
+ * going through the profile parser.  All references within the image are byte
+ * offsets from the start, so it can be mapped anywhere.  The image is host
+ * specific: it is tagged with the byte order and version and is regenerated
+ * rather than converted.
+ *
+ * A record of each file and directory read to build the image is stored in
+ * it, along with the mtime and size seen at the time.  The image is only used
+ * if all of those still match.
+ *
+ * Loading an image doesn't build any cell records.  A cell is found by binary
+ * search of a sorted index of names in the image and its record is built the
+ * first time it is looked up.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <kafs/cellserv.h>
+#include <kafs/profile.h>
+#include "lib_internal.h"
+
+#define KAFS_CELLDB_MAGIC	"kAFScdb"
+#define KAFS_CELLDB_VERSION	3
+#define KAFS_CELLDB_BYTE_ORDER	0x01020304
+
+struct kafs_celldb_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byte_order;
+	uint32_t	size;		/* Size of the entire image */
+	uint32_t	nr_sources;
+	uint32_t	nr_cells;
+	uint32_t	nr_servers;
+	uint32_t	nr_addrs;
+	uint32_t	this_cell;	/* String offset of thiscell or 0 */
+	uint32_t	sysname;	/* String offset of sysname or 0 */
+	uint32_t	addr_family;	/* enum kafs_addr_family_policy */
+	uint32_t	sources;	/* Offset of source table */
+	uint32_t	index;		/* Offset of sorted cell index */
+	uint32_t	cells;		/* Offset of cell records */
+	uint32_t	servers;	/* Offset of server records */
+	uint32_t	addrs;		/* Offset of address records */
+	uint32_t	strings;	/* Offset of string table */
+	uint32_t	strings_size;
+};
+
+struct kafs_celldb_source {
+	int64_t		mtime_sec;
+	int64_t		mtime_nsec;
+	int64_t		size;
+	uint32_t	path;		/* String offset */
+	uint8_t		is_dir;
+	uint8_t		is_root;
+	uint8_t		__pad[2];
+};
+
+struct kafs_celldb_cell {
+	uint32_t	name;		/* String offset */
+	uint32_t	desc;		/* String offset or 0 */
+	uint32_t	realm;		/* String offset or 0 */
+	uint32_t	first_server;
+	uint32_t	nr_servers;
+	uint8_t		use_dns;
+	uint8_t		show_cell;
+	uint8_t		has_vlservers;
+	uint8_t		hot;
+};
+
+struct kafs_celldb_server {
+	uint32_t	name;		/* String offset */
+	uint32_t	first_addr;
+	uint16_t	nr_addrs;
+	uint16_t	port;
+	uint16_t	pref;
+	uint16_t	weight;
+	uint8_t		protocol;
+	uint8_t		type;
+	uint8_t		__pad[2];
+};
+
+struct kafs_celldb_addr {
+	uint8_t		family;		/* 4 or 6 */
+	uint8_t		__pad;
+	uint16_t	port;		/* Network byte order */
+	uint8_t		addr[16];
+};
+
+#define report_error(r, fmt, ...)					\
+	({								\
+		r->error(fmt, ## __VA_ARGS__);				\
+		-1;							\
+	})
+
+#define verbose(r, fmt, ...)						\
+	do {								\
+		if (r->verbose)						\
+			r->verbose(fmt, ## __VA_ARGS__);		\
+	} while(0)
+
+/*
+ * Image construction buffer.
+ */
+struct kafs_celldb_buf {
+	char		*data;
+	size_t		size;
+	size_t		max;
+};
+
+static long celldb_alloc(struct kafs_celldb_buf *b, size_t size, size_t align)
+{
+	size_t off = (b->size + align - 1) & ~(align - 1);
+
+	if (off + size > UINT32_MAX)
+		return -1;
+
+	if (off + size > b->max) {
+		size_t max = b->max ? b->max : 65536;
+		char *p;
+
+		while (max < off + size)
+			max *= 2;
+		p = realloc(b->data, max);
+		if (!p)
+			return -1;
+		b->data = p;
+		b->max = max;
+	}
+
+	memset(b->data + b->size, 0, off + size - b->size);
+	b->size = off + size;
+	return off;
+}
+
+/*
+ * Add a string to the string table, which must be the last thing in the
+ * buffer.  Offset 0 of the table is reserved for NULL.
+ */
+static int celldb_add_string(struct kafs_celldb_buf *b, size_t strings,
+			     const char *s, uint32_t *_off)
+{
+	size_t len;
+	long off;
+
+	if (!s) {
+		*_off = 0;
+		return 0;
+	}
+
+	len = strlen(s) + 1;
+	off = celldb_alloc(b, len, 1);
+	if (off < 0)
+		return -1;
+	memcpy(b->data + off, s, len);
+	*_off = off - strings;
+	return 0;
+}
+
+static int celldb_cmp_cells(const void *a, const void *b, void *data)
+{
+	const struct kafs_cell_db *db = data;
+	const uint32_t *ia = a, *ib = b;
+
+	int cmp = strcasecmp(db->cells[*ia]->name, db->cells[*ib]->name);
+
+	/* Keep cells whose names differ only in case in config order. */
+	if (cmp == 0)
+		cmp = *ia < *ib ? -1 : *ia > *ib;
+	return cmp;
+}
+
+/*
+ * Lay out a configuration as an image.
+ */
+static int celldb_build(struct kafs_celldb_buf *b,
+			const struct kafs_config *config,
+			const struct kafs_profile_source *sources)
+{
+	const struct kafs_cell_db *db = config->db;
+	const struct kafs_profile_source *src;
+	struct kafs_celldb_header *hdr;
+	struct kafs_celldb_source *csrc;
+	struct kafs_celldb_cell *ccell;
+	struct kafs_celldb_server *cserver;
+	struct kafs_celldb_addr *caddr;
+	unsigned int nr_sources = 0, nr_servers = 0, nr_addrs = 0;
+	unsigned int i, j, k, s = 0, a = 0;
+	uint32_t *index, this_cell, sysname;
+	long o_hdr, o_sources, o_index, o_cells, o_servers, o_addrs, o_strings;
+
+	for (src = sources; src; src = src->next)
+		nr_sources++;
+
+	for (i = 0; i < db->nr_cells; i++) {
+		const struct kafs_server_list *vsl = db->cells[i]->vlservers;
+
+		if (!vsl)
+			continue;
+		nr_servers += vsl->nr_servers;
+		for (j = 0; j < vsl->nr_servers; j++)
+			nr_addrs += vsl->servers[j].nr_addrs;
+	}
+
+	o_hdr = celldb_alloc(b, sizeof(*hdr), 8);
+	o_sources = celldb_alloc(b, nr_sources * sizeof(*csrc), 8);
+	o_index = celldb_alloc(b, db->nr_cells * sizeof(*index), 4);
+	o_cells = celldb_alloc(b, db->nr_cells * sizeof(*ccell), 4);
+	o_servers = celldb_alloc(b, nr_servers * sizeof(*cserver), 4);
+	o_addrs = celldb_alloc(b, nr_addrs * sizeof(*caddr), 4);
+	o_strings = celldb_alloc(b, 1, 1);
+	if (o_hdr < 0 || o_sources < 0 || o_index < 0 || o_cells < 0 ||
+	    o_servers < 0 || o_addrs < 0 || o_strings < 0)
+		return -1;
+
+	/* The strings get appended to the buffer as we go, which may move it,
+	 * so we have to recalculate record pointers after each string.
+	 */
+#define REC(type, o, n) ((type *)(b->data + (o)) + (n))
+
+	for (src = sources, i = 0; src; src = src->next, i++) {
+		uint32_t path;
+
+		if (celldb_add_string(b, o_strings, src->path, &path) < 0)
+			return -1;
+		csrc = REC(struct kafs_celldb_source, o_sources, i);
+		csrc->mtime_sec	= src->mtime.tv_sec;
+		csrc->mtime_nsec = src->mtime.tv_nsec;
+		csrc->size	= src->size;
+		csrc->path	= path;
+		csrc->is_dir	= src->is_dir;
+		csrc->is_root	= src->is_root;
+	}
+
+	for (i = 0; i < db->nr_cells; i++) {
+		const struct kafs_cell *cell = db->cells[i];
+		const struct kafs_server_list *vsl = cell->vlservers;
+		uint32_t name, desc, realm;
+
+		if (celldb_add_string(b, o_strings, cell->name, &name) < 0 ||
+		    celldb_add_string(b, o_strings, cell->desc, &desc) < 0 ||
+		    celldb_add_string(b, o_strings, cell->realm, &realm) < 0)
+			return -1;
+
+		ccell = REC(struct kafs_celldb_cell, o_cells, i);
+		ccell->name		= name;
+		ccell->desc		= desc;
+		ccell->realm		= realm;
+		ccell->use_dns		= cell->use_dns;
+		ccell->show_cell	= cell->show_cell;
+		ccell->hot		= cell->hot;
+		ccell->first_server	= s;
+		if (!vsl)
+			continue;
+		ccell->has_vlservers	= true;
+		ccell->nr_servers	= vsl->nr_servers;
+
+		for (j = 0; j < vsl->nr_servers; j++) {
+			const struct kafs_server *server = &vsl->servers[j];
+
+			if (celldb_add_string(b, o_strings, server->name, &name) < 0)
+				return -1;
+
+			cserver = REC(struct kafs_celldb_server, o_servers, s++);
+			cserver->name		= name;
+			cserver->first_addr	= a;
+			cserver->nr_addrs	= server->nr_addrs;
+			cserver->port		= server->port;
+			cserver->pref		= server->pref;
+			cserver->weight		= server->weight;
+			cserver->protocol	= server->protocol;
+			cserver->type		= server->type;
+
+			for (k = 0; k < server->nr_addrs; k++) {
+				const struct kafs_server_addr *addr = &server->addrs[k];
+
+				caddr = REC(struct kafs_celldb_addr, o_addrs, a++);
+				switch (addr->sin.sin_family) {
+				case AF_INET:
+					caddr->family = 4;
+					caddr->port = addr->sin.sin_port;
+					memcpy(caddr->addr, &addr->sin.sin_addr, 4);
+					break;
+				case AF_INET6:
+					caddr->family = 6;
+					caddr->port = addr->sin6.sin6_port;
+					memcpy(caddr->addr, &addr->sin6.sin6_addr, 16);
+					break;
+				}
+			}
+		}
+	}
+
+	index = REC(uint32_t, o_index, 0);
+	for (i = 0; i < db->nr_cells; i++)
+		index[i] = i;
+	qsort_r(index, db->nr_cells, sizeof(*index), celldb_cmp_cells, (void *)db);
+
+	if (celldb_add_string(b, o_strings, config->this_cell, &this_cell) < 0 ||
+	    celldb_add_string(b, o_strings, config->sysname, &sysname) < 0)
+		return -1;
+
+	hdr = REC(struct kafs_celldb_header, o_hdr, 0);
+#undef REC
+
+	hdr->this_cell		= this_cell;
+	hdr->sysname		= sysname;
+	hdr->addr_family	= config->addr_family;
+	memcpy(hdr->magic, KAFS_CELLDB_MAGIC, sizeof(hdr->magic));
+	hdr->version		= KAFS_CELLDB_VERSION;
+	hdr->byte_order		= KAFS_CELLDB_BYTE_ORDER;
+	hdr->size		= b->size;
+	hdr->nr_sources		= nr_sources;
+	hdr->nr_cells		= db->nr_cells;
+	hdr->nr_servers		= nr_servers;
+	hdr->nr_addrs		= nr_addrs;
+	hdr->sources		= o_sources;
+	hdr->index		= o_index;
+	hdr->cells		= o_cells;
+	hdr->servers		= o_servers;
+	hdr->addrs		= o_addrs;
+	hdr->strings		= o_strings;
+	hdr->strings_size	= b->size - o_strings;
+	return 0;
+}
+
+/*
+ * Write a configuration out as a compiled image.  The configuration must have
+ * been read in full from the text files so that we know what the image depends
+ * on.
+ */
+int kafs_celldb_write2(const char *image, const struct kafs_config *config,
+		       struct kafs_report *report)
+{
+	struct kafs_celldb_buf b = {};
+	char *tmp;
+	int fd;
+
+	if (!config->db || !config->profile.tree ||
+	    !config->profile.tree->sources)
+		return report_error(report, "%s: No text configuration loaded", image);
+	if (config->base)
+		return report_error(report, "%s: Configuration was reloaded incrementally",
+				    image);
+
+	if (kafs_cellserv_materialise(config->db, report) < 0)
+		return -1;
+
+	if (celldb_build(&b, config, config->profile.tree->sources) < 0) {
+		free(b.data);
+		return report_error(report, "%s: Unable to build image", image);
+	}
+
+	if (asprintf(&tmp, "%s.tmp", image) == -1) {
+		free(b.data);
+		return report_error(report, "%m");
+	}
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		report_error(report, "%s: %m", tmp);
+		goto error;
+	}
+
+	if (write(fd, b.data, b.size) != (ssize_t)b.size ||
+	    fsync(fd) == -1) {
+		report_error(report, "%s: %m", tmp);
+		close(fd);
+		goto error_unlink;
+	}
+
+	if (close(fd) == -1) {
+		report_error(report, "%s: %m", tmp);
+		goto error_unlink;
+	}
+
+	if (rename(tmp, image) == -1) {
+		report_error(report, "%s: %m", image);
+		goto error_unlink;
+	}
+
+	verbose(report, "%s: Wrote %zu bytes", image, b.size);
+	free(tmp);
+	free(b.data);
+	return 0;
+
+error_unlink:
+	unlink(tmp);
+error:
+	free(tmp);
+	free(b.data);
+	return -1;
+}
+
+/*
+ * Write the default configuration out as a compiled image.
+ */
+int kafs_celldb_write(const char *image, struct kafs_report *report)
+{
+	struct kafs_config *config;
+	int ret;
+
+	config = kafs_get_default_config(report);
+	if (!config)
+		return -1;
+	ret = kafs_celldb_write2(image, config, report);
+	kafs_put_config(config);
+	return ret;
+}
+
+/*
+ * Check that a section lies within the image.
+ */
+static bool celldb_check_section(const struct kafs_celldb_header *hdr,
+				 uint32_t off, uint32_t nr, size_t size)
+{
+	return off <= hdr->size && nr <= (hdr->size - off) / size;
+}
+
+static const char *celldb_string(const struct kafs_celldb_header *hdr,
+				 uint32_t off)
+{
+	if (!off || off >= hdr->strings_size)
+		return NULL;
+	return (const char *)hdr + hdr->strings + off;
+}
+
+/*
+ * Validate the image header and layout.
+ */
+static bool celldb_check_image(const struct kafs_celldb_header *hdr, size_t size)
+{
+	const char *strings;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, KAFS_CELLDB_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != KAFS_CELLDB_VERSION ||
+	    hdr->byte_order != KAFS_CELLDB_BYTE_ORDER ||
+	    hdr->size != size)
+		return false;
+
+	if (!celldb_check_section(hdr, hdr->sources, hdr->nr_sources,
+				  sizeof(struct kafs_celldb_source)) ||
+	    !celldb_check_section(hdr, hdr->index, hdr->nr_cells, sizeof(uint32_t)) ||
+	    !celldb_check_section(hdr, hdr->cells, hdr->nr_cells,
+				  sizeof(struct kafs_celldb_cell)) ||
+	    !celldb_check_section(hdr, hdr->servers, hdr->nr_servers,
+				  sizeof(struct kafs_celldb_server)) ||
+	    !celldb_check_section(hdr, hdr->addrs, hdr->nr_addrs,
+				  sizeof(struct kafs_celldb_addr)) ||
+	    !celldb_check_section(hdr, hdr->strings, hdr->strings_size, 1) ||
+	    hdr->strings_size == 0)
+		return false;
+
+	/* Make sure string lookups can't run off the end. */
+	strings = (const char *)hdr + hdr->strings;
+	return strings[hdr->strings_size - 1] == 0;
+}
+
+/*
+ * Determine whether the image was built from the set of files we've been
+ * asked to read and whether any of its sources have changed since.
+ */
+static bool celldb_check_sources(const struct kafs_celldb_header *hdr,
+				 const char *const *files,
+				 struct kafs_report *report)
+{
+	const struct kafs_celldb_source *src =
+		(const void *)((const char *)hdr + hdr->sources);
+	unsigned int i;
+	struct stat st;
+
+	for (i = 0; i < hdr->nr_sources; i++) {
+		const char *path = celldb_string(hdr, src[i].path);
+
+		if (!path)
+			return false;
+
+		if (src[i].is_root) {
+			if (!*files || strcmp(*files, path) != 0) {
+				verbose(report, "Image built from different config");
+				return false;
+			}
+			files++;
+		}
+
+		if (stat(path, &st) == -1 ||
+		    st.st_mtim.tv_sec != src[i].mtime_sec ||
+		    st.st_mtim.tv_nsec != src[i].mtime_nsec ||
+		    (!src[i].is_dir && st.st_size != src[i].size)) {
+			verbose(report, "%s: Changed since image built", path);
+			return false;
+		}
+	}
+
+	if (*files) {
+		verbose(report, "Image built from different config");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Serialises the building of cells from an image; it's only taken the first
+ * time each cell is used.
+ */
+static pthread_mutex_t celldb_build_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Build a cell record from an image.  The record borrows the strings from the
+ * image.
+ */
+static struct kafs_cell *celldb_build_cell(const struct kafs_celldb_header *hdr,
+					   unsigned int nr,
+					   struct kafs_report *report)
+{
+	const struct kafs_celldb_cell *ccell =
+		(const struct kafs_celldb_cell *)((const char *)hdr + hdr->cells) + nr;
+	const struct kafs_celldb_server *cserver = (const void *)((const char *)hdr + hdr->servers);
+	const struct kafs_celldb_addr *caddr = (const void *)((const char *)hdr + hdr->addrs);
+	struct kafs_server_addr *addrs;
+	struct kafs_server_list *vsl;
+	struct kafs_cell *cell;
+	unsigned int j, k, nr_addrs;
+
+	cell = calloc(1, sizeof(*cell));
+	if (!cell)
+		goto nomem;
+
+	cell->usage		= 1;
+	cell->name		= (char *)celldb_string(hdr, ccell->name);
+	cell->desc		= (char *)celldb_string(hdr, ccell->desc);
+	cell->realm		= (char *)celldb_string(hdr, ccell->realm);
+	cell->use_dns		= ccell->use_dns;
+	cell->show_cell		= ccell->show_cell;
+	cell->hot		= ccell->hot;
+	cell->borrowed_name	= true;
+	cell->borrowed_desc	= true;
+	cell->borrowed_realm	= true;
+	if (!cell->name)
+		goto corrupt;
+
+	if (!ccell->has_vlservers)
+		return cell;
+	if (ccell->first_server > hdr->nr_servers ||
+	    ccell->nr_servers > hdr->nr_servers - ccell->first_server)
+		goto corrupt;
+
+	/* The servers and their addresses are packed into a single block; the
+	 * names stay in the image.
+	 */
+	nr_addrs = 0;
+	for (j = 0; j < ccell->nr_servers; j++) {
+		const struct kafs_celldb_server *cs = &cserver[ccell->first_server + j];
+
+		if (cs->first_addr > hdr->nr_addrs ||
+		    cs->nr_addrs > hdr->nr_addrs - cs->first_addr)
+			goto corrupt;
+		nr_addrs += cs->nr_addrs;
+	}
+
+	vsl = kafs_alloc_packed_server_list(ccell->nr_servers, nr_addrs, 0,
+					    &addrs, NULL, report);
+	if (!vsl)
+		goto error;
+	vsl->source = kafs_record_from_config;
+	vsl->ttl = 0;
+	cell->vlservers = vsl;
+
+	for (j = 0; j < ccell->nr_servers; j++) {
+		const struct kafs_celldb_server *cs = &cserver[ccell->first_server + j];
+		struct kafs_server *server = &vsl->servers[j];
+
+		server->name		= (char *)celldb_string(hdr, cs->name);
+		server->borrowed_name	= true;
+		server->port		= cs->port;
+		server->pref		= cs->pref;
+		server->weight		= cs->weight;
+		server->protocol	= cs->protocol;
+		server->type		= cs->type;
+		server->source		= kafs_record_from_config;
+		if (!server->name)
+			goto corrupt;
+		vsl->nr_servers++;
+
+		server->addrs = addrs;
+		server->borrowed_addrs = true;
+		addrs += cs->nr_addrs;
+
+		for (k = 0; k < cs->nr_addrs; k++) {
+			const struct kafs_celldb_addr *ca = &caddr[cs->first_addr + k];
+			struct kafs_server_addr *addr = &server->addrs[server->nr_addrs];
+
+			switch (ca->family) {
+			case 4:
+				addr->sin.sin_family = AF_INET;
+				addr->sin.sin_port = ca->port;
+				memcpy(&addr->sin.sin_addr, ca->addr, 4);
+				break;
+			case 6:
+				addr->sin6.sin6_family = AF_INET6;
+				addr->sin6.sin6_port = ca->port;
+				memcpy(&addr->sin6.sin6_addr, ca->addr, 16);
+				break;
+			default:
+				continue;
+			}
+			server->nr_addrs++;
+		}
+	}
+
+	return cell;
+
+nomem:
+	report->bad_error = true;
+	report_error(report, "%m");
+	goto error;
+corrupt:
+	report->bad_config = true;
+	report_error(report, "Compiled cell database is corrupt");
+error:
+	if (cell)
+		kafs_free_cell(cell);
+	return NULL;
+}
+
+/*
+ * Make sure that a cell in a database mapped from an image has been built.
+ * The config may be shared between threads, so this is done under a lock and
+ * the cell is published only once it is complete.
+ */
+int kafs_celldb_build_cell(const struct kafs_cell_db *db, unsigned int nr,
+			   struct kafs_report *report)
+{
+	struct kafs_config *config = db->image_config;
+	struct kafs_cell *cell;
+	int ret = 0;
+
+	if (__atomic_load_n(&db->cells[nr], __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&celldb_build_lock);
+	if (!db->cells[nr]) {
+		cell = celldb_build_cell(config->image, nr, report);
+		if (cell) {
+			cell->config = config;
+			__atomic_store_n((struct kafs_cell **)&db->cells[nr], cell,
+					 __ATOMIC_RELEASE);
+		} else {
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&celldb_build_lock);
+	return ret;
+}
+
+/*
+ * Find a cell in a database mapped from an image by binary search of the
+ * image's sorted index.  If two cells have names that differ only in case, the
+ * first one in the configuration wins.  Returns the position of the cell plus
+ * one or 0 if there's no such cell.
+ */
+unsigned int kafs_celldb_find_nr(const struct kafs_cell_db *db,
+				 const char *cell_name)
+{
+	const struct kafs_celldb_header *hdr = db->image_config->image;
+	const struct kafs_celldb_cell *ccell = (const void *)((const char *)hdr + hdr->cells);
+	const uint32_t *index = (const void *)((const char *)hdr + hdr->index);
+	unsigned int lo = 0, hi = hdr->nr_cells, mid;
+	const char *name;
+	int cmp;
+
+	/* Find the lowest entry that doesn't sort before the name. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index[mid] >= hdr->nr_cells)
+			return 0;
+		name = celldb_string(hdr, ccell[index[mid]].name);
+		cmp = name ? strcasecmp(name, cell_name) : -1;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo >= hdr->nr_cells || index[lo] >= hdr->nr_cells)
+		return 0;
+	name = celldb_string(hdr, ccell[index[lo]].name);
+	if (!name || strcasecmp(name, cell_name) != 0)
+		return 0;
+	return index[lo] + 1;
+}
+
+/*
+ * Load the cell database from a compiled image if it is up to date with
+ * respect to the given list of files.  Returns 1 if the image was loaded, 0 if
+ * it couldn't be used and the text configuration should be read instead and
+ * -1 on a fatal error.
+ */
+int kafs_celldb_load(const char *image, const char *const *files,
+		     struct kafs_config *config,
+		     struct kafs_report *report)
+{
+	const struct kafs_celldb_header *hdr;
+	struct kafs_cell_db *db;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(image, O_RDONLY);
+	if (fd == -1) {
+		verbose(report, "%s: %m", image);
+		return 0;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return report_error(report, "%s: %m", image);
+	}
+
+	if (st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		verbose(report, "%s: Image too small", image);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return report_error(report, "%s: mmap: %m", image);
+	hdr = map;
+
+	if (!celldb_check_image(hdr, st.st_size)) {
+		verbose(report, "%s: Not a usable image", image);
+		goto unusable;
+	}
+
+	if (!celldb_check_sources(hdr, files, report))
+		goto unusable;
+
+	/* The cells are built from the image as they're looked up and borrow
+	 * its strings, so the image stays mapped.
+	 */
+	db = calloc(1, sizeof(*db) + hdr->nr_cells * sizeof(struct kafs_cell *));
+	if (!db) {
+		munmap(map, st.st_size);
+		report->bad_error = true;
+		return report_error(report, "%m");
+	}
+	db->nr_cells = hdr->nr_cells;
+	db->image_config = config;
+
+	config->db = db;
+	config->this_cell = celldb_string(hdr, hdr->this_cell);
+	config->sysname = celldb_string(hdr, hdr->sysname);
+	if (hdr->addr_family < nr__kafs_addr_family_policy)
+		config->addr_family = hdr->addr_family;
+	config->image = map;
+	config->image_size = st.st_size;
+	verbose(report, "%s: Mapped %u cells", image, db->nr_cells);
+	return 1;
+
+unusable:
+	munmap(map, st.st_size);
+	return 0;
+}
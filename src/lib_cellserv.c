@@ -12,9 +12,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <kafs/cellserv.h>
 #include <kafs/profile.h>
+#include "lib_internal.h"
 #include "dns_resolver.h"
 
 #define report_error(r, fmt, ...)					\
@@ -43,41 +46,144 @@
 	} while(0)
 
 /*
- * Parse an address.
+ * The configuration schema.  Each section has a table, sorted by key, that
+ * maps its keys to field numbers, and a table giving the value type and
+ * handler for each field.  A node is parsed in a single pass over its
+ * relations: keys that aren't in the schema and values of the wrong type are
+ * ignored, as are repeats of a key that may only be given once.  A handler
+ * returns -1 on a fatal error and 1 to reject the node.
+ */
+struct cellserv_field {
+	enum kafs_profile_value_type type;
+	bool			repeat;		/* May be given more than once */
+	int (*parse)(const struct kafs_profile *child, void *obj,
+		     struct kafs_report *report);
+};
+
+/*
+ * Look up a key or a server type in a schema table.  Unlike
+ * kafs_lookup_constant(), names are matched exactly, as they always have been.
+ */
+static int cellserv_cmp_key(const void *key, const void *entry)
+{
+	return strcmp(key, ((const struct kafs_constant_table *)entry)->name);
+}
+
+static int cellserv_lookup_key(const struct kafs_constant_table *keys, size_t nr_keys,
+			       const char *name)
+{
+	const struct kafs_constant_table *e;
+
+	e = bsearch(name, keys, nr_keys, sizeof(keys[0]), cellserv_cmp_key);
+	return e ? e->value : -1;
+}
+
+static int cellserv_parse_node(const struct kafs_profile *node,
+			       const struct kafs_constant_table *keys, size_t nr_keys,
+			       const struct cellserv_field *fields,
+			       void *obj, struct kafs_report *report)
+{
+	unsigned int i, seen = 0;
+	int f, ret;
+
+	for (i = 0; i < node->nr_relations; i++) {
+		const struct kafs_profile *r = node->relations[i];
+
+		f = cellserv_lookup_key(keys, nr_keys, r->name);
+		if (f < 0 || r->type != fields[f].type)
+			continue;
+		if (!fields[f].repeat) {
+			if (seen & (1U << f))
+				continue;
+			seen |= 1U << f;
+		}
+
+		ret = fields[f].parse(r, obj, report);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static bool cellserv_parse_bool(const struct kafs_profile *child,
+				struct kafs_report *report)
+{
+	int tmp;
+
+	if (!child->value)
+		return false;
+
+	tmp = kafs_lookup_bool(child->value, -1);
+	if (tmp == -1) {
+		report->error("%s:%u: Invalid bool value", child->file, child->line);
+		return false;
+	}
+
+	return tmp;
+}
+
+static int cellserv_parse_port(const char *p, unsigned short *_port)
+{
+	unsigned long tmp;
+	char *q;
+
+	tmp = strtoul(p, &q, 0);
+	if (*q || q == p || tmp > 65535)
+		return -1;
+	*_port = tmp;
+	return 0;
+}
+
+/*
+ * Parse an address.  The port is filled in once the whole server record has
+ * been seen.  The profile is left untouched as a config reload may parse it
+ * again.
  */
 static int cellserv_parse_address(const struct kafs_profile *child,
 				  void *data,
 				  struct kafs_report *report)
 {
 	struct kafs_server *server = data;
-	struct kafs_server_addr *addr = &server->addrs[server->nr_addrs];
+	struct kafs_server_addr *addr;
 	const char *v = child->value;
+	char buf[INET6_ADDRSTRLEN];
 
 	if (server->nr_addrs >= server->max_addrs) {
-		report_error(report, "%s: Address list overrun", server->name);
-		return 0;
+		unsigned int max = server->max_addrs * 2 ?: 4;
+
+		addr = realloc(server->addrs, max * sizeof(*addr));
+		if (!addr) {
+			report->bad_error = true;
+			return report_error(report, "%m");
+		}
+		server->addrs = addr;
+		server->max_addrs = max;
 	}
 
+	addr = &server->addrs[server->nr_addrs];
+	memset(addr, 0, sizeof(*addr));
+
 	if (inet_pton(AF_INET, v, &addr->sin.sin_addr) == 1) {
 		addr->sin.sin_family = AF_INET;
-		addr->sin.sin_port = htons(server->port);
 		server->nr_addrs++;
 		return 0;
 	}
 
 	if (v[0] == '[') {
-		char *p;
+		const char *p;
 
 		v++;
 		p = strchr(v, ']');
-		if (!p || p[1])
+		if (!p || p[1] || (size_t)(p - v) >= sizeof(buf))
 			goto invalid;
-		p[0] = 0;
+		memcpy(buf, v, p - v);
+		buf[p - v] = 0;
+		v = buf;
 	}
 
 	if (inet_pton(AF_INET6, v, &addr->sin6.sin6_addr) == 1) {
 		addr->sin6.sin6_family = AF_INET6;
-		addr->sin6.sin6_port = htons(server->port);
 		server->nr_addrs++;
 		return 0;
 	}
@@ -88,8 +194,65 @@ invalid:
 	return 0;
 }
 
+static int cellserv_parse_server_port(const struct kafs_profile *child,
+				      void *data,
+				      struct kafs_report *report)
+{
+	struct kafs_server *server = data;
+
+	if (cellserv_parse_port(child->value, &server->port) < 0) {
+		parse_error(report, "%s:%u: Invalid address\n", child->file, child->line);
+		return 1;
+	}
+	return 0;
+}
+
+static const struct kafs_constant_table cellserv_server_types[] = {
+	{ "ptserver",	kafs_server_is_afs_ptserver },
+	{ "vlserver",	kafs_server_is_afs_vlserver },
+};
+
+static int cellserv_parse_server_type(const struct kafs_profile *child,
+				      void *data,
+				      struct kafs_report *report)
+{
+	struct kafs_server *server = data;
+	int type;
+
+	type = cellserv_lookup_key(cellserv_server_types,
+				   sizeof(cellserv_server_types) / sizeof(cellserv_server_types[0]),
+				   child->value);
+	if (type == -1)
+		fprintf(stderr, "Unknown type '%s'\n", child->value);
+	else
+		server->type = type;
+	return 0;
+}
+
+enum cellserv_server_key {
+	cellserv_server_address,
+	cellserv_server_port,
+	cellserv_server_type,
+};
+
+static const struct kafs_constant_table cellserv_server_keys[] = {
+	{ "address",	cellserv_server_address },
+	{ "port",	cellserv_server_port },
+	{ "type",	cellserv_server_type },
+};
+
+static const struct cellserv_field cellserv_server_fields[] = {
+	[cellserv_server_address] = { kafs_profile_value_is_string, true,
+				      cellserv_parse_address },
+	[cellserv_server_port]	  = { kafs_profile_value_is_string, false,
+				      cellserv_parse_server_port },
+	[cellserv_server_type]	  = { kafs_profile_value_is_string, false,
+				      cellserv_parse_server_type },
+};
+
 /*
- * Parse a server definition.
+ * Parse a server definition.  The server gets its own copy of the name, less
+ * any protocol, brackets and port, so that the profile isn't modified.
  */
 static int cellserv_parse_server(const struct kafs_profile *child,
 				 void *data,
@@ -97,13 +260,13 @@ static int cellserv_parse_server(const struct kafs_profile *child,
 {
 	struct kafs_server_list *vsl = data;
 	struct kafs_server *server = &vsl->servers[vsl->nr_servers];
-	unsigned long tmp;
-	unsigned int max_addrs = 0;
-	const char *p;
-	char *q;
+	unsigned int i;
+	const char *name, *p;
+	size_t len;
+	int ret;
 
 	if (vsl->nr_servers >= vsl->max_servers) {
-		report_error(report, "%s: Server list overrun", server->name);
+		report_error(report, "%s: Server list overrun", child->name);
 		return 0;
 	}
 
@@ -111,169 +274,489 @@ static int cellserv_parse_server(const struct kafs_profile *child,
 	server->source = kafs_record_from_config;
 
 	/* Strip off any protocol indicator */
-	server->name = child->name;
-	if (strncmp(server->name, "udp/", 4) == 0) {
+	name = child->name;
+	if (strncmp(name, "udp/", 4) == 0) {
 		server->protocol = DNS_SERVER_PROTOCOL_UDP;
-		server->name += 4;
-	} else if (strncmp(server->name, "tcp/", 4) == 0) {
+		name += 4;
+	} else if (strncmp(name, "tcp/", 4) == 0) {
 		server->protocol = DNS_SERVER_PROTOCOL_TCP;
-		server->name += 4;
+		name += 4;
 	}
 
-	if (!server->name[0])
+	if (!name[0])
 		return 0;
 
 	/* Strip any port number and square brackets */
-	if (server->name[0] == '[') {
-		server->name++;
-		p = strchr(server->name, ']');
-		if (!*p)
+	if (name[0] == '[') {
+		name++;
+		p = strchr(name, ']');
+		if (!p)
 			return 0;
-		*(char *)p = 0;
+		len = p - name;
 		p++;
-		if (*p) {
-			if (*p != ':')
-				return 0;
-			p++;
-			goto extract_port;
-		}
+		if (!*p)
+			p = NULL;
+		else if (*p++ != ':')
+			return 0;
+	} else {
+		/* Look for foo.com:port or 1.2.3.4:port, but dodge 1:2:3:4 */
+		len = strlen(name);
+		p = strchr(name, ':');
+		if (p && !strchr(p + 1, ':'))
+			len = p++ - name;
+		else
+			p = NULL;
 	}
 
-	/* Look for foo.com:port or 1.2.3.4:port, but dodge 1:2:3:4 */
-	p = strchr(server->name, ':');
-	if (!p)
-		goto no_port;
-	*(char *)p = 0;
-	p++;
-	if (strchr(p, ':'))
-		goto no_port;
-
-extract_port:
-	tmp = strtoul(p, &q, 0);
-	if (*q)
-		goto unparseable;
-	if (tmp > 65536)
-		goto unparseable;
-	server->port = tmp;
-no_port:
-
-	p = kafs_profile_get_string(child, "port", report);
-	if (p) {
-		tmp = strtoul(p, &q, 0);
-		if (*q)
-			goto unparseable;
-		if (tmp > 65536)
-			goto unparseable;
-		server->port = tmp;
+	if (p && cellserv_parse_port(p, &server->port) < 0) {
+		parse_error(report, "%s:%u: Invalid address\n", child->file, child->line);
+		return 0;
 	}
 
-	/* Generate a list of addresses */
-	if (kafs_profile_count_strings(child, "address", &max_addrs) < 0)
-		return -1;
+	server->name = strndup(name, len);
+	if (!server->name) {
+		report->bad_error = true;
+		return report_error(report, "%m");
+	}
 
-	server->addrs = calloc(max_addrs, sizeof(struct kafs_server));
-	if (!server->addrs)
-		return -1;
-	server->max_addrs = max_addrs;
+	ret = cellserv_parse_node(child, cellserv_server_keys,
+				  sizeof(cellserv_server_keys) / sizeof(cellserv_server_keys[0]),
+				  cellserv_server_fields, server, report);
+	if (ret) {
+		free(server->name);
+		free(server->addrs);
+		return ret < 0 ? -1 : 0;
+	}
 
-	if (kafs_profile_iterate_strings(child, "address",
-					 cellserv_parse_address, server,
-					 report) < 0)
-		return -1;
+	for (i = 0; i < server->nr_addrs; i++) {
+		struct kafs_server_addr *addr = &server->addrs[i];
 
-	p = kafs_profile_get_string(child, "type", report);
-	if (p) {
-		if (strcmp(p, "vlserver") == 0)
-			server->type = kafs_server_is_afs_vlserver;
-		else if (strcmp(p, "ptserver") == 0)
-			server->type = kafs_server_is_afs_ptserver;
+		if (addr->sin.sin_family == AF_INET)
+			addr->sin.sin_port = htons(server->port);
 		else
-			fprintf(stderr, "Unknown type '%s'\n", p);
+			addr->sin6.sin6_port = htons(server->port);
 	}
 
 	vsl->nr_servers++;
 	return 0;
-
-unparseable:
-	parse_error(report, "%s:%u: Invalid address\n", child->file, child->line);
-	return 0;
 }
 
 /*
- * Find any Volume Location servers listed for a cell.
+ * Parse the list of Volume Location servers for a cell.
  */
-static int kafs_cellserv_parse_vl(const struct kafs_profile *child,
-				  struct kafs_cell *cell,
+static int kafs_cellserv_parse_vl(const struct kafs_profile *servers,
+				  void *data,
 				  struct kafs_report *report)
 {
-	const struct kafs_profile *servers;
+	struct kafs_cell *cell = data;
 	struct kafs_server_list *vsl;
-	unsigned int max_servers = 0;
-
-	/* Find any Volume Location servers listed for that cell */
-	servers = kafs_profile_find_first_child(child, kafs_profile_value_is_list,
-						"servers", report);
-	if (!servers) {
-		verbose(report, "%s: No servers list", child->name);
-		return 0;
-	}
-
-	if (kafs_profile_count_list(servers, NULL, &max_servers) < 0)
-		return -1;
 
 	vsl = calloc(1, sizeof(*vsl));
 	if (!vsl)
 		return -1;
 	vsl->source = kafs_record_from_config;
 
+	/* The servers are the list-type relations; the number of relations is
+	 * near enough and saves a counting pass.
+	 */
 	cell->vlservers = vsl;
-	vsl->servers = calloc(max_servers, sizeof(struct kafs_server));
+	vsl->servers = calloc(servers->nr_relations, sizeof(struct kafs_server));
 	if (!vsl->servers)
 		return -1;
 
-	vsl->max_servers = max_servers;
-	return kafs_profile_iterate_list(servers, NULL, cellserv_parse_server,
-					 vsl, report);
+	vsl->max_servers = servers->nr_relations;
+	if (kafs_profile_iterate_list(servers, NULL, cellserv_parse_server,
+				      vsl, report) < 0)
+		return -1;
+
+	/* Pack the list into a single block as it'll be around for a while. */
+	cell->vlservers = kafs_pack_server_list(vsl, report);
+	if (!cell->vlservers) {
+		cell->vlservers = vsl;
+		return -1;
+	}
+	kafs_free_server_list(vsl);
+	return 0;
 }
 
+static int cellserv_parse_description(const struct kafs_profile *child, void *data,
+				      struct kafs_report *report)
+{
+	struct kafs_cell *cell = data;
+
+	cell->desc = child->value;
+	return 0;
+}
+
+static int cellserv_parse_realm(const struct kafs_profile *child, void *data,
+				struct kafs_report *report)
+{
+	struct kafs_cell *cell = data;
+
+	cell->realm = child->value;
+	return 0;
+}
+
+static int cellserv_parse_show_cell(const struct kafs_profile *child, void *data,
+				    struct kafs_report *report)
+{
+	struct kafs_cell *cell = data;
+
+	cell->show_cell = cellserv_parse_bool(child, report);
+	return 0;
+}
+
+static int cellserv_parse_use_dns(const struct kafs_profile *child, void *data,
+				  struct kafs_report *report)
+{
+	struct kafs_cell *cell = data;
+
+	cell->use_dns = cellserv_parse_bool(child, report);
+	return 0;
+}
+
+static int cellserv_parse_hot(const struct kafs_profile *child, void *data,
+			      struct kafs_report *report)
+{
+	struct kafs_cell *cell = data;
+
+	cell->hot = cellserv_parse_bool(child, report);
+	return 0;
+}
+
+enum cellserv_cell_key {
+	cellserv_cell_description,
+	cellserv_cell_hot,
+	cellserv_cell_realm,
+	cellserv_cell_servers,
+	cellserv_cell_show_cell,
+	cellserv_cell_use_dns,
+};
+
+static const struct kafs_constant_table cellserv_cell_keys[] = {
+	{ "description",	cellserv_cell_description },
+	{ "hot",		cellserv_cell_hot },
+	{ "kerberos_realm",	cellserv_cell_realm },
+	{ "servers",		cellserv_cell_servers },
+	{ "show_cell",		cellserv_cell_show_cell },
+	{ "use_dns",		cellserv_cell_use_dns },
+};
+
+static const struct cellserv_field cellserv_cell_fields[] = {
+	[cellserv_cell_description] = { kafs_profile_value_is_string, false,
+					cellserv_parse_description },
+	[cellserv_cell_hot]	    = { kafs_profile_value_is_string, false,
+					cellserv_parse_hot },
+	[cellserv_cell_realm]	    = { kafs_profile_value_is_string, false,
+					cellserv_parse_realm },
+	[cellserv_cell_servers]	    = { kafs_profile_value_is_list, false,
+					kafs_cellserv_parse_vl },
+	[cellserv_cell_show_cell]   = { kafs_profile_value_is_string, false,
+					cellserv_parse_show_cell },
+	[cellserv_cell_use_dns]	    = { kafs_profile_value_is_string, false,
+					cellserv_parse_use_dns },
+};
+
+struct kafs_cellserv_parse {
+	struct kafs_cell_db	*db;
+	unsigned int		flags;
+};
+
 /*
- * Parse a cell definition.
+ * Fill in a cell record from its definition.
  */
-static int kafs_cellserv_parse_cell(const struct kafs_profile *child,
-				    void *data,
-				    struct kafs_report *report)
+static int kafs_cellserv_fill_cell(const struct kafs_profile *child,
+				   struct kafs_cell *cell,
+				   struct kafs_report *report)
+{
+	if (cellserv_parse_node(child, cellserv_cell_keys,
+				sizeof(cellserv_cell_keys) / sizeof(cellserv_cell_keys[0]),
+				cellserv_cell_fields, cell, report) < 0)
+		return -1;
+
+	verbose2(report, "CELL: %s: %s", cell->name, cell->desc);
+	if (!cell->vlservers)
+		verbose(report, "%s: No servers list", child->name);
+	return 0;
+}
+
+/*
+ * Make a cell record from its definition.  In lazy mode, only the name is
+ * taken and the profile node is noted so that the rest can be filled in on
+ * first use.  The record borrows from the profile.
+ */
+struct kafs_cell *kafs_cellserv_new_cell(const struct kafs_profile *child,
+					 unsigned int flags,
+					 struct kafs_report *report)
 {
-	struct kafs_cell_db *db = data;
 	struct kafs_cell *cell;
 
 	cell = calloc(1, sizeof(*cell));
 	if (!cell)
-		return -1;
+		return NULL;
+	cell->usage = 1;
 	cell->name = child->name;
-	cell->show_cell	= kafs_profile_get_bool(child, "show_cell", report);
-	cell->use_dns	= kafs_profile_get_bool(child, "use_dns", report);
-	cell->desc	= (char *)kafs_profile_get_string(child, "description", report);
-	cell->realm	= (char *)kafs_profile_get_string(child, "kerberos_realm", report);
 	cell->borrowed_name = true;
 	cell->borrowed_desc = true;
 	cell->borrowed_realm = true;
+	cell->def = child;
 
-	verbose2(report, "CELL: %s: %s", cell->name, cell->desc);
+	if (flags & KAFS_READ_CONFIG_LAZY) {
+		cell->node = child;
+		return cell;
+	}
+
+	if (kafs_cellserv_fill_cell(child, cell, report) < 0) {
+		kafs_free_cell(cell);
+		return NULL;
+	}
+	return cell;
+}
+
+static int kafs_cellserv_parse_cell(const struct kafs_profile *child,
+				    void *data,
+				    struct kafs_report *report)
+{
+	const struct kafs_cellserv_parse *parse = data;
+	struct kafs_cell_db *db = parse->db;
+	struct kafs_cell *cell;
+
+	cell = kafs_cellserv_new_cell(child, parse->flags, report);
+	if (!cell)
+		return -1;
 	db->cells[db->nr_cells] = cell;
 	db->nr_cells++;
+	return 0;
+}
+
+/*
+ * Collects the definitions of a cell from the events of a config file into a
+ * tree of its own.
+ */
+struct kafs_cellserv_reader {
+	struct kafs_profile_builder build;
+	struct kafs_profile	root;
+	struct kafs_profile	*cells;		/* [cells] in the tree */
+	const char		*cell_name;	/* Name to look for */
+	const char		*name;		/* Name as spelt in the config or NULL */
+	bool			in_cells;	/* T if in a [cells] section */
+	bool			in_cell;	/* T if in a definition of the cell */
+	bool			resumed;	/* T if reading from a noted position */
+	bool			first_only;	/* T to stop after the first definition */
+};
+
+static int kafs_cellserv_init_reader(struct kafs_cellserv_reader *r,
+				     const char *cell_name,
+				     struct kafs_report *report)
+{
+	memset(r, 0, sizeof(*r));
+	r->root.name = "<cell>";
+	r->build.root = &r->root;
+	r->build.copy = true;
+	r->cell_name = cell_name;
+	r->cells = kafs_profile_add_list(&r->root, &r->root, "cells", report);
+	return r->cells ? 0 : -1;
+}
+
+static int kafs_cellserv_read_event(const struct kafs_profile_event *ev,
+				    void *data,
+				    struct kafs_report *report)
+{
+	struct kafs_cellserv_reader *r = data;
+
+	if (ev->type == kafs_profile_event_section) {
+		if (r->resumed)
+			goto moved;
+		r->in_cells = strcmp(ev->name, "cells") == 0;
+		r->in_cell = false;
+		return 0;
+	}
 
-	return kafs_cellserv_parse_vl(child, cell, report);
+	if (!r->in_cell) {
+		if (r->resumed) {
+			/* The first line must be the start of the definition. */
+			if (ev->type != kafs_profile_event_open ||
+			    ev->depth != 1 ||
+			    strcmp(ev->name, r->name) != 0)
+				goto moved;
+		} else {
+			if (!r->in_cells ||
+			    ev->type != kafs_profile_event_open ||
+			    ev->depth != 1)
+				return 0;
+			if (r->name ?
+			    strcmp(ev->name, r->name) != 0 :
+			    strcasecmp(ev->name, r->cell_name) != 0)
+				return 0;
+		}
+
+		if (!r->name) {
+			size_t len = strlen(ev->name) + 1;
+			char *name = kafs_profile_arena_alloc(&r->root, len);
+
+			if (!name)
+				return report_error(report, "%m");
+			r->name = memcpy(name, ev->name, len);
+		}
+		r->in_cell = true;
+		r->build.list = r->cells;
+	}
+
+	if (kafs_profile_build(&r->build, ev, report) < 0)
+		return -1;
+
+	if (ev->type == kafs_profile_event_close && ev->depth == 1) {
+		r->in_cell = false;
+		if (r->resumed || r->first_only || ev->final)
+			return 1;
+	}
+	return 0;
+
+moved:
+	return parse_error(report, "Definition of cell %s has moved", r->cell_name);
 }
 
 /*
- * Extract cell information from a kafs_profile parse tree.
+ * Fill in a cell record from the definitions collected by a reader.  The
+ * strings that the record would borrow are copied as the reader's tree is about
+ * to be discarded.
  */
-struct kafs_cell_db *kafs_cellserv_parse_conf(const struct kafs_profile *prof,
-					      struct kafs_report *report)
+static int kafs_cellserv_fill_from_reader(struct kafs_cellserv_reader *r,
+					  struct kafs_cell *cell,
+					  struct kafs_report *report)
+{
+	const struct kafs_profile *def;
+	char *desc = NULL, *realm = NULL;
+
+	def = kafs_profile_find_first_child(r->cells, kafs_profile_value_is_list,
+					    r->name, report);
+	if (!def)
+		return report_error(report, "%s: Cell definition not found",
+				    r->cell_name);
+
+	if (kafs_cellserv_fill_cell(def, cell, report) < 0)
+		goto error;
+
+	if (cell->desc && !(desc = strdup(cell->desc)))
+		goto nomem;
+	if (cell->realm && !(realm = strdup(cell->realm))) {
+		free(desc);
+		goto nomem;
+	}
+	cell->desc = desc;
+	cell->realm = realm;
+	cell->borrowed_desc = false;
+	cell->borrowed_realm = false;
+	return 0;
+
+nomem:
+	report_error(report, "%m");
+error:
+	cell->desc = NULL;
+	cell->realm = NULL;
+	cell->borrowed_desc = true;
+	cell->borrowed_realm = true;
+	return -1;
+}
+
+/*
+ * Read the definitions of an indexed cell from the config files.
+ */
+static int kafs_cellserv_read_cell(struct kafs_cell *cell,
+				   struct kafs_report *report)
+{
+	struct kafs_cellserv_reader r;
+	const struct kafs_cell_pos *pos;
+	int ret = -1;
+
+	if (kafs_cellserv_init_reader(&r, cell->name, report) < 0)
+		goto out;
+	r.name = cell->name;
+	r.resumed = true;
+
+	for (pos = cell->pos; pos; pos = pos->next)
+		if (kafs_profile_stream(pos->file, pos->offset, pos->line,
+					kafs_cellserv_read_event, &r, report) < 0)
+			goto out;
+
+	ret = kafs_cellserv_fill_from_reader(&r, cell, report);
+out:
+	kafs_profile_free(&r.root);
+	return ret;
+}
+
+/*
+ * Serialises the filling in of lazily parsed cells; it's only taken the first
+ * time each cell is used.
+ */
+static pthread_mutex_t kafs_cellserv_lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Fill in a lazily parsed or indexed cell if that hasn't been done yet.  The
+ * config may be shared between threads, so this is done under a lock and the
+ * node or position pointer is cleared only once the cell is complete.
+ */
+static int kafs_cellserv_materialise_cell(struct kafs_cell *cell,
+					  struct kafs_report *report)
+{
+	const struct kafs_profile *node;
+	int ret = 0;
+
+	if (!__atomic_load_n(&cell->node, __ATOMIC_ACQUIRE) &&
+	    !__atomic_load_n(&cell->pos, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_lock(&kafs_cellserv_lazy_lock);
+	node = cell->node;
+	if (node || cell->pos) {
+		if (node)
+			ret = kafs_cellserv_fill_cell(node, cell, report);
+		else
+			ret = kafs_cellserv_read_cell(cell, report);
+		if (ret == 0) {
+			__atomic_store_n(&cell->node, NULL, __ATOMIC_RELEASE);
+			__atomic_store_n(&cell->pos, NULL, __ATOMIC_RELEASE);
+		} else if (cell->vlservers) {
+			kafs_free_server_list(cell->vlservers);
+			cell->vlservers = NULL;
+		}
+	}
+	pthread_mutex_unlock(&kafs_cellserv_lazy_lock);
+	return ret;
+}
+
+/*
+ * Fill in all the lazily parsed cells in a database.
+ */
+int kafs_cellserv_materialise(const struct kafs_cell_db *db,
+			      struct kafs_report *report)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->nr_cells; i++) {
+		if (db->image_config &&
+		    kafs_celldb_build_cell(db, i, report) < 0)
+			return -1;
+		if (kafs_cellserv_materialise_cell(db->cells[i], report) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Extract cell information from a kafs_profile parse tree.  If
+ * KAFS_READ_CONFIG_LAZY is given, the cells are only fully parsed when they're
+ * first looked up with kafs_cellserv_find_cell2() or kafs_cellserv_materialise()
+ * is called, and the profile tree must be kept as long as the database.
+ */
+struct kafs_cell_db *kafs_cellserv_parse_conf2(const struct kafs_profile *prof,
+					       unsigned int flags,
+					       struct kafs_report *report)
 {
 	const struct kafs_profile *cells;
+	struct kafs_cellserv_parse parse = { .flags = flags };
 	struct kafs_cell_db *db;
-	unsigned int nr_cells = 0;
+	unsigned int nr_cells;
 
 	cells = kafs_profile_find_first_child(prof, kafs_profile_value_is_list, "cells", report);
 	if (!cells) {
@@ -281,23 +764,475 @@ struct kafs_cell_db *kafs_cellserv_parse_conf(const struct kafs_profile *prof,
 		return NULL;
 	}
 
-	if (kafs_profile_count_list(cells, NULL, &nr_cells) < 0)
-		return NULL;
-
+	/* Size the table from the number of relations rather than counting
+	 * the cells separately.
+	 */
+	nr_cells = cells->nr_relations;
 	db = calloc(1, sizeof(*db) + nr_cells * sizeof(struct kafs_cell *));
 	if (!db)
 		return NULL;
-	if (!nr_cells)
-		return db;
 
-	if (kafs_profile_iterate_list(cells, NULL,
-				      kafs_cellserv_parse_cell, db,
+	parse.db = db;
+	if (nr_cells &&
+	    kafs_profile_iterate_list(cells, NULL,
+				      kafs_cellserv_parse_cell, &parse,
 				      report) == -1)
 		return NULL;
 
+	if (kafs_cellserv_index(db, report) < 0)
+		return NULL;
 	return db;
 }
 
+struct kafs_cell_db *kafs_cellserv_parse_conf(const struct kafs_profile *prof,
+					      struct kafs_report *report)
+{
+	return kafs_cellserv_parse_conf2(prof, 0, report);
+}
+
+/*
+ * Hash a cell or server name.  Such names are case-insensitive, so we fold the
+ * case as we go (FNV-1a).
+ */
+unsigned int kafs_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *name; name++) {
+		hash ^= (unsigned char)tolower((unsigned char)*name);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Build an open-addressed hash index over the cell names in a database.  If
+ * two cells have names that differ only in case, the first one in the
+ * configuration wins.
+ */
+int kafs_cellserv_index(struct kafs_cell_db *db, struct kafs_report *report)
+{
+	unsigned int size = 16, mask, i, slot, *index;
+
+	while (size < db->nr_cells * 2)
+		size *= 2;
+	mask = size - 1;
+
+	index = calloc(size, sizeof(*index));
+	if (!index) {
+		report->bad_error = true;
+		return report_error(report, "%m");
+	}
+
+	for (i = 0; i < db->nr_cells; i++) {
+		const char *name = db->cells[i]->name;
+
+		for (slot = kafs_name_hash(name) & mask;
+		     index[slot];
+		     slot = (slot + 1) & mask)
+			if (strcasecmp(db->cells[index[slot] - 1]->name, name) == 0)
+				break;
+
+		if (index[slot]) {
+			verbose(report, "%s: Duplicate of cell %s ignored",
+				name, db->cells[index[slot] - 1]->name);
+			continue;
+		}
+		index[slot] = i + 1;
+	}
+
+	free(db->index);
+	db->index = index;
+	db->index_mask = mask;
+	return 0;
+}
+
+/*
+ * Add a cell that has been appended to a database to the index.  The index is
+ * rebuilt if it's getting too full.  A cell whose name matches one already
+ * indexed, bar case, isn't indexed.
+ */
+int kafs_cellserv_index_add(struct kafs_cell_db *db, unsigned int i,
+			    struct kafs_report *report)
+{
+	unsigned int mask = db->index_mask, slot;
+	const char *name = db->cells[i]->name;
+
+	if (!db->index || db->nr_cells * 2 > mask + 1)
+		return kafs_cellserv_index(db, report);
+
+	for (slot = kafs_name_hash(name) & mask;
+	     db->index[slot];
+	     slot = (slot + 1) & mask) {
+		if (strcasecmp(db->cells[db->index[slot] - 1]->name, name) == 0) {
+			verbose(report, "%s: Duplicate of cell %s ignored",
+				name, db->cells[db->index[slot] - 1]->name);
+			return 0;
+		}
+	}
+
+	db->index[slot] = i + 1;
+	return 0;
+}
+
+/*
+ * Find the position of a cell in the database by name.  Returns the position
+ * plus one or 0 if there's no such cell.
+ */
+unsigned int kafs_cellserv_find_nr(const struct kafs_cell_db *db,
+				   const char *cell_name)
+{
+	unsigned int slot, mask = db->index_mask;
+
+	if (db->image_config)
+		return kafs_celldb_find_nr(db, cell_name);
+	if (!db->index)
+		return 0;
+
+	for (slot = kafs_name_hash(cell_name) & mask;
+	     db->index[slot];
+	     slot = (slot + 1) & mask) {
+		struct kafs_cell *cell = db->cells[db->index[slot] - 1];
+
+		if (strcasecmp(cell->name, cell_name) == 0)
+			return db->index[slot];
+	}
+
+	return 0;
+}
+
+/*
+ * Find a cell in the database by name.  A cell in a database loaded from an
+ * image isn't found unless it has already been built.
+ */
+struct kafs_cell *kafs_cellserv_find_cell(const struct kafs_cell_db *db,
+					  const char *cell_name)
+{
+	unsigned int nr = kafs_cellserv_find_nr(db, cell_name);
+
+	return nr ? __atomic_load_n(&db->cells[nr - 1], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/*
+ * Find a cell in the database by name, building it or filling it in first if
+ * the database was loaded from an image or parsed lazily.  NULL is returned if
+ * there's no such cell; -1 is stored in *_err if the cell couldn't be built or
+ * filled in.
+ */
+struct kafs_cell *kafs_cellserv_find_cell2(const struct kafs_cell_db *db,
+					   const char *cell_name,
+					   struct kafs_report *report,
+					   int *_err)
+{
+	struct kafs_cell *cell;
+	unsigned int nr;
+
+	*_err = 0;
+	if (db->image_config) {
+		nr = kafs_celldb_find_nr(db, cell_name);
+		if (!nr)
+			return NULL;
+		if (kafs_celldb_build_cell(db, nr - 1, report) < 0) {
+			*_err = -1;
+			return NULL;
+		}
+		return db->cells[nr - 1];
+	}
+
+	cell = kafs_cellserv_find_cell(db, cell_name);
+	if (cell && kafs_cellserv_materialise_cell(cell, report) < 0) {
+		*_err = -1;
+		return NULL;
+	}
+	return cell;
+}
+
+/*
+ * State for indexing the cells in a config as it's streamed.  Everything
+ * outside of the cell definitions is built into the config's profile tree.
+ */
+struct kafs_cellserv_indexer {
+	struct kafs_profile_builder build;
+	struct kafs_profile	*prof;
+	struct kafs_cell_db	*db;
+	unsigned int		max_cells;
+	unsigned int		mask;		/* Size of names - 1 */
+	unsigned int		*names;		/* Hash of exact name -> cell nr + 1 */
+	const char		*file;		/* Copy of the current filename */
+	struct kafs_cell_pos	*pos;		/* Definition being skipped or NULL */
+	bool			in_cells;	/* T if in a [cells] section */
+	bool			in_cell;	/* T if skipping a cell definition */
+};
+
+/*
+ * Copy a string into the arena of the config's profile tree.
+ */
+static char *kafs_cellserv_save_string(struct kafs_cellserv_indexer *ix,
+				       const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	p = kafs_profile_arena_alloc(ix->prof, len);
+	return p ? memcpy(p, s, len) : NULL;
+}
+
+/*
+ * Find the slot in the name hash for a name, matching the case exactly as the
+ * profile does when merging definitions.
+ */
+static unsigned int kafs_cellserv_name_slot(const struct kafs_cellserv_indexer *ix,
+					    const char *name)
+{
+	unsigned int slot;
+
+	for (slot = kafs_name_hash(name) & ix->mask;
+	     ix->names[slot];
+	     slot = (slot + 1) & ix->mask)
+		if (strcmp(ix->db->cells[ix->names[slot] - 1]->name, name) == 0)
+			break;
+	return slot;
+}
+
+static int kafs_cellserv_grow_names(struct kafs_cellserv_indexer *ix)
+{
+	unsigned int size = (ix->mask + 1) * 2 ?: 64, i;
+
+	free(ix->names);
+	ix->names = calloc(size, sizeof(ix->names[0]));
+	if (!ix->names)
+		return -1;
+	ix->mask = size - 1;
+	for (i = 0; i < ix->db->nr_cells; i++)
+		ix->names[kafs_cellserv_name_slot(ix, ix->db->cells[i]->name)] = i + 1;
+	return 0;
+}
+
+/*
+ * Note the position of a definition of a cell, adding the cell to the database
+ * if it's the first.  A definition that follows one that was marked final is
+ * ignored, as it would be when parsing.
+ */
+static int kafs_cellserv_index_def(struct kafs_cellserv_indexer *ix,
+				   const struct kafs_profile_event *ev,
+				   struct kafs_report *report)
+{
+	struct kafs_cell_db *db = ix->db;
+	struct kafs_cell_pos *pos, *p;
+	struct kafs_cell *cell;
+	unsigned int slot;
+
+	ix->pos = NULL;
+	if ((!ix->names || db->nr_cells * 2 >= ix->mask + 1) &&
+	    kafs_cellserv_grow_names(ix) < 0)
+		goto nomem;
+
+	slot = kafs_cellserv_name_slot(ix, ev->name);
+	if (ix->names[slot]) {
+		cell = db->cells[ix->names[slot] - 1];
+		for (p = (struct kafs_cell_pos *)cell->pos; p->next; p = p->next)
+			;
+		if (p->final)
+			return 0;
+	} else {
+		cell = NULL;
+		p = NULL;
+	}
+
+	if (!ix->file || strcmp(ix->file, ev->file) != 0) {
+		ix->file = kafs_cellserv_save_string(ix, ev->file);
+		if (!ix->file)
+			goto nomem;
+	}
+
+	pos = kafs_profile_arena_alloc(ix->prof, sizeof(*pos));
+	if (!pos)
+		goto nomem;
+	pos->next	= NULL;
+	pos->file	= ix->file;
+	pos->offset	= ev->offset;
+	pos->line	= ev->line;
+	pos->final	= false;
+	ix->pos = pos;
+
+	if (p) {
+		p->next = pos;
+		return 0;
+	}
+
+	if (db->nr_cells >= ix->max_cells) {
+		unsigned int max = ix->max_cells * 2 ?: 64;
+
+		db = realloc(db, sizeof(*db) + max * sizeof(db->cells[0]));
+		if (!db)
+			goto nomem;
+		ix->db = db;
+		ix->max_cells = max;
+	}
+
+	cell = calloc(1, sizeof(*cell));
+	if (!cell)
+		goto nomem;
+	cell->usage = 1;
+	cell->name = kafs_cellserv_save_string(ix, ev->name);
+	if (!cell->name) {
+		free(cell);
+		goto nomem;
+	}
+	cell->borrowed_name = true;
+	cell->borrowed_desc = true;
+	cell->borrowed_realm = true;
+	cell->pos = pos;
+
+	ix->names[slot] = db->nr_cells + 1;
+	db->cells[db->nr_cells++] = cell;
+	return 0;
+
+nomem:
+	report->bad_error = true;
+	return report_error(report, "%m");
+}
+
+static int kafs_cellserv_index_event(const struct kafs_profile_event *ev,
+				     void *data,
+				     struct kafs_report *report)
+{
+	struct kafs_cellserv_indexer *ix = data;
+
+	if (ev->type == kafs_profile_event_section) {
+		ix->in_cells = strcmp(ev->name, "cells") == 0;
+		ix->in_cell = false;
+		return kafs_profile_build(&ix->build, ev, report);
+	}
+
+	if (!ix->in_cells)
+		return kafs_profile_build(&ix->build, ev, report);
+
+	if (ix->in_cell) {
+		if (ev->type == kafs_profile_event_close && ev->depth == 1) {
+			ix->in_cell = false;
+			if (ix->pos && ev->final)
+				ix->pos->final = true;
+		}
+		return 0;
+	}
+
+	if (ev->type != kafs_profile_event_open)
+		return kafs_profile_build(&ix->build, ev, report);
+
+	ix->in_cell = true;
+	return kafs_cellserv_index_def(ix, ev, report);
+}
+
+/*
+ * Build a cell database from config files without parsing the cell
+ * definitions.  The files are streamed and just the positions of the
+ * definitions are noted, each cell being read in from the files when it's first
+ * looked up with kafs_cellserv_find_cell2() or kafs_cellserv_materialise() is
+ * called.  The other sections are parsed into the profile tree, which the
+ * database borrows from and must outlast it.  The files mustn't be changed
+ * while the database is in use.
+ */
+struct kafs_cell_db *kafs_cellserv_stream_conf(struct kafs_profile *prof,
+					       const char *const *files,
+					       struct kafs_report *report)
+{
+	struct kafs_cellserv_indexer ix = {
+		.build.root	= prof,
+		.build.copy	= true,
+		.prof		= prof,
+	};
+
+	ix.db = calloc(1, sizeof(*ix.db));
+	if (!ix.db) {
+		report->bad_error = true;
+		report_error(report, "%m");
+		return NULL;
+	}
+
+	for (; *files; files++)
+		if (kafs_profile_stream(*files, 0, 0, kafs_cellserv_index_event,
+					&ix, report) < 0)
+			goto error;
+
+	if (!kafs_profile_find_first_child(prof, kafs_profile_value_is_list,
+					   "cells", report)) {
+		report_error(report, "Cannot find [cells] section");
+		goto error;
+	}
+
+	verbose(report, "Indexed %u cells", ix.db->nr_cells);
+	if (kafs_cellserv_index(ix.db, report) < 0)
+		goto error;
+	free(ix.names);
+	return ix.db;
+
+error:
+	free(ix.names);
+	kafs_free_cell_db(ix.db);
+	return NULL;
+}
+
+/*
+ * Look up a single cell in config files, reading them as a stream and
+ * building just the one cell.  Reading stops as soon as a definition of the
+ * cell that's marked final has been read.  If first_only is true, it stops
+ * after the first definition instead; that's quicker, but any later
+ * definitions that would be merged with it are missed.  The record doesn't
+ * borrow from anything.  NULL is returned if there's no such cell; -1 is
+ * stored in *_err if the files couldn't be read.
+ */
+struct kafs_cell *kafs_cellserv_stream_cell(const char *const *files,
+					    const char *cell_name,
+					    bool first_only,
+					    struct kafs_report *report,
+					    int *_err)
+{
+	struct kafs_cellserv_reader r;
+	struct kafs_cell *cell = NULL;
+	int ret = 0;
+
+	*_err = 0;
+	if (kafs_cellserv_init_reader(&r, cell_name, report) < 0)
+		goto error;
+	r.first_only = first_only;
+
+	for (; *files; files++) {
+		ret = kafs_profile_stream(*files, 0, 0, kafs_cellserv_read_event,
+					  &r, report);
+		if (ret != 0)
+			break;
+	}
+	if (ret < 0)
+		goto error;
+	if (!r.name)
+		goto out;
+
+	cell = calloc(1, sizeof(*cell));
+	if (!cell)
+		goto nomem;
+	cell->usage = 1;
+	cell->name = strdup(r.name);
+	if (!cell->name)
+		goto nomem;
+	if (kafs_cellserv_fill_from_reader(&r, cell, report) < 0)
+		goto error;
+
+out:
+	kafs_profile_free(&r.root);
+	return cell;
+
+nomem:
+	report->bad_error = true;
+	report_error(report, "%m");
+error:
+	if (cell)
+		kafs_free_cell(cell);
+	cell = NULL;
+	*_err = -1;
+	goto out;
+}
+
 static const char *const kafs_record_sources[nr__kafs_record_source] = {
 	[kafs_record_unavailable]	= "unavailable",
 	[kafs_record_from_config]	= "config",
@@ -391,10 +1326,17 @@ void kafs_dump_cell(const struct kafs_cell *cell)
 {
 	const struct kafs_server_list *vsl = cell->vlservers;
 
+	if (cell->node || cell->pos) {
+		printf("  - not yet parsed\n");
+		return;
+	}
+
 	if (!cell->use_dns)
 		printf("  - use-dns=no\n");
 	if (!cell->show_cell)
 		printf("  - show-cell=no\n");
+	if (cell->hot)
+		printf("  - hot\n");
 
 	if (vsl) {
 		printf("  - status: %s, from %s\n",
@@ -0,0 +1,935 @@
+/*
+ * Incremental config reloading.
+ *
+ * When a config is read with KAFS_READ_CONFIG_RELOADABLE, each file and
+ * directory that went into it is noted, along with the cells that each file
+ * contributed to as told by the provenance in the profile nodes.  When
+ * kafs_reload_config() is called, it looks to see which of the files have
+ * changed and, if those only define cells, just reparses them and rebuilds the
+ * cells they touch.  A rebuilt cell's definition is replayed from the changed
+ * files and from the parts of the old definition that came from the other
+ * files, in the order that the files are read, so that it comes out the same
+ * as a full reparse would make it.
+ *
+ * Anything else, such as a change to a file that has other sections in it or
+ * includes other files, causes the whole configuration to be read again.  So
+ * does a change to a file that marks a cell or anything in one final, either
+ * before or after the change, as the definitions from later files that the
+ * marker discards aren't recorded.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <kafs/cellserv.h>
+#include <kafs/profile.h>
+#include "lib_internal.h"
+
+#define KAFS_CONFIG_MAX_LAYERS	8	/* Max incremental reloads to stack up */
+
+#define verbose(r, fmt, ...)						\
+	do {								\
+		if ((r)->verbose)					\
+			(r)->verbose(fmt, ## __VA_ARGS__);		\
+	} while(0)
+
+static int kafs_config_cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int kafs_config_cmp_units(const void *a, const void *b)
+{
+	const struct kafs_config_unit *ua = *(const struct kafs_config_unit *const *)a;
+	const struct kafs_config_unit *ub = *(const struct kafs_config_unit *const *)b;
+
+	return strcmp(ua->path, ub->path);
+}
+
+/*
+ * State for attributing the parts of a profile to the files they came from.
+ */
+struct kafs_config_walk {
+	struct kafs_config	*config;
+	struct kafs_config_unit	**by_path;	/* File units in path order */
+	unsigned int		nr_files;
+	const char		*last_file;	/* The last file looked up */
+	struct kafs_config_unit	*last_unit;
+	unsigned int		*seen;		/* Cell last counted against each unit */
+	unsigned int		cell;
+	bool			fill;		/* T to fill in the cell lists */
+};
+
+static struct kafs_config_unit *kafs_config_find_unit(struct kafs_config_walk *w,
+						       const char *file)
+{
+	struct kafs_config_unit key = { .path = file }, *k = &key, **u;
+
+	/* Nodes from the same file share the filename string. */
+	if (file == w->last_file)
+		return w->last_unit;
+
+	u = bsearch(&k, w->by_path, w->nr_files, sizeof(w->by_path[0]),
+		    kafs_config_cmp_units);
+	w->last_file = file;
+	w->last_unit = u ? *u : NULL;
+	return w->last_unit;
+}
+
+/*
+ * Note that the files that supplied a subtree outside of [cells] can't be
+ * reparsed on their own.
+ */
+static void kafs_config_exclude(struct kafs_config_walk *w,
+				const struct kafs_profile *p)
+{
+	struct kafs_config_unit *u;
+	unsigned int i;
+
+	if (p->file) {
+		u = kafs_config_find_unit(w, p->file);
+		if (u)
+			u->incremental = false;
+	}
+	for (i = 0; i < p->nr_relations; i++)
+		kafs_config_exclude(w, p->relations[i]);
+}
+
+/*
+ * Note a cell against each of the files that contributed to its definition.
+ * A list that was marked final carries the name of the file that marked it.
+ */
+static void kafs_config_note_cell(struct kafs_config_walk *w,
+				  const struct kafs_profile *p,
+				  const char *name)
+{
+	struct kafs_config_unit *u;
+	unsigned int i;
+
+	if (p->file) {
+		u = kafs_config_find_unit(w, p->file);
+		if (u && p->final)
+			u->has_final = true;
+		if (u && w->seen[u - w->config->units] != w->cell) {
+			w->seen[u - w->config->units] = w->cell;
+			if (w->fill)
+				u->cells[u->nr_cells] = name;
+			u->nr_cells++;
+		}
+	}
+	for (i = 0; i < p->nr_relations; i++)
+		kafs_config_note_cell(w, p->relations[i], name);
+}
+
+/*
+ * Note the files and directories that a config was read from and the cells
+ * that each file contributed to so that the config can be reloaded
+ * incrementally.
+ */
+int kafs_config_note_units(struct kafs_config *config, struct kafs_report *report)
+{
+	const struct kafs_profile *prof = &config->profile, *cells, *r;
+	const struct kafs_profile_source *src;
+	struct kafs_config_walk w = { .config = config };
+	struct kafs_config_unit *u;
+	unsigned int nr = 0, total = 0, i;
+	int pass;
+
+	if (!prof->tree)
+		return 0;
+
+	for (src = prof->tree->sources; src; src = src->next)
+		nr++;
+	if (!nr)
+		return 0;
+
+	config->units = calloc(nr, sizeof(config->units[0]));
+	w.by_path = malloc(nr * sizeof(w.by_path[0]));
+	w.seen = calloc(nr, sizeof(w.seen[0]));
+	if (!config->units || !w.by_path || !w.seen)
+		goto nomem;
+	config->nr_units = nr;
+
+	/* A file can be reparsed by itself if it doesn't include anything. */
+	for (src = prof->tree->sources, u = config->units; src; src = src->next, u++) {
+		u->path		= src->path;
+		u->mtime	= src->mtime;
+		u->size		= src->size;
+		u->depth	= src->depth;
+		u->is_dir	= src->is_dir;
+		u->incremental	= (!src->is_dir && !src->is_root &&
+				   (!src->next || src->next->depth <= src->depth));
+		if (!u->is_dir)
+			w.by_path[w.nr_files++] = u;
+	}
+	qsort(w.by_path, w.nr_files, sizeof(w.by_path[0]), kafs_config_cmp_units);
+
+	/* ...and it only supplies cells. */
+	for (i = 0; i < prof->nr_relations; i++) {
+		r = prof->relations[i];
+		if (r->type == kafs_profile_value_is_list &&
+		    strcmp(r->name, "cells") == 0 &&
+		    !r->final)
+			continue;
+		kafs_config_exclude(&w, r);
+	}
+
+	cells = kafs_profile_find_first_child(prof, kafs_profile_value_is_list,
+					      "cells", report);
+	if (!cells)
+		goto out;
+	if (cells->final)
+		kafs_config_exclude(&w, cells);
+
+	/* Count the cells each file contributes to and then list them. */
+	for (pass = 0; pass < 2; pass++) {
+		w.fill = pass;
+		w.cell = 0;
+		for (i = 0; i < cells->nr_relations; i++) {
+			r = cells->relations[i];
+			if (r->type != kafs_profile_value_is_list)
+				continue;
+			w.cell++;
+			kafs_config_note_cell(&w, r, r->name);
+		}
+
+		if (pass > 0)
+			break;
+
+		for (i = 0; i < nr; i++)
+			total += config->units[i].nr_cells;
+		config->unit_cells = malloc((total ?: 1) * sizeof(config->unit_cells[0]));
+		if (!config->unit_cells)
+			goto nomem;
+		total = 0;
+		for (i = 0; i < nr; i++) {
+			u = &config->units[i];
+			u->cells = config->unit_cells + total;
+			total += u->nr_cells;
+			u->nr_cells = 0;
+		}
+		memset(w.seen, 0, nr * sizeof(w.seen[0]));
+	}
+
+	for (i = 0; i < nr; i++) {
+		u = &config->units[i];
+		qsort(u->cells, u->nr_cells, sizeof(u->cells[0]), kafs_config_cmp_names);
+	}
+
+out:
+	free(w.by_path);
+	free(w.seen);
+	return 0;
+
+nomem:
+	free(w.by_path);
+	free(w.seen);
+	report->bad_error = true;
+	report->error("%m");
+	return -1;
+}
+
+/*
+ * Free the provenance attached to a config.
+ */
+void kafs_config_free_units(struct kafs_config *config)
+{
+	struct kafs_config_unit *u;
+	unsigned int i;
+
+	for (i = 0; i < config->nr_units; i++) {
+		u = &config->units[i];
+		if (u->own_path)
+			free((char *)u->path);
+		if (u->own_cells)
+			free(u->cells);
+	}
+	free(config->units);
+	free(config->unit_cells);
+	free(config->changed);
+}
+
+/*
+ * The state of a reload.
+ */
+struct kafs_reload {
+	struct kafs_config	*old;
+	struct kafs_config	*new;
+	struct kafs_report	*report;
+	struct kafs_report	quiet;		/* For things that get reparsed */
+	struct kafs_config_unit	*units;		/* The new list of units */
+	struct kafs_profile	**frags;	/* Reparsed file for each unit or NULL */
+	unsigned int		nr_units;
+	unsigned int		max_units;
+	const char		**names;	/* Cells that may have changed */
+	unsigned int		nr_names;
+	unsigned int		max_names;
+	bool			changed;	/* T if any file has changed */
+	bool			full;		/* T if a full reload is needed */
+};
+
+/*
+ * Errors found whilst reparsing a file are left to the full reload that they
+ * provoke to report.
+ */
+static __thread bool kafs_reload_complained;
+
+static void kafs_reload_quiet(const char *fmt, ...)
+{
+	kafs_reload_complained = true;
+}
+
+static struct kafs_config_unit *kafs_reload_add_unit(struct kafs_reload *r,
+						      const struct kafs_config_unit *from)
+{
+	struct kafs_config_unit *u;
+
+	if (r->nr_units >= r->max_units) {
+		struct kafs_profile **frags;
+		unsigned int max = r->max_units * 2 ?: 16;
+
+		u = realloc(r->units, max * sizeof(r->units[0]));
+		if (!u)
+			return NULL;
+		r->units = u;
+		frags = realloc(r->frags, max * sizeof(r->frags[0]));
+		if (!frags)
+			return NULL;
+		r->frags = frags;
+		r->max_units = max;
+	}
+
+	u = &r->units[r->nr_units];
+	*u = *from;
+	u->own_path = false;
+	u->own_cells = false;
+	r->frags[r->nr_units] = NULL;
+	r->nr_units++;
+	return u;
+}
+
+static int kafs_reload_add_names(struct kafs_reload *r,
+				 const char *const *names, unsigned int nr)
+{
+	if (!nr)
+		return 0;
+	if (r->nr_names + nr > r->max_names) {
+		unsigned int max = r->max_names * 2 ?: 16;
+		const char **p;
+
+		while (max < r->nr_names + nr)
+			max *= 2;
+		p = realloc(r->names, max * sizeof(r->names[0]));
+		if (!p)
+			return -1;
+		r->names = p;
+		r->max_names = max;
+	}
+
+	memcpy(r->names + r->nr_names, names, nr * sizeof(names[0]));
+	r->nr_names += nr;
+	return 0;
+}
+
+/*
+ * See if anything in a subtree is marked final.
+ */
+static bool kafs_reload_has_final(const struct kafs_profile *p)
+{
+	unsigned int i;
+
+	if (p->final)
+		return true;
+	for (i = 0; i < p->nr_relations; i++)
+		if (kafs_reload_has_final(p->relations[i]))
+			return true;
+	return false;
+}
+
+/*
+ * Reparse the file behind the most recently added unit and note the cells it
+ * now defines.  If the file has anything in it that can't be dealt with
+ * incrementally, a full reload is called for instead.
+ */
+static int kafs_reload_parse(struct kafs_reload *r)
+{
+	struct kafs_config_unit *u = &r->units[r->nr_units - 1];
+	const struct kafs_profile *cells, *c;
+	struct kafs_profile *frag;
+	unsigned int i;
+
+	frag = calloc(1, sizeof(*frag));
+	if (!frag)
+		return -1;
+	frag->name = "<kafsconfig>";
+	r->frags[r->nr_units - 1] = frag;
+
+	kafs_reload_complained = false;
+	if (kafs_profile_parse_file(frag, u->path, &r->quiet) < 0 ||
+	    kafs_reload_complained ||
+	    !frag->tree || !frag->tree->sources ||
+	    frag->tree->sources->next)
+		goto full;
+
+	u->mtime = frag->tree->sources->mtime;
+	u->size = frag->tree->sources->size;
+
+	for (i = 0; i < frag->nr_relations; i++) {
+		c = frag->relations[i];
+		if (c->type != kafs_profile_value_is_list ||
+		    strcmp(c->name, "cells") != 0 ||
+		    c->final)
+			goto full;
+	}
+
+	u->cells = NULL;
+	u->nr_cells = 0;
+	u->has_final = false;
+	cells = kafs_profile_find_first_child(frag, kafs_profile_value_is_list,
+					      "cells", &r->quiet);
+	if (!cells)
+		return 0;
+	if (kafs_reload_has_final(cells))
+		goto full;
+
+	u->cells = malloc((cells->nr_relations ?: 1) * sizeof(u->cells[0]));
+	if (!u->cells)
+		return -1;
+	u->own_cells = true;
+	for (i = 0; i < cells->nr_relations; i++) {
+		c = cells->relations[i];
+		if (c->type == kafs_profile_value_is_list)
+			u->cells[u->nr_cells++] = c->name;
+	}
+	qsort(u->cells, u->nr_cells, sizeof(u->cells[0]), kafs_config_cmp_names);
+	return kafs_reload_add_names(r, u->cells, u->nr_cells);
+
+full:
+	verbose(r->report, "%s: Can't be reloaded on its own", u->path);
+	r->full = true;
+	return 0;
+}
+
+static bool kafs_reload_same(const struct kafs_config_unit *u, const struct stat *st)
+{
+	return (st->st_mtim.tv_sec == u->mtime.tv_sec &&
+		st->st_mtim.tv_nsec == u->mtime.tv_nsec &&
+		st->st_size == u->size);
+}
+
+/*
+ * Check a file for changes.
+ */
+static int kafs_reload_scan_file(struct kafs_reload *r,
+				 const struct kafs_config_unit *u)
+{
+	struct stat st;
+
+	if (stat(u->path, &st) == -1) {
+		r->full = true;
+		return 0;
+	}
+
+	if (!kafs_reload_add_unit(r, u))
+		return -1;
+	if (kafs_reload_same(u, &st))
+		return 0;
+
+	verbose(r->report, "%s: Changed", u->path);
+	r->changed = true;
+	if (!u->incremental || u->has_final) {
+		r->full = true;
+		return 0;
+	}
+	if (kafs_reload_add_names(r, u->cells, u->nr_cells) < 0)
+		return -1;
+	return kafs_reload_parse(r);
+}
+
+/*
+ * Check a directory for files that have been added or removed, and check the
+ * files in it for changes.  Returns the index of the next unit to look at.
+ */
+static int kafs_reload_scan_dir(struct kafs_reload *r, unsigned int i)
+{
+	const struct kafs_config_unit *units = r->old->units, *dir = &units[i], *u;
+	struct kafs_config_unit added = {}, *nu;
+	struct dirent *de;
+	struct stat st;
+	char **files = NULL, **tmp;
+	unsigned int nr_files = 0, max_files = 0, end, k;
+	DIR *d;
+	int cmp, n;
+
+	if (stat(dir->path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		r->full = true;
+		return i + 1;
+	}
+
+	nu = kafs_reload_add_unit(r, dir);
+	if (!nu)
+		return -1;
+	if (kafs_reload_same(dir, &st))
+		return i + 1;
+
+	/* The directory's files follow it, unless they include things. */
+	verbose(r->report, "%s: Changed", dir->path);
+	for (end = i + 1; end < r->old->nr_units && units[end].depth > dir->depth; end++) {
+		if (units[end].depth > dir->depth + 1 || units[end].is_dir) {
+			r->full = true;
+			return end;
+		}
+	}
+
+	d = opendir(dir->path);
+	if (!d) {
+		r->full = true;
+		return end;
+	}
+
+	if (fstat(dirfd(d), &st) == -1)
+		goto error_dir;
+	nu->mtime = st.st_mtim;
+	nu->size = st.st_size;
+
+	while (errno = 0,
+	       (de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		n = strlen(de->d_name);
+		if (n < 1 || de->d_name[n - 1] == '~')
+			continue;
+
+		if (nr_files >= max_files) {
+			max_files = max_files * 2 ?: 16;
+			tmp = realloc(files, max_files * sizeof(files[0]));
+			if (!tmp)
+				goto error_dir;
+			files = tmp;
+		}
+		if (asprintf(&files[nr_files], "%s/%s", dir->path, de->d_name) == -1)
+			goto error_dir;
+		nr_files++;
+	}
+	if (errno != 0)
+		goto error_dir;
+	closedir(d);
+
+	qsort(files, nr_files, sizeof(files[0]), kafs_config_cmp_names);
+
+	/* Merge the listing with the files we had before. */
+	k = 0;
+	i++;
+	while (!r->full && (i < end || k < nr_files)) {
+		u = i < end ? &units[i] : NULL;
+		cmp = !u ? 1 : k >= nr_files ? -1 : strcmp(u->path, files[k]);
+
+		if (cmp == 0) {
+			if (kafs_reload_scan_file(r, u) < 0)
+				goto error;
+			free(files[k]);
+			i++;
+			k++;
+		} else if (cmp < 0) {
+			verbose(r->report, "%s: Removed", u->path);
+			r->changed = true;
+			if (!u->incremental || u->has_final)
+				r->full = true;
+			else if (kafs_reload_add_names(r, u->cells, u->nr_cells) < 0)
+				goto error;
+			i++;
+		} else {
+			verbose(r->report, "%s: Added", files[k]);
+			r->changed = true;
+			added.path = files[k];
+			added.depth = dir->depth + 1;
+			added.incremental = true;
+			nu = kafs_reload_add_unit(r, &added);
+			if (!nu)
+				goto error;
+			nu->own_path = true;
+			k++;
+			if (kafs_reload_parse(r) < 0)
+				goto error;
+		}
+	}
+
+	for (; k < nr_files; k++)
+		free(files[k]);
+	free(files);
+	return end;
+
+error_dir:
+	closedir(d);
+	k = 0;
+error:
+	for (; k < nr_files; k++)
+		free(files[k]);
+	free(files);
+	return -1;
+}
+
+/*
+ * Find out which of the files that went into the old config have changed.
+ */
+static int kafs_reload_scan(struct kafs_reload *r)
+{
+	unsigned int i = 0;
+	int next;
+
+	while (i < r->old->nr_units && !r->full) {
+		if (r->old->units[i].is_dir) {
+			next = kafs_reload_scan_dir(r, i);
+			if (next < 0)
+				return -1;
+			i = next;
+		} else {
+			if (kafs_reload_scan_file(r, &r->old->units[i]) < 0)
+				return -1;
+			i++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * A replacement for a cell in the old database.
+ */
+struct kafs_reload_cell {
+	unsigned int		nr;		/* Old cell nr + 1 or 0 if new */
+	struct kafs_cell	*cell;		/* Replacement or NULL if deleted */
+};
+
+static int kafs_reload_cmp_cells(const void *a, const void *b)
+{
+	const struct kafs_reload_cell *ca = a, *cb = b;
+
+	return (ca->nr > cb->nr) - (ca->nr < cb->nr);
+}
+
+/*
+ * Rebuild a cell's definition from the files that now contribute to it, in the
+ * order that they're read.
+ */
+static int kafs_reload_cell(struct kafs_reload *r, struct kafs_profile *cells,
+			    const char *name, const struct kafs_cell *old,
+			    struct kafs_profile **_def)
+{
+	struct kafs_profile *root = &r->new->profile, *def = NULL, *c;
+	const struct kafs_profile *from, *fcells;
+	const struct kafs_config_unit *u;
+	const char *file;
+	unsigned int i;
+
+	for (i = 0; i < r->nr_units; i++) {
+		u = &r->units[i];
+		if (r->frags[i]) {
+			fcells = kafs_profile_find_first_child(r->frags[i],
+							       kafs_profile_value_is_list,
+							       "cells", &r->quiet);
+			from = fcells ? kafs_profile_find_first_child(fcells,
+								      kafs_profile_value_is_list,
+								      name, &r->quiet) : NULL;
+			if (!from)
+				continue;
+			file = NULL;
+		} else {
+			if (!bsearch(&name, u->cells, u->nr_cells, sizeof(u->cells[0]),
+				     kafs_config_cmp_names))
+				continue;
+			if (!u->incremental || !old || !old->def) {
+				r->full = true;
+				return 0;
+			}
+			from = old->def;
+			file = u->path;
+		}
+
+		c = kafs_profile_add_list(root, cells, name, r->report);
+		if (!c)
+			return -1;
+		if (c->dummy)
+			continue;
+		def = c;
+		if (!file || (from->file && strcmp(from->file, file) == 0)) {
+			c->file = from->file;
+			c->line = from->line;
+		}
+		if (kafs_profile_copy(root, c, from, file, r->report) < 0)
+			return -1;
+		if (from->final && (!file || (from->file && strcmp(from->file, file) == 0)))
+			c->final = true;
+	}
+
+	*_def = def;
+	return 0;
+}
+
+/*
+ * Make the new config's cell database from the old one with the changed cells
+ * replaced, removed or added.  The unchanged cells are shared.
+ */
+static int kafs_reload_db(struct kafs_reload *r, struct kafs_reload_cell *repl,
+			  unsigned int nr_repl)
+{
+	const struct kafs_cell_db *old = r->old->db;
+	struct kafs_cell_db *db;
+	unsigned int nr_add = 0, nr_del = 0, i, k, n;
+
+	qsort(repl, nr_repl, sizeof(repl[0]), kafs_reload_cmp_cells);
+	for (k = 0; k < nr_repl; k++) {
+		if (!repl[k].nr)
+			nr_add++;
+		else if (!repl[k].cell)
+			nr_del++;
+	}
+
+	db = malloc(sizeof(*db) + (old->nr_cells + nr_add) * sizeof(db->cells[0]));
+	if (!db)
+		return -1;
+	db->nr_cells = 0;
+	db->index_mask = 0;
+	db->index = NULL;
+	db->image_config = NULL;
+	r->new->db = db;
+
+	n = 0;
+	k = nr_add;
+	for (i = 0; i < old->nr_cells; i++) {
+		if (k < nr_repl && repl[k].nr == i + 1) {
+			if (repl[k].cell)
+				db->cells[n++] = repl[k].cell;
+			repl[k].cell = NULL;
+			k++;
+		} else {
+			/* The database's ref doesn't pin the old config. */
+			__atomic_add_fetch(&old->cells[i]->usage, 1, __ATOMIC_RELAXED);
+			db->cells[n++] = old->cells[i];
+		}
+		db->nr_cells = n;
+	}
+
+	if (!nr_del && old->index) {
+		db->index = malloc((old->index_mask + 1) * sizeof(db->index[0]));
+		if (!db->index)
+			goto error;
+		memcpy(db->index, old->index, (old->index_mask + 1) * sizeof(db->index[0]));
+		db->index_mask = old->index_mask;
+	}
+
+	for (k = 0; k < nr_add; k++) {
+		db->cells[n] = repl[k].cell;
+		repl[k].cell = NULL;
+		db->nr_cells = ++n;
+		if (db->index && kafs_cellserv_index_add(db, n - 1, r->report) < 0)
+			goto error;
+	}
+
+	if (!db->index && kafs_cellserv_index(db, r->report) < 0)
+		goto error;
+	return 0;
+
+error:
+	for (; k < nr_repl; k++)
+		if (repl[k].cell)
+			kafs_free_cell(repl[k].cell);
+	return -1;
+}
+
+/*
+ * Build the rest of the new config once the changes are known.
+ */
+static int kafs_reload_build(struct kafs_reload *r)
+{
+	struct kafs_config *old = r->old, *new = r->new;
+	struct kafs_reload_cell *repl;
+	struct kafs_profile *cells, *def;
+	const struct kafs_cell *oc;
+	unsigned int nr_repl = 0, i, j, nr;
+	int ret = -1;
+
+	/* Weed out the repeats in the list of cells that may have changed. */
+	if (r->nr_names)
+		qsort(r->names, r->nr_names, sizeof(r->names[0]), kafs_config_cmp_names);
+	for (i = 0, j = 0; i < r->nr_names; i++)
+		if (j == 0 || strcmp(r->names[i], r->names[j - 1]) != 0)
+			r->names[j++] = r->names[i];
+	r->nr_names = j;
+
+	/* Replaying a large part of the config costs more than rereading it. */
+	if (r->nr_names > old->db->nr_cells / 4 + 64) {
+		r->full = true;
+		return 0;
+	}
+
+	repl = calloc(r->nr_names ?: 1, sizeof(repl[0]));
+	if (!repl)
+		return -1;
+
+	cells = kafs_profile_add_list(&new->profile, &new->profile, "cells", r->report);
+	if (!cells)
+		goto out;
+
+	for (i = 0; i < r->nr_names; i++) {
+		nr = kafs_cellserv_find_nr(old->db, r->names[i]);
+		oc = nr ? old->db->cells[nr - 1] : NULL;
+		if (oc && (strcmp(oc->name, r->names[i]) != 0 || !oc->def))
+			goto full;
+
+		def = NULL;
+		if (kafs_reload_cell(r, cells, r->names[i], oc, &def) < 0)
+			goto out;
+		if (r->full)
+			goto full;
+		if (!def && !oc)
+			continue;
+
+		repl[nr_repl].nr = nr;
+		if (def) {
+			kafs_reload_complained = false;
+			repl[nr_repl].cell = kafs_cellserv_new_cell(def, old->flags, &r->quiet);
+			if (!repl[nr_repl].cell || kafs_reload_complained) {
+				if (repl[nr_repl].cell)
+					kafs_free_cell(repl[nr_repl].cell);
+				goto full;
+			}
+			repl[nr_repl].cell->config = new;
+		}
+		nr_repl++;
+	}
+
+	/* The cells borrow from the reparsed files. */
+	for (i = 0; i < r->nr_units; i++)
+		if (r->frags[i] && kafs_profile_take(&new->profile, r->frags[i]) < 0)
+			goto out;
+
+	ret = kafs_reload_db(r, repl, nr_repl);
+	nr_repl = 0;
+	goto out;
+
+full:
+	r->full = true;
+	ret = 0;
+out:
+	for (i = 0; i < nr_repl; i++)
+		if (repl[i].cell)
+			kafs_free_cell(repl[i].cell);
+	free(repl);
+	return ret;
+}
+
+/*
+ * Reload a config, reparsing only the files that have changed if that's
+ * possible.  The config must have been read with KAFS_READ_CONFIG_RELOADABLE
+ * for that; otherwise, or if the changes aren't confined to cell definitions,
+ * the whole configuration is read again.  If nothing has changed, a new
+ * reference to the old config is returned.
+ *
+ * A config reloaded incrementally has the old config as its base and lists
+ * the cells that differ from the base's; the caller gets the only reference to
+ * it.  NULL is returned on error, in which case the old config is still good.
+ */
+struct kafs_config *kafs_reload_config(struct kafs_config *config,
+				       struct kafs_report *report)
+{
+	struct kafs_reload r = {
+		.old	= config,
+		.report	= report,
+		.quiet	= {
+			.error		= kafs_reload_quiet,
+			.verbose	= report->verbose2,
+		},
+	};
+	struct kafs_config *new = NULL;
+	unsigned long long start;
+	unsigned int i;
+	int ret = -1;
+
+	if (!config->units || !config->db)
+		return kafs_new_config((const char *const *)config->files,
+				       config->flags, report);
+
+	if (kafs_reload_scan(&r) < 0)
+		goto nomem;
+	if (r.full)
+		goto full;
+
+	if (!r.changed) {
+		new = kafs_get_config(config);
+		goto out;
+	}
+
+	if (config->layers >= KAFS_CONFIG_MAX_LAYERS)
+		goto full;
+
+	start = kafs_stats_start(report);
+	new = calloc(1, sizeof(*new));
+	if (!new)
+		goto nomem;
+	new->usage	= 1;
+	new->serial	= kafs_config_new_serial();
+	new->profile.name = "<kafsconfig>";
+	new->this_cell	= config->this_cell;
+	new->sysname	= config->sysname;
+	new->addr_family = config->addr_family;
+	new->flags	= config->flags;
+	new->files	= config->files;	/* Pinned by the base */
+	new->base	= kafs_get_config(config);
+	new->layers	= config->layers + 1;
+	r.new = new;
+
+	ret = kafs_reload_build(&r);
+	if (ret < 0 || r.full) {
+		new->files = NULL;
+		kafs_put_config(new);
+		new = NULL;
+		if (ret < 0)
+			goto nomem;
+		goto full;
+	}
+
+	new->units	= r.units;
+	new->nr_units	= r.nr_units;
+	new->changed	= r.names;
+	new->nr_changed	= r.nr_names;
+	r.units		= NULL;
+	r.names		= NULL;
+	verbose(report, "Reloaded %u cells", new->nr_changed);
+	kafs_stats_end(report, kafs_stats_config, start);
+	goto out;
+
+full:
+	verbose(report, "Reading the whole configuration again");
+	new = kafs_new_config((const char *const *)config->files, config->flags, report);
+	goto out;
+
+nomem:
+	report->bad_error = true;
+	report->error("%m");
+out:
+	for (i = 0; r.units && i < r.nr_units; i++) {
+		if (r.units[i].own_path)
+			free((char *)r.units[i].path);
+		if (r.units[i].own_cells)
+			free(r.units[i].cells);
+	}
+	for (i = 0; i < r.nr_units; i++) {
+		if (r.frags[i]) {
+			kafs_profile_free(r.frags[i]);
+			free(r.frags[i]);
+		}
+	}
+	free(r.units);
+	free(r.frags);
+	free(r.names);
+	return new;
+}
@@ -36,14 +36,21 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <resolv.h>
 #include <netdb.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <arpa/nameser.h>
 #include <kafs/cellserv.h>
+#include "lib_internal.h"
 #include "dns_resolver.h"
 
 #define AFS_VL_PORT		7003	/* volume location service port */
@@ -55,30 +62,77 @@
 	} while(0)
 
 /*
- * Perform address resolution on a hostname and add the resulting address as a
- * string to the list of payload segments.
+ * Set up the hints for looking up a server's addresses.
  */
-static int kafs_resolve_addrs(struct kafs_server *server,
-			      int socktype,
-			      struct kafs_lookup_context *ctx)
+static void kafs_addr_hints(struct addrinfo *hints, int socktype,
+			    const struct kafs_lookup_context *ctx)
 {
-	struct kafs_server_addr *addr;
-	struct addrinfo hints, *addrs, *ai;
-	int ret, count = 0;
+	memset(hints, 0, sizeof(*hints));
+	hints->ai_socktype = socktype;
+	if (ctx->want_ipv4_addrs && !ctx->want_ipv6_addrs)
+		hints->ai_family = AF_INET;
+	else if (ctx->want_ipv6_addrs && !ctx->want_ipv4_addrs)
+		hints->ai_family = AF_INET6;
+}
 
-	verbose("Resolve '%s'", server->name);
+/*
+ * Look up a host's addresses through the context's resolver, if it has one,
+ * or through libc.
+ */
+static int kafs_getaddrinfo(const struct kafs_resolver *resolver,
+			    const char *node, const struct addrinfo *hints,
+			    struct addrinfo **_result)
+{
+	if (resolver)
+		return resolver->getaddrinfo(resolver, node, hints, _result);
+	return getaddrinfo(node, NULL, hints, _result);
+}
 
-	server->source = kafs_record_from_nss;
+static void kafs_freeaddrinfo(const struct kafs_resolver *resolver,
+			      struct addrinfo *res)
+{
+	if (resolver)
+		resolver->freeaddrinfo(resolver, res);
+	else
+		freeaddrinfo(res);
+}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_socktype = socktype;
-	if (ctx->want_ipv4_addrs && !ctx->want_ipv6_addrs)
-		hints.ai_family = AF_INET;
-	else if (ctx->want_ipv6_addrs && !ctx->want_ipv4_addrs)
-		hints.ai_family = AF_INET6;
+/*
+ * Get a reference on a resolver for a lookup that may outlive its caller.
+ */
+static const struct kafs_resolver *kafs_get_resolver(const struct kafs_resolver *resolver)
+{
+	if (resolver && resolver->release)
+		__atomic_add_fetch(&((struct kafs_resolver *)resolver)->usage, 1,
+				   __ATOMIC_RELAXED);
+	return resolver;
+}
+
+/*
+ * Drop a reference on a resolver, releasing it when the last one goes.
+ */
+void kafs_put_resolver(const struct kafs_resolver *resolver)
+{
+	struct kafs_resolver *r = (struct kafs_resolver *)resolver;
+
+	if (r && r->release &&
+	    __atomic_sub_fetch(&r->usage, 1, __ATOMIC_ACQ_REL) == 0)
+		r->release(r);
+}
+
+/*
+ * Add the outcome of address resolution on a hostname to the server record.
+ */
+static int kafs_store_addrs(struct kafs_server *server, int ret,
+			    struct addrinfo *addrs,
+			    struct kafs_lookup_context *ctx)
+{
+	struct kafs_server_addr *addr;
+	struct addrinfo *ai;
+	int count = 0;
+
+	server->source = kafs_record_from_nss;
 
-	/* resolve name to ip */
-	ret = getaddrinfo(server->name, NULL, &hints, &addrs);
 	if (ret) {
 		verbose("%s: getaddrinfo() = %d", server->name, ret);
 		switch (ret) {
@@ -154,11 +208,238 @@ static int kafs_resolve_addrs(struct kafs_server *server,
 		}
 	}
 
-	freeaddrinfo(addrs);
+	kafs_freeaddrinfo(ctx->resolver, addrs);
 	return 0;
 
+system_error:
+	if (addrs)
+		kafs_freeaddrinfo(ctx->resolver, addrs);
+	ctx->report.bad_error = true;
+	return -1;
+}
+
+/*
+ * Perform address resolution on a hostname and add the resulting address as a
+ * string to the list of payload segments.
+ */
+static int kafs_resolve_addrs(struct kafs_server *server,
+			      int socktype,
+			      struct kafs_lookup_context *ctx)
+{
+	struct addrinfo hints, *addrs = NULL;
+	int ret;
+
+	verbose("Resolve '%s'", server->name);
+
+	/* resolve name to ip */
+	kafs_addr_hints(&hints, socktype, ctx);
+	ret = kafs_getaddrinfo(ctx->resolver, server->name, &hints, &addrs);
+	return kafs_store_addrs(server, ret, addrs, ctx);
+}
+
+#define KAFS_ADDR_LOOKUP_MAX_THREADS 16	/* Most threads per batch of lookups */
+
+/*
+ * A batch of address lookups running in parallel on up to
+ * KAFS_ADDR_LOOKUP_MAX_THREADS threads, each of which takes names from the
+ * batch until there are none left.  The batch is shared between the caller
+ * and the lookup threads and is freed by whoever drops the last reference, as
+ * the caller may give up waiting before all the lookups have finished.  Once
+ * it has given up, no more lookups are started.  The batch holds a reference
+ * on the resolver for the lookups that are still running.
+ */
+struct kafs_addr_req {
+	char			*name;
+	struct addrinfo		*result;
+	int			ret;
+	bool			done;
+};
+
+struct kafs_addr_batch {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		usage;		/* Caller + running threads */
+	unsigned int		pending;	/* Lookups not yet done */
+	unsigned int		next;		/* Next lookup to start */
+	unsigned int		nr;
+	bool			abandoned;	/* Caller stopped waiting */
+	struct addrinfo		hints;
+	const struct kafs_resolver *resolver;
+	struct kafs_addr_req	reqs[];
+};
+
+static void kafs_put_addr_batch(struct kafs_addr_batch *b)
+{
+	unsigned int i, usage;
+
+	pthread_mutex_lock(&b->lock);
+	usage = --b->usage;
+	pthread_mutex_unlock(&b->lock);
+	if (usage > 0)
+		return;
+
+	for (i = 0; i < b->nr; i++) {
+		if (b->reqs[i].result)
+			kafs_freeaddrinfo(b->resolver, b->reqs[i].result);
+		free(b->reqs[i].name);
+	}
+	kafs_put_resolver(b->resolver);
+	pthread_cond_destroy(&b->cond);
+	pthread_mutex_destroy(&b->lock);
+	free(b);
+}
+
+/*
+ * Do lookups from a batch until there are none left to start or the caller
+ * has stopped waiting.
+ */
+static void kafs_addr_lookup_work(struct kafs_addr_batch *b)
+{
+	struct kafs_addr_req *req;
+	struct addrinfo *result;
+	int ret;
+
+	pthread_mutex_lock(&b->lock);
+	while (!b->abandoned && b->next < b->nr) {
+		req = &b->reqs[b->next++];
+		pthread_mutex_unlock(&b->lock);
+
+		result = NULL;
+		ret = kafs_getaddrinfo(b->resolver, req->name, &b->hints, &result);
+
+		pthread_mutex_lock(&b->lock);
+		req->ret = ret;
+		req->result = result;
+		req->done = true;
+		b->pending--;
+		pthread_cond_signal(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void *kafs_addr_lookup_thread(void *data)
+{
+	struct kafs_addr_batch *b = data;
+
+	kafs_addr_lookup_work(b);
+	kafs_put_addr_batch(b);
+	return NULL;
+}
+
+/*
+ * Look up the addresses of all the servers in a list in parallel, waiting no
+ * longer than the context's address lookup timeout for them.  Servers that
+ * haven't been resolved by the time we give up are marked as having suffered
+ * a temporary failure.
+ */
+static int kafs_resolve_addrs_parallel(struct kafs_server_list *sl,
+				       int socktype,
+				       struct kafs_lookup_context *ctx)
+{
+	struct kafs_addr_batch *b;
+	struct kafs_addr_req *req;
+	struct timespec deadline;
+	pthread_condattr_t cattr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned int i, nr_threads, nr_started = 0;
+	int err = 0;
+
+	b = calloc(1, sizeof(*b) + sl->nr_servers * sizeof(b->reqs[0]));
+	if (!b)
+		goto system_error;
+
+	b->nr = sl->nr_servers;
+	b->usage = 1;
+	b->pending = b->nr;
+	kafs_addr_hints(&b->hints, socktype, ctx);
+	for (i = 0; i < b->nr; i++) {
+		b->reqs[i].name = strdup(sl->servers[i].name);
+		if (!b->reqs[i].name)
+			goto system_error_free;
+		verbose("Resolve '%s'", b->reqs[i].name);
+	}
+	b->resolver = kafs_get_resolver(ctx->resolver);
+
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&b->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec  += ctx->addr_lookup_timeout / 1000;
+	deadline.tv_nsec += (ctx->addr_lookup_timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	nr_threads = b->nr;
+	if (nr_threads > KAFS_ADDR_LOOKUP_MAX_THREADS)
+		nr_threads = KAFS_ADDR_LOOKUP_MAX_THREADS;
+	for (i = 0; i < nr_threads; i++) {
+		pthread_mutex_lock(&b->lock);
+		b->usage++;
+		pthread_mutex_unlock(&b->lock);
+
+		if (pthread_create(&thread, &attr, kafs_addr_lookup_thread, b) != 0) {
+			pthread_mutex_lock(&b->lock);
+			b->usage--;
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		nr_started++;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	/* If we couldn't start any threads, do the lookups ourselves. */
+	if (!nr_started)
+		kafs_addr_lookup_work(b);
+
+	pthread_mutex_lock(&b->lock);
+	while (b->pending > 0) {
+		if (!ctx->addr_lookup_timeout)
+			pthread_cond_wait(&b->cond, &b->lock);
+		else if (pthread_cond_timedwait(&b->cond, &b->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	b->abandoned = true;
+
+	/* Take the results that are in.  Anything still outstanding is left
+	 * for the lookup thread to clean up.
+	 */
+	for (i = 0; i < b->nr; i++) {
+		struct kafs_server *server = &sl->servers[i];
+
+		req = &b->reqs[i];
+		if (req->done) {
+			if (kafs_store_addrs(server, req->ret, req->result, ctx) < 0)
+				err = -1;
+			req->result = NULL;
+			continue;
+		}
+
+		verbose("%s: Address lookup timed out", server->name);
+		server->source = kafs_record_from_nss;
+		server->status = kafs_lookup_got_temp_failure;
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	kafs_put_addr_batch(b);
+	return err;
+
+system_error_free:
+	for (i = 0; i < b->nr; i++)
+		free(b->reqs[i].name);
+	free(b);
 system_error:
 	ctx->report.bad_error = true;
+	ctx->report.error("%m");
 	return -1;
 }
 
@@ -169,8 +450,9 @@ int kafs_dns_lookup_addresses(struct kafs_server_list *ss,
 			      struct kafs_lookup_context *ctx)
 {
 	struct kafs_server *server;
+	unsigned long long start;
 	unsigned int i;
-	int ret;
+	int ret = 0;
 
 	if (ss) {
 		verbose("NR_SERVERS %u", ss->nr_servers);
@@ -180,22 +462,780 @@ int kafs_dns_lookup_addresses(struct kafs_server_list *ss,
 			return 0;
 		}
 
-		for (i = 0; i < ss->nr_servers; i++) {
-			server = &ss->servers[i];
+		start = kafs_stats_start(&ctx->report);
+
+		if (ctx->parallel_addr_lookup && ss->nr_servers > 1) {
+			ret = kafs_resolve_addrs_parallel(ss, SOCK_DGRAM, ctx);
+		} else {
+			for (i = 0; i < ss->nr_servers; i++) {
+				server = &ss->servers[i];
+
+				/* Turn the hostname into IP addresses */
+				if (kafs_resolve_addrs(server, SOCK_DGRAM, ctx))
+					verbose("AFSDB RR can't resolve. subtype:1, server name:%s",
+						server->name);
+				else
+					verbose("NR_ADDRS %u", server->nr_addrs);
+			}
+		}
+
+		kafs_stats_end(&ctx->report, kafs_stats_addrs, start);
+		for (i = 0; i < ss->nr_servers; i++)
+			kafs_stats_result(&ctx->report, kafs_stats_addrs,
+					  ss->servers[i].status);
+	}
+
+	return ret;
+}
+
+/*
+ * The query engine.  Queries are sent over UDP with an EDNS0 OPT record so
+ * that nameservers can give us answers bigger than 512 bytes.  There's one
+ * connected socket per nameserver and all the queries made through a lookup
+ * context share it, being matched up with their responses by ID and question.
+ * A connected socket is used so that we hear about ICMP errors.  Truncated
+ * answers are fetched by pipelining the queries over a TCP connection, which
+ * may be kept open between lookups if the context asks for that.
+ */
+#define KAFS_DNS_EDNS_SIZE	1232	/* UDP payload size we advertise */
+#define KAFS_DNS_OPT_SIZE	11	/* Size of an OPT RR with no options */
+
+struct kafs_dns_engine {
+	int		udp_fd[MAXNS];	/* Connected UDP socket per nameserver */
+	int		tcp_fd;		/* TCP connection or -1 */
+	unsigned int	tcp_ns;		/* Nameserver that tcp_fd is connected to */
+};
+
+/*
+ * A DNS query that's being run concurrently with others.
+ */
+struct kafs_dns_query {
+	const char	*name;
+	int		type;		/* ns_t_* */
+	unsigned int	ns;		/* Index of current nameserver */
+	unsigned int	tries;		/* Number of transmissions made */
+	bool		done;
+	bool		truncated;	/* Need to retry over TCP */
+	bool		preferred;	/* An answer to this makes the rest moot */
+	bool		abandoned;	/* Given up on as a preferred one was answered */
+	int		query_len;
+	int		response_len;	/* Length of response or -1 */
+	int		herr;		/* h_errno value on failure */
+	struct timespec	resend_at;
+	struct timespec	done_at;	/* When the query finished */
+	u_char		query[NS_PACKETSZ + KAFS_DNS_OPT_SIZE];
+	u_char		*response;	/* Response; must be freed */
+};
+
+/*
+ * Get the query engine state for a lookup context, creating it if need be.
+ */
+static struct kafs_dns_engine *kafs_dns_get_engine(struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_engine *e = ctx->dns;
+	unsigned int i;
+
+	if (!e) {
+		e = malloc(sizeof(*e));
+		if (!e)
+			return NULL;
+		for (i = 0; i < MAXNS; i++)
+			e->udp_fd[i] = -1;
+		e->tcp_fd = -1;
+		ctx->dns = e;
+	}
+	return e;
+}
+
+/*
+ * Close the TCP connection, if there is one.
+ */
+static void kafs_dns_close_tcp(struct kafs_dns_engine *e)
+{
+	if (e->tcp_fd != -1)
+		close(e->tcp_fd);
+	e->tcp_fd = -1;
+}
+
+/*
+ * Release the query engine state attached to a lookup context.
+ */
+void kafs_dns_free_engine(struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_engine *e = ctx->dns;
+	unsigned int i;
+
+	if (!e)
+		return;
+	for (i = 0; i < MAXNS; i++)
+		if (e->udp_fd[i] != -1)
+			close(e->udp_fd[i]);
+	kafs_dns_close_tcp(e);
+	free(e);
+	ctx->dns = NULL;
+}
+
+/*
+ * Get the address of one of the nameservers in the resolver state.  IPv6
+ * nameservers are kept in the extension area by glibc.
+ */
+static const struct sockaddr *kafs_dns_nameserver(const struct __res_state *res,
+						  unsigned int i,
+						  socklen_t *_len)
+{
+	if (res->nsaddr_list[i].sin_family == AF_INET) {
+		*_len = sizeof(res->nsaddr_list[i]);
+		return (const struct sockaddr *)&res->nsaddr_list[i];
+	}
+#ifdef __GLIBC__
+	if (res->_u._ext.nsaddrs[i]) {
+		*_len = sizeof(*res->_u._ext.nsaddrs[i]);
+		return (const struct sockaddr *)res->_u._ext.nsaddrs[i];
+	}
+#endif
+	return NULL;
+}
+
+/*
+ * Get a socket connected to a nameserver, creating it if need be.
+ */
+static int kafs_dns_socket(struct kafs_dns_engine *e, unsigned int ns,
+			   int type, struct kafs_lookup_context *ctx)
+{
+	const struct sockaddr *sa;
+	socklen_t salen;
+	int fd;
+
+	sa = kafs_dns_nameserver(&ctx->res, ns, &salen);
+	if (!sa)
+		return -1;
+
+	fd = socket(sa->sa_family, type | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (connect(fd, sa, salen) == -1) {
+		verbose("Connect to nameserver %u: %m", ns);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Add an EDNS0 OPT pseudo-RR to the additional section of a query to say how
+ * big a UDP response we can take [RFC 6891].
+ */
+static void kafs_dns_add_opt(struct kafs_dns_query *q)
+{
+	HEADER *hdr = (HEADER *)q->query;
+	u_char *p = q->query + q->query_len;
+
+	*p++ = 0;				/* Root domain */
+	NS_PUT16(ns_t_opt, p);
+	NS_PUT16(KAFS_DNS_EDNS_SIZE, p);	/* The class is the payload size */
+	NS_PUT32(0, p);				/* Extended RCODE and flags */
+	NS_PUT16(0, p);				/* No options */
+	q->query_len += KAFS_DNS_OPT_SIZE;
+	hdr->arcount = htons(ntohs(hdr->arcount) + 1);
+}
+
+/*
+ * Remove the OPT RR from a query so that it can be resent to a nameserver
+ * that doesn't understand EDNS0.  Returns false if there wasn't one.
+ */
+static bool kafs_dns_strip_opt(struct kafs_dns_query *q)
+{
+	HEADER *hdr = (HEADER *)q->query;
+
+	if (ntohs(hdr->arcount) == 0)
+		return false;
+	q->query_len -= KAFS_DNS_OPT_SIZE;
+	hdr->arcount = htons(ntohs(hdr->arcount) - 1);
+	return true;
+}
+
+/*
+ * Note that a query has finished.
+ */
+static void kafs_dns_query_done(struct kafs_dns_query *q, int response_len, int herr)
+{
+	q->done = true;
+	q->response_len = response_len;
+	q->herr = herr;
+	clock_gettime(CLOCK_MONOTONIC, &q->done_at);
+}
+
+/*
+ * (Re)transmit a query to the next nameserver in the list.  The query is
+ * completed with the given error if we've run out of attempts.
+ */
+static void kafs_dns_query_send(struct kafs_dns_query *q, int herr,
+				struct kafs_dns_engine *e,
+				struct kafs_lookup_context *ctx)
+{
+	struct __res_state *res = &ctx->res;
+	unsigned int nscount = res->nscount, attempts;
+	int *fdp;
+
+	attempts = (res->retry > 0 ? res->retry : 1) * nscount;
+
+	for (; q->tries < attempts; q->tries++) {
+		q->ns = q->tries % nscount;
+		fdp = &e->udp_fd[q->ns];
+		if (*fdp == -1)
+			*fdp = kafs_dns_socket(e, q->ns, SOCK_DGRAM | SOCK_NONBLOCK, ctx);
+		if (*fdp == -1)
+			continue;
+		if (send(*fdp, q->query, q->query_len, 0) != q->query_len) {
+			verbose("%s: send to nameserver %u: %m", q->name, q->ns);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &q->resend_at);
+		q->resend_at.tv_sec += res->retrans > 0 ? res->retrans : RES_TIMEOUT;
+		q->tries++;
+		return;
+	}
+
+	kafs_dns_query_done(q, -1, herr);
+}
+
+/*
+ * Find the query that a response belongs to.  The ID and the question must
+ * both match.  Only queries waiting for a TCP answer are considered if tcp is
+ * set.
+ */
+static struct kafs_dns_query *kafs_dns_match(struct kafs_dns_query *queries,
+					     unsigned int nr, unsigned int ns,
+					     const u_char *buf, size_t len,
+					     bool tcp)
+{
+	const HEADER *hdr = (const HEADER *)buf;
+	struct kafs_dns_query *q;
+	unsigned int i;
+	size_t qlen;
+
+	if (len < HFIXEDSZ || !hdr->qr)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		q = &queries[i];
+		if ((tcp ? !q->truncated : q->done) || q->ns != ns ||
+		    ((const HEADER *)q->query)->id != hdr->id)
+			continue;
+
+		qlen = q->query_len - HFIXEDSZ;
+		if (ntohs(((const HEADER *)q->query)->arcount))
+			qlen -= KAFS_DNS_OPT_SIZE;
+		if (len < HFIXEDSZ + qlen ||
+		    memcmp(buf + HFIXEDSZ, q->query + HFIXEDSZ, qlen) != 0)
+			continue;
+		return q;
+	}
+
+	return NULL;
+}
 
-			/* Turn the hostname into IP addresses */
-			ret = kafs_resolve_addrs(server, SOCK_DGRAM, ctx);
-			if (ret)
-				verbose("AFSDB RR can't resolve. subtype:1, server name:%s",
-					server->name);
-			else
-				verbose("NR_ADDRS %u", server->nr_addrs);
+/*
+ * Deal with the response to a query.  The query takes over the buffer if it
+ * completes successfully.  A failure response causes the next nameserver to
+ * be tried if we're using UDP.  Returns true if the buffer was taken.
+ */
+static bool kafs_dns_query_answer(struct kafs_dns_query *q, u_char *buf,
+				  size_t len, bool tcp,
+				  struct kafs_dns_engine *e,
+				  struct kafs_lookup_context *ctx)
+{
+	const HEADER *hdr = (const HEADER *)buf;
+
+	if (hdr->tc && !tcp) {
+		verbose("%s: Truncated response", q->name);
+		q->truncated = true;
+		kafs_dns_query_done(q, -1, TRY_AGAIN);
+		return false;
+	}
+
+	switch (hdr->rcode) {
+	case ns_r_noerror:
+		if (ntohs(hdr->ancount) == 0) {
+			kafs_dns_query_done(q, -1, NO_DATA);
+			return false;
+		}
+		q->response = buf;
+		kafs_dns_query_done(q, len, 0);
+		return true;
+	case ns_r_nxdomain:
+		kafs_dns_query_done(q, -1, HOST_NOT_FOUND);
+		return false;
+	case ns_r_formerr:
+		if (!tcp && kafs_dns_strip_opt(q)) {
+			verbose("%s: Nameserver %u rejected EDNS0", q->name, q->ns);
+			q->tries--;
+			kafs_dns_query_send(q, NO_RECOVERY, e, ctx);
+			return false;
 		}
+		/* Fall through */
+	default:
+		if (tcp)
+			kafs_dns_query_done(q, -1, NO_RECOVERY);
+		else
+			kafs_dns_query_send(q, NO_RECOVERY, e, ctx);
+		return false;
+	case ns_r_servfail:
+		if (tcp)
+			kafs_dns_query_done(q, -1, TRY_AGAIN);
+		else
+			kafs_dns_query_send(q, TRY_AGAIN, e, ctx);
+		return false;
 	}
+}
+
+/*
+ * Read all the datagrams waiting on a nameserver's socket and hand them to
+ * the queries they belong to.  Anything that doesn't belong to one of our
+ * queries is discarded.
+ */
+static void kafs_dns_udp_recv(struct kafs_dns_query *queries, unsigned int nr,
+			      unsigned int ns, struct kafs_dns_engine *e,
+			      struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_query *q;
+	u_char *buf = NULL;
+	unsigned int i;
+	ssize_t len;
 
+	for (;;) {
+		if (!buf) {
+			buf = malloc(KAFS_DNS_EDNS_SIZE);
+			if (!buf)
+				break;
+		}
+
+		len = recv(e->udp_fd[ns], buf, KAFS_DNS_EDNS_SIZE, MSG_TRUNC);
+		if (len == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			verbose("recv from nameserver %u: %m", ns);
+			for (i = 0; i < nr; i++)
+				if (!queries[i].done && queries[i].ns == ns)
+					kafs_dns_query_send(&queries[i], TRY_AGAIN, e, ctx);
+			break;
+		}
+
+		q = kafs_dns_match(queries, nr, ns, buf,
+				   len < KAFS_DNS_EDNS_SIZE ? len : KAFS_DNS_EDNS_SIZE,
+				   false);
+		if (!q)
+			continue;
+
+		if (len > KAFS_DNS_EDNS_SIZE) {
+			verbose("%s: Oversize response", q->name);
+			q->truncated = true;
+			kafs_dns_query_done(q, -1, TRY_AGAIN);
+			continue;
+		}
+
+		if (kafs_dns_query_answer(q, buf, len, false, e, ctx))
+			buf = NULL;
+	}
+
+	free(buf);
+}
+
+/*
+ * Write a whole packet to a stream.
+ */
+static int kafs_dns_write_all(int fd, const u_char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read a whole packet from a stream.
+ */
+static int kafs_dns_read_all(int fd, u_char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, buf, len, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
 	return 0;
 }
 
+/*
+ * Send all the queries that are waiting for nameserver ns over a TCP
+ * connection and then collect the responses, which may come back in any
+ * order [RFC 7766].  Returns the number of responses received or -1 if the
+ * connection failed.
+ */
+static int kafs_dns_tcp_exchange(struct kafs_dns_query *queries, unsigned int nr,
+				 unsigned int ns, struct kafs_dns_engine *e,
+				 struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_query *q;
+	struct timeval tv;
+	unsigned int i, waiting = 0;
+	u_char lbuf[2], *buf;
+	int received = 0, len, fd;
+
+	if (e->tcp_fd != -1 && e->tcp_ns != ns)
+		kafs_dns_close_tcp(e);
+	if (e->tcp_fd == -1) {
+		fd = kafs_dns_socket(e, ns, SOCK_STREAM, ctx);
+		if (fd == -1)
+			return -1;
+		tv.tv_sec = ctx->res.retrans > 0 ? ctx->res.retrans : RES_TIMEOUT;
+		tv.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		e->tcp_fd = fd;
+		e->tcp_ns = ns;
+	}
+	fd = e->tcp_fd;
+
+	for (i = 0; i < nr; i++) {
+		q = &queries[i];
+		if (!q->truncated || q->ns != ns)
+			continue;
+		verbose("%s: Query nameserver %u over TCP", q->name, ns);
+		lbuf[0] = q->query_len >> 8;
+		lbuf[1] = q->query_len;
+		if (kafs_dns_write_all(fd, lbuf, 2) < 0 ||
+		    kafs_dns_write_all(fd, q->query, q->query_len) < 0)
+			goto failed;
+		waiting++;
+	}
+
+	while (waiting > 0) {
+		if (kafs_dns_read_all(fd, lbuf, 2) < 0)
+			goto failed;
+		len = (lbuf[0] << 8) | lbuf[1];
+		buf = malloc(len ?: 1);
+		if (!buf)
+			goto failed;
+		if (kafs_dns_read_all(fd, buf, len) < 0) {
+			free(buf);
+			goto failed;
+		}
+
+		q = kafs_dns_match(queries, nr, ns, buf, len, true);
+		if (!q) {
+			free(buf);
+			continue;
+		}
+
+		q->truncated = false;
+		if (!kafs_dns_query_answer(q, buf, len, true, e, ctx))
+			free(buf);
+		received++;
+		waiting--;
+	}
+
+	return received;
+
+failed:
+	verbose("TCP exchange with nameserver %u: %m", ns);
+	kafs_dns_close_tcp(e);
+	return received ?: -1;
+}
+
+/*
+ * Redo over TCP the queries that got truncated answers.  If a connection we
+ * kept from a previous lookup has been dropped by the server before we got
+ * anything back, we reconnect and try again.
+ */
+static void kafs_dns_run_tcp(struct kafs_dns_query *queries, unsigned int nr,
+			     struct kafs_dns_engine *e,
+			     struct kafs_lookup_context *ctx)
+{
+	unsigned int i, ns;
+	bool reused;
+
+	for (;;) {
+		for (i = 0; i < nr; i++)
+			if (queries[i].truncated)
+				break;
+		if (i == nr)
+			break;
+
+		ns = queries[i].ns;
+		reused = e->tcp_fd != -1 && e->tcp_ns == ns;
+		if (kafs_dns_tcp_exchange(queries, nr, ns, e, ctx) < 0 && reused)
+			kafs_dns_tcp_exchange(queries, nr, ns, e, ctx);
+
+		/* Anything left over for this nameserver has failed. */
+		for (i = 0; i < nr; i++) {
+			if (queries[i].truncated && queries[i].ns == ns) {
+				queries[i].truncated = false;
+				kafs_dns_query_done(&queries[i], -1, TRY_AGAIN);
+			}
+		}
+	}
+
+	if (!ctx->reuse_dns_tcp)
+		kafs_dns_close_tcp(e);
+}
+
+/*
+ * Make sure that a query's ID differs from those of the queries before it as
+ * they're going to share sockets.
+ */
+static void kafs_dns_unique_id(struct kafs_dns_query *queries, unsigned int n)
+{
+	HEADER *hdr = (HEADER *)queries[n].query;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (queries[i].query_len > 0 &&
+		    ((HEADER *)queries[i].query)->id == hdr->id) {
+			hdr->id = htons(ntohs(hdr->id) + 1);
+			i = -1;
+		}
+	}
+}
+
+/*
+ * Once a preferred query has been answered, give up on the ones that are still
+ * outstanding, including any waiting to be retried over TCP.  Returns true if
+ * a preferred query has been answered.
+ */
+static bool kafs_dns_abandon_rest(struct kafs_dns_query *queries, unsigned int nr)
+{
+	struct kafs_dns_query *q;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		if (queries[i].preferred && queries[i].done &&
+		    queries[i].response_len >= 0)
+			break;
+	if (i == nr)
+		return false;
+
+	for (i = 0; i < nr; i++) {
+		q = &queries[i];
+		if (!q->done || q->truncated) {
+			q->truncated = false;
+			q->abandoned = true;
+			kafs_dns_query_done(q, -1, TRY_AGAIN);
+		}
+	}
+	return true;
+}
+
+/*
+ * Use the stub resolver or the context's own resolver to do queries if we
+ * can't use the engine.  The queries are done in order.
+ */
+static void kafs_dns_run_stub(struct kafs_dns_query *queries, unsigned int nr,
+			      struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_query *q;
+	unsigned int i;
+	int len, herr = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (kafs_dns_abandon_rest(queries, nr))
+			break;
+		q = &queries[i];
+		q->response = malloc(NS_MAXMSG);
+		if (!q->response) {
+			kafs_dns_query_done(q, -1, NETDB_INTERNAL);
+			continue;
+		}
+		if (ctx->resolver) {
+			len = ctx->resolver->query(ctx->resolver, q->name, q->type,
+						   q->response, NS_MAXMSG, &herr);
+		} else {
+			len = res_nquery(&ctx->res, q->name, ns_c_in,
+					 q->type, q->response, NS_MAXMSG);
+			herr = h_errno;
+		}
+		kafs_dns_query_done(q, len, herr);
+	}
+}
+
+/*
+ * Run a set of queries concurrently against the nameservers configured in the
+ * lookup context, following the retransmission policy of the resolver state.
+ * We stop waiting for the others as soon as a preferred query is answered.
+ */
+static void kafs_dns_exchange(struct kafs_dns_query *queries, unsigned int nr,
+			      struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_engine *e;
+	struct kafs_dns_query *q;
+	struct pollfd fds[MAXNS];
+	struct timespec now;
+	unsigned int i, n, pending = nr;
+	long tmo, t;
+
+	e = ctx->res.nscount > 0 && !ctx->resolver ? kafs_dns_get_engine(ctx) : NULL;
+	if (!e) {
+		kafs_dns_run_stub(queries, nr, ctx);
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		q = &queries[i];
+		q->response = NULL;
+		q->query_len = res_nmkquery(&ctx->res, ns_o_query, q->name, ns_c_in,
+					    q->type, NULL, 0, NULL,
+					    q->query, NS_PACKETSZ);
+		if (q->query_len < 0) {
+			kafs_dns_query_done(q, -1, NO_RECOVERY);
+			continue;
+		}
+
+		kafs_dns_unique_id(queries, i);
+
+		if (ctx->res.options & RES_USEVC) {
+			q->truncated = true;
+			kafs_dns_query_done(q, -1, TRY_AGAIN);
+			continue;
+		}
+
+		kafs_dns_add_opt(q);
+		kafs_dns_query_send(q, TRY_AGAIN, e, ctx);
+	}
+
+	while (pending > 0) {
+		if (kafs_dns_abandon_rest(queries, nr))
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		tmo = -1;
+		pending = 0;
+		for (i = 0; i < nr; i++) {
+			q = &queries[i];
+			if (q->done)
+				continue;
+			t = (q->resend_at.tv_sec - now.tv_sec) * 1000 +
+				(q->resend_at.tv_nsec - now.tv_nsec) / 1000000;
+			if (t <= 0) {
+				verbose("%s: Timed out", q->name);
+				kafs_dns_query_send(q, TRY_AGAIN, e, ctx);
+				if (q->done)
+					continue;
+				t = (q->resend_at.tv_sec - now.tv_sec) * 1000;
+			}
+			if (tmo == -1 || t < tmo)
+				tmo = t;
+			pending++;
+		}
+
+		if (!pending)
+			break;
+
+		for (i = 0, n = 0; i < MAXNS; i++) {
+			if (e->udp_fd[i] == -1)
+				continue;
+			fds[n].fd = e->udp_fd[i];
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			n++;
+		}
+
+		if (poll(fds, n, tmo) == -1 && errno != EINTR) {
+			for (i = 0; i < nr; i++)
+				if (!queries[i].done)
+					kafs_dns_query_done(&queries[i], -1, NETDB_INTERNAL);
+			break;
+		}
+
+		for (i = 0, n = 0; i < MAXNS; i++) {
+			if (e->udp_fd[i] == -1)
+				continue;
+			if (fds[n++].revents)
+				kafs_dns_udp_recv(queries, nr, i, e, ctx);
+		}
+	}
+
+	kafs_dns_run_tcp(queries, nr, e, ctx);
+}
+
+/*
+ * Run a set of queries and note how long each took and how it turned out.
+ * The responses must be released with kafs_dns_release_queries().
+ */
+static void kafs_dns_run_queries(struct kafs_dns_query *queries, unsigned int nr,
+				 struct kafs_lookup_context *ctx)
+{
+	enum kafs_stats_phase phase;
+	enum kafs_lookup_status status;
+	struct kafs_dns_query *q;
+	struct timespec start;
+	unsigned int i;
+
+	if (!ctx->report.stats) {
+		kafs_dns_exchange(queries, nr, ctx);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	kafs_dns_exchange(queries, nr, ctx);
+
+	for (i = 0; i < nr; i++) {
+		q = &queries[i];
+		if (q->abandoned)
+			continue;
+		phase = q->type == ns_t_srv ? kafs_stats_srv : kafs_stats_afsdb;
+
+		if (q->response_len >= 0) {
+			status = kafs_lookup_good;
+		} else {
+			switch (q->herr) {
+			case HOST_NOT_FOUND:
+			case NO_DATA:
+				status = kafs_lookup_got_not_found;
+				break;
+			case NO_RECOVERY:
+				status = kafs_lookup_got_ns_failure;
+				break;
+			case TRY_AGAIN:
+				status = kafs_lookup_got_temp_failure;
+				break;
+			default:
+				status = kafs_lookup_got_local_failure;
+				break;
+			}
+		}
+
+		kafs_stats_add(&ctx->report, phase,
+			       (q->done_at.tv_sec - start.tv_sec) * 1000000000ULL +
+			       q->done_at.tv_nsec - start.tv_nsec);
+		kafs_stats_result(&ctx->report, phase, status);
+	}
+}
+
+/*
+ * Release the responses to a set of queries.
+ */
+static void kafs_dns_release_queries(struct kafs_dns_query *queries, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		free(queries[i].response);
+}
+
 /*
  * Convert the outcome of an AFSDB record lookup into a set of server records.
  */
@@ -207,7 +1247,7 @@ static int kafs_parse_afsdb(struct kafs_server_list *vsl,
 			    struct kafs_lookup_context *ctx)
 {
 	struct kafs_server *server;
-	unsigned int rr_ttl, max_servers = 0, i;
+	unsigned int rr_ttl, max_servers = 0;
 	ns_rr rr;
 	char buf[MAXDNAME];
 	int rrnum, rr_subtype;
@@ -269,14 +1309,9 @@ static int kafs_parse_afsdb(struct kafs_server_list *vsl,
 		if (vsl->ttl > rr_ttl)
 			vsl->ttl = rr_ttl;
 
-		/* Check the domain name we've just unpacked and add it to
-		 * the list of VL servers if it is not a duplicate.
-		 * If it is a duplicate, just ignore it.
+		/* Add the domain name we've just unpacked to the list of VL
+		 * servers.  Duplicates are weeded out later.
 		 */
-		for (i = 0; i < vsl->nr_servers; i++)
-			if (strcasecmp(buf, vsl->servers[i].name) == 0)
-				continue;
-
 		server->name = strdup(buf);
 		if (!server->name)
 			goto system_error;
@@ -301,36 +1336,25 @@ system_error:
 }
 
 /*
- * Look up an AFSDB record to get the VL server addresses.
+ * Process the response to an AFSDB record query.  response_len is the return
+ * value of the query and herr is the h_errno value to go with a failure.
  */
-static int dns_query_AFSDB(struct kafs_server_list *vsl,
-			   const char *cell_name,
-			   unsigned short subtype,
-			   struct kafs_lookup_context *ctx)
+static int dns_process_AFSDB(struct kafs_server_list *vsl,
+			     const char *cell_name,
+			     unsigned short subtype,
+			     const u_char *response,
+			     int response_len,
+			     int herr,
+			     struct kafs_lookup_context *ctx)
 {
-	int	response_len;		/* buffer length */
 	ns_msg	handle;			/* handle for response message */
-	union {
-		HEADER hdr;
-		u_char buf[NS_PACKETSZ];
-	} response;		/* response buffers */
 
 	vsl->source = kafs_record_from_dns_afsdb;
 	vsl->status = kafs_lookup_good;
 
-	verbose("Get AFSDB RR for cell name:'%s'", cell_name);
-
-	/* query the dns for an AFSDB resource record */
-	response_len = res_nquery(&ctx->res,
-				  cell_name,
-				  ns_c_in,
-				  ns_t_afsdb,
-				  response.buf,
-				  sizeof(response));
-
 	if (response_len < 0) {
-		ctx->report.error("%s: %s", cell_name, hstrerror(h_errno));
-		switch (h_errno) {
+		ctx->report.error("%s: %s", cell_name, hstrerror(herr));
+		switch (herr) {
 		case HOST_NOT_FOUND:
 		case NO_DATA:
 		default:
@@ -346,7 +1370,7 @@ static int dns_query_AFSDB(struct kafs_server_list *vsl,
 		return 0;
 	}
 
-	if (ns_initparse(response.buf, response_len, &handle) < 0) {
+	if (ns_initparse(response, response_len, &handle) < 0) {
 		ctx->report.error("%s: ns_initparse: %s",
 				  cell_name, hstrerror(h_errno));
 		vsl->status = kafs_lookup_bad;
@@ -357,6 +1381,28 @@ static int dns_query_AFSDB(struct kafs_server_list *vsl,
 	return kafs_parse_afsdb(vsl, cell_name, subtype, handle, ns_s_an, ctx);
 }
 
+/*
+ * Look up an AFSDB record to get the VL server addresses.
+ */
+static int dns_query_AFSDB(struct kafs_server_list *vsl,
+			   const char *cell_name,
+			   unsigned short subtype,
+			   struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_query query = { .name = cell_name, .type = ns_t_afsdb };
+	int ret;
+
+	verbose("Get AFSDB RR for cell name:'%s'", cell_name);
+
+	/* query the dns for an AFSDB resource record */
+	kafs_dns_run_queries(&query, 1, ctx);
+
+	ret = dns_process_AFSDB(vsl, cell_name, subtype,
+				query.response, query.response_len, query.herr, ctx);
+	kafs_dns_release_queries(&query, 1);
+	return ret;
+}
+
 /*
  * Convert the outcome of an SRV record lookup into a set of server records.
  */
@@ -368,7 +1414,7 @@ static int kafs_parse_srv(struct kafs_server_list *vsl,
 			  struct kafs_lookup_context *ctx)
 {
 	struct kafs_server *server;
-	unsigned int max_servers = 0, rr_ttl, i;
+	unsigned int max_servers = 0, rr_ttl;
 	ns_rr rr;
 	char buf[MAXDNAME];
 	int rrnum;
@@ -429,18 +1475,14 @@ static int kafs_parse_srv(struct kafs_server_list *vsl,
 		server->port   = ns_get16(ns_rr_rdata(rr) + 4);
 		verbose("rdata %u %u %u", server->pref, server->weight, server->port);
 
-		/* Check the domain name we've just unpacked and add it to
-		 * the list of VL servers if it is not a duplicate.
-		 * If it is a duplicate, just ignore it.
+		/* Add the domain name we've just unpacked to the list of VL
+		 * servers.  Duplicates are weeded out later.
 		 */
-		for (i = 0; i < vsl->nr_servers; i++)
-			if (strcasecmp(buf, vsl->servers[i].name) == 0)
-				continue;
-
 		server->name = strdup(buf);
 		if (!server->name)
 			goto system_error;
-		server->port = AFS_VL_PORT;
+		if (!server->port)
+			server->port = AFS_VL_PORT;
 		server->protocol = protocol;
 
 		verbose("SERVER[%u] %s", vsl->nr_servers, server->name);
@@ -461,41 +1503,38 @@ system_error:
 }
 
 /*
- * Look up an SRV record to get the VL server addresses [RFC 5864].
+ * Build the name under which SRV records for a service are found.
  */
-static int dns_query_SRV(struct kafs_server_list *vsl,
+static void dns_SRV_name(char *name, size_t size,
 			 const char *domain_name,
 			 const char *service_name,
-			 const char *proto_name,
-			 struct kafs_lookup_context *ctx)
+			 const char *proto_name)
+{
+	snprintf(name, size, "_%s._%s.%s",
+		 service_name, proto_name, domain_name);
+}
+
+/*
+ * Process the response to an SRV record query.  response_len is the return
+ * value of the query and herr is the h_errno value to go with a failure.
+ */
+static int dns_process_SRV(struct kafs_server_list *vsl,
+			   const char *domain_name,
+			   const char *proto_name,
+			   const u_char *response,
+			   int response_len,
+			   int herr,
+			   struct kafs_lookup_context *ctx)
 {
-	int	response_len;		/* buffer length */
 	ns_msg	handle;			/* handle for response message */
-	union {
-		HEADER hdr;
-		u_char buf[NS_PACKETSZ];
-	} response;
 	enum dns_payload_protocol_type protocol;
-	char name[1024];
 
 	vsl->source = kafs_record_from_dns_srv;
 
-	snprintf(name, sizeof(name), "_%s._%s.%s",
-		 service_name, proto_name, domain_name);
-
-	verbose("Get SRV RR for name:'%s'", name);
-
-	response_len = res_nquery(&ctx->res,
-				  name,
-				  ns_c_in,
-				  ns_t_srv,
-				  response.buf,
-				  sizeof(response));
-
 	if (response_len < 0) {
 		ctx->report.error("%s: dns: %s",
-				  domain_name, hstrerror(h_errno));
-		switch (h_errno) {
+				  domain_name, hstrerror(herr));
+		switch (herr) {
 		case HOST_NOT_FOUND:
 		case NO_DATA:
 			vsl->status = kafs_lookup_got_not_found;
@@ -510,7 +1549,7 @@ static int dns_query_SRV(struct kafs_server_list *vsl,
 		return 0;
 	}
 
-	if (ns_initparse(response.buf, response_len, &handle) < 0) {
+	if (ns_initparse(response, response_len, &handle) < 0) {
 		ctx->report.error("%s: ns_initparse: %s",
 				  domain_name, hstrerror(h_errno));
 		vsl->status = kafs_lookup_bad;
@@ -529,15 +1568,89 @@ static int dns_query_SRV(struct kafs_server_list *vsl,
 }
 
 /*
- * Look up a cell by name in the DNS.
+ * Look up an SRV record to get the VL server addresses [RFC 5864].
  */
-int kafs_dns_lookup_vlservers(struct kafs_server_list *vsl,
+static int dns_query_SRV(struct kafs_server_list *vsl,
+			 const char *domain_name,
+			 const char *service_name,
+			 const char *proto_name,
+			 struct kafs_lookup_context *ctx)
+{
+	struct kafs_dns_query query = { .type = ns_t_srv };
+	char name[1024];
+	int ret;
+
+	dns_SRV_name(name, sizeof(name), domain_name, service_name, proto_name);
+
+	verbose("Get SRV RR for name:'%s'", name);
+
+	query.name = name;
+	kafs_dns_run_queries(&query, 1, ctx);
+
+	ret = dns_process_SRV(vsl, domain_name, proto_name,
+			      query.response, query.response_len, query.herr, ctx);
+	kafs_dns_release_queries(&query, 1);
+	return ret;
+}
+
+/*
+ * Look up a cell's SRV and AFSDB records at the same time rather than waiting
+ * for the SRV lookup to fail before trying AFSDB.  The SRV records still take
+ * precedence if there are any, so we don't wait for the AFSDB answer once
+ * they've come in.  If it turns out that they don't give us any servers, the
+ * AFSDB query is redone if it was given up on.
+ */
+static int dns_race_vlservers(struct kafs_server_list *vsl,
 			      const char *cell_name,
 			      struct kafs_lookup_context *ctx)
 {
+	struct kafs_dns_query queries[2];
+	char name[1024];
 	int ret;
 
-	vsl->status = kafs_lookup_not_done;
+	memset(queries, 0, sizeof(queries));
+	dns_SRV_name(name, sizeof(name), cell_name, "afs3-vlserver", "udp");
+	verbose("Get SRV and AFSDB RR for cell name:'%s'", cell_name);
+	queries[0].name = name;
+	queries[0].type = ns_t_srv;
+	queries[0].preferred = true;
+	queries[1].name = cell_name;
+	queries[1].type = ns_t_afsdb;
+
+	kafs_dns_run_queries(queries, 2, ctx);
+
+	ret = dns_process_SRV(vsl, cell_name, "udp",
+			      queries[0].response, queries[0].response_len,
+			      queries[0].herr, ctx);
+	if (ret == 0 && vsl->nr_servers == 0) {
+		free(vsl->servers);
+		vsl->servers = NULL;
+		vsl->max_servers = 0;
+		if (queries[1].abandoned)
+			ret = dns_query_AFSDB(vsl, cell_name, 1, ctx);
+		else
+			ret = dns_process_AFSDB(vsl, cell_name, 1,
+						queries[1].response,
+						queries[1].response_len,
+						queries[1].herr, ctx);
+	}
+
+	kafs_dns_release_queries(queries, 2);
+	return ret;
+}
+
+/*
+ * Look up a cell by name in the DNS.
+ */
+static int dns_lookup_vlservers(struct kafs_server_list *vsl,
+				const char *cell_name,
+				struct kafs_lookup_context *ctx)
+{
+	int ret;
+
+	if (ctx->race_vls_lookup && !ctx->no_vls_srv && !ctx->no_vls_afsdb &&
+	    (ctx->res.nscount > 0 || ctx->resolver))
+		return dns_race_vlservers(vsl, cell_name, ctx);
 
 	if (!ctx->no_vls_srv) {
 		ret = dns_query_SRV(vsl, cell_name, "afs3-vlserver", "udp", ctx);
@@ -557,3 +1670,20 @@ int kafs_dns_lookup_vlservers(struct kafs_server_list *vsl,
 
 	return 0;
 }
+
+/*
+ * Look up the VL servers for a cell in the DNS, first trying SRV records and
+ * then AFSDB records.  Duplicate servers are removed and SRV results are put
+ * into the order given by their priorities and weights.
+ */
+int kafs_dns_lookup_vlservers(struct kafs_server_list *vsl,
+			      const char *cell_name,
+			      struct kafs_lookup_context *ctx)
+{
+	vsl->status = kafs_lookup_not_done;
+
+	if (dns_lookup_vlservers(vsl, cell_name, ctx) < 0)
+		return -1;
+	kafs_normalise_servers(vsl, ctx);
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Functions shared between the library's source files.  These aren't listed in
+ * version.lds and so aren't exported; keep them out of the installed headers.
+ */
+#include <kafs/cellserv.h>
+#include <kafs/profile.h>
+
+/*
+ * profile.c
+ */
+extern void *kafs_profile_arena_alloc(struct kafs_profile *root, size_t size);
+extern struct kafs_profile *kafs_profile_add_list(struct kafs_profile *root,
+						  struct kafs_profile *parent,
+						  const char *name,
+						  struct kafs_report *report);
+extern int kafs_profile_copy(struct kafs_profile *root,
+			     struct kafs_profile *to,
+			     const struct kafs_profile *from,
+			     const char *file,
+			     struct kafs_report *report);
+extern int kafs_profile_take(struct kafs_profile *root,
+			     struct kafs_profile *other);
+
+/*
+ * cellserv.c
+ */
+extern struct kafs_cell *kafs_cellserv_new_cell(const struct kafs_profile *child,
+						unsigned int flags,
+						struct kafs_report *report);
+extern unsigned int kafs_name_hash(const char *name);
+extern int kafs_cellserv_index_add(struct kafs_cell_db *db, unsigned int i,
+				   struct kafs_report *report);
+extern unsigned int kafs_cellserv_find_nr(const struct kafs_cell_db *db,
+					  const char *cell_name);
+
+/*
+ * cell_lookup.c
+ */
+extern unsigned long long kafs_config_new_serial(void);
+
+/*
+ * dns_lookup.c
+ */
+extern void kafs_dns_free_engine(struct kafs_lookup_context *ctx);
+
+/*
+ * server_order.c
+ */
+extern void kafs_normalise_servers(struct kafs_server_list *vsl,
+				   struct kafs_lookup_context *ctx);
+
+/*
+ * celldb.c
+ */
+extern int kafs_celldb_build_cell(const struct kafs_cell_db *db, unsigned int nr,
+				  struct kafs_report *report);
+extern unsigned int kafs_celldb_find_nr(const struct kafs_cell_db *db,
+					const char *cell_name);
+
+/*
+ * config_reload.c
+ */
+extern int kafs_config_note_units(struct kafs_config *config,
+				  struct kafs_report *report);
+extern void kafs_config_free_units(struct kafs_config *config);
@@ -0,0 +1,593 @@
+/*
+ * Cache of VL server lookup results.
+ *
+ * A long-running user of the library, such as the kafs-dns daemon, can hang
+ * one of these off its lookup context to avoid repeating the SRV/AFSDB and
+ * address lookups for a cell each time a key for it is requested.  Entries
+ * are keyed by cell name, by the lookup options that affect the result, by
+ * the RTT probe timeout and by the config the lookup was made under, and live
+ * for as long as the DNS TTL of the records they were built from, subject to
+ * an upper bound.  Cells that the DNS says don't exist are
+ * remembered for a short, fixed period.  Temporary failures aren't cached.
+ * When the cache is full, the entry that was least recently looked up is
+ * evicted to make room.  A cache may be shared between threads.
+ *
+ * Entries that are in use can be re-resolved in the background before they
+ * expire by calling kafs_lookup_cache_refresh() periodically.  An expired
+ * entry is kept for a while longer so that its data can be served if a fresh
+ * lookup fails transiently.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <kafs/cellserv.h>
+#include "lib_internal.h"
+
+#define KAFS_LOOKUP_CACHE_BUCKETS	64
+#define KAFS_LOOKUP_CACHE_MAX		1024	/* Max entries */
+#define KAFS_LOOKUP_CACHE_MAX_TTL	600	/* Max lifetime of a good result (s) */
+#define KAFS_LOOKUP_CACHE_NEG_TTL	60	/* Lifetime of a negative result (s) */
+#define KAFS_LOOKUP_CACHE_STALE_TTL	3600	/* How long last-good data is kept (s) */
+#define KAFS_LOOKUP_CACHE_RETRY		30	/* Interval between refresh attempts (s) */
+
+#define KAFS_LOOKUP_WANT_IPV4		0x01
+#define KAFS_LOOKUP_WANT_IPV6		0x02
+#define KAFS_LOOKUP_NO_VLS_SRV		0x04
+#define KAFS_LOOKUP_NO_VLS_AFSDB	0x08
+#define KAFS_LOOKUP_NO_VL_HOST		0x10
+#define KAFS_LOOKUP_FAMILY_SHIFT	5	/* Address family policy */
+#define KAFS_LOOKUP_FAMILY_MASK		0x07
+
+/*
+ * What an entry's result depends on besides the cell name.  A config that was
+ * reloaded incrementally shares the config ID of its base for the cells that
+ * the reload didn't change.
+ */
+struct kafs_lookup_cache_key {
+	unsigned long long	config_id;
+	unsigned int		options;
+	unsigned int		probe_timeout;	/* RTT probe timeout (ms) or 0 */
+};
+
+struct kafs_lookup_cache_entry {
+	struct kafs_lookup_cache_entry *hash_next;
+	struct kafs_lookup_cache_entry *lru_next;
+	struct kafs_lookup_cache_entry *lru_prev;
+	struct kafs_server_list	*vlservers;
+	time_t			expiry;		/* CLOCK_MONOTONIC seconds */
+	time_t			refresh;	/* When to re-resolve if in use */
+	time_t			discard;	/* When to drop the last-good data */
+	unsigned int		hash;
+	struct kafs_lookup_cache_key key;
+	bool			used;		/* Looked up since last refreshed */
+	char			name[];
+};
+
+struct kafs_lookup_cache {
+	pthread_mutex_t		lock;
+	unsigned int		nr_entries;
+	struct kafs_lookup_cache_entry	*lru_head;	/* Least recently used first */
+	struct kafs_lookup_cache_entry	*lru_tail;
+	struct kafs_lookup_cache_entry	*buckets[KAFS_LOOKUP_CACHE_BUCKETS];
+};
+
+#define verbose(r, fmt, ...)						\
+	do {								\
+		if ((r)->verbose)					\
+			(r)->verbose(fmt, ## __VA_ARGS__);		\
+	} while(0)
+
+static time_t kafs_lookup_cache_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+/*
+ * Work out which of the lookup options are relevant to the result.
+ */
+static unsigned int kafs_lookup_cache_options(const struct kafs_lookup_context *ctx)
+{
+	return ((ctx->want_ipv4_addrs	? KAFS_LOOKUP_WANT_IPV4 : 0) |
+		(ctx->want_ipv6_addrs	? KAFS_LOOKUP_WANT_IPV6 : 0) |
+		(ctx->no_vls_srv	? KAFS_LOOKUP_NO_VLS_SRV : 0) |
+		(ctx->no_vls_afsdb	? KAFS_LOOKUP_NO_VLS_AFSDB : 0) |
+		(ctx->no_vl_host	? KAFS_LOOKUP_NO_VL_HOST : 0) |
+		(ctx->addr_family << KAFS_LOOKUP_FAMILY_SHIFT));
+}
+
+/*
+ * Set the lookup options in a context to those an entry was made with.
+ */
+static void kafs_lookup_cache_set_options(struct kafs_lookup_context *ctx,
+					  unsigned int options)
+{
+	ctx->want_ipv4_addrs	= options & KAFS_LOOKUP_WANT_IPV4;
+	ctx->want_ipv6_addrs	= options & KAFS_LOOKUP_WANT_IPV6;
+	ctx->no_vls_srv		= options & KAFS_LOOKUP_NO_VLS_SRV;
+	ctx->no_vls_afsdb	= options & KAFS_LOOKUP_NO_VLS_AFSDB;
+	ctx->no_vl_host		= options & KAFS_LOOKUP_NO_VL_HOST;
+	ctx->addr_family	= ((options >> KAFS_LOOKUP_FAMILY_SHIFT) &
+				   KAFS_LOOKUP_FAMILY_MASK);
+}
+
+/*
+ * Work out the config ID for a cell: that of the config in which the cell's
+ * definition last changed or, failing that, of the config at the bottom of the
+ * stack of incremental reloads.
+ */
+static unsigned long long kafs_lookup_cache_config_id(const struct kafs_config *config,
+						      const char *cell_name)
+{
+	unsigned int i;
+
+	for (; config->base; config = config->base)
+		for (i = 0; i < config->nr_changed; i++)
+			if (strcasecmp(config->changed[i], cell_name) == 0)
+				return config->serial;
+	return config->serial;
+}
+
+/*
+ * Work out the key for a lookup of a cell made with the given context and
+ * config.
+ */
+static void kafs_lookup_cache_make_key(struct kafs_lookup_cache_key *key,
+				       const struct kafs_config *config,
+				       const char *cell_name,
+				       const struct kafs_lookup_context *ctx)
+{
+	key->config_id = kafs_lookup_cache_config_id(config, cell_name);
+	key->options = kafs_lookup_cache_options(ctx);
+	key->probe_timeout = ctx->rtt_probe_timeout;
+}
+
+static bool kafs_lookup_cache_key_eq(const struct kafs_lookup_cache_key *a,
+				     const struct kafs_lookup_cache_key *b)
+{
+	return (a->config_id == b->config_id &&
+		a->options == b->options &&
+		a->probe_timeout == b->probe_timeout);
+}
+
+/*
+ * Allocate an empty cache.
+ */
+struct kafs_lookup_cache *kafs_alloc_lookup_cache(struct kafs_report *report)
+{
+	struct kafs_lookup_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		report->bad_error = true;
+		report->error("%m");
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+static void kafs_lookup_cache_lru_del(struct kafs_lookup_cache *cache,
+				      struct kafs_lookup_cache_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void kafs_lookup_cache_lru_add(struct kafs_lookup_cache *cache,
+				      struct kafs_lookup_cache_entry *entry)
+{
+	entry->lru_next = NULL;
+	entry->lru_prev = cache->lru_tail;
+	if (cache->lru_tail)
+		cache->lru_tail->lru_next = entry;
+	else
+		cache->lru_head = entry;
+	cache->lru_tail = entry;
+}
+
+/*
+ * Note that an entry has been looked up, moving it to the back of the queue
+ * for eviction.
+ */
+static void kafs_lookup_cache_touch(struct kafs_lookup_cache *cache,
+				    struct kafs_lookup_cache_entry *entry)
+{
+	entry->used = true;
+	if (entry != cache->lru_tail) {
+		kafs_lookup_cache_lru_del(cache, entry);
+		kafs_lookup_cache_lru_add(cache, entry);
+	}
+}
+
+static void kafs_lookup_cache_unlink(struct kafs_lookup_cache *cache,
+				     struct kafs_lookup_cache_entry *entry)
+{
+	struct kafs_lookup_cache_entry **pp;
+
+	pp = &cache->buckets[entry->hash % KAFS_LOOKUP_CACHE_BUCKETS];
+	while (*pp != entry)
+		pp = &(*pp)->hash_next;
+	*pp = entry->hash_next;
+
+	kafs_lookup_cache_lru_del(cache, entry);
+	cache->nr_entries--;
+	kafs_free_server_list(entry->vlservers);
+	free(entry);
+}
+
+/*
+ * Discard everything in a cache.
+ */
+void kafs_flush_lookup_cache(struct kafs_lookup_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	while (cache->lru_head)
+		kafs_lookup_cache_unlink(cache, cache->lru_head);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Discard the entries for a cell, whatever they were keyed by.
+ */
+void kafs_lookup_cache_forget(struct kafs_lookup_cache *cache,
+			      const char *cell_name)
+{
+	struct kafs_lookup_cache_entry *entry, *next;
+	unsigned int hash = kafs_name_hash(cell_name);
+
+	pthread_mutex_lock(&cache->lock);
+	for (entry = cache->buckets[hash % KAFS_LOOKUP_CACHE_BUCKETS];
+	     entry;
+	     entry = next) {
+		next = entry->hash_next;
+		if (entry->hash == hash &&
+		    strcasecmp(entry->name, cell_name) == 0)
+			kafs_lookup_cache_unlink(cache, entry);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Free a cache.
+ */
+void kafs_free_lookup_cache(struct kafs_lookup_cache *cache)
+{
+	if (cache) {
+		kafs_flush_lookup_cache(cache);
+		pthread_mutex_destroy(&cache->lock);
+		free(cache);
+	}
+}
+
+/*
+ * Find the entry for a cell, discarding any dead entries we pass.  The caller
+ * must hold the lock.
+ */
+static struct kafs_lookup_cache_entry *
+kafs_lookup_cache_find(struct kafs_lookup_cache *cache, const char *cell_name,
+		       const struct kafs_lookup_cache_key *key, time_t now)
+{
+	struct kafs_lookup_cache_entry *entry, *next;
+	unsigned int hash = kafs_name_hash(cell_name);
+
+	for (entry = cache->buckets[hash % KAFS_LOOKUP_CACHE_BUCKETS];
+	     entry;
+	     entry = next) {
+		next = entry->hash_next;
+		if (entry->discard <= now) {
+			kafs_lookup_cache_unlink(cache, entry);
+			continue;
+		}
+
+		if (entry->hash == hash &&
+		    kafs_lookup_cache_key_eq(&entry->key, key) &&
+		    strcasecmp(entry->name, cell_name) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Look up a cell in the cache for a lookup being made under the given config.
+ * If there's an unexpired entry, a copy of the server list is returned with
+ * its TTL trimmed to the time remaining.  NULL is returned if there's no
+ * entry; -1 is stored in *_err if we couldn't make the copy.
+ */
+struct kafs_server_list *kafs_lookup_cache_get(struct kafs_lookup_cache *cache,
+					       const char *cell_name,
+					       const struct kafs_config *config,
+					       struct kafs_lookup_context *ctx,
+					       int *_err)
+{
+	struct kafs_lookup_cache_entry *entry;
+	struct kafs_lookup_cache_key key;
+	struct kafs_server_list *vsl = NULL;
+	time_t now = kafs_lookup_cache_now();
+
+	*_err = 0;
+	kafs_lookup_cache_make_key(&key, config, cell_name, ctx);
+	pthread_mutex_lock(&cache->lock);
+	entry = kafs_lookup_cache_find(cache, cell_name, &key, now);
+	if (entry && entry->expiry > now) {
+		verbose(&ctx->report, "%s: Using cached lookup result (%lds left)",
+			cell_name, (long)(entry->expiry - now));
+		kafs_lookup_cache_touch(cache, entry);
+		vsl = kafs_dup_server_list(entry->vlservers, &ctx->report);
+		if (!vsl)
+			*_err = -1;
+		else
+			vsl->ttl = entry->expiry - now;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	return vsl;
+}
+
+/*
+ * Determine if a lookup failed in a way that might not happen on another try.
+ */
+static bool kafs_lookup_cache_transient(const struct kafs_server_list *vsl)
+{
+	unsigned int i;
+
+	switch (vsl->status) {
+	case kafs_lookup_got_local_failure:
+	case kafs_lookup_got_temp_failure:
+	case kafs_lookup_got_ns_failure:
+		return true;
+	default:
+		break;
+	}
+
+	for (i = 0; i < vsl->nr_servers; i++) {
+		switch (vsl->servers[i].status) {
+		case kafs_lookup_got_local_failure:
+		case kafs_lookup_got_temp_failure:
+		case kafs_lookup_got_ns_failure:
+			return true;
+		default:
+			break;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * If the lookup that produced vsl failed transiently, get a copy of the last
+ * good result for the cell, even if it has expired, so that it can be served
+ * instead.  The copy is given a short TTL so that it gets asked for again
+ * soon.  NULL is returned if there's nothing suitable.
+ */
+struct kafs_server_list *kafs_lookup_cache_get_stale(struct kafs_lookup_cache *cache,
+						     const char *cell_name,
+						     const struct kafs_config *config,
+						     const struct kafs_server_list *vsl,
+						     struct kafs_lookup_context *ctx)
+{
+	struct kafs_lookup_cache_entry *entry;
+	struct kafs_lookup_cache_key key;
+	struct kafs_server_list *stale = NULL;
+	struct kafs_report quiet = { .error = ctx->report.error };
+
+	if (!kafs_lookup_cache_transient(vsl))
+		return NULL;
+
+	kafs_lookup_cache_make_key(&key, config, cell_name, ctx);
+	pthread_mutex_lock(&cache->lock);
+	entry = kafs_lookup_cache_find(cache, cell_name, &key, kafs_lookup_cache_now());
+	if (entry && entry->vlservers->nr_servers > 0) {
+		stale = kafs_dup_server_list(entry->vlservers, &quiet);
+		if (stale) {
+			verbose(&ctx->report, "%s: Lookup failed, using last good result",
+				cell_name);
+			if (!ctx->cache_refresh)
+				kafs_lookup_cache_touch(cache, entry);
+			stale->ttl = KAFS_LOOKUP_CACHE_NEG_TTL;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return stale;
+}
+
+/*
+ * Work out how long a lookup result may be cached for, returning 0 if it
+ * shouldn't be cached at all.
+ */
+static unsigned int kafs_lookup_cache_lifetime(const struct kafs_server_list *vsl)
+{
+	unsigned int i;
+
+	if (vsl->nr_servers == 0)
+		return (vsl->status == kafs_lookup_got_not_found ?
+			KAFS_LOOKUP_CACHE_NEG_TTL : 0);
+
+	switch (vsl->status) {
+	case kafs_lookup_got_local_failure:
+	case kafs_lookup_got_temp_failure:
+	case kafs_lookup_got_ns_failure:
+		return 0;
+	default:
+		break;
+	}
+
+	/* Don't hang on to a list that's missing addresses we might get on
+	 * another try.
+	 */
+	for (i = 0; i < vsl->nr_servers; i++) {
+		switch (vsl->servers[i].status) {
+		case kafs_lookup_got_local_failure:
+		case kafs_lookup_got_temp_failure:
+		case kafs_lookup_got_ns_failure:
+			return 0;
+		default:
+			break;
+		}
+	}
+
+	return (vsl->ttl < KAFS_LOOKUP_CACHE_MAX_TTL ?
+		vsl->ttl : KAFS_LOOKUP_CACHE_MAX_TTL);
+}
+
+/*
+ * Record the result of looking up a cell under the given config.  Failure to
+ * add an entry isn't an error as far as the caller is concerned.
+ */
+void kafs_lookup_cache_put(struct kafs_lookup_cache *cache,
+			   const char *cell_name,
+			   const struct kafs_config *config,
+			   const struct kafs_server_list *vsl,
+			   struct kafs_lookup_context *ctx)
+{
+	struct kafs_lookup_cache_entry *entry, *old, **bucket;
+	struct kafs_report quiet = { .error = ctx->report.error };
+	unsigned int lifetime = kafs_lookup_cache_lifetime(vsl);
+	size_t nlen = strlen(cell_name) + 1;
+
+	if (lifetime == 0)
+		return;
+
+	entry = calloc(1, sizeof(*entry) + nlen);
+	if (!entry)
+		return;
+	entry->vlservers = kafs_dup_server_list(vsl, &quiet);
+	if (!entry->vlservers) {
+		free(entry);
+		return;
+	}
+
+	memcpy(entry->name, cell_name, nlen);
+	entry->hash = kafs_name_hash(cell_name);
+	kafs_lookup_cache_make_key(&entry->key, config, cell_name, ctx);
+	entry->expiry = kafs_lookup_cache_now() + lifetime;
+	entry->refresh = entry->expiry - lifetime / 4;
+	entry->discard = entry->expiry + KAFS_LOOKUP_CACHE_STALE_TTL;
+	entry->used = !ctx->cache_refresh;
+
+	pthread_mutex_lock(&cache->lock);
+	old = kafs_lookup_cache_find(cache, cell_name, &entry->key,
+				     kafs_lookup_cache_now());
+	if (old)
+		kafs_lookup_cache_unlink(cache, old);
+	if (cache->nr_entries >= KAFS_LOOKUP_CACHE_MAX)
+		kafs_lookup_cache_unlink(cache, cache->lru_head);
+
+	bucket = &cache->buckets[entry->hash % KAFS_LOOKUP_CACHE_BUCKETS];
+	entry->hash_next = *bucket;
+	*bucket = entry;
+
+	kafs_lookup_cache_lru_add(cache, entry);
+	cache->nr_entries++;
+	pthread_mutex_unlock(&cache->lock);
+
+	verbose(&ctx->report, "%s: Cached lookup result for %us", cell_name, lifetime);
+}
+
+struct kafs_lookup_cache_due {
+	struct kafs_lookup_cache_key key;
+	char			*name;
+};
+
+/*
+ * Re-resolve the cells in the cache that have been looked up since they were
+ * last resolved and that are getting close to expiry, or have expired, so
+ * that the result is ready before it's needed again.  If a refresh fails, the
+ * old entry is left in place and tried again later.  The lookups are done with
+ * the given context, which should be private to the caller, adjusted to match
+ * the options each entry was made with.  Only entries that are good for the
+ * context's config, or the default config if it doesn't specify one, are
+ * refreshed.  Returns the number of seconds until the next entry is due.
+ */
+unsigned int kafs_lookup_cache_refresh(struct kafs_lookup_cache *cache,
+				       struct kafs_lookup_context *ctx)
+{
+	struct kafs_lookup_cache_entry *entry, *next;
+	struct kafs_lookup_cache_due *due;
+	struct kafs_lookup_context rctx;
+	struct kafs_config *config;
+	struct kafs_cell *cell;
+	unsigned int i, nr_due = 0, wait = KAFS_LOOKUP_CACHE_MAX_TTL;
+	time_t now = kafs_lookup_cache_now();
+
+	if (ctx->config)
+		config = kafs_get_config(ctx->config);
+	else
+		config = kafs_get_default_config(&ctx->report);
+	if (!config)
+		return KAFS_LOOKUP_CACHE_RETRY;
+
+	pthread_mutex_lock(&cache->lock);
+	due = calloc(cache->nr_entries ?: 1, sizeof(*due));
+	if (!due) {
+		pthread_mutex_unlock(&cache->lock);
+		kafs_put_config(config);
+		return KAFS_LOOKUP_CACHE_RETRY;
+	}
+
+	for (entry = cache->lru_head; entry; entry = next) {
+		next = entry->lru_next;
+		if (entry->discard <= now) {
+			kafs_lookup_cache_unlink(cache, entry);
+			continue;
+		}
+		if (!entry->used ||
+		    entry->key.config_id != kafs_lookup_cache_config_id(config, entry->name))
+			continue;
+
+		if (entry->refresh > now) {
+			if (entry->refresh - now < wait)
+				wait = entry->refresh - now;
+			continue;
+		}
+
+		due[nr_due].name = strdup(entry->name);
+		if (!due[nr_due].name)
+			break;
+		due[nr_due].key = entry->key;
+		nr_due++;
+
+		/* Don't retry too soon if this attempt fails. */
+		entry->refresh = now + KAFS_LOOKUP_CACHE_RETRY;
+		if (KAFS_LOOKUP_CACHE_RETRY < wait)
+			wait = KAFS_LOOKUP_CACHE_RETRY;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	for (i = 0; i < nr_due; i++) {
+		verbose(&ctx->report, "%s: Refreshing cached lookup result", due[i].name);
+		rctx = *ctx;
+		kafs_lookup_cache_set_options(&rctx, due[i].key.options);
+		rctx.rtt_probe_timeout = due[i].key.probe_timeout;
+		rctx.config = config;
+		rctx.cache = cache;
+		rctx.cache_refresh = true;
+		cell = kafs_lookup_cell(due[i].name, &rctx);
+		/* Hand back any query engine so that the next pass reuses it. */
+		ctx->dns = rctx.dns;
+		if (cell)
+			kafs_free_cell(cell);
+		free(due[i].name);
+	}
+
+	free(due);
+	kafs_put_config(config);
+	return wait;
+}
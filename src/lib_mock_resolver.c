@@ -0,0 +1,624 @@
+/*
+ * Mock resolver serving canned DNS data.
+ *
+ * This can be attached to a lookup context in place of the system resolver so
+ * that lookups can be driven at full speed, or with a known amount of delay,
+ * without involving any nameservers.  This is intended for benchmarking and
+ * load testing.  The data comes from a fixture file that looks something like
+ * a zone file:
+ *
+ *	; Comments start with ';' or '#'
+ *	$TTL 300
+ *	$LATENCY 2
+ *	_afs3-vlserver._udp.example.com	SRV	10 5 7003 vl1.example.com
+ *	example.com			AFSDB	1 vl1.example.com
+ *	vl1.example.com		600	IN	A	192.0.2.1
+ *	vl1.example.com			AAAA	2001:db8::1
+ *	broken.example.com		SERVFAIL
+ *
+ * Names must be fully qualified and are matched without regard to case.  Each
+ * record may be given a TTL and a class, which must be IN.  $TTL sets the TTL
+ * for records that don't give one.  $LATENCY sets the time in milliseconds
+ * that a query or address lookup for a name takes; this is fixed by the
+ * setting in force when the name's first record is read, and names that
+ * aren't in the fixture get the setting in force at the end of the file.  A
+ * SERVFAIL record makes all queries for a name fail temporarily.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <kafs/cellserv.h>
+
+#define KAFS_MOCK_SERVFAIL	-1	/* Pseudo record type */
+
+struct kafs_mock_record {
+	char			*name;
+	int			type;		/* ns_t_* or KAFS_MOCK_SERVFAIL */
+	unsigned int		ttl;
+	unsigned int		latency;	/* Query time for this name (ms) */
+	unsigned int		order;		/* Position in the fixture */
+	union {
+		struct in_addr	a;
+		struct in6_addr	aaaa;
+		struct {
+			unsigned short	priority;
+			unsigned short	weight;
+			unsigned short	port;
+		} srv;
+		unsigned short	afsdb_subtype;
+	};
+	char			*target;	/* SRV target or AFSDB host */
+};
+
+struct kafs_mock_resolver {
+	struct kafs_resolver	resolver;
+	unsigned int		latency;	/* Query time for unknown names (ms) */
+	unsigned int		nr_records;
+	unsigned int		max_records;
+	struct kafs_mock_record	*records;	/* Sorted by name */
+};
+
+/*
+ * An address returned by the mock getaddrinfo(), allocated all of a piece.
+ */
+struct kafs_mock_addrinfo {
+	struct addrinfo		ai;
+	union {
+		struct sockaddr_in	sin;
+		struct sockaddr_in6	sin6;
+	};
+};
+
+static const struct {
+	const char	*name;
+	int		type;
+} kafs_mock_types[] = {
+	{ "A",		ns_t_a },
+	{ "AAAA",	ns_t_aaaa },
+	{ "AFSDB",	ns_t_afsdb },
+	{ "SERVFAIL",	KAFS_MOCK_SERVFAIL },
+	{ "SRV",	ns_t_srv },
+};
+
+static int kafs_mock_cmp_name(const void *a, const void *b)
+{
+	const struct kafs_mock_record *ra = a, *rb = b;
+	int cmp = strcasecmp(ra->name, rb->name);
+
+	if (cmp)
+		return cmp;
+	return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+/*
+ * Strip the root label from a name.
+ */
+static void kafs_mock_strip_dot(char *name)
+{
+	size_t len = strlen(name);
+
+	if (len > 1 && name[len - 1] == '.')
+		name[len - 1] = 0;
+}
+
+/*
+ * Parse an unsigned number no greater than max.
+ */
+static int kafs_mock_number(const char *word, unsigned long max, unsigned int *_n)
+{
+	unsigned long n;
+	char *end;
+
+	if (!word || !isdigit(*word))
+		return -1;
+	errno = 0;
+	n = strtoul(word, &end, 10);
+	if (errno || *end || n > max)
+		return -1;
+	*_n = n;
+	return 0;
+}
+
+/*
+ * Parse the data part of a record.  Returns 1 on success, 0 if there was a
+ * syntax error and -1 on a system error.
+ */
+static int kafs_mock_parse_rdata(struct kafs_mock_record *rec, char **words,
+				 unsigned int nr_words)
+{
+	unsigned int a, b, c;
+
+	switch (rec->type) {
+	case ns_t_a:
+		return nr_words == 1 && inet_pton(AF_INET, words[0], &rec->a) == 1;
+	case ns_t_aaaa:
+		return nr_words == 1 && inet_pton(AF_INET6, words[0], &rec->aaaa) == 1;
+	case ns_t_srv:
+		if (nr_words != 4 ||
+		    kafs_mock_number(words[0], 65535, &a) < 0 ||
+		    kafs_mock_number(words[1], 65535, &b) < 0 ||
+		    kafs_mock_number(words[2], 65535, &c) < 0)
+			return 0;
+		rec->srv.priority = a;
+		rec->srv.weight = b;
+		rec->srv.port = c;
+		break;
+	case ns_t_afsdb:
+		if (nr_words != 2 ||
+		    kafs_mock_number(words[0], 65535, &a) < 0)
+			return 0;
+		rec->afsdb_subtype = a;
+		break;
+	default:
+		return nr_words == 0;
+	}
+
+	rec->target = strdup(words[nr_words - 1]);
+	if (!rec->target)
+		return -1;
+	kafs_mock_strip_dot(rec->target);
+	return 1;
+}
+
+/*
+ * Parse one line of a fixture.  Returns 1 on success, 0 if there was a syntax
+ * error (which has been reported) and -1 on a system error.
+ */
+static int kafs_mock_parse_line(struct kafs_mock_resolver *mock, char *line,
+				unsigned int *_ttl, unsigned int *_latency,
+				struct kafs_report *report)
+{
+	struct kafs_mock_record *rec, *records;
+	unsigned int nr_words = 0, w, i;
+	char *words[8], *p, *save;
+	int ret;
+
+	p = strpbrk(line, ";#\n");
+	if (p)
+		*p = 0;
+
+	for (p = strtok_r(line, " \t\r", &save); p; p = strtok_r(NULL, " \t\r", &save)) {
+		if (nr_words >= 8)
+			goto syntax_error;
+		words[nr_words++] = p;
+	}
+	if (nr_words == 0)
+		return 1;
+
+	if (strcasecmp(words[0], "$TTL") == 0) {
+		if (nr_words != 2 || kafs_mock_number(words[1], UINT_MAX, _ttl) < 0)
+			goto syntax_error;
+		return 1;
+	}
+	if (strcasecmp(words[0], "$LATENCY") == 0) {
+		if (nr_words != 2 || kafs_mock_number(words[1], UINT_MAX, _latency) < 0)
+			goto syntax_error;
+		return 1;
+	}
+	if (words[0][0] == '$' || nr_words < 2)
+		goto syntax_error;
+
+	if (mock->nr_records >= mock->max_records) {
+		w = mock->max_records ? mock->max_records * 2 : 64;
+		records = realloc(mock->records, w * sizeof(*records));
+		if (!records)
+			return -1;
+		mock->records = records;
+		mock->max_records = w;
+	}
+	rec = &mock->records[mock->nr_records];
+	memset(rec, 0, sizeof(*rec));
+	rec->ttl = *_ttl;
+	rec->latency = *_latency;
+	rec->order = mock->nr_records;
+
+	w = 1;
+	if (isdigit(words[w][0]) &&
+	    kafs_mock_number(words[w++], UINT_MAX, &rec->ttl) < 0)
+		goto syntax_error;
+	if (w < nr_words && strcasecmp(words[w], "IN") == 0)
+		w++;
+	if (w >= nr_words)
+		goto syntax_error;
+
+	for (i = 0; i < sizeof(kafs_mock_types) / sizeof(kafs_mock_types[0]); i++)
+		if (strcasecmp(words[w], kafs_mock_types[i].name) == 0)
+			break;
+	if (i >= sizeof(kafs_mock_types) / sizeof(kafs_mock_types[0])) {
+		report->error("%s:%u: Unsupported record type '%s'",
+			      report->what, report->line, words[w]);
+		return 0;
+	}
+	rec->type = kafs_mock_types[i].type;
+	w++;
+
+	ret = kafs_mock_parse_rdata(rec, words + w, nr_words - w);
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		goto syntax_error;
+
+	rec->name = strdup(words[0]);
+	if (!rec->name) {
+		free(rec->target);
+		return -1;
+	}
+	kafs_mock_strip_dot(rec->name);
+	mock->nr_records++;
+	return 1;
+
+syntax_error:
+	report->error("%s:%u: Syntax error", report->what, report->line);
+	return 0;
+}
+
+/*
+ * Find the records for a name.  Returns the first record or NULL.
+ */
+static const struct kafs_mock_record *
+kafs_mock_find(const struct kafs_mock_resolver *mock, const char *name,
+	       unsigned int *_nr)
+{
+	const struct kafs_mock_record *r = NULL;
+	unsigned int lo = 0, hi = mock->nr_records, mid, n;
+	char key[NS_MAXDNAME];
+	int cmp;
+
+	snprintf(key, sizeof(key), "%s", name);
+	kafs_mock_strip_dot(key);
+
+	/* Find the first record for the name. */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = strcasecmp(mock->records[mid].name, key);
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			if (cmp == 0)
+				r = &mock->records[mid];
+			hi = mid;
+		}
+	}
+
+	if (!r)
+		return NULL;
+	for (n = 0; r + n < mock->records + mock->nr_records; n++)
+		if (strcasecmp(r[n].name, key) != 0)
+			break;
+	*_nr = n;
+	return r;
+}
+
+/*
+ * Pretend to take some time over a lookup.
+ */
+static void kafs_mock_delay(const struct kafs_mock_resolver *mock,
+			    const struct kafs_mock_record *r)
+{
+	unsigned int ms = r ? r->latency : mock->latency;
+	struct timespec ts = {
+		.tv_sec		= ms / 1000,
+		.tv_nsec	= (ms % 1000) * 1000000,
+	};
+
+	if (ms)
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+}
+
+/*
+ * Append a resource record to a response.  Returns -1 if it won't fit.
+ */
+static int kafs_mock_put_rr(const struct kafs_mock_record *r,
+			    u_char **_p, u_char *end,
+			    const u_char **dnptrs, const u_char **lastdnptr)
+{
+	u_char *p = *_p, *rdlen;
+	int n;
+
+	n = dn_comp(r->name, p, end - p, (u_char **)dnptrs, (u_char **)lastdnptr);
+	if (n < 0 || end - (p + n) < NS_RRFIXEDSZ)
+		return -1;
+	p += n;
+	NS_PUT16(r->type, p);
+	NS_PUT16(ns_c_in, p);
+	NS_PUT32(r->ttl, p);
+	rdlen = p;
+	p += NS_INT16SZ;
+
+	switch (r->type) {
+	case ns_t_a:
+		if (end - p < NS_INADDRSZ)
+			return -1;
+		memcpy(p, &r->a, NS_INADDRSZ);
+		p += NS_INADDRSZ;
+		break;
+	case ns_t_aaaa:
+		if (end - p < NS_IN6ADDRSZ)
+			return -1;
+		memcpy(p, &r->aaaa, NS_IN6ADDRSZ);
+		p += NS_IN6ADDRSZ;
+		break;
+	case ns_t_srv:
+		if (end - p < 3 * NS_INT16SZ)
+			return -1;
+		NS_PUT16(r->srv.priority, p);
+		NS_PUT16(r->srv.weight, p);
+		NS_PUT16(r->srv.port, p);
+		goto target;
+	case ns_t_afsdb:
+		if (end - p < NS_INT16SZ)
+			return -1;
+		NS_PUT16(r->afsdb_subtype, p);
+	target:
+		n = dn_comp(r->target, p, end - p, (u_char **)dnptrs, (u_char **)lastdnptr);
+		if (n < 0)
+			return -1;
+		p += n;
+		break;
+	}
+
+	NS_PUT16(p - (rdlen + NS_INT16SZ), rdlen);
+	*_p = p;
+	return 0;
+}
+
+/*
+ * Answer a query from the fixture, building a response message just like a
+ * nameserver would.
+ */
+static int kafs_mock_query(const struct kafs_resolver *resolver,
+			   const char *name, int type,
+			   unsigned char *answer, int anslen, int *_herr)
+{
+	const struct kafs_mock_resolver *mock = (const struct kafs_mock_resolver *)resolver;
+	const struct kafs_mock_record *r;
+	const u_char *dnptrs[32], **lastdnptr = dnptrs + 32;
+	unsigned int nr = 0, i, ancount = 0;
+	HEADER *hdr = (HEADER *)answer;
+	u_char *p = answer, *end = answer + anslen;
+	int n;
+
+	r = kafs_mock_find(mock, name, &nr);
+	kafs_mock_delay(mock, r);
+	if (!r) {
+		*_herr = HOST_NOT_FOUND;
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (r[i].type == KAFS_MOCK_SERVFAIL) {
+			*_herr = TRY_AGAIN;
+			return -1;
+		}
+	}
+
+	if (anslen < HFIXEDSZ)
+		goto too_big;
+	memset(hdr, 0, HFIXEDSZ);
+	hdr->id = htons(1);
+	hdr->qr = 1;
+	hdr->aa = 1;
+	hdr->rd = 1;
+	hdr->ra = 1;
+	hdr->qdcount = htons(1);
+	p += HFIXEDSZ;
+
+	dnptrs[0] = answer;
+	dnptrs[1] = NULL;
+	n = dn_comp(name, p, end - p, (u_char **)dnptrs, (u_char **)lastdnptr);
+	if (n < 0 || end - (p + n) < NS_QFIXEDSZ)
+		goto too_big;
+	p += n;
+	NS_PUT16(type, p);
+	NS_PUT16(ns_c_in, p);
+
+	for (i = 0; i < nr; i++) {
+		if (r[i].type != type)
+			continue;
+		if (kafs_mock_put_rr(&r[i], &p, end, dnptrs, lastdnptr) < 0)
+			goto too_big;
+		ancount++;
+	}
+
+	if (ancount == 0) {
+		*_herr = NO_DATA;
+		return -1;
+	}
+
+	hdr->ancount = htons(ancount);
+	return p - answer;
+
+too_big:
+	*_herr = NO_RECOVERY;
+	return -1;
+}
+
+/*
+ * Look up a host's addresses in the fixture.
+ */
+static int kafs_mock_getaddrinfo(const struct kafs_resolver *resolver,
+				 const char *node, const struct addrinfo *hints,
+				 struct addrinfo **_result)
+{
+	const struct kafs_mock_resolver *mock = (const struct kafs_mock_resolver *)resolver;
+	const struct kafs_mock_record *r;
+	struct kafs_mock_addrinfo *mai;
+	struct addrinfo *head = NULL, **pp = &head;
+	unsigned int nr = 0, i;
+	int family = hints ? hints->ai_family : AF_UNSPEC;
+
+	r = kafs_mock_find(mock, node, &nr);
+	kafs_mock_delay(mock, r);
+	if (!r)
+		return EAI_NONAME;
+
+	for (i = 0; i < nr; i++)
+		if (r[i].type == KAFS_MOCK_SERVFAIL)
+			return EAI_AGAIN;
+
+	for (i = 0; i < nr; i++) {
+		if (!((r[i].type == ns_t_a && family != AF_INET6) ||
+		      (r[i].type == ns_t_aaaa && family != AF_INET)))
+			continue;
+
+		mai = calloc(1, sizeof(*mai));
+		if (!mai) {
+			resolver->freeaddrinfo(resolver, head);
+			return EAI_MEMORY;
+		}
+
+		mai->ai.ai_socktype = hints ? hints->ai_socktype : 0;
+		mai->ai.ai_protocol = hints ? hints->ai_protocol : 0;
+		mai->ai.ai_addr = (struct sockaddr *)&mai->sin;
+		if (r[i].type == ns_t_a) {
+			mai->ai.ai_family = AF_INET;
+			mai->ai.ai_addrlen = sizeof(mai->sin);
+			mai->sin.sin_family = AF_INET;
+			mai->sin.sin_addr = r[i].a;
+		} else {
+			mai->ai.ai_family = AF_INET6;
+			mai->ai.ai_addrlen = sizeof(mai->sin6);
+			mai->sin6.sin6_family = AF_INET6;
+			mai->sin6.sin6_addr = r[i].aaaa;
+		}
+
+		*pp = &mai->ai;
+		pp = &mai->ai.ai_next;
+	}
+
+	if (!head) {
+#ifdef EAI_NODATA
+		return EAI_NODATA;
+#else
+		return EAI_NONAME;
+#endif
+	}
+
+	*_result = head;
+	return 0;
+}
+
+static void kafs_mock_freeaddrinfo(const struct kafs_resolver *resolver,
+				   struct addrinfo *res)
+{
+	struct addrinfo *next;
+
+	for (; res; res = next) {
+		next = res->ai_next;
+		free(res);
+	}
+}
+
+/*
+ * Free a mock resolver once the last lookup using it has finished.
+ */
+static void kafs_mock_release(struct kafs_resolver *resolver)
+{
+	struct kafs_mock_resolver *mock = (struct kafs_mock_resolver *)resolver;
+	unsigned int i;
+
+	for (i = 0; i < mock->nr_records; i++) {
+		free(mock->records[i].name);
+		free(mock->records[i].target);
+	}
+	free(mock->records);
+	free(mock);
+}
+
+/*
+ * Load a fixture and build a mock resolver from it.
+ */
+struct kafs_resolver *kafs_new_mock_resolver(const char *fixture,
+					     struct kafs_report *report)
+{
+	struct kafs_mock_resolver *mock;
+	const char *old_file = report->what;
+	unsigned int ttl = 300, latency = 0, i;
+	size_t size = 0;
+	char *line = NULL;
+	FILE *f;
+	int ret;
+
+	mock = calloc(1, sizeof(*mock));
+	if (!mock)
+		goto system_error;
+	mock->resolver.name		= "mock";
+	mock->resolver.query		= kafs_mock_query;
+	mock->resolver.getaddrinfo	= kafs_mock_getaddrinfo;
+	mock->resolver.freeaddrinfo	= kafs_mock_freeaddrinfo;
+	mock->resolver.release		= kafs_mock_release;
+	mock->resolver.usage		= 1;
+
+	f = fopen(fixture, "r");
+	if (!f) {
+		report->error("%s: %m", fixture);
+		goto error;
+	}
+
+	report->what = fixture;
+	report->line = 0;
+	while (getline(&line, &size, f) != -1) {
+		report->line++;
+		ret = kafs_mock_parse_line(mock, line, &ttl, &latency, report);
+		if (ret == 1)
+			continue;
+		if (ret < 0)
+			report->error("%m");
+		report->bad_config |= ret == 0;
+		report->bad_error |= ret < 0;
+		free(line);
+		fclose(f);
+		goto error;
+	}
+
+	free(line);
+	fclose(f);
+	report->what = old_file;
+
+	mock->latency = latency;
+	qsort(mock->records, mock->nr_records, sizeof(mock->records[0]),
+	      kafs_mock_cmp_name);
+
+	/* The latency for a name is the one in force at its first record. */
+	for (i = 1; i < mock->nr_records; i++)
+		if (strcasecmp(mock->records[i].name, mock->records[i - 1].name) == 0)
+			mock->records[i].latency = mock->records[i - 1].latency;
+
+	if (report->verbose)
+		report->verbose("%s: Loaded %u records", fixture, mock->nr_records);
+	return &mock->resolver;
+
+system_error:
+	report->error("%m");
+	report->bad_error = true;
+	return NULL;
+error:
+	report->what = old_file;
+	kafs_free_mock_resolver(&mock->resolver);
+	return NULL;
+}
+
+/*
+ * Drop the creator's reference on a mock resolver.  It must no longer be
+ * attached to any lookup context, but address lookups that were abandoned
+ * whilst using it may still be running; it's freed when they finish.
+ */
+void kafs_free_mock_resolver(struct kafs_resolver *resolver)
+{
+	kafs_put_resolver(resolver);
+}
@@ -16,12 +16,14 @@
 #include <arpa/inet.h>
 #include <kafs/cellserv.h>
 #include <kafs/profile.h>
+#include "lib_internal.h"
 
 /*
  * Initialise state in a lookup context.
  */
 int kafs_init_lookup_context(struct kafs_lookup_context *ctx)
 {
+	ctx->dns = NULL;
 	memset(&ctx->res, 0, sizeof(ctx->res));
 	if (res_ninit(&ctx->res) < 0) {
 		ctx->report.bad_error = true;
@@ -36,6 +38,7 @@ int kafs_init_lookup_context(struct kafs_lookup_context *ctx)
  */
 void kafs_clear_lookup_context(struct kafs_lookup_context *ctx)
 {
+	kafs_dns_free_engine(ctx);
 	res_nclose(&ctx->res);
 }
 
@@ -58,7 +61,100 @@ struct kafs_server_list *kafs_alloc_server_list(struct kafs_report *report)
 }
 
 /*
- * Free a server list.
+ * Allocate a packed server list: a single block holding the list, an array of
+ * nr_servers server records, a pool of nr_addrs addresses and a string table
+ * of the given size.  The caller fills in the servers, marking the names and
+ * addresses as borrowed if they point into the block, and updates nr_servers.
+ */
+struct kafs_server_list *kafs_alloc_packed_server_list(unsigned int nr_servers,
+						       unsigned int nr_addrs,
+						       size_t strings,
+						       struct kafs_server_addr **_addrs,
+						       char **_strings,
+						       struct kafs_report *report)
+{
+	struct kafs_server_list *sl;
+	size_t o_servers, o_addrs, o_strings, size;
+
+	o_servers = sizeof(*sl);
+	o_addrs = o_servers + nr_servers * sizeof(struct kafs_server);
+	o_strings = o_addrs + nr_addrs * sizeof(struct kafs_server_addr);
+	size = o_strings + strings;
+
+	sl = calloc(1, size);
+	if (!sl) {
+		report->bad_error = true;
+		report->error("%m");
+		return NULL;
+	}
+
+	sl->ttl = UINT_MAX;
+	sl->packed_size = size;
+	sl->max_servers = nr_servers;
+	if (nr_servers)
+		sl->servers = (void *)sl + o_servers;
+	if (_addrs)
+		*_addrs = (void *)sl + o_addrs;
+	if (_strings)
+		*_strings = (void *)sl + o_strings;
+	return sl;
+}
+
+/*
+ * Make a packed copy of a server list.  The copy shares nothing with the
+ * original.
+ */
+struct kafs_server_list *kafs_pack_server_list(const struct kafs_server_list *from,
+					       struct kafs_report *report)
+{
+	struct kafs_server_list *sl;
+	struct kafs_server_addr *addrs;
+	unsigned int i, nr_addrs = 0;
+	size_t strings = 0, n;
+	char *p;
+
+	for (i = 0; i < from->nr_servers; i++) {
+		nr_addrs += from->servers[i].nr_addrs;
+		strings += strlen(from->servers[i].name) + 1;
+	}
+
+	sl = kafs_alloc_packed_server_list(from->nr_servers, nr_addrs, strings,
+					   &addrs, &p, report);
+	if (!sl)
+		return NULL;
+
+	sl->ttl = from->ttl;
+	sl->source = from->source;
+	sl->status = from->status;
+	sl->nr_servers = from->nr_servers;
+
+	for (i = 0; i < from->nr_servers; i++) {
+		const struct kafs_server *f = &from->servers[i];
+		struct kafs_server *s = &sl->servers[i];
+
+		*s = *f;
+		n = strlen(f->name) + 1;
+		memcpy(p, f->name, n);
+		s->name = p;
+		p += n;
+
+		s->addrs = f->nr_addrs ? addrs : NULL;
+		s->max_addrs = 0;
+		if (f->nr_addrs) {
+			memcpy(addrs, f->addrs, f->nr_addrs * sizeof(*addrs));
+			addrs += f->nr_addrs;
+		}
+
+		s->borrowed_name = true;
+		s->borrowed_addrs = true;
+	}
+
+	return sl;
+}
+
+/*
+ * Free a server list.  Anything attached to a packed list after it was built
+ * is freed separately.
  */
 void kafs_free_server_list(struct kafs_server_list *sl)
 {
@@ -72,25 +168,72 @@ void kafs_free_server_list(struct kafs_server_list *sl)
 			if (!s->borrowed_addrs)
 				free(s->addrs);
 		}
-		free(sl->servers);
+		if (!sl->packed_size)
+			free(sl->servers);
 	}
 
 	free(sl);
 }
 
 /*
- * Free a cell.
+ * Get a reference on a cell.  Cells from the config are shared this way rather
+ * than being copied and must be treated as read-only.  Each reference on a
+ * cell that borrows from a config also pins that config.
+ */
+struct kafs_cell *kafs_get_cell(struct kafs_cell *cell)
+{
+	if (cell->config)
+		kafs_get_config(cell->config);
+	__atomic_add_fetch(&cell->usage, 1, __ATOMIC_RELAXED);
+	return cell;
+}
+
+/*
+ * Drop a reference on a cell without dropping the config it pins.  A cell that
+ * the caller allocated and filled in itself has a zero count and is just freed.
+ */
+static void kafs_drop_cell(struct kafs_cell *cell)
+{
+	if (__atomic_load_n(&cell->usage, __ATOMIC_ACQUIRE) == 0 ||
+	    __atomic_sub_fetch(&cell->usage, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (!cell->borrowed_name)	free(cell->name);
+		if (!cell->borrowed_desc)	free(cell->desc);
+		if (!cell->borrowed_realm)	free(cell->realm);
+
+		if (cell->vlservers)
+			kafs_free_server_list(cell->vlservers);
+
+		free(cell);
+	}
+}
+
+/*
+ * Drop a reference on a cell, freeing it when the last one goes.
  */
 void kafs_free_cell(struct kafs_cell *cell)
 {
-	if (!cell->borrowed_name)	free(cell->name);
-	if (!cell->borrowed_desc)	free(cell->desc);
-	if (!cell->borrowed_realm)	free(cell->realm);
+	struct kafs_config *config = cell->config;
 
-	if (cell->vlservers)
-		kafs_free_server_list(cell->vlservers);
+	kafs_drop_cell(cell);
+	if (config)
+		kafs_put_config(config);
+}
 
-	free(cell);
+/*
+ * Free a cell database and the cells in it.  The database's own references on
+ * its cells don't pin the config that owns them.  A cell may be shared with
+ * the database of the config that a config was reloaded from.  The cells of a
+ * database loaded from an image that were never looked up were never built.
+ */
+void kafs_free_cell_db(struct kafs_cell_db *db)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->nr_cells; i++)
+		if (db->cells[i])
+			kafs_drop_cell(db->cells[i]);
+	free(db->index);
+	free(db);
 }
 
 /*
@@ -105,6 +248,16 @@ void kafs_transfer_addresses(struct kafs_server *to,
 	to->borrowed_addrs = true;
 }
 
+/*
+ * Make a deep copy of a server list that shares nothing with the original.
+ * The copy is packed into a single allocation.
+ */
+struct kafs_server_list *kafs_dup_server_list(const struct kafs_server_list *from,
+					      struct kafs_report *report)
+{
+	return kafs_pack_server_list(from, report);
+}
+
 /*
  * Transfer the list of servers from one server list to another.
  */
@@ -140,7 +293,8 @@ int kafs_transfer_server_list(struct kafs_server_list *to,
 }
 
 /*
- * Transfer information from one cell record to another.
+ * Transfer information from one cell record to another.  The strings are
+ * borrowed, so the destination pins any config the source belongs to.
  */
 void kafs_transfer_cell(struct kafs_cell *to, const struct kafs_cell *from)
 {
@@ -161,4 +315,8 @@ void kafs_transfer_cell(struct kafs_cell *to, const struct kafs_cell *from)
 
 	to->use_dns = from->use_dns;
 	to->show_cell = from->show_cell;
+	to->hot = from->hot;
+
+	if (from->config && !to->config)
+		to->config = kafs_get_config(from->config);
 }
@@ -17,9 +17,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <kafs/profile.h>
+#include "lib_internal.h"
 
 #define report_error(r, fmt, ...)					\
 	({								\
@@ -53,20 +56,307 @@ void kafs_profile_dump(const struct kafs_profile *p, unsigned int depth)
 	}
 }
 
+/*
+ * Arena chunk.  Small allocations are carved sequentially out of the chunk at
+ * the front of the list; large ones get a chunk of their own that is tucked in
+ * behind it.
+ */
+#define KAFS_PROFILE_CHUNK_SIZE	(64 * 1024 - 64)
+#define KAFS_PROFILE_ALIGN	(2 * sizeof(void *))
+
+struct kafs_profile_chunk {
+	struct kafs_profile_chunk *next;
+	size_t			size;
+	size_t			used;
+	char			data[] __attribute__((aligned(KAFS_PROFILE_ALIGN)));
+};
+
+static void *kafs_profile_alloc(struct kafs_profile_tree *tree, size_t size)
+{
+	struct kafs_profile_chunk *chunk = tree->chunks;
+	void *p;
+
+	size = (size + KAFS_PROFILE_ALIGN - 1) & ~(KAFS_PROFILE_ALIGN - 1);
+
+	if (size > KAFS_PROFILE_CHUNK_SIZE / 4) {
+		struct kafs_profile_chunk *big;
+
+		big = malloc(sizeof(*big) + size);
+		if (!big)
+			return NULL;
+		big->size = size;
+		big->used = size;
+		if (chunk) {
+			big->next = chunk->next;
+			chunk->next = big;
+		} else {
+			big->next = NULL;
+			tree->chunks = big;
+		}
+		return big->data;
+	}
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk = malloc(sizeof(*chunk) + KAFS_PROFILE_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+		chunk->size = KAFS_PROFILE_CHUNK_SIZE;
+		chunk->used = 0;
+		chunk->next = tree->chunks;
+		tree->chunks = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+	return p;
+}
+
+/*
+ * Discard a profile tree and everything allocated to it.  Anything that
+ * borrowed strings from the tree, such as a cell database parsed from it, must
+ * be discarded first.
+ */
+void kafs_profile_free(struct kafs_profile *prof)
+{
+	struct kafs_profile_tree *tree = prof->tree;
+	struct kafs_profile_chunk *chunk;
+
+	if (!tree)
+		return;
+
+	while ((chunk = tree->chunks)) {
+		tree->chunks = chunk->next;
+		free(chunk);
+	}
+
+	free(tree);
+	prof->tree = NULL;
+	prof->relations = NULL;
+	prof->index = NULL;
+	prof->nr_relations = 0;
+	prof->max_relations = 0;
+}
+
+/*
+ * Get the state attached to the root of the tree, creating it if necessary.
+ */
+static struct kafs_profile_tree *kafs_profile_get_tree(struct kafs_profile *prof)
+{
+	struct kafs_profile_tree *tree = prof->tree;
+
+	if (!tree) {
+		tree = calloc(1, sizeof(*tree));
+		if (!tree)
+			return NULL;
+		tree->sources_tail = &tree->sources;
+		prof->tree = tree;
+	}
+	return tree;
+}
+
+/*
+ * Allocate memory from a tree's arena so that it lasts as long as the tree.
+ */
+void *kafs_profile_arena_alloc(struct kafs_profile *root, size_t size)
+{
+	struct kafs_profile_tree *tree = kafs_profile_get_tree(root);
+
+	return tree ? kafs_profile_alloc(tree, size) : NULL;
+}
+
+/*
+ * Note a file or directory that we've read so that we can tell later whether
+ * what we derived from it has gone stale.
+ */
+static int kafs_profile_add_source(struct kafs_profile_tree *tree,
+				   const char *path,
+				   const struct stat *st)
+{
+	struct kafs_profile_source *src;
+	size_t len = strlen(path);
+
+	src = kafs_profile_alloc(tree, sizeof(*src) + len + 1);
+	if (!src)
+		return -1;
+	memset(src, 0, sizeof(*src));
+	memcpy(src->path, path, len + 1);
+	src->is_dir = S_ISDIR(st->st_mode);
+	src->is_root = tree->depth == 0;
+	src->depth = tree->depth;
+	src->mtime = st->st_mtim;
+	src->size = st->st_size;
+
+	*tree->sources_tail = src;
+	tree->sources_tail = &src->next;
+	return 0;
+}
+
+/*
+ * Name index for list nodes with lots of children.  The hash table maps each
+ * distinct type and name to the first child that has them and each child then
+ * points to the next with the same type and name, so that first-match order
+ * is preserved.  All references are relation numbers plus one, with 0 meaning
+ * none.
+ *
+ * The index is rebuilt, sized to match, whenever the relation vector is
+ * grown.
+ */
+#define KAFS_PROFILE_INDEX_THRESHOLD 8
+
+struct kafs_profile_index {
+	unsigned int		mask;
+	unsigned int		*slots;		/* First relation in each chain */
+	unsigned int		*tails;		/* Last relation in each chain */
+	unsigned int		next[];		/* Next relation in the chain */
+};
+
+static unsigned int kafs_profile_hash(enum kafs_profile_value_type type,
+				      const char *name)
+{
+	unsigned int hash = 2166136261U ^ type;
+
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Find the slot for a type and name, or the empty slot it would go in.
+ */
+static unsigned int kafs_profile_index_slot(const struct kafs_profile *prof,
+					    enum kafs_profile_value_type type,
+					    const char *name)
+{
+	const struct kafs_profile_index *ix = prof->index;
+	unsigned int slot;
+
+	for (slot = kafs_profile_hash(type, name) & ix->mask;
+	     ix->slots[slot];
+	     slot = (slot + 1) & ix->mask) {
+		const struct kafs_profile *r = prof->relations[ix->slots[slot] - 1];
+
+		if (r->type == type && strcmp(r->name, name) == 0)
+			break;
+	}
+
+	return slot;
+}
+
+static void kafs_profile_index_add(struct kafs_profile *prof, unsigned int n)
+{
+	struct kafs_profile_index *ix = prof->index;
+	const struct kafs_profile *r = prof->relations[n];
+	unsigned int slot = kafs_profile_index_slot(prof, r->type, r->name);
+
+	ix->next[n] = 0;
+	if (ix->slots[slot])
+		ix->next[ix->tails[slot] - 1] = n + 1;
+	else
+		ix->slots[slot] = n + 1;
+	ix->tails[slot] = n + 1;
+}
+
+static int kafs_profile_build_index(struct kafs_profile_tree *tree,
+				    struct kafs_profile *prof)
+{
+	struct kafs_profile_index *ix;
+	unsigned int size = 16, i;
+
+	while (size < prof->max_relations * 2)
+		size *= 2;
+
+	ix = kafs_profile_alloc(tree, sizeof(*ix) +
+				sizeof(ix->next[0]) * prof->max_relations);
+	if (!ix)
+		return -1;
+	ix->slots = kafs_profile_alloc(tree, sizeof(ix->slots[0]) * size);
+	ix->tails = kafs_profile_alloc(tree, sizeof(ix->tails[0]) * size);
+	if (!ix->slots || !ix->tails)
+		return -1;
+	memset(ix->slots, 0, sizeof(ix->slots[0]) * size);
+	ix->mask = size - 1;
+
+	prof->index = ix;
+	for (i = 0; i < prof->nr_relations; i++)
+		kafs_profile_index_add(prof, i);
+	return 0;
+}
+
+/*
+ * Find the number (plus one) of the first child of a list node with the given
+ * type and name, or 0 if there isn't one.
+ */
+static unsigned int kafs_profile_find_first(const struct kafs_profile *prof,
+					    enum kafs_profile_value_type type,
+					    const char *name)
+{
+	unsigned int i;
+
+	if (prof->index)
+		return prof->index->slots[kafs_profile_index_slot(prof, type, name)];
+
+	for (i = 0; i < prof->nr_relations; i++) {
+		const struct kafs_profile *r = prof->relations[i];
+
+		if (r->type == type &&
+		    strcmp(r->name, name) == 0)
+			return i + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Append a relation to a list.
+ */
+static int kafs_profile_add_relation(struct kafs_profile_tree *tree,
+				     struct kafs_profile *parent,
+				     struct kafs_profile *r)
+{
+	struct kafs_profile **list;
+	unsigned int n = parent->nr_relations;
+
+	/* Grow the vector geometrically.  The old one is left in the arena. */
+	if (n >= parent->max_relations) {
+		unsigned int max = parent->max_relations * 2 ?: 4;
+
+		list = kafs_profile_alloc(tree, sizeof(*list) * max);
+		if (!list)
+			return -1;
+		if (n)
+			memcpy(list, parent->relations, sizeof(*list) * n);
+		parent->relations = list;
+		parent->max_relations = max;
+
+		if (max > KAFS_PROFILE_INDEX_THRESHOLD &&
+		    kafs_profile_build_index(tree, parent) < 0)
+			return -1;
+	}
+
+	parent->relations[n] = r;
+	parent->nr_relations = n + 1;
+	if (parent->index)
+		kafs_profile_index_add(parent, n);
+	return 0;
+}
+
 /*
  * Find/create relation in the list to which we're contributing.
  *
  * If a list relation is already closed then it is replaced unless it is final,
  * in which case the new stuff is ignored.
  */
-static struct kafs_profile *kafs_profile_get_relation(struct kafs_profile *parent,
+static struct kafs_profile *kafs_profile_get_relation(struct kafs_profile_tree *tree,
+						      struct kafs_profile *parent,
 						      char *name,
 						      enum kafs_profile_value_type type,
 						      struct kafs_report *report)
 {
-	struct kafs_profile *r, **list = parent->relations;
+	struct kafs_profile *r;
 	bool dummy = false;
-	int i, n = parent->nr_relations;
+	unsigned int i;
 
 	if (parent->type != kafs_profile_value_is_list) {
 		report->error("%s:%u: Can't insert into a non-list",
@@ -75,12 +365,9 @@ static struct kafs_profile *kafs_profile_get_relation(struct kafs_profile *paren
 	}
 
 	if (type == kafs_profile_value_is_list) {
-		for (i = 0; i < n; i++) {
-			r = list[i];
-			if (r->type != kafs_profile_value_is_list ||
-			    strcmp(r->name, name) != 0)
-				continue;
-
+		i = kafs_profile_find_first(parent, kafs_profile_value_is_list, name);
+		if (i) {
+			r = parent->relations[i - 1];
 			if (r->final) {
 				dummy = true;
 				goto create;
@@ -92,7 +379,7 @@ static struct kafs_profile *kafs_profile_get_relation(struct kafs_profile *paren
 	}
 
 create:
-	r = malloc(sizeof(*r));
+	r = kafs_profile_alloc(tree, sizeof(*r));
 	if (!r)
 		return NULL;
 
@@ -102,57 +389,260 @@ create:
 	r->parent = parent;
 	r->dummy = dummy | parent->final | parent->dummy;
 
-	if (!r->dummy) {
-		list = realloc(list, sizeof(*list) * (n + 1));
-		if (!list)
-			return NULL;
+	if (!r->dummy && kafs_profile_add_relation(tree, parent, r) < 0)
+		return NULL;
+	return r;
+}
 
-		list[n] = r;
-		parent->relations = list;
-		parent->nr_relations = n + 1;
+/*
+ * Character classification for the tokeniser.  The text is classified a
+ * block at a time, giving a bitmask for each class of character that matters
+ * when splitting up a line, with bit n standing for byte n of the block.  The
+ * brackets, '#' and ';' only matter as the first or last character of a line,
+ * where it's cheaper to look at the byte directly.
+ *
+ * A block may extend past the end of the text, so buffers that are to be
+ * scanned must have KAFS_PROFILE_SCAN_PAD bytes of zeroed padding after the
+ * terminating NUL.
+ */
+#define KAFS_PROFILE_BLOCK	32
+#define KAFS_PROFILE_SCAN_PAD	KAFS_PROFILE_BLOCK
+
+#if defined(__AVX2__) || defined(__SSE2__) || \
+	(defined(__ARM_NEON) && defined(__aarch64__))
+#define KAFS_PROFILE_SIMD 1
+#else
+#define KAFS_PROFILE_SIMD 0
+#endif
+
+struct kafs_profile_classes {
+	uint32_t		eol;		/* '\n' or '\r' */
+	uint32_t		blank;		/* ' ' or '\t' */
+	uint32_t		eq;		/* '=' */
+	uint32_t		escape;		/* '\\' */
+};
+
+static bool kafs_profile_simd = KAFS_PROFILE_SIMD;
+
+/*
+ * Classify up to n bytes a byte at a time, stopping after the first line
+ * terminator.
+ */
+static void kafs_profile_classify_scalar(const char *b, size_t n,
+					 struct kafs_profile_classes *c)
+{
+	unsigned int i;
+
+	memset(c, 0, sizeof(*c));
+	if (n > KAFS_PROFILE_BLOCK)
+		n = KAFS_PROFILE_BLOCK;
+	for (i = 0; i < n; i++) {
+		switch (b[i]) {
+		case '\n':
+		case '\r':
+			c->eol |= 1U << i;
+			return;
+		case ' ':
+		case '\t':
+			c->blank |= 1U << i;
+			break;
+		case '=':
+			c->eq |= 1U << i;
+			break;
+		case '\\':
+			c->escape |= 1U << i;
+			break;
+		}
 	}
+}
 
-	return r;
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+static void kafs_profile_classify_simd(const char *b, struct kafs_profile_classes *c)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)b);
+
+#define CLASS(ch) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch))
+	c->eol	  = _mm256_movemask_epi8(_mm256_or_si256(CLASS('\n'), CLASS('\r')));
+	c->blank  = _mm256_movemask_epi8(_mm256_or_si256(CLASS(' '), CLASS('\t')));
+	c->eq	  = _mm256_movemask_epi8(CLASS('='));
+	c->escape = _mm256_movemask_epi8(CLASS('\\'));
+#undef CLASS
 }
 
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+static void kafs_profile_classify_simd(const char *b, struct kafs_profile_classes *c)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i *)b);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(b + 16));
+
+#define MASK(v, ch) _mm_cmpeq_epi8(v, _mm_set1_epi8(ch))
+#define CLASS(ch) \
+	((uint32_t)_mm_movemask_epi8(MASK(lo, ch)) | \
+	 (uint32_t)_mm_movemask_epi8(MASK(hi, ch)) << 16)
+#define CLASS2(ch1, ch2)						\
+	((uint32_t)_mm_movemask_epi8(_mm_or_si128(MASK(lo, ch1), MASK(lo, ch2))) | \
+	 (uint32_t)_mm_movemask_epi8(_mm_or_si128(MASK(hi, ch1), MASK(hi, ch2))) << 16)
+	c->eol	  = CLASS2('\n', '\r');
+	c->blank  = CLASS2(' ', '\t');
+	c->eq	  = CLASS('=');
+	c->escape = CLASS('\\');
+#undef CLASS2
+#undef CLASS
+#undef MASK
+}
+
+#elif KAFS_PROFILE_SIMD
+#include <arm_neon.h>
+
 /*
- * Parse the contents of a kafs_profile file.
+ * NEON has no movemask, so weight each lane by its bit and add up each half.
  */
-static int kafs_profile_parse_content(struct kafs_profile *prof, const char *file,
-				      char *p, char *end,
-				      struct kafs_report *report)
+static inline uint32_t kafs_profile_movemask(uint8x16_t m)
 {
-	struct kafs_profile *section = NULL, *list = NULL, *tmp;
-	unsigned int line = 0;
-	char *eol, *next_line = p, *key, *value;
-	bool at_left;
+	static const uint8_t weights[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+	};
+	uint8x16_t w = vandq_u8(m, vld1q_u8(weights));
 
-next_line:
-	p = next_line;
-	line++;
-	report->line = line;
-	at_left = p < end && !isblank(*p);
-	while (p < end && isblank(*p)) p++;
-	if (p == end)
-		return 0;
-	eol = strpbrk(p, "\n\r");
-	if (!eol) {
-		next_line = eol = end;
-	} else {
-		next_line = eol + 1;
-		if (next_line < end && *next_line != *eol &&
-		    (*next_line == '\n' || *next_line == '\r'))
-			next_line++; /* handle CRLF and LFCR */
-		while (eol > p && isblank(eol[-1]))
-			eol--;
-		*eol = 0;
+	return vaddv_u8(vget_low_u8(w)) | (uint32_t)vaddv_u8(vget_high_u8(w)) << 8;
+}
+
+static void kafs_profile_classify_simd(const char *b, struct kafs_profile_classes *c)
+{
+	uint8x16_t lo = vld1q_u8((const uint8_t *)b);
+	uint8x16_t hi = vld1q_u8((const uint8_t *)b + 16);
+
+#define MASK(v, ch) vceqq_u8(v, vdupq_n_u8(ch))
+#define CLASS(ch) \
+	(kafs_profile_movemask(MASK(lo, ch)) | \
+	 kafs_profile_movemask(MASK(hi, ch)) << 16)
+#define CLASS2(ch1, ch2)						\
+	(kafs_profile_movemask(vorrq_u8(MASK(lo, ch1), MASK(lo, ch2))) | \
+	 kafs_profile_movemask(vorrq_u8(MASK(hi, ch1), MASK(hi, ch2))) << 16)
+	c->eol	  = CLASS2('\n', '\r');
+	c->blank  = CLASS2(' ', '\t');
+	c->eq	  = CLASS('=');
+	c->escape = CLASS('\\');
+#undef CLASS2
+#undef CLASS
+#undef MASK
+}
+#endif
+
+/*
+ * Select whether the tokeniser uses the vector classifier, if there is one
+ * for this CPU, or classifies a byte at a time.  Returns whether the vector
+ * classifier is now in use.  This is so that one can be checked against the
+ * other.
+ */
+bool kafs_profile_set_simd(bool enable)
+{
+	kafs_profile_simd = enable && KAFS_PROFILE_SIMD;
+	return kafs_profile_simd;
+}
+
+/*
+ * The parts of a line that the tokeniser needs to find.
+ */
+struct kafs_profile_line {
+	char			*text;		/* First non-blank character */
+	char			*eol;		/* Line terminator or end of text */
+	char			*eq;		/* First '=' or NULL */
+	char			*escape;	/* First '\\' or NULL */
+};
+
+/*
+ * Find the end of the line starting at p and the things in it, a block at a
+ * time.  Only the bits for bytes before the terminator are looked at.
+ */
+static void kafs_profile_classify_line(char *p, char *end,
+				       struct kafs_profile_line *l)
+{
+	struct kafs_profile_classes c;
+	uint32_t valid, stop;
+	char *b;
+
+	l->text = NULL;
+	l->eq = NULL;
+	l->escape = NULL;
+
+	for (b = p; b < end; b += KAFS_PROFILE_BLOCK) {
+#if KAFS_PROFILE_SIMD
+		if (kafs_profile_simd)
+			kafs_profile_classify_simd(b, &c);
+		else
+#endif
+			kafs_profile_classify_scalar(b, end - b, &c);
+
+		valid = end - b >= KAFS_PROFILE_BLOCK ? ~0U : (1U << (end - b)) - 1;
+		stop = c.eol & valid;
+		if (stop)
+			valid = (stop & -stop) - 1;
+
+		if (!l->text && (~c.blank & valid))
+			l->text = b + __builtin_ctz(~c.blank & valid);
+		if (!l->eq && (c.eq & valid))
+			l->eq = b + __builtin_ctz(c.eq & valid);
+		if (!l->escape && (c.escape & valid))
+			l->escape = b + __builtin_ctz(c.escape & valid);
+		if (stop) {
+			l->eol = b + __builtin_ctz(stop);
+			goto found;
+		}
 	}
 
+	l->eol = end;
+found:
+	if (!l->text)
+		l->text = l->eol;
+}
+
+/*
+ * State of the line scanner that turns the text of a kafs_profile file into
+ * events.  The scanner keeps only the nesting depth; it's up to the consumer
+ * to build whatever it wants from the events.
+ */
+struct kafs_profile_scanner {
+	const char		*file;
+	off_t			offset;		/* File offset of the next line */
+	unsigned int		line;		/* Number of the last line scanned */
+	unsigned int		depth;		/* List nesting depth in the section */
+	bool			in_section;	/* T once a section has been opened */
+	kafs_profile_event_func_t func;
+	void			*data;
+};
+
+/*
+ * Scan a line that has been classified and emit an event for it if it's not
+ * blank or a comment.  The name and value strings are carved out of the line
+ * in place.
+ */
+static int kafs_profile_scan_line(struct kafs_profile_scanner *s,
+				  char *p, const struct kafs_profile_line *l,
+				  struct kafs_report *report)
+{
+	struct kafs_profile_event ev = {
+		.file	= s->file,
+		.line	= s->line,
+		.offset	= s->offset,
+	};
+	char *eol = l->eol, *key, *value;
+	bool at_left;
+
+	at_left = l->text == p;
+	p = l->text;
+	while (eol > p && isblank(eol[-1])) eol--;
+	*eol = 0;
+
 	if (!*p || p[0] == '#' || p[0] == ';')
-		goto next_line;
+		return 0;
 
 	/* Deal with section markers. */
-	if (list == section && p[0] == '[') {
+	if (s->depth == 0 && p[0] == '[') {
 		if (eol - p < 3 || eol[-1] != ']')
 			return parse_error(report, "Bad section label");
 		p++;
@@ -161,22 +651,18 @@ next_line:
 		if (strchr(p, ']'))
 			return parse_error(report, "Bad section label");
 
-		section = kafs_profile_get_relation(prof, p, kafs_profile_value_is_list,
-						    report);
-		if (!section)
-			return -1;
-		section->file = file;
-		section->line = line;
-		list = section;
-		goto next_line;
+		s->in_section = true;
+		ev.type = kafs_profile_event_section;
+		ev.name = p;
+		return s->func(&ev, s->data, report);
 	}
 
 	/* Things before the first section are either comments or inclusion
 	 * directives.
 	 */
-	if (!section) {
+	if (!s->in_section) {
 		if (!at_left || strncmp(p, "include", 7) != 0)
-			goto next_line;
+			return 0;
 		p += 7;
 
 		if (isblank(*p)) {
@@ -184,42 +670,37 @@ next_line:
 			while (*p && isblank(*p)) p++;
 			if (!*p)
 				return parse_error(report, "No include path");
-
-			if (kafs_profile_parse_file(prof, p, report) < 0)
-				return -1;
-		}
-
-		if (strncmp(p, "dir", 3) == 0 && (isblank(p[3]) || !p[3])) {
+			ev.type = kafs_profile_event_include;
+		} else if (strncmp(p, "dir", 3) == 0 && (isblank(p[3]) || !p[3])) {
 			/* It's an includedir directive */
 			p += 3;
 			while (*p && isblank(*p)) p++;
 			if (!*p)
 				return parse_error(report, "No includedir path");
-
-			if (kafs_profile_parse_dir(prof, p, report) < 0)
-				return -1;
+			ev.type = kafs_profile_event_include_dir;
+		} else {
+			return 0;
 		}
 
-		goto next_line;
+		ev.value = p;
+		return s->func(&ev, s->data, report);
 	}
 
 	/* Deal with the closure of a list */
 	if (p[0] == '}') {
-		if (list == section)
+		if (s->depth == 0)
 			return parse_error(report, "Unmatched '}'");
 		p++;
 		if (p[0] == '*') {
-			list->final = true;
+			ev.final = true;
 			p++;
 		}
 		if (*p)
 			return parse_error(report, "Unexpected stuff after '}'");
 
-		tmp = list;
-		list = list->parent;
-		if (tmp->dummy)
-			free(tmp);
-		goto next_line;
+		ev.type = kafs_profile_event_close;
+		ev.depth = s->depth--;
+		return s->func(&ev, s->data, report);
 	}
 
 	/* Everything else should be a relation specifier of one of the
@@ -229,7 +710,7 @@ next_line:
 	 *	x = { .. }
 	 */
 	key = p;
-	p = strchr(p, '=');
+	p = l->eq;
 	if (!p)
 		return parse_error(report, "Missing '=' in relation");
 	if (p == key)
@@ -241,19 +722,16 @@ next_line:
 	while (p > key && isblank(p[-1]))
 		p--;
 	*p = 0;
+	ev.name = key;
 
 	/* Handle the opening of a new list-type relation */
 	if (value[0] == '{') {
 		if (value[1])
 			return parse_error(report, "Unexpected stuff after '{'");
 
-		list = kafs_profile_get_relation(list, key, kafs_profile_value_is_list,
-						 report);
-		if (!list)
-			return -1;
-		list->file = file;
-		list->line = line;
-		goto next_line;
+		ev.type = kafs_profile_event_open;
+		ev.depth = ++s->depth;
+		return s->func(&ev, s->data, report);
 	}
 
 	/* Handle a relation with a quoted-string value */
@@ -266,8 +744,15 @@ next_line:
 		eol--;
 		eol[0] = 0;
 
-		/* Substitute for all the escape chars in place */
-		for (p = q = value; p < eol;) {
+		/* Substitute for all the escape chars in place, starting from
+		 * the first.
+		 */
+		p = l->escape;
+		if (!p || p >= eol)
+			p = eol;
+		else if (p < value)
+			p = value;
+		for (q = p; p < eol;) {
 			char ch = *p++;
 			if (ch == '\\') {
 				if (p >= eol)
@@ -286,13 +771,178 @@ next_line:
 		*q = 0;
 	}
 
-	tmp = kafs_profile_get_relation(list, key, kafs_profile_value_is_string, report);
-	if (!tmp)
-		return -1;
-	tmp->file = file;
-	tmp->line = line;
-	tmp->value = value;
-	goto next_line;
+	ev.type = kafs_profile_event_relation;
+	ev.depth = s->depth + 1;
+	ev.value = value;
+	return s->func(&ev, s->data, report);
+}
+
+/*
+ * Scan the lines in a buffer, which must be followed by a NUL and the scan
+ * padding.  If more is true, a line that isn't terminated within the buffer is
+ * left for the caller to complete.  *_p is advanced over the lines consumed.
+ * Returns 0 if the buffer was used up, -1 on error or whatever non-zero value
+ * the event handler returned to stop the scan.
+ */
+static int kafs_profile_scan(struct kafs_profile_scanner *s,
+			     char **_p, char *end, bool more,
+			     struct kafs_report *report)
+{
+	struct kafs_profile_line l;
+	char *p, *eol, *next_line = *_p;
+	int ret;
+
+	while (p = next_line, p < end) {
+		kafs_profile_classify_line(p, end, &l);
+		eol = l.eol;
+		if (eol == end) {
+			if (more)
+				break;
+			next_line = end;
+		} else {
+			next_line = eol + 1;
+			if (next_line == end && more)
+				break; /* Can't tell if it's a CRLF yet */
+			if (next_line < end && *next_line != *eol &&
+			    (*next_line == '\n' || *next_line == '\r'))
+				next_line++; /* handle CRLF and LFCR */
+		}
+
+		s->line++;
+		report->line = s->line;
+		ret = kafs_profile_scan_line(s, p, &l, report);
+		s->offset += next_line - p;
+		*_p = next_line;
+		if (ret != 0)
+			return ret;
+	}
+
+	*_p = p;
+	return 0;
+}
+
+/*
+ * Get the copy of a string to be put into a tree, copying it into the arena
+ * if the builder is in copy mode.
+ */
+static char *kafs_profile_build_string(struct kafs_profile_builder *b,
+				       struct kafs_profile_tree *tree,
+				       char *s)
+{
+	size_t len;
+	char *p;
+
+	if (!b->copy || !s)
+		return s;
+	len = strlen(s) + 1;
+	p = kafs_profile_alloc(tree, len);
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+/*
+ * Add the thing described by an event to the tree a builder is building.  The
+ * strings in the event are taken over unless the builder is in copy mode.
+ * Inclusion events are ignored; the caller must deal with those.
+ */
+int kafs_profile_build(struct kafs_profile_builder *b,
+		       const struct kafs_profile_event *ev,
+		       struct kafs_report *report)
+{
+	struct kafs_profile_tree *tree;
+	struct kafs_profile *r;
+	char *name;
+
+	tree = b->root->tree ?: kafs_profile_get_tree(b->root);
+	if (!tree)
+		return report_error(report, "%m");
+
+	if (b->file != ev->file &&
+	    (!b->copy || !b->file || strcmp(b->file, ev->file) != 0)) {
+		b->file = kafs_profile_build_string(b, tree, (char *)ev->file);
+		if (!b->file)
+			return report_error(report, "%m");
+	}
+
+	switch (ev->type) {
+	case kafs_profile_event_section:
+		b->list = b->root;
+		/* Fall through */
+	case kafs_profile_event_open:
+		name = kafs_profile_build_string(b, tree, ev->name);
+		if (!name)
+			return report_error(report, "%m");
+		r = kafs_profile_get_relation(tree, b->list, name,
+					      kafs_profile_value_is_list, report);
+		if (!r)
+			return -1;
+		r->file = b->file;
+		r->line = ev->line;
+		b->list = r;
+		return 0;
+
+	case kafs_profile_event_relation:
+		name = kafs_profile_build_string(b, tree, ev->name);
+		if (!name)
+			return report_error(report, "%m");
+		r = kafs_profile_get_relation(tree, b->list, name,
+					      kafs_profile_value_is_string, report);
+		if (!r)
+			return -1;
+		r->file = b->file;
+		r->line = ev->line;
+		r->value = kafs_profile_build_string(b, tree, ev->value);
+		if (!r->value)
+			return report_error(report, "%m");
+		return 0;
+
+	case kafs_profile_event_close:
+		if (ev->final)
+			b->list->final = true;
+		b->list = b->list->parent;
+		return 0;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Handle an event from a file being parsed into a tree, following inclusions
+ * and building everything else into the tree.
+ */
+static int kafs_profile_parse_event(const struct kafs_profile_event *ev,
+				    void *data,
+				    struct kafs_report *report)
+{
+	struct kafs_profile_builder *b = data;
+
+	switch (ev->type) {
+	case kafs_profile_event_include:
+		return kafs_profile_parse_file(b->root, ev->value, report);
+	case kafs_profile_event_include_dir:
+		return kafs_profile_parse_dir(b->root, ev->value, report);
+	default:
+		return kafs_profile_build(b, ev, report);
+	}
+}
+
+/*
+ * Parse the contents of a kafs_profile file.
+ */
+static int kafs_profile_parse_content(struct kafs_profile *prof, const char *file,
+				      char *p, char *end,
+				      struct kafs_report *report)
+{
+	struct kafs_profile_builder b = { .root = prof };
+	struct kafs_profile_scanner s = {
+		.file	= file,
+		.func	= kafs_profile_parse_event,
+		.data	= &b,
+	};
+
+	return kafs_profile_scan(&s, &p, end, false, report);
 }
 
 /*
@@ -301,23 +951,29 @@ next_line:
 int kafs_profile_parse_file(struct kafs_profile *prof, const char *file,
 			    struct kafs_report *report)
 {
+	struct kafs_profile_tree *tree;
 	const char *old_file = report->what;
 	struct stat st;
 	ssize_t n;
 	char *buffer;
 	int fd, ret;
 
+	tree = kafs_profile_get_tree(prof);
+	if (!tree)
+		return -1;
+
 	report->what = file;
 	fd = open(file, O_RDONLY);
 	if (fd == -1)
 		return -1;
 
-	if (fstat(fd, &st) == -1) {
+	if (fstat(fd, &st) == -1 ||
+	    kafs_profile_add_source(tree, file, &st) == -1) {
 		close(fd);
 		return -1;
 	}
 
-	buffer = malloc(st.st_size + 1);
+	buffer = kafs_profile_alloc(tree, st.st_size + 1 + KAFS_PROFILE_SCAN_PAD);
 	if (!buffer) {
 		close(fd);
 		return -1;
@@ -325,37 +981,354 @@ int kafs_profile_parse_file(struct kafs_profile *prof, const char *file,
 
 	n = read(fd, buffer, st.st_size);
 	close(fd);
-	if (n == -1) {
-		free(buffer);
+	if (n == -1)
 		return -1;
-	}
-	buffer[n] = 0;
+	memset(buffer + n, 0, 1 + KAFS_PROFILE_SCAN_PAD);
 
+	tree->depth++;
 	ret = kafs_profile_parse_content(prof, file, buffer, buffer + n, report);
+	tree->depth--;
 	if (ret == 0)
 		report->what = old_file;
 	return ret;
 }
 
 /*
- * Parse a kafs_profile directory.
+ * Set the number of threads that may be used to parse the fragments in an
+ * include directory.  0 or 1 means that they're parsed serially.  No more than
+ * KAFS_PROFILE_MAX_THREADS are used.
  */
-int kafs_profile_parse_dir(struct kafs_profile *prof,
-			   const char *dirname,
-			   struct kafs_report *report)
+int kafs_profile_set_threads(struct kafs_profile *prof, unsigned int nr_threads)
+{
+	struct kafs_profile_tree *tree;
+
+	tree = kafs_profile_get_tree(prof);
+	if (!tree)
+		return -1;
+	if (nr_threads > KAFS_PROFILE_MAX_THREADS)
+		nr_threads = KAFS_PROFILE_MAX_THREADS;
+	tree->nr_threads = nr_threads;
+	return 0;
+}
+
+/*
+ * A fragment from an include directory being parsed into a tree of its own.
+ */
+struct kafs_profile_fragment {
+	char			*filename;
+	struct kafs_profile	root;
+	int			ret;
+};
+
+struct kafs_profile_pool {
+	struct kafs_profile_fragment *frags;
+	unsigned int		nr_frags;
+	unsigned int		next;		/* Next fragment to parse */
+	unsigned int		depth;		/* Inclusion depth of the fragments */
+};
+
+static void kafs_profile_quiet(const char *fmt, ...)
+{
+}
+
+static void kafs_profile_parse_fragment(struct kafs_profile_fragment *frag,
+					unsigned int depth)
+{
+	struct kafs_report quiet = { .error = kafs_profile_quiet };
+	struct kafs_profile_tree *tree;
+
+	frag->root.type = kafs_profile_value_is_list;
+	tree = kafs_profile_get_tree(&frag->root);
+	if (!tree) {
+		frag->ret = -1;
+		return;
+	}
+	tree->depth = depth;
+	frag->ret = kafs_profile_parse_file(&frag->root, frag->filename, &quiet);
+}
+
+static void *kafs_profile_parse_worker(void *data)
+{
+	struct kafs_profile_pool *pool = data;
+	unsigned int i;
+
+	while (i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED),
+	       i < pool->nr_frags)
+		kafs_profile_parse_fragment(&pool->frags[i], pool->depth);
+	return NULL;
+}
+
+/*
+ * Merge a tree parsed from a fragment into the main tree.  This replays the
+ * fragment's relations in order through the same rules as are applied when
+ * parsing directly into the main tree, so that the result is the same.  Where
+ * a relation would just be added afresh, the fragment's node is grafted in
+ * whole rather than being copied.  The fragment's arena and source records are
+ * then taken over by the main tree.
+ */
+static int kafs_profile_merge(struct kafs_profile_tree *tree,
+			      struct kafs_profile *to,
+			      struct kafs_profile *from,
+			      struct kafs_report *report)
+{
+	unsigned int i;
+
+	for (i = 0; i < from->nr_relations; i++) {
+		struct kafs_profile *f = from->relations[i];
+		struct kafs_profile *r;
+
+		if (!to->final && !to->dummy &&
+		    (f->type == kafs_profile_value_is_string ||
+		     !kafs_profile_find_first(to, kafs_profile_value_is_list, f->name))) {
+			f->parent = to;
+			if (kafs_profile_add_relation(tree, to, f) < 0)
+				return -1;
+			continue;
+		}
+
+		report->what = f->file;
+		report->line = f->line;
+		r = kafs_profile_get_relation(tree, to, f->name, f->type, report);
+		if (!r)
+			return -1;
+		if (r->dummy)
+			continue;
+
+		r->file = f->file;
+		r->line = f->line;
+		if (f->type == kafs_profile_value_is_string) {
+			r->value = f->value;
+			continue;
+		}
+
+		if (kafs_profile_merge(tree, r, f, report) < 0)
+			return -1;
+		if (f->final)
+			r->final = true;
+	}
+
+	return 0;
+}
+
+static void kafs_profile_adopt(struct kafs_profile_tree *tree,
+			       struct kafs_profile *frag)
+{
+	struct kafs_profile_tree *ftree = frag->tree;
+	struct kafs_profile_chunk *last;
+
+	if (ftree->chunks) {
+		for (last = ftree->chunks; last->next; last = last->next)
+			;
+		if (tree->chunks) {
+			last->next = tree->chunks->next;
+			tree->chunks->next = ftree->chunks;
+		} else {
+			tree->chunks = ftree->chunks;
+		}
+	}
+
+	if (ftree->sources) {
+		*tree->sources_tail = ftree->sources;
+		tree->sources_tail = ftree->sources_tail;
+	}
+
+	free(ftree);
+	frag->tree = NULL;
+}
+
+/*
+ * Parse the fragments from an include directory in parallel and then merge
+ * them in order.  If a fragment can't be parsed, it is parsed again directly
+ * into the main tree so that the errors get reported in the right order and
+ * the tree ends up in the same state as if the fragments had been parsed
+ * serially.
+ */
+static int kafs_profile_parse_fragments(struct kafs_profile *prof,
+					char **files, unsigned int nr_files,
+					struct kafs_report *report)
+{
+	struct kafs_profile_tree *tree = prof->tree;
+	struct kafs_profile_pool pool = {};
+	pthread_t threads[KAFS_PROFILE_MAX_THREADS];
+	unsigned int nr_threads = 0, i;
+	int ret = 0;
+
+	pool.frags = calloc(nr_files, sizeof(pool.frags[0]));
+	if (!pool.frags)
+		return report_error(report, "%m");
+	pool.nr_frags = nr_files;
+	pool.depth = tree->depth;
+	for (i = 0; i < nr_files; i++)
+		pool.frags[i].filename = files[i];
+
+	for (i = 0; i < tree->nr_threads && i < nr_files; i++) {
+		if (pthread_create(&threads[i], NULL,
+				   kafs_profile_parse_worker, &pool) != 0)
+			break;
+		nr_threads++;
+	}
+
+	/* Lend a hand, and take over entirely if there are no threads. */
+	kafs_profile_parse_worker(&pool);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < nr_files; i++) {
+		struct kafs_profile_fragment *frag = &pool.frags[i];
+
+		if (ret < 0 || frag->ret < 0 || !frag->root.tree) {
+			kafs_profile_free(&frag->root);
+			if (ret == 0)
+				ret = kafs_profile_parse_file(prof, frag->filename, report);
+			continue;
+		}
+
+		ret = kafs_profile_merge(tree, prof, &frag->root, report);
+		kafs_profile_adopt(tree, &frag->root);
+	}
+
+	free(pool.frags);
+	return ret;
+}
+
+static int kafs_profile_cmp_filenames(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Add a list relation to a node in a tree, or find the existing one of that
+ * name, as if it had been opened in a file.  The name isn't copied.
+ */
+struct kafs_profile *kafs_profile_add_list(struct kafs_profile *root,
+					   struct kafs_profile *parent,
+					   const char *name,
+					   struct kafs_report *report)
+{
+	struct kafs_profile_tree *tree;
+
+	tree = kafs_profile_get_tree(root);
+	if (!tree) {
+		report_error(report, "%m");
+		return NULL;
+	}
+	return kafs_profile_get_relation(tree, parent, (char *)name,
+					 kafs_profile_value_is_list, report);
+}
+
+/*
+ * See if any part of a subtree came from the named file.
+ */
+static bool kafs_profile_from_file(const struct kafs_profile *p, const char *file)
+{
+	unsigned int i;
+
+	if (p->file && strcmp(p->file, file) == 0)
+		return true;
+	for (i = 0; i < p->nr_relations; i++)
+		if (kafs_profile_from_file(p->relations[i], file))
+			return true;
+	return false;
+}
+
+/*
+ * Copy the relations of one node into a node of another tree, applying the
+ * same rules as if they were being parsed there.  If a file is given, only
+ * the parts of the source that came from that file are copied, so that its
+ * contribution to the source can be replayed.  The nodes are copied, but the
+ * names and values are borrowed from the source, which must be kept as long
+ * as the destination.
+ */
+int kafs_profile_copy(struct kafs_profile *root,
+		      struct kafs_profile *to,
+		      const struct kafs_profile *from,
+		      const char *file,
+		      struct kafs_report *report)
+{
+	struct kafs_profile_tree *tree;
+	unsigned int i;
+
+	tree = kafs_profile_get_tree(root);
+	if (!tree)
+		return report_error(report, "%m");
+
+	for (i = 0; i < from->nr_relations; i++) {
+		const struct kafs_profile *f = from->relations[i];
+		struct kafs_profile *r;
+
+		if (file && !kafs_profile_from_file(f, file))
+			continue;
+
+		r = kafs_profile_get_relation(tree, to, f->name, f->type, report);
+		if (!r)
+			return -1;
+		if (r->dummy)
+			continue;
+
+		r->file = f->file;
+		r->line = f->line;
+		if (f->type == kafs_profile_value_is_string) {
+			r->value = f->value;
+			continue;
+		}
+
+		if (kafs_profile_copy(root, r, f, file, report) < 0)
+			return -1;
+		if (f->final)
+			r->final = true;
+	}
+
+	return 0;
+}
+
+/*
+ * Take over the storage of another tree so that things in it can be borrowed
+ * by the first tree.  The other tree is left empty.
+ */
+int kafs_profile_take(struct kafs_profile *root, struct kafs_profile *other)
+{
+	struct kafs_profile_tree *tree;
+
+	if (!other->tree)
+		return 0;
+	tree = kafs_profile_get_tree(root);
+	if (!tree)
+		return -1;
+	kafs_profile_adopt(tree, other);
+	other->relations = NULL;
+	other->index = NULL;
+	other->nr_relations = 0;
+	other->max_relations = 0;
+	return 0;
+}
+
+/*
+ * List the files in a kafs_profile directory in filename order, skipping
+ * hidden files and backups.  The names are allocated from the tree's arena and
+ * the directory is noted as a source of the tree.
+ */
+static int kafs_profile_list_dir(struct kafs_profile_tree *tree,
+				 const char *dirname,
+				 char ***_files, unsigned int *_nr_files,
+				 struct kafs_report *report)
 {
-	const char *old_file = report->what;
 	struct dirent *de;
-	char *filename;
+	struct stat st;
+	char *filename, **files = NULL, **tmp;
+	unsigned int nr_files = 0, max_files = 0;
 	DIR *dir;
-	int ret, n;
+	int n;
 
-	report->what = dirname;
-	report->line = 0;
 	dir = opendir(dirname);
 	if (!dir)
 		return report_error(report, "%s: %m", dirname);
 
+	if (fstat(dirfd(dir), &st) == -1 ||
+	    kafs_profile_add_source(tree, dirname, &st) == -1) {
+		closedir(dir);
+		return report_error(report, "%s: %m", dirname);
+	}
+
 	while (errno = 0,
 	       (de = readdir(dir))) {
 		if (de->d_name[0] == '.')
@@ -364,26 +1337,258 @@ int kafs_profile_parse_dir(struct kafs_profile *prof,
 		if (n < 1 || de->d_name[n - 1] == '~')
 			continue;
 
-		if (asprintf(&filename, "%s/%s", dirname, de->d_name) == -1) {
-			closedir(dir);
-			return report_error(report, "%m");
+		filename = kafs_profile_alloc(tree, strlen(dirname) + 1 + n + 1);
+		if (!filename)
+			goto nomem;
+		sprintf(filename, "%s/%s", dirname, de->d_name);
+
+		if (nr_files >= max_files) {
+			max_files = max_files * 2 ?: 16;
+			tmp = realloc(files, max_files * sizeof(files[0]));
+			if (!tmp)
+				goto nomem;
+			files = tmp;
 		}
+		files[nr_files++] = filename;
+	}
 
-		ret = kafs_profile_parse_file(prof, filename, report);
-		if (ret < 0) {
-			closedir(dir);
-			return -1;
-		}
+	if (errno != 0) {
+		closedir(dir);
+		free(files);
+		return -1;
 	}
+	closedir(dir);
 
-	report->what = dirname;
+	if (nr_files)
+		qsort(files, nr_files, sizeof(files[0]), kafs_profile_cmp_filenames);
+	*_files = files;
+	*_nr_files = nr_files;
+	return 0;
+
+nomem:
 	closedir(dir);
-	if (errno != 0)
+	free(files);
+	return report_error(report, "%m");
+}
+
+/*
+ * Parse a kafs_profile directory.  The files are parsed in filename order.
+ */
+int kafs_profile_parse_dir(struct kafs_profile *prof,
+			   const char *dirname,
+			   struct kafs_report *report)
+{
+	struct kafs_profile_tree *tree;
+	const char *old_file = report->what;
+	char **files = NULL;
+	unsigned int nr_files = 0, i;
+	int ret = 0;
+
+	tree = kafs_profile_get_tree(prof);
+	if (!tree)
+		return report_error(report, "%m");
+
+	report->what = dirname;
+	report->line = 0;
+	if (kafs_profile_list_dir(tree, dirname, &files, &nr_files, report) < 0)
+		return -1;
+
+	tree->depth++;
+	if (tree->nr_threads > 1 && nr_files > 1) {
+		ret = kafs_profile_parse_fragments(prof, files, nr_files, report);
+	} else {
+		for (i = 0; i < nr_files; i++) {
+			ret = kafs_profile_parse_file(prof, files[i], report);
+			if (ret < 0)
+				break;
+		}
+	}
+	tree->depth--;
+
+	free(files);
+	if (ret < 0)
 		return -1;
 	report->what = old_file;
 	return 0;
 }
 
+/*
+ * Streaming reads.  A file is read through a fixed-size buffer, which is only
+ * grown if a line won't fit in it, and the events are handed to the caller as
+ * each line is scanned, so no tree is built and the memory used doesn't depend
+ * on the size of the file.
+ */
+#define KAFS_PROFILE_STREAM_BUFSIZE	(64 * 1024)
+#define KAFS_PROFILE_RESUME_BUFSIZE	(4 * 1024)	/* If starting part way in */
+
+struct kafs_profile_stream {
+	kafs_profile_event_func_t func;
+	void			*data;
+	struct kafs_profile	names;		/* Arena for the names of included files */
+};
+
+static int kafs_profile_stream_file(struct kafs_profile_stream *st,
+				    const char *file, off_t offset,
+				    unsigned int line,
+				    struct kafs_report *report);
+
+static int kafs_profile_stream_dir(struct kafs_profile_stream *st,
+				   const char *dirname,
+				   struct kafs_report *report)
+{
+	struct kafs_profile_tree *tree;
+	const char *old_file = report->what;
+	char **files = NULL;
+	unsigned int nr_files = 0, i;
+	int ret = 0;
+
+	tree = kafs_profile_get_tree(&st->names);
+	if (!tree)
+		return report_error(report, "%m");
+
+	report->what = dirname;
+	report->line = 0;
+	if (kafs_profile_list_dir(tree, dirname, &files, &nr_files, report) < 0)
+		return -1;
+
+	for (i = 0; i < nr_files; i++) {
+		ret = kafs_profile_stream_file(st, files[i], 0, 0, report);
+		if (ret != 0)
+			break;
+	}
+
+	free(files);
+	if (ret == 0)
+		report->what = old_file;
+	return ret;
+}
+
+static int kafs_profile_stream_event(const struct kafs_profile_event *ev,
+				     void *data,
+				     struct kafs_report *report)
+{
+	struct kafs_profile_stream *st = data;
+
+	switch (ev->type) {
+	case kafs_profile_event_include:
+		return kafs_profile_stream_file(st, ev->value, 0, 0, report);
+	case kafs_profile_event_include_dir:
+		return kafs_profile_stream_dir(st, ev->value, report);
+	default:
+		return st->func(ev, st->data, report);
+	}
+}
+
+static int kafs_profile_stream_file(struct kafs_profile_stream *st,
+				    const char *file, off_t offset,
+				    unsigned int line,
+				    struct kafs_report *report)
+{
+	struct kafs_profile_scanner s = {
+		.file		= file,
+		.offset		= offset,
+		.line		= line ? line - 1 : 0,
+		.in_section	= offset > 0,
+		.func		= kafs_profile_stream_event,
+		.data		= st,
+	};
+	const char *old_file = report->what;
+	size_t size, len = 0;
+	ssize_t n;
+	char *buffer, *p, *tmp;
+	bool more = true;
+	int fd, ret = 0;
+
+	report->what = file;
+	report->line = 0;
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		return report_error(report, "%s: %m", file);
+	if (offset > 0 && lseek(fd, offset, SEEK_SET) == -1) {
+		close(fd);
+		return report_error(report, "%s: %m", file);
+	}
+
+	/* Reading from part way in is usually to get at one small part of the
+	 * file, so start with a smaller buffer for that.
+	 */
+	size = offset > 0 ? KAFS_PROFILE_RESUME_BUFSIZE : KAFS_PROFILE_STREAM_BUFSIZE;
+	buffer = malloc(size + 1 + KAFS_PROFILE_SCAN_PAD);
+	if (!buffer) {
+		close(fd);
+		return report_error(report, "%m");
+	}
+
+	p = buffer;
+	do {
+		/* Shift the incomplete line down to the front of the buffer,
+		 * growing the buffer if the line fills it.
+		 */
+		if (p > buffer) {
+			len -= p - buffer;
+			memmove(buffer, p, len);
+		} else if (len == size) {
+			tmp = realloc(buffer, size * 2 + 1 + KAFS_PROFILE_SCAN_PAD);
+			if (!tmp) {
+				ret = report_error(report, "%m");
+				break;
+			}
+			buffer = tmp;
+			size *= 2;
+		}
+		p = buffer;
+
+		n = read(fd, buffer + len, size - len);
+		if (n == -1) {
+			ret = report_error(report, "%s: %m", file);
+			break;
+		}
+		if (n == 0)
+			more = false;
+		len += n;
+		memset(buffer + len, 0, 1 + KAFS_PROFILE_SCAN_PAD);
+
+		ret = kafs_profile_scan(&s, &p, buffer + len, more, report);
+	} while (ret == 0 && more);
+
+	free(buffer);
+	close(fd);
+	if (ret >= 0)
+		report->what = old_file;
+	return ret;
+}
+
+/*
+ * Read a kafs_profile file as a stream of events without building a tree.
+ * Inclusions are followed.  The strings in each event are only valid for the
+ * duration of the call to the handler, so anything that's to be kept must be
+ * copied.
+ *
+ * Reading may be started part way through a file by giving the offset and
+ * number of a line that lies within a section, as noted from the events of an
+ * earlier read; the lines before that aren't looked at and the nesting depths
+ * in the events are then relative to that point.  Pass 0 for both to read the
+ * whole file.
+ *
+ * The handler should return 0 to continue, -1 to abort or a positive value to
+ * stop early, which is then returned.  0 is returned if the whole file got
+ * read.
+ */
+int kafs_profile_stream(const char *file, off_t offset, unsigned int line,
+			kafs_profile_event_func_t func, void *data,
+			struct kafs_report *report)
+{
+	struct kafs_profile_stream st = {
+		.func	= func,
+		.data	= data,
+	};
+	int ret;
+
+	ret = kafs_profile_stream_file(&st, file, offset, line, report);
+	kafs_profile_free(&st.names);
+	return ret;
+}
+
 /*
  * Find the first child object of a type and name in the list attached to the
  * given object.
@@ -401,15 +1606,8 @@ const struct kafs_profile *kafs_profile_find_first_child(const struct kafs_profi
 		return NULL;
 	}
 
-	for (i = 0; i < prof->nr_relations; i++) {
-		const struct kafs_profile *r = prof->relations[i];
-
-		if (r->type == type &&
-		    strcmp(r->name, name) == 0)
-			return r;
-	}
-
-	return NULL;
+	i = kafs_profile_find_first(prof, type, name);
+	return i ? prof->relations[i - 1] : NULL;
 }
 
 /*
@@ -432,6 +1630,18 @@ int kafs_profile_iterate(const struct kafs_profile *prof,
 		return -1;
 	}
 
+	/* Follow the chain in the index if we're looking for a name. */
+	if (name && prof->index) {
+		for (i = kafs_profile_find_first(prof, type, name);
+		     i;
+		     i = prof->index->next[i - 1]) {
+			ret = iterator(prof->relations[i - 1], data, report);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
 	for (i = 0; i < prof->nr_relations; i++) {
 		const struct kafs_profile *r = prof->relations[i];
 
@@ -465,7 +1675,7 @@ int kafs_profile_count(const struct kafs_profile *prof,
 		       const char *name,
 		       unsigned int *_nr)
 {
-	return kafs_profile_iterate(prof, type, NULL, kafs_count_objects, _nr, NULL);
+	return kafs_profile_iterate(prof, type, name, kafs_count_objects, _nr, NULL);
 }
 
 static int cmp_constant(const void *name, const void *entry)
@@ -0,0 +1,733 @@
+/*
+ * Normalisation and ordering of VL server lists.
+ *
+ * Server lists obtained from the DNS are cleaned up before use: duplicate
+ * names are removed, SRV results are put into the order that RFC 2782 asks
+ * for and addresses that turn up more than once are dropped, so that the
+ * kernel doesn't waste time probing the same host repeatedly.
+ *
+ * The kernel tries VL servers in the order in which they're listed in the
+ * payload we give it, so it's worth putting the closest ones first.  Each
+ * address is sent an Rx version probe, which any Rx server will answer without
+ * setting up a call, and the addresses and servers are then sorted by how
+ * quickly they replied.  The whole thing is done under a strict time budget;
+ * servers that don't answer in time keep their relative positions behind
+ * those that did.
+ *
+ * On a dual-stack network, one family may not be reachable, so the addresses
+ * can also be put in order by family to avoid the kernel spending its first
+ * attempts on it.  This is done before probing, so that addresses that answer
+ * probes are still put first.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <kafs/cellserv.h>
+#include "lib_internal.h"
+
+#define AFS_VL_PORT		7003	/* volume location service port */
+#define RX_PACKET_TYPE_VERSION	13
+#define RX_CLIENT_INITIATED	0x01
+#define KAFS_RTT_NONE		UINT_MAX
+#define KAFS_RTT_GRANULARITY	1000	/* RTTs closer than this are equal (us) */
+#define KAFS_NAME_HASH_MIN	16
+
+struct rx_header {
+	uint32_t	epoch;
+	uint32_t	cid;
+	uint32_t	call_number;
+	uint32_t	seq;
+	uint32_t	serial;
+	uint8_t		type;
+	uint8_t		flags;
+	uint8_t		user_status;
+	uint8_t		security_index;
+	uint16_t	cksum;
+	uint16_t	service_id;
+} __attribute__((packed));
+
+struct kafs_probe {
+	struct kafs_server_addr	addr;		/* Address as listed */
+	struct kafs_server_addr	dest;		/* Address with port filled in */
+	struct timespec		sent;
+	unsigned int		server;		/* Index of server */
+	unsigned int		index;		/* Index of address in server */
+	unsigned int		rtt;		/* RTT in microseconds */
+};
+
+struct kafs_server_rank {
+	unsigned int		server;
+	unsigned int		rtt;		/* Best RTT of any address */
+	unsigned short		pref;
+};
+
+#define verbose(r, fmt, ...)						\
+	do {								\
+		if ((r)->verbose)					\
+			(r)->verbose(fmt, ## __VA_ARGS__);		\
+	} while(0)
+
+static void kafs_discard_server(struct kafs_server *server)
+{
+	if (!server->borrowed_name)
+		free(server->name);
+	if (!server->borrowed_addrs)
+		free(server->addrs);
+}
+
+/*
+ * Remove servers whose names duplicate those of earlier servers.  The
+ * first-seen server is kept.  An open-addressed hash table of indices is used
+ * as SRV and AFSDB results can be quite long.
+ */
+static void kafs_dedup_names(struct kafs_server_list *vsl,
+			     struct kafs_lookup_context *ctx)
+{
+	unsigned int *table, size = KAFS_NAME_HASH_MIN, mask, i, h, n = 0;
+
+	while (size < vsl->nr_servers * 2)
+		size *= 2;
+	mask = size - 1;
+
+	table = calloc(size, sizeof(*table));	/* Index + 1 or 0 if empty */
+	if (!table)
+		return;
+
+	for (i = 0; i < vsl->nr_servers; i++) {
+		struct kafs_server *server = &vsl->servers[i];
+
+		for (h = kafs_name_hash(server->name) & mask;
+		     table[h];
+		     h = (h + 1) & mask)
+			if (strcasecmp(vsl->servers[table[h] - 1].name,
+				       server->name) == 0)
+				break;
+
+		if (table[h]) {
+			verbose(&ctx->report, "%s: Duplicate server", server->name);
+			kafs_discard_server(server);
+			continue;
+		}
+
+		vsl->servers[n] = *server;
+		table[h] = ++n;
+	}
+
+	vsl->nr_servers = n;
+	free(table);
+}
+
+/*
+ * Order the servers obtained from SRV records as described in RFC 2782:
+ * ascending priority, and then, within each priority, a random selection
+ * weighted by the servers' weights, with weight 0 servers only chosen when
+ * there's nothing else left.  The list must already be free of duplicates.
+ */
+static void kafs_order_srv(struct kafs_server_list *vsl)
+{
+	struct kafs_server *servers = vsl->servers, tmp;
+	struct timespec now;
+	unsigned long sum, pick;
+	unsigned int seed, i, j, start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	seed = now.tv_nsec ^ getpid();
+
+	/* Sort by priority, keeping DNS order otherwise (insertion sort). */
+	for (i = 1; i < vsl->nr_servers; i++) {
+		tmp = servers[i];
+		for (j = i; j > 0 && servers[j - 1].pref > tmp.pref; j--)
+			servers[j] = servers[j - 1];
+		servers[j] = tmp;
+	}
+
+	for (start = 0; start < vsl->nr_servers; start = end) {
+		for (end = start + 1;
+		     end < vsl->nr_servers && servers[end].pref == servers[start].pref;
+		     end++)
+			;
+
+		/* Repeatedly pick one of the unordered servers in this group. */
+		for (i = start; i < end - 1; i++) {
+			sum = 0;
+			for (j = i; j < end; j++)
+				sum += servers[j].weight;
+			if (sum == 0)
+				break;
+
+			pick = (unsigned long)rand_r(&seed) % sum;
+			for (j = i; j < end; j++) {
+				if (pick < servers[j].weight)
+					break;
+				pick -= servers[j].weight;
+			}
+
+			tmp = servers[j];
+			memmove(&servers[i + 1], &servers[i], (j - i) * sizeof(tmp));
+			servers[i] = tmp;
+		}
+	}
+}
+
+/*
+ * Clean up a server list obtained from the DNS, removing duplicate names and
+ * ordering SRV results by priority and weight.
+ */
+void kafs_normalise_servers(struct kafs_server_list *vsl,
+			    struct kafs_lookup_context *ctx)
+{
+	if (vsl->nr_servers < 2)
+		return;
+	kafs_dedup_names(vsl, ctx);
+	if (vsl->source == kafs_record_from_dns_srv)
+		kafs_order_srv(vsl);
+}
+
+static bool kafs_addr_equal(const struct kafs_server_addr *a,
+			    const struct kafs_server_addr *b)
+{
+	if (a->sin.sin_family != b->sin.sin_family)
+		return false;
+	switch (a->sin.sin_family) {
+	case AF_INET:
+		return (a->sin.sin_port == b->sin.sin_port &&
+			a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr);
+	case AF_INET6:
+		return (a->sin6.sin6_port == b->sin6.sin6_port &&
+			memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr, 16) == 0);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Drop addresses that have already been seen, whether on the same server or on
+ * an earlier one.  A server that had addresses, all of which were seen
+ * earlier, is just another name for an earlier server and is removed.
+ */
+void kafs_dedup_addresses(struct kafs_server_list *vsl,
+			  struct kafs_lookup_context *ctx)
+{
+	unsigned int i, j, k, l, n = 0, nr_addrs;
+
+	for (i = 0; i < vsl->nr_servers; i++) {
+		struct kafs_server *server = &vsl->servers[i];
+		const struct kafs_server_addr *src = server->addrs;
+		struct kafs_server_addr *addrs = server->addrs;
+
+		nr_addrs = 0;
+		for (j = 0; j < server->nr_addrs; j++) {
+			bool dup = false;
+
+			for (k = 0; k < nr_addrs && !dup; k++)
+				dup = kafs_addr_equal(&addrs[k], &src[j]);
+			for (k = 0; k < n && !dup; k++)
+				for (l = 0; l < vsl->servers[k].nr_addrs && !dup; l++)
+					dup = kafs_addr_equal(&vsl->servers[k].addrs[l],
+							      &src[j]);
+			if (dup)
+				continue;
+
+			/* We can't compact a list that belongs to someone else,
+			 * so take a copy first.
+			 */
+			if (nr_addrs != j && server->borrowed_addrs) {
+				addrs = malloc(server->nr_addrs * sizeof(*addrs));
+				if (!addrs) {
+					addrs = server->addrs;
+					nr_addrs = server->nr_addrs;
+					break;
+				}
+				memcpy(addrs, src, nr_addrs * sizeof(*addrs));
+				server->addrs = addrs;
+				server->max_addrs = server->nr_addrs;
+				server->borrowed_addrs = false;
+			}
+			if (nr_addrs != j)
+				addrs[nr_addrs] = src[j];
+			nr_addrs++;
+		}
+
+		if (nr_addrs < server->nr_addrs)
+			verbose(&ctx->report, "%s: Dropped %u duplicate addresses",
+				server->name, server->nr_addrs - nr_addrs);
+
+		if (server->nr_addrs > 0 && nr_addrs == 0) {
+			verbose(&ctx->report, "%s: Alias of earlier server", server->name);
+			kafs_discard_server(server);
+			continue;
+		}
+
+		server->nr_addrs = nr_addrs;
+		vsl->servers[n++] = *server;
+	}
+
+	vsl->nr_servers = n;
+}
+
+static const char *const kafs_addr_family_names[nr__kafs_addr_family_policy] = {
+	[kafs_addr_family_default]	= "default",
+	[kafs_addr_family_as_listed]	= "listed",
+	[kafs_addr_family_prefer_ipv6]	= "prefer-ipv6",
+	[kafs_addr_family_prefer_ipv4]	= "prefer-ipv4",
+	[kafs_addr_family_interleave]	= "interleave",
+};
+
+/*
+ * Turn the name of an address family policy into its value.  "prefer-v6" and
+ * "prefer-v4" are accepted too.
+ */
+int kafs_parse_addr_family(const char *name,
+			   enum kafs_addr_family_policy *_policy)
+{
+	unsigned int i;
+
+	if (strcmp(name, "prefer-v6") == 0) {
+		*_policy = kafs_addr_family_prefer_ipv6;
+		return 0;
+	}
+	if (strcmp(name, "prefer-v4") == 0) {
+		*_policy = kafs_addr_family_prefer_ipv4;
+		return 0;
+	}
+	for (i = 0; i < nr__kafs_addr_family_policy; i++) {
+		if (strcmp(name, kafs_addr_family_names[i]) == 0) {
+			*_policy = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *kafs_addr_family_name(enum kafs_addr_family_policy policy)
+{
+	if (policy >= nr__kafs_addr_family_policy)
+		return "unknown";
+	return kafs_addr_family_names[policy];
+}
+
+static bool kafs_has_family(const struct kafs_server *server, int family)
+{
+	unsigned int i;
+
+	for (i = 0; i < server->nr_addrs; i++)
+		if (server->addrs[i].sin.sin_family == family)
+			return true;
+	return false;
+}
+
+/*
+ * Rearrange the addresses of a server into the given order, taking a copy of
+ * them first if they belong to someone else.  Returns false if there's no
+ * memory for the copy.
+ */
+static bool kafs_reorder_addrs(struct kafs_server *server,
+			       const struct kafs_server_addr *order)
+{
+	struct kafs_server_addr *addrs = server->addrs;
+	size_t size = server->nr_addrs * sizeof(*addrs);
+
+	if (memcmp(addrs, order, size) == 0)
+		return true;
+	if (server->borrowed_addrs) {
+		addrs = malloc(size);
+		if (!addrs)
+			return false;
+		server->addrs = addrs;
+		server->max_addrs = server->nr_addrs;
+		server->borrowed_addrs = false;
+	}
+	memcpy(addrs, order, size);
+	return true;
+}
+
+/*
+ * Order the addresses of a server by family, keeping their relative order
+ * within each family.  The addresses of the first family are put first or, if
+ * interleaving, alternated with those of the other family, beginning with one
+ * of the first family.  Returns the family of the first address.
+ */
+static int kafs_order_server_families(struct kafs_server *server, int first,
+				      bool interleave,
+				      struct kafs_server_addr *scratch)
+{
+	const struct kafs_server_addr *addrs = server->addrs;
+	unsigned int a = 0, b = 0, n = 0, nr = server->nr_addrs;
+	bool take_first = true;
+
+	/* a steps through the addresses of the first family, b the rest. */
+	while (n < nr) {
+		while (a < nr && addrs[a].sin.sin_family != first)
+			a++;
+		while (b < nr && addrs[b].sin.sin_family == first)
+			b++;
+		if (a < nr && (take_first || b >= nr))
+			scratch[n++] = addrs[a++];
+		else
+			scratch[n++] = addrs[b++];
+		if (interleave)
+			take_first = !take_first;
+	}
+
+	kafs_reorder_addrs(server, scratch);
+	return server->addrs[0].sin.sin_family;
+}
+
+/*
+ * Order a server list by address family according to a policy.  With a
+ * preference, each server's addresses of the preferred family go first and
+ * servers that have any such addresses go before those that don't.  When
+ * interleaving, the families are alternated within each server, and the family
+ * each server starts with is the opposite of the family the previous server
+ * started with, so that the kernel's first attempts against successive servers
+ * don't all go to one family.  Servers keep their order otherwise.  This is
+ * best effort.
+ */
+void kafs_order_families(struct kafs_server_list *vsl,
+			 enum kafs_addr_family_policy policy,
+			 struct kafs_lookup_context *ctx)
+{
+	struct kafs_server_addr *scratch;
+	struct kafs_server *servers, *server;
+	unsigned int i, n, max = 0;
+	int first = AF_INET6, started;
+
+	if (!vsl || vsl->nr_servers == 0 ||
+	    policy <= kafs_addr_family_as_listed ||
+	    policy >= nr__kafs_addr_family_policy)
+		return;
+
+	for (i = 0; i < vsl->nr_servers; i++)
+		if (vsl->servers[i].nr_addrs > max)
+			max = vsl->servers[i].nr_addrs;
+	scratch = malloc((max ?: 1) * sizeof(*scratch));
+	servers = malloc(vsl->nr_servers * sizeof(*servers));
+	if (!scratch || !servers)
+		goto out;
+
+	if (policy == kafs_addr_family_prefer_ipv4)
+		first = AF_INET;
+
+	for (i = 0; i < vsl->nr_servers; i++) {
+		server = &vsl->servers[i];
+		if (server->nr_addrs < 2) {
+			started = server->nr_addrs ? server->addrs[0].sin.sin_family : AF_UNSPEC;
+		} else {
+			started = kafs_order_server_families(
+				server, first,
+				policy == kafs_addr_family_interleave, scratch);
+		}
+
+		if (policy == kafs_addr_family_interleave && started != AF_UNSPEC)
+			first = started == AF_INET6 ? AF_INET : AF_INET6;
+	}
+
+	if (policy != kafs_addr_family_interleave) {
+		/* Stable partition of the servers by preferred family. */
+		n = 0;
+		for (i = 0; i < vsl->nr_servers; i++)
+			if (kafs_has_family(&vsl->servers[i], first))
+				servers[n++] = vsl->servers[i];
+		for (i = 0; i < vsl->nr_servers; i++)
+			if (!kafs_has_family(&vsl->servers[i], first))
+				servers[n++] = vsl->servers[i];
+		memcpy(vsl->servers, servers, vsl->nr_servers * sizeof(*servers));
+	}
+
+	verbose(&ctx->report, "Ordered addresses by family: %s",
+		kafs_addr_family_name(policy));
+out:
+	free(servers);
+	free(scratch);
+}
+
+static long kafs_elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+	return ((to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000);
+}
+
+static bool kafs_same_addr(const struct kafs_server_addr *a,
+			   const struct sockaddr *sa)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+	if (a->sin.sin_family != sa->sa_family)
+		return false;
+	switch (sa->sa_family) {
+	case AF_INET:
+		return (a->sin.sin_port == sin->sin_port &&
+			a->sin.sin_addr.s_addr == sin->sin_addr.s_addr);
+	case AF_INET6:
+		return (a->sin6.sin6_port == sin6->sin6_port &&
+			memcmp(&a->sin6.sin6_addr, &sin6->sin6_addr, 16) == 0);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Send a version probe to an address.
+ */
+static void kafs_probe_send(struct kafs_probe *p, int fd, uint32_t epoch,
+			    unsigned int serial)
+{
+	struct rx_header hdr = {
+		.epoch		= htonl(epoch),
+		.cid		= htonl(serial << 2),
+		.serial		= htonl(serial),
+		.type		= RX_PACKET_TYPE_VERSION,
+		.flags		= RX_CLIENT_INITIATED,
+	};
+	socklen_t salen = (p->dest.sin.sin_family == AF_INET ?
+			   sizeof(p->dest.sin) : sizeof(p->dest.sin6));
+
+	clock_gettime(CLOCK_MONOTONIC, &p->sent);
+	if (sendto(fd, &hdr, sizeof(hdr), 0,
+		   (struct sockaddr *)&p->dest, salen) != sizeof(hdr))
+		p->rtt = KAFS_RTT_NONE - 1;	/* Don't wait for it */
+}
+
+/*
+ * Read replies from a socket, noting the RTT of each probe answered.  Returns
+ * the number of probes newly answered.
+ */
+static unsigned int kafs_probe_recv(struct kafs_probe *probes, unsigned int nr,
+				    int fd)
+{
+	struct sockaddr_in6 from;
+	struct rx_header hdr;
+	struct timespec now;
+	socklen_t flen;
+	unsigned int serial, answered = 0;
+	ssize_t len;
+
+	for (;;) {
+		flen = sizeof(from);
+		len = recvfrom(fd, &hdr, sizeof(hdr), MSG_TRUNC,
+			       (struct sockaddr *)&from, &flen);
+		if (len == -1)
+			return answered;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (len < (ssize_t)sizeof(hdr) ||
+		    hdr.type != RX_PACKET_TYPE_VERSION ||
+		    (hdr.flags & RX_CLIENT_INITIATED))
+			continue;
+
+		serial = ntohl(hdr.serial);
+		if (serial == 0 || serial > nr)
+			continue;
+		if (probes[serial - 1].rtt != KAFS_RTT_NONE ||
+		    !kafs_same_addr(&probes[serial - 1].dest, (struct sockaddr *)&from))
+			continue;
+
+		probes[serial - 1].rtt = kafs_elapsed_us(&probes[serial - 1].sent, &now);
+		answered++;
+	}
+}
+
+/*
+ * Sort probes by server and then by RTT, keeping listed order otherwise.
+ */
+static int kafs_probe_cmp(const void *_a, const void *_b)
+{
+	const struct kafs_probe *a = _a, *b = _b;
+
+	if (a->server != b->server)
+		return a->server < b->server ? -1 : 1;
+	if (a->rtt != b->rtt)
+		return a->rtt < b->rtt ? -1 : 1;
+	return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/*
+ * Sort servers by RTT, using SRV priority to break ties and then keeping listed
+ * order, which for SRV results already reflects the weights.
+ */
+static int kafs_rank_cmp(const void *_a, const void *_b)
+{
+	const struct kafs_server_rank *a = _a, *b = _b;
+	unsigned int ra = a->rtt, rb = b->rtt;
+
+	if (ra != KAFS_RTT_NONE)
+		ra /= KAFS_RTT_GRANULARITY;
+	if (rb != KAFS_RTT_NONE)
+		rb /= KAFS_RTT_GRANULARITY;
+	if (ra != rb)
+		return ra < rb ? -1 : 1;
+	if (a->pref != b->pref)
+		return a->pref < b->pref ? -1 : 1;
+	return a->server < b->server ? -1 : a->server > b->server;
+}
+
+/*
+ * Probe all the addresses in a list concurrently until they've all answered
+ * or the time budget runs out.  Returns the number that answered.
+ */
+static unsigned int kafs_probe_all(struct kafs_probe *probes, unsigned int nr,
+				   unsigned int budget_ms)
+{
+	struct pollfd fds[2] = { { .fd = -1 }, { .fd = -1 } };
+	struct timespec start, now;
+	unsigned int i, answered = 0, waiting = 0;
+	uint32_t epoch;
+	long left;
+	int fd;
+
+	fds[0].fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	fds[1].fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	fds[0].events = POLLIN;
+	fds[1].events = POLLIN;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	epoch = time(NULL);
+
+	for (i = 0; i < nr; i++) {
+		fd = probes[i].dest.sin.sin_family == AF_INET ? fds[0].fd : fds[1].fd;
+		if (fd == -1) {
+			probes[i].rtt = KAFS_RTT_NONE - 1;
+			continue;
+		}
+		kafs_probe_send(&probes[i], fd, epoch, i + 1);
+		if (probes[i].rtt == KAFS_RTT_NONE)
+			waiting++;
+	}
+
+	while (answered < waiting) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left = budget_ms - kafs_elapsed_us(&start, &now) / 1000;
+		if (left <= 0)
+			break;
+		if (poll(fds, 2, left) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < 2; i++)
+			if (fds[i].revents & POLLIN)
+				answered += kafs_probe_recv(probes, nr, fds[i].fd);
+	}
+
+	for (i = 0; i < 2; i++)
+		if (fds[i].fd != -1)
+			close(fds[i].fd);
+
+	/* Anything that failed to send counts as unanswered. */
+	for (i = 0; i < nr; i++)
+		if (probes[i].rtt == KAFS_RTT_NONE - 1)
+			probes[i].rtt = KAFS_RTT_NONE;
+	return answered;
+}
+
+/*
+ * Reorder the servers in a list, and the addresses of each server, by probed
+ * RTT if the lookup context asks for it.  The servers keep their order if no
+ * one answers.  This is best effort: failure isn't reported to the caller.
+ */
+void kafs_order_servers(struct kafs_server_list *vsl,
+			struct kafs_lookup_context *ctx)
+{
+	struct kafs_server_rank *ranks = NULL;
+	struct kafs_server *servers = NULL;
+	struct kafs_probe *probes = NULL;
+	unsigned int i, j, n, nr = 0, answered;
+
+	if (!ctx->rtt_probe_timeout || !vsl || vsl->nr_servers == 0)
+		return;
+
+	for (i = 0; i < vsl->nr_servers; i++)
+		nr += vsl->servers[i].nr_addrs;
+	if (nr < 2)
+		return;
+
+	probes = calloc(nr, sizeof(*probes));
+	ranks = calloc(vsl->nr_servers, sizeof(*ranks));
+	servers = malloc(vsl->nr_servers * sizeof(*servers));
+	if (!probes || !ranks || !servers)
+		goto out;
+
+	for (i = 0, n = 0; i < vsl->nr_servers; i++) {
+		const struct kafs_server *server = &vsl->servers[i];
+
+		for (j = 0; j < server->nr_addrs; j++) {
+			struct kafs_probe *p = &probes[n++];
+
+			p->addr = server->addrs[j];
+			p->dest = server->addrs[j];
+			p->server = i;
+			p->index = j;
+			p->rtt = KAFS_RTT_NONE;
+
+			/* sin_port and sin6_port occupy the same place. */
+			if (!p->dest.sin.sin_port)
+				p->dest.sin.sin_port =
+					htons(server->port ?: AFS_VL_PORT);
+		}
+	}
+
+	answered = kafs_probe_all(probes, nr, ctx->rtt_probe_timeout);
+	verbose(&ctx->report, "Probed %u addresses, %u answered", nr, answered);
+	if (!answered)
+		goto out;
+
+	/* Put each server's addresses in order.  We may have to take a copy of
+	 * them first as they may belong to the config.
+	 */
+	qsort(probes, nr, sizeof(*probes), kafs_probe_cmp);
+	for (i = 0, n = 0; i < vsl->nr_servers; i++) {
+		struct kafs_server *server = &vsl->servers[i];
+
+		ranks[i].server = i;
+		ranks[i].rtt = KAFS_RTT_NONE;
+		ranks[i].pref = server->pref;
+		if (!server->nr_addrs)
+			continue;
+
+		if (server->borrowed_addrs) {
+			struct kafs_server_addr *addrs;
+
+			addrs = malloc(server->nr_addrs * sizeof(*addrs));
+			if (!addrs) {
+				n += server->nr_addrs;
+				continue;
+			}
+			server->addrs = addrs;
+			server->max_addrs = server->nr_addrs;
+			server->borrowed_addrs = false;
+		}
+
+		ranks[i].rtt = probes[n].rtt;
+		for (j = 0; j < server->nr_addrs; j++)
+			server->addrs[j] = probes[n++].addr;
+	}
+
+	/* And then put the servers in order. */
+	qsort(ranks, vsl->nr_servers, sizeof(*ranks), kafs_rank_cmp);
+	for (i = 0; i < vsl->nr_servers; i++) {
+		servers[i] = vsl->servers[ranks[i].server];
+		if (ranks[i].rtt != KAFS_RTT_NONE)
+			verbose(&ctx->report, "%s: RTT %uus",
+				servers[i].name, ranks[i].rtt);
+	}
+	memcpy(vsl->servers, servers, vsl->nr_servers * sizeof(*servers));
+
+out:
+	free(servers);
+	free(ranks);
+	free(probes);
+}
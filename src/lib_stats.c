@@ -0,0 +1,138 @@
+/*
+ * Lookup statistics.
+ *
+ * A caller that wants to know where the time goes can point the stats member
+ * of its report struct at a kafs_stats record.  The library then notes the
+ * monotonic time spent in each phase of reading the config and looking up
+ * cells and counts the outcomes of the queries it makes.  The counters are
+ * updated atomically as address lookups may be done on other threads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <kafs/cellserv.h>
+
+static const char *const kafs_stats_phases[nr__kafs_stats_phase] = {
+	[kafs_stats_config]	= "config",
+	[kafs_stats_lookup]	= "lookup",
+	[kafs_stats_srv]	= "srv",
+	[kafs_stats_afsdb]	= "afsdb",
+	[kafs_stats_addrs]	= "addrs",
+	[kafs_stats_payload]	= "payload",
+};
+
+/*
+ * Note the start of a phase.  Returns 0 if stats aren't being collected.
+ */
+unsigned long long kafs_stats_start(const struct kafs_report *report)
+{
+	struct timespec ts;
+
+	if (!report->stats)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec ?: 1;
+}
+
+/*
+ * Note the end of a phase that was started with kafs_stats_start().
+ */
+void kafs_stats_end(struct kafs_report *report, enum kafs_stats_phase phase,
+		    unsigned long long start)
+{
+	if (report->stats && start)
+		kafs_stats_add(report, phase, kafs_stats_start(report) - start);
+}
+
+/*
+ * Count a run of a phase that took the given time.
+ */
+void kafs_stats_add(struct kafs_report *report, enum kafs_stats_phase phase,
+		    unsigned long long ns)
+{
+	struct kafs_phase_stats *ps;
+
+	if (!report->stats)
+		return;
+	ps = &report->stats->phases[phase];
+	__atomic_add_fetch(&ps->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ps->ns, ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count the outcome of a query made during a phase.
+ */
+void kafs_stats_result(struct kafs_report *report, enum kafs_stats_phase phase,
+		       enum kafs_lookup_status status)
+{
+	if (!report->stats || status >= nr__kafs_lookup_status)
+		return;
+	__atomic_add_fetch(&report->stats->phases[phase].results[status], 1,
+			   __ATOMIC_RELAXED);
+}
+
+/*
+ * Clear all the timings and counters.
+ */
+void kafs_reset_stats(struct kafs_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+/*
+ * Summarise the stats on one line, listing the phases that ran with their
+ * run counts, total times and query outcomes, eg.:
+ *
+ *	config=1/2.210ms lookup=1/1.874ms srv=1/0.902ms(good:1)
+ *
+ * Returns the length of the summary, which is truncated to fit the buffer.
+ */
+int kafs_format_stats(const struct kafs_stats *stats, char *buf, size_t size)
+{
+	const struct kafs_phase_stats *ps;
+	const char *sep;
+	unsigned int i, j;
+	size_t len = 0;
+	int n;
+
+#define add(FMT, ...)						\
+	do {							\
+		if (len >= size)				\
+			break;					\
+		n = snprintf(buf + len, size - len, FMT, ## __VA_ARGS__); \
+		if (n > 0)					\
+			len += n;				\
+	} while (0)
+
+	if (size > 0)
+		buf[0] = 0;
+
+	for (i = 0; i < nr__kafs_stats_phase; i++) {
+		ps = &stats->phases[i];
+		if (!ps->count)
+			continue;
+
+		add("%s%s=%u/%llu.%03llums", len ? " " : "", kafs_stats_phases[i],
+		    ps->count, ps->ns / 1000000, ps->ns / 1000 % 1000);
+
+		sep = "(";
+		for (j = 0; j < nr__kafs_lookup_status; j++) {
+			if (!ps->results[j])
+				continue;
+			add("%s%s:%u", sep, kafs_lookup_status(j), ps->results[j]);
+			sep = ",";
+		}
+		if (sep[0] == ',')
+			add(")");
+	}
+
+#undef add
+	if (len >= size && size > 0)
+		len = size - 1;
+	return len;
+}
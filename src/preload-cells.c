@@ -17,6 +17,7 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
  */
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -26,9 +27,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include <kafs/profile.h>
 #include <kafs/cellserv.h>
+#include "dns_daemon.h"
+
+#define WARM_MAX_THREADS	16
+#define WARM_CONNECT_TRIES	50	/* At 100ms intervals */
+
+static const char *socket_path = KAFS_DNS_SOCKET;
+
+struct warm_cell {
+	const char	*name;
+	int		status;		/* 0, -1 on failure or 1 if no daemon */
+	unsigned int	ttl;
+};
+
+struct warm_pool {
+	struct warm_cell *cells;
+	unsigned int	nr_cells;
+	unsigned int	next;
+};
 
 static void verbose(const char *fmt, ...)
 {
@@ -94,15 +117,142 @@ static void write_to_proc(const char *file, const char *str, bool redirect_to_st
 	}
 }
 
+/*
+ * Ask the resolver daemon to look up a cell, discarding the payload.  This is
+ * the request that the upcall will make when the kernel first asks for the
+ * cell's VL servers, so the daemon caches the result against that.
+ */
+static void warm_one(struct warm_cell *wc)
+{
+	struct kafs_dns_reply reply;
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct timeval tv = { .tv_sec = 60 };
+	static const char callout_info[] = "srv=1";
+	size_t nlen = strlen(wc->name) + 1;
+	char buf[4096];
+	ssize_t n;
+	int fd, tries;
+
+	wc->status = 1;
+	if (strlen(socket_path) >= sizeof(sun.sun_path) ||
+	    nlen + sizeof(callout_info) > REQUEST_MAX)
+		return;
+	strcpy(sun.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return;
+
+	/* The daemon may still be starting up if we were run alongside it. */
+	for (tries = 0; ; tries++) {
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0)
+			break;
+		if ((errno != ENOENT && errno != ECONNREFUSED) ||
+		    tries >= WARM_CONNECT_TRIES)
+			goto out;
+		usleep(100 * 1000);
+	}
+
+	wc->status = -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (write(fd, wc->name, nlen) != (ssize_t)nlen ||
+	    write(fd, callout_info, sizeof(callout_info)) != sizeof(callout_info) ||
+	    shutdown(fd, SHUT_WR) == -1 ||
+	    read(fd, &reply, sizeof(reply)) != sizeof(reply) ||
+	    reply.status != 0)
+		goto out;
+
+	/* Drain the payload so that the daemon doesn't see a broken pipe. */
+	while (n = read(fd, buf, sizeof(buf)), n > 0)
+		;
+	wc->ttl = reply.ttl;
+	wc->status = 0;
+out:
+	close(fd);
+}
+
+static void *warm_worker(void *data)
+{
+	struct warm_pool *pool = data;
+	unsigned int i;
+
+	while (i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED),
+	       i < pool->nr_cells)
+		warm_one(&pool->cells[i]);
+	return NULL;
+}
+
+/*
+ * Get the resolver daemon to look up the root cell and any cells marked as
+ * hot so that it has them cached by the time the kernel asks.  The lookups
+ * are done concurrently.  This is best effort: failures are only reported.
+ */
+static void do_warm_up(const struct kafs_config *config)
+{
+	const struct kafs_cell_db *db = config->db;
+	const char *this_cell = config->this_cell;
+	struct warm_pool pool = {};
+	pthread_t threads[WARM_MAX_THREADS];
+	unsigned int i, nr_threads, nr_started = 0;
+
+	pool.cells = calloc(db->nr_cells + 1, sizeof(pool.cells[0]));
+	if (!pool.cells) {
+		_error("%m");
+		return;
+	}
+
+	if (this_cell)
+		pool.cells[pool.nr_cells++].name = this_cell;
+	for (i = 0; i < db->nr_cells; i++) {
+		const struct kafs_cell *cell = db->cells[i];
+
+		if (cell->hot &&
+		    !(this_cell && strcmp(cell->name, this_cell) == 0))
+			pool.cells[pool.nr_cells++].name = cell->name;
+	}
+
+	nr_threads = pool.nr_cells < WARM_MAX_THREADS ? pool.nr_cells : WARM_MAX_THREADS;
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[nr_started], NULL, warm_worker, &pool) != 0)
+			break;
+		nr_started++;
+	}
+	warm_worker(&pool);
+	for (i = 0; i < nr_started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < pool.nr_cells; i++) {
+		const struct warm_cell *wc = &pool.cells[i];
+
+		switch (wc->status) {
+		case 0:
+			verbose("%s: Warmed, ttl %u", wc->name, wc->ttl);
+			break;
+		case 1:
+			verbose("%s: No resolver daemon at %s", wc->name, socket_path);
+			break;
+		default:
+			_error("%s: Warm-up lookup failed", wc->name);
+			break;
+		}
+	}
+
+	free(pool.cells);
+}
+
 /*
  * Parse the cell database file
  */
-int do_preload(const struct kafs_cell_db *db, bool redirect_to_stdout)
+int do_preload(const struct kafs_config *config, bool redirect_to_stdout, bool warm_up)
 {
+	const struct kafs_cell_db *db = config->db;
 	unsigned int i;
 	char buf[4096];
 	int fd, n;
 
+	if (warm_up)
+		do_warm_up(config);
+
 	if (!redirect_to_stdout) {
 		fd = open("/proc/fs/afs/cells", O_WRONLY);
 		if (fd == -1) {
@@ -137,29 +287,33 @@ int do_preload(const struct kafs_cell_db *db, bool redirect_to_stdout)
 		}
 	}
 
-	write_to_proc("/proc/net/afs/rootcell", kafs_this_cell, redirect_to_stdout);
-	write_to_proc("/proc/net/afs/sysname", kafs_sysname, redirect_to_stdout);
+	if (config->this_cell && !kafs_cellserv_find_cell(db, config->this_cell))
+		verbose("%s: Root cell not in cell database", config->this_cell);
+
+	write_to_proc("/proc/net/afs/rootcell", config->this_cell, redirect_to_stdout);
+	write_to_proc("/proc/net/afs/sysname", config->sysname, redirect_to_stdout);
 	exit(0);
 }
 
 static __attribute__((noreturn))
 void usage(const char *prog)
 {
-	fprintf(stderr, "Usage: %s [-Dv] [<dbfile>*]\n", prog);
+	fprintf(stderr, "Usage: %s [-DvwW] [-S <socket>] [<dbfile>*]\n", prog);
 	exit(2);
 }
 
 int main(int argc, char *argv[])
 {
 	struct kafs_report report = {};
+	struct kafs_config *config;
 	const char *const *files;
-	bool redirect_to_stdout = false;
+	bool redirect_to_stdout = false, warm_up = false, warm_only = false;
 	int opt;
 
 	if (argc > 1 && strcmp(argv[1], "--help") == 0)
 		usage(argv[0]);
 
-	while (opt = getopt(argc, argv, "Dv"),
+	while (opt = getopt(argc, argv, "DvwWS:"),
 	       opt != -1) {
 		switch (opt) {
 		case 'D':
@@ -171,6 +325,16 @@ int main(int argc, char *argv[])
 			else
 				report.verbose2 = verbose;
 			break;
+		case 'w':
+			warm_up = true;
+			break;
+		case 'W':
+			/* Just warm the daemon's cache; don't touch /proc. */
+			warm_only = true;
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
 		default:
 			usage(argv[0]);
 			break;
@@ -179,7 +343,8 @@ int main(int argc, char *argv[])
 
 	if (!redirect_to_stdout) {
 		openlog("kafs-preload", 0, LOG_USER);
-		syslog(LOG_NOTICE, "kAFS: Preloading cell database");
+		if (!warm_only)
+			syslog(LOG_NOTICE, "kAFS: Preloading cell database");
 	}
 
 	argc -= optind;
@@ -189,9 +354,15 @@ int main(int argc, char *argv[])
 	if (argc > 0)
 		files = (const char **)argv;
 
-	if (kafs_read_config(files, &report) < 0)
+	config = kafs_new_config(files, 0, &report);
+	if (!config)
 		exit(3);
 
-	do_preload(kafs_cellserv_db, redirect_to_stdout);
+	if (warm_only) {
+		do_warm_up(config);
+		exit(0);
+	}
+
+	do_preload(config, redirect_to_stdout, warm_up);
 	return 0;
 }